@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,6 +12,7 @@
 #include "http.h"
 
 #define BUFSIZE 512
+#define MAX_SEND_CHUNK 0x7ffff000 // most bytes linux will move in one sendfile/splice call
 
 const char *get_mime_type(const char *file_extension) {
     if (strcmp(".txt", file_extension) == 0) {
@@ -103,7 +107,7 @@ int read_http_request(int fd, char *resource_name) {
 
 
 // Returns size of resource_path on success, -1 if resource_path doesn't exist, or -2 on other error
-int get_file_size(const char *resource_path) {
+off_t get_file_size(const char *resource_path) {
     struct stat stat_buf;
     if (stat(resource_path, &stat_buf) == -1) {
         if (errno == ENOENT) {
@@ -142,16 +146,123 @@ const char *get_file_type(const char *resource_path) {
     return get_mime_type(file_extension);
 }
 
+// Copies 'count' bytes starting at 'offset' in in_fd to out_fd with pread/write
+// through a user space buffer. Last resort for when sendfile and splice both refuse the fds.
+// Returns 0 on success or 1 on error
+static int copy_file_body(int out_fd, int in_fd, off_t offset, off_t count) {
+    char buf[BUFSIZE * 16];
+    while (count > 0) {
+        size_t chunk = count < (off_t) sizeof(buf) ? (size_t) count : sizeof(buf);
+        ssize_t nbytes = pread(in_fd, buf, chunk, offset);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            perror("pread");
+            return 1;
+        }
+        if (nbytes == 0) { // file got shorter since we stat'ed it
+            fprintf(stderr, "unexpected end of file\n");
+            return 1;
+        }
+        ssize_t written = 0;
+        while (written < nbytes) { // socket writes can be short, keep going until it's all out
+            ssize_t n = write(out_fd, buf + written, nbytes - written);
+            if (n == -1) {
+                if (errno == EINTR) { continue; }
+                perror("write");
+                return 1;
+            }
+            written += n;
+        }
+        offset += nbytes;
+        count -= nbytes;
+    }
+    return 0;
+}
+
+// Moves 'count' bytes starting at 'offset' in in_fd to out_fd by splicing them
+// through a pipe, so the data never gets copied into user space.
+// Returns 0 on success, 1 on error, or -1 if splice isn't supported for these fds
+static int splice_file_body(int out_fd, int in_fd, off_t offset, off_t count) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        perror("pipe");
+        return 1;
+    }
+    int ret_val = 0;
+    int sent_any = 0;
+    loff_t in_off = offset; // splice always takes a 64 bit offset
+    while (count > 0 && ret_val == 0) {
+        size_t chunk = count < MAX_SEND_CHUNK ? (size_t) count : MAX_SEND_CHUNK;
+        ssize_t in_pipe = splice(in_fd, &in_off, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1) {
+            if (errno == EINTR) { continue; }
+            if (!sent_any && (errno == EINVAL || errno == ENOSYS)) { ret_val = -1; break; } // let the caller fall back
+            perror("splice");
+            ret_val = 1;
+            break;
+        }
+        if (in_pipe == 0) {
+            fprintf(stderr, "unexpected end of file\n");
+            ret_val = 1;
+            break;
+        }
+        count -= in_pipe;
+        while (in_pipe > 0) { // drain the pipe before filling it back up
+            ssize_t out = splice(pipe_fds[0], NULL, out_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out == -1) {
+                if (errno == EINTR) { continue; }
+                perror("splice");
+                ret_val = 1;
+                break;
+            }
+            in_pipe -= out;
+            sent_any = 1;
+        }
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return ret_val;
+}
+
+// Sends 'count' bytes starting at 'offset' in in_fd to the socket out_fd without
+// copying them through user space. Uses sendfile, falls back to splice and then
+// to plain read/write if the kernel won't do either for this file.
+// Returns 0 on success or 1 on error
+static int send_file_body(int out_fd, int in_fd, off_t offset, off_t count) {
+    int sent_any = 0;
+    while (count > 0) {
+        size_t chunk = count < MAX_SEND_CHUNK ? (size_t) count : MAX_SEND_CHUNK;
+        ssize_t nbytes = sendfile(out_fd, in_fd, &offset, chunk); // advances offset for us, handles short writes
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            if (!sent_any && (errno == EINVAL || errno == ENOSYS)) { // e.g. a filesystem without sendfile support
+                int ret_val = splice_file_body(out_fd, in_fd, offset, count);
+                if (ret_val != -1) { return ret_val; }
+                return copy_file_body(out_fd, in_fd, offset, count);
+            }
+            perror("sendfile");
+            return 1;
+        }
+        if (nbytes == 0) { // file got shorter since we stat'ed it
+            fprintf(stderr, "unexpected end of file\n");
+            return 1;
+        }
+        count -= nbytes;
+        sent_any = 1;
+    }
+    return 0;
+}
+
 int write_http_response(int fd, const char *resource_path) {
     int file_exists = 1;
-    int file_size = get_file_size(resource_path);
+    off_t file_size = get_file_size(resource_path);
     if (file_size == -2) { // 
         return 1; // error already printed
     } else if (file_size == -1) {
         file_exists = 0; // still send back 404
     }
 
-    const char *file_type;
+    const char *file_type = ""; // stays empty for a 404, checked below
     if (file_exists) { // only get file type if file exists
         file_type = get_file_type(resource_path);
         if (strcmp(file_type, "\0") == 0) {return 1;} // no "." found in resource_path, error already printed
@@ -165,7 +276,7 @@ int write_http_response(int fd, const char *resource_path) {
         // add "Content-Type: file_type\r\n" to header
         sprintf(header + strlen(header), "Content-Type: %s\r\n", file_type);
         // add "Content-Length: file_size\r\n" to header
-        sprintf(header + strlen(header), "Content-Length: %d\r\n", file_size);
+        sprintf(header + strlen(header), "Content-Length: %lld\r\n", (long long) file_size);
     }
     else if(strcmp(file_type, "file type not supported") == 0){ //handling files like .c, .h, a.out
         //file type not supported. project documentation didn't tell us to do this BUT we should anyways
@@ -200,26 +311,12 @@ int write_http_response(int fd, const char *resource_path) {
         return 1;
     }
 
-    void *buf = malloc(sizeof(void *) * BUFSIZE); // buffer to read from target_file and write to fd
-    int nbytes; // to store how many bytes are read from target_file
-    while ((nbytes = read(target_file, buf, BUFSIZE)) > 0){//know it'll be > 0 at first because know the target_file exists
-
-        if (write(fd, buf, nbytes) == -1) { // write the same amount of bytes that was read from target_file
-            perror("write");
-            free(buf);
-            close(target_file);
-            return 1;
-        }
-    }
-    if (nbytes < 0) { // If loop breaks because read returned an error
-        perror("read");
-        free(buf);
+    // stream the file straight from the page cache to the socket
+    if (send_file_body(fd, target_file, 0, file_size) != 0) {
         close(target_file);
         return 1;
     }
 
-    free(buf); // done reading and writing, don't need this anymore
-
     if (close(target_file) == -1) {
         perror("close");
         return 1;
@@ -1,17 +1,35 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "http.h"
 
 #define BUFSIZE 512
 #define LISTEN_QUEUE_LEN 5
+#define MAX_WORKERS 64         // most worker processes prefork mode will run
+#define RESPAWN_BACKOFF_S 1    // a worker that dies this soon after starting waits this long to be replaced
+#define DRAIN_TIMEOUT_S 5      // how long workers get to finish up after SIGINT before they're killed
+
+// One slot of the prefork pool. Lives in memory shared with the workers: the
+// worker in the slot writes requests, the supervisor writes everything else.
+typedef struct {
+    pid_t pid;                // -1 once the worker has exited and hasn't been replaced
+    time_t started;           // when the current worker was forked
+    unsigned long requests;   // answered by every worker that has had this slot
+    int respawns;             // workers that died and were replaced
+} worker_slot_t;
 
 int keep_going = 1;
 
@@ -19,15 +37,257 @@ void handle_sigint(int signo) { //we'll need to write cleanup code for when keep
     keep_going = 0;
 }
 
+// Only there so a child exiting wakes the supervisor's sigsuspend, the default is to ignore SIGCHLD
+void handle_sigchld(int signo) {
+}
+
+// Accepts and answers one connection at a time until SIGINT
+// n_requests: Bumped after every response that was sent
+// Returns 0 once SIGINT stops it or 1 on error
+static int serve_connections(int sock_fd, const char *serve_dir, unsigned long *n_requests) {
+     // SIGINT is blocked from checking keep_going until pselect lets it in, so it can't
+     // land in between and leave us waiting for a client that never comes
+     sigset_t interrupt, wait_mask;
+     sigemptyset(&interrupt);
+     sigaddset(&interrupt, SIGINT);
+     int waiting = 0; // already said so, a wakeup another worker won the accept for doesn't print again
+     while (1) { //server loop for receiving and servicing requests
+         if (sigprocmask(SIG_BLOCK, &interrupt, &wait_mask) == -1) {
+             perror("sigprocmask");
+             return 1;
+         }
+         if (keep_going == 0) {
+             sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+             break; //SIGINT received, terminating loop to shut down server.
+         }
+         //wait to receive a req from a client; don't bother saving client address info because this is tcp and we have an active connection
+         if (!waiting) {
+             printf("Waiting for a client to connect\n"); //not strictly necessary, but might be nice for debugging later or for matching test output >_>
+             waiting = 1;
+         }
+         fd_set readable;
+         FD_ZERO(&readable);
+         FD_SET(sock_fd, &readable);
+         int ready = pselect(sock_fd + 1, &readable, NULL, NULL, NULL, &wait_mask);
+         sigprocmask(SIG_SETMASK, &wait_mask, NULL); // a request in progress can still be cut short by SIGINT, as before
+         if (ready == -1) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             perror("pselect");
+             return 1;
+         }
+         int client_fd = accept(sock_fd, NULL, NULL); //NULLs since we don't need to save address info
+         if (client_fd == -1) {
+             // the socket doesn't block: another worker may have taken the client, or SIGINT came after pselect
+             if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                 continue;
+             }
+             perror("accept"); //not much use having a server that can't accept clients, so terminate upon accept error
+             return 1;
+         }
+         waiting = 0;
+
+         //do stuff with http requests while connected to client.
+         int http_ret; //return value for read_http_request
+         char resource[BUFSIZE]; //probably won't get a file path longer than bufsize long?
+         if ((http_ret = read_http_request(client_fd, resource)) == 0) { //1 is error value for http_read_request
+
+             //http req read in, convert what's stored in resource to a proper file path for use in write_http_response
+             char temp[BUFSIZE]; //temp to store rest of file path so "/server_files" can be appended to the start of resource.
+             strncpy(temp, resource, strlen(resource)+1);
+             strncpy(resource, serve_dir, strlen(serve_dir)+1);
+             strncat(resource, temp, strlen(temp)+1); // serve_dir is directory to serve, the "/" should be part of what read_http_request returns
+
+             //printf("%s", resource); //debugging
+
+             //write result
+             if (write_http_response(client_fd, resource) == 1) {//write error
+                 fprintf(stderr, "http write failure\n");
+                 close(client_fd); //close since can't write to it
+                 return 1;
+             }
+
+             close(client_fd);
+             (*n_requests)++;
+
+         } //end client r/w loop
+         if (http_ret == 1) { // read_http_request failed
+            fprintf(stderr, "read_http_request failed\n");
+            close(client_fd);
+            return 1;
+         }
+
+     }//end accept loop
+     return 0;
+}
+
+// Forks a worker into slot 'index' that serves from the shared listening socket
+// worker_mask: Signal mask the worker runs with, the supervisor's own blocks SIGINT
+// Returns 0 on success (in the supervisor) or -1 on error. The worker itself never returns.
+static int spawn_worker(worker_slot_t *slots, int index, int sock_fd, const char *serve_dir,
+                        const sigset_t *worker_mask) {
+    fflush(stdout); // or the child would print whatever the supervisor had buffered a second time
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) { // the SIGINT handler carries over, so SIGINT drains a worker the same way it stops a lone server
+        if (sigprocmask(SIG_SETMASK, worker_mask, NULL) == -1) {
+            perror("sigprocmask");
+            exit(1);
+        }
+        int result = serve_connections(sock_fd, serve_dir, &slots[index].requests);
+        close(sock_fd);
+        exit(result);
+    }
+    slots[index].pid = pid;
+    slots[index].started = time(NULL);
+    return 0;
+}
+
+// Prefork mode: n_workers processes all accepting on sock_fd. A worker that
+// dies is replaced until SIGINT, which is passed on to every worker so they
+// finish what they're doing and exit, and then each one's request count is printed.
+// Returns 0 on success or 1 on error
+static int serve_prefork(int sock_fd, const char *serve_dir, int n_workers) {
+    // shared so the counts survive their workers and the supervisor can add them up at the end
+    worker_slot_t *slots = mmap(NULL, n_workers * sizeof(worker_slot_t), PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    // SIGINT and SIGCHLD stay blocked except inside sigsuspend, so neither can
+    // slip in between checking keep_going (or for exited workers) and waiting
+    struct sigaction sact;
+    memset(&sact, 0, sizeof(sact));
+    sact.sa_handler = handle_sigchld;
+    sigset_t interrupt, blocked, old_mask, wait_mask;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    blocked = interrupt;
+    sigaddset(&blocked, SIGCHLD);
+    if (sigaction(SIGCHLD, &sact, NULL) == -1 || sigprocmask(SIG_BLOCK, &blocked, &old_mask) == -1) {
+        perror("sigaction");
+        munmap(slots, n_workers * sizeof(worker_slot_t));
+        return 1;
+    }
+    wait_mask = old_mask;
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGCHLD);
+
+    int ret_val = 0;
+    for (int i = 0; i < n_workers; i++) {
+        slots[i].pid = -1;
+        slots[i].requests = 0;
+        slots[i].respawns = 0;
+    }
+    for (int i = 0; i < n_workers && ret_val == 0; i++) {
+        if (spawn_worker(slots, i, sock_fd, serve_dir, &old_mask) != 0) {
+            ret_val = 1;
+            keep_going = 0; // don't run with fewer workers than asked for, shut down the ones already started
+        }
+    }
+
+    // supervise: replace any worker that exits until SIGINT
+    while (keep_going != 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0) {
+            sigsuspend(&wait_mask); // returns once SIGINT or SIGCHLD has been handled
+            continue;
+        }
+        if (pid == -1) {
+            perror("waitpid");
+            ret_val = 1;
+            break;
+        }
+        for (int i = 0; i < n_workers; i++) {
+            if (slots[i].pid != pid) {
+                continue;
+            }
+            slots[i].pid = -1;
+            if (WIFSIGNALED(status)) {
+                fprintf(stderr, "worker %d (pid %d) killed by signal %d, replacing it\n", i, (int) pid, WTERMSIG(status));
+            }
+            else {
+                fprintf(stderr, "worker %d (pid %d) exited with status %d, replacing it\n", i, (int) pid, WEXITSTATUS(status));
+            }
+            if (time(NULL) - slots[i].started < RESPAWN_BACKOFF_S) {
+                // dying right away will likely happen again, don't fork as fast as we can. SIGINT cuts the wait short.
+                sigprocmask(SIG_UNBLOCK, &interrupt, NULL);
+                sleep(RESPAWN_BACKOFF_S);
+                sigprocmask(SIG_BLOCK, &interrupt, NULL);
+            }
+            if (keep_going != 0) {
+                slots[i].respawns++;
+                if (spawn_worker(slots, i, sock_fd, serve_dir, &old_mask) != 0) {
+                    ret_val = 1; // keep running with the workers that are left
+                }
+            }
+            break;
+        }
+    }
+
+    if (sigprocmask(SIG_SETMASK, &old_mask, NULL) == -1) {
+        perror("sigprocmask");
+    }
+
+    // drain: pass SIGINT on (the terminal may already have sent it to the whole group) and wait for everyone
+    for (int i = 0; i < n_workers; i++) {
+        if (slots[i].pid != -1 && kill(slots[i].pid, SIGINT) == -1) {
+            perror("kill");
+        }
+    }
+    // a worker stuck on a client that never finishes its request doesn't get to hold up the exit
+    time_t deadline = time(NULL) + DRAIN_TIMEOUT_S;
+    struct timespec poll_interval = {0, 10 * 1000 * 1000};
+    for (int i = 0; i < n_workers; i++) {
+        while (slots[i].pid != -1) {
+            pid_t done = waitpid(slots[i].pid, NULL, WNOHANG);
+            if (done == slots[i].pid || (done == -1 && errno != EINTR)) {
+                slots[i].pid = -1;
+            }
+            else if (time(NULL) >= deadline) {
+                fprintf(stderr, "worker %d (pid %d) didn't stop in %d seconds, killing it\n", i, (int) slots[i].pid, DRAIN_TIMEOUT_S);
+                kill(slots[i].pid, SIGKILL);
+                while (waitpid(slots[i].pid, NULL, 0) == -1 && errno == EINTR) {
+                    // another SIGINT only interrupts the wait
+                }
+                slots[i].pid = -1;
+            }
+            else {
+                nanosleep(&poll_interval, NULL);
+            }
+        }
+    }
+
+    unsigned long total = 0;
+    for (int i = 0; i < n_workers; i++) {
+        printf("worker %d: %lu requests, %d respawns\n", i, slots[i].requests, slots[i].respawns);
+        total += slots[i].requests;
+    }
+    printf("%lu requests in all\n", total);
+    munmap(slots, n_workers * sizeof(worker_slot_t));
+    return ret_val;
+}
+
 int main(int argc, char **argv) {
-    // First command is directory to serve, second command is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
+    // First command is directory to serve, second command is port, an optional third forks that many workers
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s <directory> <port> [<worker processes, 0 = serve from this process>]\n", argv[0]);
         return 1;
     }
     // Uncomment the lines below to use these definitions:
      const char *serve_dir = argv[1]; //directory to serve
      const char *port = argv[2]; //port to bind to
+     int n_workers = argc == 4 ? atoi(argv[3]) : 0;
+     if (n_workers < 0 || n_workers > MAX_WORKERS) {
+         fprintf(stderr, "worker processes must be between 0 and %d\n", MAX_WORKERS);
+         return 1;
+     }
 
      //install sigint handler before starting setup (similar to in-class example) for tcp server
      struct sigaction sact;
@@ -81,54 +341,32 @@ int main(int argc, char **argv) {
          close(sock_fd);
          return 1;
      }
+     // every worker wakes for a new client but only one gets it, the rest mustn't then block in accept
+     int flags = fcntl(sock_fd, F_GETFL);
+     if (flags == -1 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+         perror("fcntl");
+         close(sock_fd);
+         return 1;
+     }
 
-     while (keep_going != 0) { //server loop for receiving and servicing requests
-         //wait to receive a req from a client; don't bother saving client address info because this is tcp and we have an active connection
-         printf("Waiting for a client to connect\n"); //not strictly necessary, but might be nice for debugging later or for matching test output >_>
-         int client_fd = accept(sock_fd, NULL, NULL); //NULLs since we don't need to save address info
-         if (client_fd == -1) {
-             if (errno != EINTR) {
-                 perror("accept"); //not much use having a server that can't accept clients, so clean up and terminate upon accept error
-                 close(sock_fd);
-                 return 1;
-             }
-             else {
-                 break; //SIGINT received, terminating loop to shut down server.
-             }
-         }
-
-         //do stuff with http requests while connected to client.
-         int http_ret; //return value for read_http_request
-         char resource[BUFSIZE]; //probably won't get a file path longer than bufsize long?
-         if ((http_ret = read_http_request(client_fd, resource)) == 0) { //1 is error value for http_read_request
-
-             //http req read in, convert what's stored in resource to a proper file path for use in write_http_response
-             char temp[BUFSIZE]; //temp to store rest of file path so "/server_files" can be appended to the start of resource.
-             strncpy(temp, resource, strlen(resource)+1);
-             strncpy(resource, serve_dir, strlen(serve_dir)+1);
-             strncat(resource, temp, strlen(temp)+1); // serve_dir is directory to serve, the "/" should be part of what read_http_request returns
-
-             //printf("%s", resource); //debugging
-
-             //write result
-             if (write_http_response(client_fd, resource) == 1) {//write error
-                 fprintf(stderr, "http write failure\n");
-                 close(client_fd); //close since can't write to it
-                 close(sock_fd);
-                 return 1;
-             }
-
-             close(client_fd);
-             
-         } //end client r/w loop
-         if (http_ret == 1) { // read_http_request failed
-            fprintf(stderr, "read_http_request failed\n");
-            close(sock_fd);
-            close(client_fd);
-            return 1;
-         }
+     // a client that hangs up mid-response should fail the write, not kill the process serving it
+     struct sigaction ignore;
+     memset(&ignore, 0, sizeof(ignore));
+     ignore.sa_handler = SIG_IGN;
+     if (sigaction(SIGPIPE, &ignore, NULL) == -1) {
+         perror("sigaction");
+         close(sock_fd);
+         return 1;
+     }
 
-     }//end accept loop
+     // every worker inherits the listening socket and blocks in accept on it, the kernel hands each connection to one of them
+     unsigned long n_requests = 0;
+     int result = n_workers > 0 ? serve_prefork(sock_fd, serve_dir, n_workers)
+                                : serve_connections(sock_fd, serve_dir, &n_requests);
+     if (result != 0) {
+         close(sock_fd);
+         return 1;
+     }
 
     //cleanup; reached even if sigint thanks to our handler.
      if (close(sock_fd) == -1) {
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+
+#define RING_MASK (ACCESS_LOG_RING_SIZE - 1)
+#define LINE_MAX_BYTES (ACCESS_LOG_PATH_MAX + 160) // longest line one entry can turn into
+
+void access_log_write(access_log_ring_t *ring, const http_request_t *req, int status, off_t bytes,
+                      long long start_ns, long long end_ns) {
+    if (ring == NULL) {
+        return;
+    }
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail == ACCESS_LOG_RING_SIZE) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head - ring->cached_tail == ACCESS_LOG_RING_SIZE) {
+            if (ring->policy == ACCESS_LOG_DROP) {
+                // only this thread writes the counter, so no atomic add is needed
+                unsigned long long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+                atomic_store_explicit(&ring->dropped, dropped + 1, memory_order_relaxed);
+                return;
+            }
+            sched_yield(); // ACCESS_LOG_BLOCK: give the flusher the CPU to make room
+            ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        }
+    }
+
+    access_log_entry_t *entry = &ring->entries[head & RING_MASK];
+    entry->end_ns = end_ns;
+    entry->duration_ns = end_ns - start_ns;
+    entry->bytes = bytes;
+    entry->status = status;
+    int method_len = req->method.len < (int) sizeof(entry->method) - 1 ? req->method.len : (int) sizeof(entry->method) - 1;
+    memcpy(entry->method, req->method.start, method_len);
+    entry->method[method_len] = '\0';
+    entry->path_len = req->path.len < ACCESS_LOG_PATH_MAX ? req->path.len : ACCESS_LOG_PATH_MAX;
+    memcpy(entry->path, req->path.start, entry->path_len);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release); // hand it to the flusher
+}
+
+// Turns one entry into a line of text
+// Returns the number of bytes written to 'out', at most LINE_MAX_BYTES
+static int format_entry(access_log_t *log, const access_log_entry_t *entry, char *out) {
+    long long wall_ns = entry->end_ns + log->realtime_offset_ns;
+    time_t seconds = wall_ns / 1000000000LL;
+    if (seconds != log->text_second) { // the date only has to be worked out once a second
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+        log->second_len = strftime(log->second_text, sizeof(log->second_text), "time=%Y-%m-%dT%H:%M:%S", &tm);
+        log->text_second = seconds;
+    }
+    memcpy(out, log->second_text, log->second_len);
+    int len = log->second_len;
+    len += snprintf(out + len, LINE_MAX_BYTES - len, ".%06lldZ method=%s path=%.*s status=%d bytes=%lld duration_us=%lld\n",
+                    (wall_ns % 1000000000LL) / 1000, entry->method, entry->path_len, entry->path, entry->status,
+                    entry->bytes, entry->duration_ns / 1000);
+    return len < LINE_MAX_BYTES ? len : LINE_MAX_BYTES - 1;
+}
+
+// Writes every byte of an iovec array, picking up after short writes
+// Returns 0 on success or -1 on error
+static int write_all(int fd, struct iovec *iov, int n_iov) {
+    while (n_iov > 0) {
+        ssize_t nbytes = writev(fd, iov, n_iov);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            perror("writev");
+            return -1;
+        }
+        while (n_iov > 0 && (size_t) nbytes >= iov->iov_len) {
+            nbytes -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (char *) iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+    return 0;
+}
+
+// Formats whatever each ring holds, up to ACCESS_LOG_BATCH_BYTES of text in
+// all, and writes it with one writev: one iovec per ring that had anything
+// Returns the number of entries taken out of the rings
+static size_t flush_batch(access_log_t *log, char *buf) {
+    struct iovec iov[ACCESS_LOG_MAX_RINGS];
+    int n_iov = 0;
+    size_t used = 0;
+    size_t taken = 0;
+    int n_rings = atomic_load_explicit(&log->n_rings, memory_order_acquire);
+    for (int i = 0; i < n_rings && used + LINE_MAX_BYTES <= ACCESS_LOG_BATCH_BYTES; i++) {
+        access_log_ring_t *ring = log->rings[i];
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t start = used;
+        while (tail != head && used + LINE_MAX_BYTES <= ACCESS_LOG_BATCH_BYTES) {
+            used += format_entry(log, &ring->entries[tail & RING_MASK], buf + used);
+            tail++;
+            taken++;
+        }
+        // the text is in buf now, so the worker can have the slots back before the write
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        if (used > start) {
+            iov[n_iov].iov_base = buf + start;
+            iov[n_iov].iov_len = used - start;
+            n_iov++;
+        }
+    }
+    if (n_iov > 0) {
+        write_all(log->fd, iov, n_iov); // a failed write loses this batch, there's nowhere better to put it
+    }
+    return taken;
+}
+
+// THREAD FUNCTION: drains the rings until access_log_close, then once more
+static void *run_flusher(void *arg) {
+    access_log_t *log = (access_log_t *) arg;
+    char *buf = malloc(ACCESS_LOG_BATCH_BYTES);
+    if (buf == NULL) {
+        perror("malloc");
+        return (void *) -1;
+    }
+    while (1) {
+        // read stop first: anything logged before it was set is picked up by this pass or the next
+        int stopping = atomic_load_explicit(&log->stop, memory_order_acquire);
+        if (flush_batch(log, buf) > 0) {
+            continue; // there may be more, don't sleep yet
+        }
+        if (stopping) {
+            break;
+        }
+        struct timespec nap = { .tv_sec = 0, .tv_nsec = ACCESS_LOG_FLUSH_MS * 1000000L };
+        nanosleep(&nap, NULL);
+    }
+    free(buf);
+    return NULL;
+}
+
+int access_log_open(access_log_t *log, const char *path, int policy) {
+    if (strcmp(path, "-") == 0) {
+        log->fd = dup(STDOUT_FILENO);
+    }
+    else {
+        log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    if (log->fd == -1) {
+        perror(path);
+        return -1;
+    }
+    log->policy = policy;
+    log->text_second = -1;
+    atomic_init(&log->n_rings, 0);
+    atomic_init(&log->stop, 0);
+    if (pthread_mutex_init(&log->lock, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        close(log->fd);
+        return -1;
+    }
+    struct timespec real;
+    struct timespec mono;
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    log->realtime_offset_ns = (real.tv_sec - mono.tv_sec) * 1000000000LL + (real.tv_nsec - mono.tv_nsec);
+
+    sigset_t sigset;
+    sigset_t oldset;
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+    int err_code = pthread_create(&log->flusher, NULL, run_flusher, log);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+        pthread_mutex_destroy(&log->lock);
+        close(log->fd);
+        return -1;
+    }
+    return 0;
+}
+
+access_log_ring_t *access_log_register(access_log_t *log) {
+    if (log == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&log->lock);
+    int n_rings = atomic_load_explicit(&log->n_rings, memory_order_relaxed);
+    if (n_rings == ACCESS_LOG_MAX_RINGS) {
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+    }
+    // aligned so the two indexes really do land on separate cache lines
+    access_log_ring_t *ring = aligned_alloc(CACHE_LINE, sizeof(access_log_ring_t));
+    if (ring == NULL) {
+        perror("aligned_alloc");
+        pthread_mutex_unlock(&log->lock);
+        return NULL;
+    }
+    memset(ring->entries, 0, sizeof(ring->entries)); // fault the pages in now rather than on the request path
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->cached_tail = 0;
+    ring->policy = log->policy;
+    log->rings[n_rings] = ring;
+    atomic_store_explicit(&log->n_rings, n_rings + 1, memory_order_release); // the flusher can see it now
+    pthread_mutex_unlock(&log->lock);
+    return ring;
+}
+
+unsigned long long access_log_dropped(access_log_t *log) {
+    unsigned long long dropped = 0;
+    int n_rings = atomic_load_explicit(&log->n_rings, memory_order_acquire);
+    for (int i = 0; i < n_rings; i++) {
+        dropped += atomic_load_explicit(&log->rings[i]->dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+int access_log_close(access_log_t *log) {
+    int ret_val = 0;
+    atomic_store_explicit(&log->stop, 1, memory_order_release);
+    void *thread_ret;
+    int err_code = pthread_join(log->flusher, &thread_ret);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+        ret_val = -1;
+    }
+    else if (thread_ret != NULL) {
+        ret_val = -1;
+    }
+    int n_rings = atomic_load_explicit(&log->n_rings, memory_order_relaxed);
+    for (int i = 0; i < n_rings; i++) {
+        free(log->rings[i]);
+    }
+    pthread_mutex_destroy(&log->lock);
+    if (close(log->fd) == -1) {
+        perror("close");
+        ret_val = -1;
+    }
+    return ret_val;
+}
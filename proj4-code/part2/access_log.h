@@ -0,0 +1,96 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "http_parser.h"
+#include "lockfree_queue.h"
+
+#define ACCESS_LOG_RING_SIZE 4096  // entries each thread can have waiting for the flusher, a power of two
+#define ACCESS_LOG_MAX_RINGS 256   // threads that can log, any more just don't
+#define ACCESS_LOG_PATH_MAX 128    // longer request paths are cut short in the log
+#define ACCESS_LOG_FLUSH_MS 5      // how long the flusher sleeps once every ring is empty
+#define ACCESS_LOG_BATCH_BYTES (256 * 1024) // most log text written in one writev
+
+// What a worker does when its ring is full
+#define ACCESS_LOG_DROP 0  // count the entry as dropped and move on
+#define ACCESS_LOG_BLOCK 1 // wait for the flusher to make room
+
+// One request, as the worker saw it. Workers only copy these in; turning them
+// into text is the flusher's job.
+typedef struct {
+    long long end_ns;      // monotonic time the response was done
+    long long duration_ns;
+    long long bytes;
+    int status;
+    int path_len;          // bytes of path used
+    char method[8];
+    char path[ACCESS_LOG_PATH_MAX];
+} access_log_entry_t;
+
+// Single-producer single-consumer ring: one worker writes entries in, the
+// flusher takes them out. Each side owns one index and only reads the other's,
+// so neither ever waits on a lock.
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t head; // next slot the worker fills
+    size_t cached_tail; // the worker's last look at tail, so it only reads the flusher's line when it seems full
+    int policy;         // ACCESS_LOG_DROP or ACCESS_LOG_BLOCK
+    _Alignas(CACHE_LINE) atomic_size_t tail; // next slot the flusher empties
+    _Alignas(CACHE_LINE) atomic_ullong dropped;
+    access_log_entry_t entries[ACCESS_LOG_RING_SIZE];
+} access_log_ring_t;
+
+typedef struct {
+    int fd;
+    int policy;
+    access_log_ring_t *rings[ACCESS_LOG_MAX_RINGS];
+    atomic_int n_rings;   // rings handed out, each pointer is set before this counts it
+    pthread_mutex_t lock; // serializes access_log_register
+    long long realtime_offset_ns; // wall clock minus monotonic clock, for the timestamps
+    atomic_int stop;
+    pthread_t flusher;
+    long long text_second; // flusher only: the second second_text was formatted for
+    char second_text[32];  // "time=YYYY-MM-DDTHH:MM:SS", reused by every entry in the same second
+    int second_len;
+} access_log_t;
+
+/*
+ * Open the log file (appending, created if need be, "-" for stdout) and start
+ * the flusher thread. The flusher blocks every signal.
+ * policy: ACCESS_LOG_DROP or ACCESS_LOG_BLOCK
+ * Returns 0 on success or -1 on error
+ */
+int access_log_open(access_log_t *log, const char *path, int policy);
+
+/*
+ * Give the calling thread a ring to log into. Thread safe.
+ * Returns the ring, or NULL if log is NULL or every ring is taken, in which
+ * case the thread's requests aren't logged
+ */
+access_log_ring_t *access_log_register(access_log_t *log);
+
+/*
+ * Log a finished request. Only the thread that registered the ring may call
+ * this. Does nothing if ring is NULL.
+ * req: The parsed request, for its method and path
+ * start_ns, end_ns: Monotonic times the request was complete and its response was sent
+ */
+void access_log_write(access_log_ring_t *ring, const http_request_t *req, int status, off_t bytes,
+                      long long start_ns, long long end_ns);
+
+/*
+ * Returns the number of entries dropped because a ring was full
+ */
+unsigned long long access_log_dropped(access_log_t *log);
+
+/*
+ * Write out everything still in the rings, stop the flusher and close the
+ * file. Every thread that logs must have stopped.
+ * Returns 0 on success or -1 on error
+ */
+int access_log_close(access_log_t *log);
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,83 @@
+#include <math.h>
+
+#include "admission.h"
+
+void admission_init(admission_t *admission, const admission_config_t *config) {
+    admission->config = config;
+    admission->first_above_ns = 0;
+    admission->drop_next_ns = 0;
+    admission->count = 0;
+    admission->dropping = 0;
+}
+
+// CoDel's control law: the gap between sheds shrinks with the square root of
+// how many there have been, so the rate keeps rising until wait comes down
+static long long next_drop(const admission_t *admission, long long from_ns) {
+    return from_ns + (long long) (admission->config->interval_ns / sqrt(admission->count));
+}
+
+// CoDel (Nichols and Jacobson), run at the acceptor: the oldest connection's
+// wait so far stands in for the sojourn time a packet queue would measure as
+// packets leave. Brief bursts are let through; only wait that stays above
+// target for a whole interval starts the shedding.
+// Returns 1 to queue the connection or 0 to turn it away
+static int codel_admit(admission_t *admission, long long wait_ns, long long now_ns) {
+    const admission_config_t *config = admission->config;
+    if (wait_ns < config->target_ns) {
+        admission->first_above_ns = 0;
+        admission->dropping = 0;
+        return 1;
+    }
+    if (admission->first_above_ns == 0) {
+        admission->first_above_ns = now_ns + config->interval_ns;
+        return 1;
+    }
+    if (!admission->dropping) {
+        if (now_ns < admission->first_above_ns) {
+            return 1;
+        }
+        admission->dropping = 1;
+        // overloaded again soon after the last time: start near the rate that worked then
+        if (admission->count > 2 && now_ns - admission->drop_next_ns < 16 * config->interval_ns) {
+            admission->count -= 2;
+        }
+        else {
+            admission->count = 1;
+        }
+        admission->drop_next_ns = next_drop(admission, now_ns);
+        return 0;
+    }
+    if (now_ns >= admission->drop_next_ns) {
+        admission->count++;
+        admission->drop_next_ns = next_drop(admission, admission->drop_next_ns);
+        return 0;
+    }
+    return 1;
+}
+
+int admission_admit(admission_t *admission, connection_queue_t *queue, long long now_ns) {
+    const admission_config_t *config = admission->config;
+    if (config->policy == ADMIT_ALL) {
+        return 1;
+    }
+    // workers only ever shorten the queue, so if there's room now, enqueue won't wait for it
+    size_t limit = connection_queue_capacity(queue);
+    if (config->max_depth > 0 && config->max_depth < limit) {
+        limit = config->max_depth;
+    }
+    if (connection_queue_length(queue) >= limit) {
+        return 0;
+    }
+    long long wait_ns = connection_queue_oldest_wait(queue, now_ns);
+    if (config->policy == ADMIT_CODEL) {
+        return codel_admit(admission, wait_ns, now_ns);
+    }
+    return config->max_wait_ns == 0 || wait_ns < config->max_wait_ns;
+}
+
+long long admission_wait_limit(const admission_config_t *config) {
+    if (config->policy == ADMIT_CODEL) {
+        return config->interval_ns;
+    }
+    return config->policy == ADMIT_LIMIT ? config->max_wait_ns : 0;
+}
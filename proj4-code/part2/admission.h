@@ -0,0 +1,60 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+#include "connection_queue.h"
+
+// How an acceptor decides whether a new connection joins the queue
+#define ADMIT_ALL 0   // always queue it, waiting for room if the queue is full
+#define ADMIT_LIMIT 1 // turn it away once the queue is max_depth deep or its oldest connection has waited max_wait_ns
+#define ADMIT_CODEL 2 // turn connections away at CoDel's rising rate once queue wait has stayed above target_ns
+
+#define DEFAULT_CODEL_INTERVAL_MS 100 // how long queue wait has to stay above target before shedding starts
+#define DEFAULT_RETRY_AFTER_S 1       // Retry-After sent with a 503
+
+// Settings picked on the command line
+typedef struct {
+    int policy;             // ADMIT_ALL, ADMIT_LIMIT or ADMIT_CODEL
+    size_t max_depth;       // turn connections away at this queue length, 0 for only when full
+    long long max_wait_ns;  // ADMIT_LIMIT: 0 for no limit on queue wait
+    long long target_ns;    // ADMIT_CODEL: queue wait to keep under
+    long long interval_ns;  // ADMIT_CODEL
+    int retry_after_s;
+} admission_config_t;
+
+// One acceptor's view of its queue. Only that acceptor uses it, so there's no locking.
+typedef struct {
+    const admission_config_t *config;
+    long long first_above_ns; // CoDel: when wait has been above target for an interval, 0 while it's below
+    long long drop_next_ns;   // CoDel: when the next connection gets turned away
+    unsigned int count;       // CoDel: connections turned away since shedding started
+    int dropping;             // CoDel: 1 while shedding
+} admission_t;
+
+/*
+ * Set up the state for one acceptor
+ */
+void admission_init(admission_t *admission, const admission_config_t *config);
+
+/*
+ * Decide whether a connection that just arrived joins the queue. Under
+ * ADMIT_LIMIT and ADMIT_CODEL a full queue always turns it away, so the
+ * acceptor never waits for room.
+ * queue: The queue it would join, only ever added to by this acceptor
+ * now_ns: The current CLOCK_MONOTONIC time in nanoseconds
+ * Returns 1 to queue it or 0 to turn it away with a 503
+ */
+int admission_admit(admission_t *admission, connection_queue_t *queue, long long now_ns);
+
+/*
+ * Longest a connection should sit in the queue before it gets a 503 instead
+ * of waiting on: max_wait_ns under ADMIT_LIMIT, a whole interval under
+ * ADMIT_CODEL. Turning away connections that have waited this long keeps the
+ * latency of everything that is served bounded, even while every worker is
+ * tied up with a kept-alive connection.
+ * Returns the limit in nanoseconds, or 0 for none
+ */
+long long admission_wait_limit(const admission_config_t *config);
+
+#endif // ADMISSION_H
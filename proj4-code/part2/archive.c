@@ -0,0 +1,252 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+// FNV-1a, picks the bucket
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns name without any leading '/' or "./", which tar -C dir . puts on every member
+static const char *strip_leading(const char *name) {
+    while (name[0] == '/' || (name[0] == '.' && name[1] == '/')) {
+        name += name[0] == '/' ? 1 : 2;
+    }
+    return name;
+}
+
+// Reads a numeric header field: 0-padded octal, or base-256 if the top bit of
+// the first byte is set (how GNU tar writes sizes of 8GB and up)
+// Returns 0 on success or -1 if the field isn't a number
+static int parse_number(const char *field, size_t len, long long *value) {
+    *value = 0;
+    if ((unsigned char) field[0] & 0x80) {
+        *value = (unsigned char) field[0] & 0x7f;
+        for (size_t i = 1; i < len; i++) {
+            *value = (*value << 8) | (unsigned char) field[i];
+        }
+        return 0;
+    }
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    if (i == len || field[i] < '0' || field[i] > '7') {
+        return -1;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        *value = *value * 8 + (field[i] - '0');
+    }
+    return 0;
+}
+
+// Returns 1 if the header's checksum matches its bytes, 0 if not
+static int checksum_ok(const archive_header_t *header) {
+    long long expected;
+    if (parse_number(header->chksum, sizeof(header->chksum), &expected) != 0) {
+        return 0;
+    }
+    const unsigned char *bytes = (const unsigned char *) header;
+    long long sum = 0;
+    for (size_t i = 0; i < sizeof(archive_header_t); i++) {
+        int in_chksum = i >= offsetof(archive_header_t, chksum) &&
+                        i < offsetof(archive_header_t, chksum) + sizeof(header->chksum);
+        sum += in_chksum ? ' ' : bytes[i];
+    }
+    return sum == expected;
+}
+
+// Returns 1 if the block is all zeros, which marks the end of the archive
+static int zero_block(const char *block) {
+    for (int i = 0; i < ARCHIVE_BLOCK_SIZE; i++) {
+        if (block[i] != '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns the member's full name (prefix/name) in a new string, or NULL on error
+static char *member_name(const archive_header_t *header) {
+    size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    char *name = malloc(prefix_len + name_len + 2);
+    if (name == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    if (prefix_len > 0) {
+        memcpy(name, header->prefix, prefix_len);
+        name[prefix_len++] = '/';
+    }
+    memcpy(name + prefix_len, header->name, name_len);
+    name[prefix_len + name_len] = '\0';
+    const char *stripped = strip_leading(name);
+    memmove(name, stripped, strlen(stripped) + 1);
+    return name;
+}
+
+// Adds a member to the end of the list, growing it as needed
+// Returns 0 on success or -1 on error
+static int add_member(archive_t *archive, size_t *capacity, const archive_header_t *header, off_t offset,
+                      long long size, long long mtime) {
+    if (archive->n_members == *capacity) {
+        size_t bigger = *capacity > 0 ? *capacity * 2 : 64;
+        archive_member_t *members = realloc(archive->members, bigger * sizeof(archive_member_t));
+        if (members == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        archive->members = members;
+        *capacity = bigger;
+    }
+    archive_member_t *member = &archive->members[archive->n_members];
+    memset(member, 0, sizeof(archive_member_t));
+    member->name = member_name(header);
+    if (member->name == NULL) {
+        return -1;
+    }
+    member->offset = offset;
+    member->mtime = mtime;
+    member->data.path = member->name;
+    member->data.body = archive->map + offset;
+    member->data.size = size;
+    member->data.source_size = size;
+    member->data.mtime.tv_sec = mtime;
+    member->data.refs = 1; // the archive's, never let go of while it's open
+    archive->n_members++;
+    return 0;
+}
+
+// Walks the headers from the start of the archive, skipping over each
+// member's data without touching it
+// Returns 0 on success or -1 on error
+static int index_members(archive_t *archive, const char *path) {
+    size_t capacity = 0;
+    size_t offset = 0;
+    while (offset + ARCHIVE_BLOCK_SIZE <= archive->map_len) {
+        const archive_header_t *header = (const archive_header_t *) (archive->map + offset);
+        if (zero_block((const char *) header)) {
+            break;
+        }
+        long long size;
+        long long mtime;
+        if (!checksum_ok(header) || parse_number(header->size, sizeof(header->size), &size) != 0 ||
+            parse_number(header->mtime, sizeof(header->mtime), &mtime) != 0) {
+            fprintf(stderr, "%s: bad tar header at byte %zu\n", path, offset);
+            return -1;
+        }
+        size_t data = offset + ARCHIVE_BLOCK_SIZE;
+        if (size < 0 || (unsigned long long) size > archive->map_len - data) {
+            fprintf(stderr, "%s: member at byte %zu runs past the end of the archive\n", path, offset);
+            return -1;
+        }
+        // directories, links and pax/GNU extension headers are skipped like any other data
+        int regular = header->typeflag == ARCHIVE_REGTYPE || header->typeflag == ARCHIVE_AREGTYPE;
+        if (regular && strncmp(header->magic, ARCHIVE_MAGIC, strlen(ARCHIVE_MAGIC)) == 0 &&
+            add_member(archive, &capacity, header, data, size, mtime) != 0) {
+            return -1;
+        }
+        offset = data + (size + ARCHIVE_BLOCK_SIZE - 1) / ARCHIVE_BLOCK_SIZE * ARCHIVE_BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// Chains every member into its bucket. Later copies of a name go in front of
+// earlier ones, so a lookup finds the last one.
+// Returns 0 on success or -1 on error
+static int build_index(archive_t *archive) {
+    archive->n_buckets = 16;
+    while (archive->n_buckets < archive->n_members * 2) {
+        archive->n_buckets *= 2;
+    }
+    archive->buckets = calloc(archive->n_buckets, sizeof(archive_member_t *));
+    if (archive->buckets == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (size_t i = 0; i < archive->n_members; i++) {
+        archive_member_t *member = &archive->members[i];
+        archive_member_t **bucket = &archive->buckets[hash_name(member->name) & (archive->n_buckets - 1)];
+        member->next = *bucket;
+        *bucket = member;
+    }
+    return 0;
+}
+
+int archive_open(archive_t *archive, const char *path) {
+    archive->map = NULL;
+    archive->map_len = 0;
+    archive->members = NULL;
+    archive->n_members = 0;
+    archive->buckets = NULL;
+    archive->n_buckets = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    if (stat_buf.st_size == 0) {
+        fprintf(stderr, "%s: empty archive\n", path);
+        close(fd);
+        return -1;
+    }
+    archive->map_len = stat_buf.st_size;
+    archive->map = mmap(NULL, archive->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (archive->map == MAP_FAILED) {
+        perror("mmap");
+        archive->map = NULL;
+        return -1;
+    }
+    if (index_members(archive, path) != 0 || build_index(archive) != 0) {
+        archive_close(archive);
+        return -1;
+    }
+    return 0;
+}
+
+const archive_member_t *archive_find(const archive_t *archive, const char *name) {
+    name = strip_leading(name);
+    archive_member_t *member = archive->buckets[hash_name(name) & (archive->n_buckets - 1)];
+    while (member != NULL && strcmp(member->name, name) != 0) {
+        member = member->next;
+    }
+    return member;
+}
+
+int archive_close(archive_t *archive) {
+    int ret_val = 0;
+    for (size_t i = 0; i < archive->n_members; i++) {
+        free(archive->members[i].name);
+    }
+    free(archive->members);
+    free(archive->buckets);
+    archive->members = NULL;
+    archive->buckets = NULL;
+    archive->n_members = 0;
+    if (archive->map != NULL && munmap(archive->map, archive->map_len) == -1) {
+        perror("munmap");
+        ret_val = -1;
+    }
+    archive->map = NULL;
+    return ret_val;
+}
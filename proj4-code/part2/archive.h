@@ -0,0 +1,79 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "file_cache.h"
+
+#define ARCHIVE_BLOCK_SIZE 512 // tar headers and member data both come in blocks this big
+
+// The 512-byte ustar header, laid out as in proj1-code/minitar.h
+typedef struct {
+    char name[100];    // member's name, only null-terminated if it's shorter than 100 bytes
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];     // 0-padded octal, or base-256 with the top bit set for huge members
+    char mtime[12];    // 0-padded octal, Unix epoch time
+    char chksum[8];    // 0-padded octal sum of the header's bytes, taking this field as blanks
+    char typeflag;     // ARCHIVE_REGTYPE for the regular files we serve
+    char linkname[100];
+    char magic[6];     // "ustar"
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];  // goes in front of name, with a '/' between them, for long paths
+    char padding[12];
+} archive_header_t;
+
+#define ARCHIVE_MAGIC "ustar"
+#define ARCHIVE_REGTYPE '0'
+#define ARCHIVE_AREGTYPE '\0' // regular file as old tars write it
+
+// One regular file in the archive
+typedef struct archive_member {
+    char *name;           // path within the archive without any leading "./"
+    off_t offset;         // where the member's data starts in the archive
+    time_t mtime;
+    cache_entry_t data;   // body and size point into the mapping, so it goes out like a cached file
+    struct archive_member *next; // next member in the same bucket
+} archive_member_t;
+
+// A ustar archive mapped into memory with an index from member name to data.
+// Opening one only reads the headers, so it takes time in proportion to the
+// number of members rather than the size of the archive.
+typedef struct {
+    char *map;
+    size_t map_len;
+    archive_member_t *members;  // n_members of them, in archive order
+    size_t n_members;
+    archive_member_t **buckets; // n_buckets chains, a power of two
+    size_t n_buckets;
+} archive_t;
+
+/*
+ * Map a ustar archive and index its regular files. When a name appears more
+ * than once, the last copy wins, as it would if the archive were extracted.
+ * Returns 0 on success or -1 on error
+ */
+int archive_open(archive_t *archive, const char *path);
+
+/*
+ * Find a member by name. Thread safe, the index never changes once opened.
+ * name: Path within the archive, a leading '/' or "./" is ignored
+ * Returns the member, or NULL if there's no such regular file
+ */
+const archive_member_t *archive_find(const archive_t *archive, const char *name);
+
+/*
+ * Unmap the archive and free its index. No response may still be sending
+ * from it.
+ * Returns 0 on success or -1 on error
+ */
+int archive_close(archive_t *archive);
+
+#endif // ARCHIVE_H
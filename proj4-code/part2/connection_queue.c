@@ -1,30 +1,101 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "connection_queue.h"
 
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 int connection_queue_init(connection_queue_t *queue) {
     memset(&queue->client_fds, -1, CAPACITY * sizeof(int));
+    memset(&queue->enqueued_ns, 0, CAPACITY * sizeof(long long));
     queue->length = 0;
     queue->read_idx = 0; // read_idx == write_idx --> length == 0
     queue->write_idx = 0;
     queue->shutdown = 0; // if changed to 1, all enqueues and dequeues should stop
+    queue->kind = QUEUE_MUTEX;
+    queue->lockfree = NULL;
 
     if (pthread_mutex_init(&queue->lock, NULL) != 0) {
         fprintf(stderr, "pthread_mutex_init failed\n");
         return -1;
     }
-    if (pthread_cond_init(&queue->empty, NULL) != 0 ||
+    // timed dequeues wait on 'empty' against the monotonic clock, so setting the date can't cut them short
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (pthread_cond_init(&queue->empty, &attr) != 0 ||
         pthread_cond_init(&queue->full, NULL) != 0)
     {
         fprintf(stderr, "pthread_cond_init failed\n");
+        pthread_condattr_destroy(&attr);
         return -1;
     } // destroyed in connection_queue_free
+    pthread_condattr_destroy(&attr);
     return 0;
 }
 
+int connection_queue_init_lockfree(connection_queue_t *queue, size_t capacity) {
+    if (connection_queue_init(queue) == -1) { // the lock and conditions go unused but keep free() uniform
+        return -1;
+    }
+    // aligned so the ring's counters really do land on separate cache lines
+    queue->lockfree = aligned_alloc(CACHE_LINE, sizeof(lockfree_queue_t));
+    if (queue->lockfree == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    if (lockfree_queue_init(queue->lockfree, capacity) == -1) {
+        free(queue->lockfree);
+        queue->lockfree = NULL;
+        return -1;
+    }
+    queue->kind = QUEUE_LOCKFREE;
+    return 0;
+}
+
+size_t connection_queue_length(connection_queue_t *queue) {
+    if (queue->kind == QUEUE_LOCKFREE) {
+        return lockfree_queue_length(queue->lockfree);
+    }
+    pthread_mutex_lock(&queue->lock);
+    size_t length = queue->length;
+    pthread_mutex_unlock(&queue->lock);
+    return length;
+}
+
+size_t connection_queue_capacity(connection_queue_t *queue) {
+    if (queue->kind == QUEUE_LOCKFREE) {
+        return queue->lockfree->mask + 1;
+    }
+    return CAPACITY;
+}
+
+long long connection_queue_oldest_wait(connection_queue_t *queue, long long now_ns) {
+    long long enqueued_ns = 0;
+    if (queue->kind == QUEUE_LOCKFREE) {
+        enqueued_ns = lockfree_queue_oldest(queue->lockfree);
+    }
+    else {
+        pthread_mutex_lock(&queue->lock);
+        if (queue->length > 0) {
+            enqueued_ns = queue->enqueued_ns[queue->read_idx];
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return enqueued_ns == 0 || enqueued_ns > now_ns ? 0 : now_ns - enqueued_ns;
+}
+
 int connection_enqueue(connection_queue_t *queue, int connection_fd) {
     // printf("enqueue %d\n", connection_fd); // debugging
+    if (queue->kind == QUEUE_LOCKFREE) {
+        return lockfree_enqueue(queue->lockfree, connection_fd, monotonic_ns());
+    }
     if (pthread_mutex_lock(&queue->lock) != 0) {
         fprintf(stderr, "pthread_mutex_lock failed\n");
         return -1;
@@ -58,6 +129,7 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd) {
 
     // add item to queue
     queue->client_fds[queue->write_idx] = connection_fd; //update array
+    queue->enqueued_ns[queue->write_idx] = monotonic_ns();
     queue->write_idx = (queue->write_idx + 1) % CAPACITY; // increment write_idx
     queue->length++;
 
@@ -74,7 +146,26 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd) {
 }
 
 int connection_dequeue(connection_queue_t *queue) {
+    long long enqueued_ns;
+    return connection_dequeue_stamped(queue, &enqueued_ns);
+}
+
+int connection_dequeue_stamped(connection_queue_t *queue, long long *enqueued_ns) {
+    return connection_dequeue_timed(queue, enqueued_ns, -1);
+}
+
+int connection_dequeue_timed(connection_queue_t *queue, long long *enqueued_ns, int timeout_ms) {
     // printf("dequeue %d (if it's -1 that means this thread is waiting for a value)\n", queue->client_fds[queue->read_idx]); // debugging
+    *enqueued_ns = 0;
+    if (queue->kind == QUEUE_LOCKFREE) {
+        return lockfree_dequeue_timed(queue->lockfree, enqueued_ns, timeout_ms);
+    }
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        long long deadline_ns = monotonic_ns() + timeout_ms * 1000000LL;
+        deadline.tv_sec = deadline_ns / 1000000000LL;
+        deadline.tv_nsec = deadline_ns % 1000000000LL;
+    }
     if (pthread_mutex_lock(&queue->lock) != 0) {
         perror("pthread_mutex_lock");
         return -1;
@@ -91,8 +182,20 @@ int connection_dequeue(connection_queue_t *queue) {
 
     while (queue->length <= 0 && !queue->shutdown) {
         // printf("inside while, queue->length = %d, shutdown = %d\n", queue->length, queue->shutdown); // debugging
-        if (pthread_cond_wait(&queue->empty, &queue->lock) != 0) { // wait until there's an open slot
-            fprintf(stderr, "pthread_cond_wait failed\n");
+        if (timeout_ms < 0) {
+            if (pthread_cond_wait(&queue->empty, &queue->lock) != 0) { // wait until there's an open slot
+                fprintf(stderr, "pthread_cond_wait failed\n");
+                return -1;
+            }
+            continue;
+        }
+        int err = pthread_cond_timedwait(&queue->empty, &queue->lock, &deadline);
+        if (err == ETIMEDOUT && queue->length <= 0 && !queue->shutdown) {
+            pthread_mutex_unlock(&queue->lock);
+            return CONNECTION_QUEUE_TIMEOUT;
+        }
+        if (err != 0 && err != ETIMEDOUT) {
+            fprintf(stderr, "pthread_cond_timedwait failed\n");
             return -1;
         }
     }
@@ -109,6 +212,7 @@ int connection_dequeue(connection_queue_t *queue) {
 
     // add item to queue
     int ret_val = queue->client_fds[queue->read_idx]; //read from front of queue
+    *enqueued_ns = queue->enqueued_ns[queue->read_idx];
     queue->read_idx = (queue->read_idx + 1) % CAPACITY; // increment write_idx
     queue->length--;
 
@@ -124,8 +228,28 @@ int connection_dequeue(connection_queue_t *queue) {
     return ret_val;
 }
 
+int connection_dequeue_older(connection_queue_t *queue, long long before_ns) {
+    if (queue->kind == QUEUE_LOCKFREE) {
+        return lockfree_dequeue_older(queue->lockfree, before_ns);
+    }
+    pthread_mutex_lock(&queue->lock);
+    int ret_val = -1;
+    if (!queue->shutdown && queue->length > 0 && queue->enqueued_ns[queue->read_idx] < before_ns) {
+        ret_val = queue->client_fds[queue->read_idx];
+        queue->read_idx = (queue->read_idx + 1) % CAPACITY;
+        queue->length--;
+        pthread_cond_signal(&queue->full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret_val;
+}
+
 int connection_queue_shutdown(connection_queue_t *queue) {
     queue->shutdown = 1;
+    if (queue->kind == QUEUE_LOCKFREE) {
+        lockfree_queue_shutdown(queue->lockfree);
+        return 0;
+    }
     int err;
     // wake up all other threads
     err = pthread_cond_broadcast(&queue->empty);
@@ -144,6 +268,10 @@ int connection_queue_shutdown(connection_queue_t *queue) {
 int connection_queue_free(connection_queue_t *queue) {
     int ret_val = 0;
     // threads already waited for before call to this function
+    if (queue->lockfree != NULL) {
+        lockfree_queue_free(queue->lockfree);
+        free(queue->lockfree);
+    }
 
     if (pthread_mutex_destroy(&queue->lock) != 0 ||
         pthread_cond_destroy(&queue->full) != 0 ||
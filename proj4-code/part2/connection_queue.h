@@ -2,13 +2,24 @@
 #define CONNECTION_QUEUE_H
 
 #include <pthread.h>
+#include <stddef.h>
+
+#include "lockfree_queue.h"
 
 #define CAPACITY 5
 
+#define QUEUE_MUTEX 0    // the fixed CAPACITY ring guarded by a mutex and condition variables
+#define QUEUE_LOCKFREE 1 // lockfree_queue_t, sized at runtime
+#define QUEUE_STEAL 2    // threads mode only: no shared queue, per-worker steal_deque_t instead
+#define QUEUE_SJF 3      // threads mode only: requests ordered by response size in a priority_queue_t instead
+
+#define CONNECTION_QUEUE_TIMEOUT LOCKFREE_TIMEOUT // connection_dequeue_timed found nothing in time
+
 // Struct representing a thread-safe queue data structure
 // The queue stores file descriptors of active client TCP sockets
 typedef struct {
     int client_fds[CAPACITY];
+    long long enqueued_ns[CAPACITY]; // when each fd went in
     int length;
     int read_idx;
     int write_idx;
@@ -16,6 +27,8 @@ typedef struct {
     pthread_mutex_t lock; // mutex lock initialized to 1
     pthread_cond_t empty;
     pthread_cond_t full;
+    int kind;                  // QUEUE_MUTEX or QUEUE_LOCKFREE
+    lockfree_queue_t *lockfree; // only used when kind == QUEUE_LOCKFREE
 } connection_queue_t;
 
 /*
@@ -26,6 +39,32 @@ typedef struct {
  */
 int connection_queue_init(connection_queue_t *queue);
 
+/*
+ * Initialize a connection queue backed by a lock-free ring instead of a mutex.
+ * Every other connection_queue function works the same way on it.
+ * queue: Pointer to connection_queue_t to be initialized
+ * capacity: Number of slots, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int connection_queue_init_lockfree(connection_queue_t *queue, size_t capacity);
+
+/*
+ * Number of connections waiting in the queue right now
+ */
+size_t connection_queue_length(connection_queue_t *queue);
+
+/*
+ * Most connections the queue can hold before an enqueue has to wait
+ */
+size_t connection_queue_capacity(connection_queue_t *queue);
+
+/*
+ * How long the connection at the front of the queue has been waiting, or 0 if
+ * the queue is empty
+ * now_ns: The current CLOCK_MONOTONIC time in nanoseconds
+ */
+long long connection_queue_oldest_wait(connection_queue_t *queue, long long now_ns);
+
 /*
  * Add a new file descriptor to a connection queue. If the queue is full, then
  * this function blocks until space becomes available. If the queue is shut
@@ -46,6 +85,28 @@ int connection_enqueue(connection_queue_t *queue, int connection_fd);
  */
 int connection_dequeue(connection_queue_t *queue);
 
+/*
+ * connection_dequeue, also saying when the connection was enqueued
+ * enqueued_ns: Set to the CLOCK_MONOTONIC time in nanoseconds it was added
+ * Returns the removed socket file descriptor on success or -1 on error
+ */
+int connection_dequeue_stamped(connection_queue_t *queue, long long *enqueued_ns);
+
+/*
+ * connection_dequeue_stamped, giving up if no connection arrives in time
+ * timeout_ms: Longest to wait, -1 to wait as long as it takes
+ * Returns the removed socket file descriptor, CONNECTION_QUEUE_TIMEOUT, or -1 on error
+ */
+int connection_dequeue_timed(connection_queue_t *queue, long long *enqueued_ns, int timeout_ms);
+
+/*
+ * Remove the connection at the front of the queue if it has been waiting since
+ * before a given time. Never waits.
+ * before_ns: CLOCK_MONOTONIC time in nanoseconds it must have been enqueued before
+ * Returns the removed socket file descriptor, or -1 if there's none that old
+ */
+int connection_dequeue_older(connection_queue_t *queue, long long before_ns);
+
 /*
  * Cleanly shuts down the connection queue. All threads currently blocked on an
  * enqueue or dequeue operation are unblocked and an error is returned to them.
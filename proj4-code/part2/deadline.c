@@ -0,0 +1,105 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "deadline.h"
+
+long long deadline_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long deadline_timeout_ms(const server_config_t *config, int kind) {
+    if (kind == DEADLINE_HEADER) {
+        return config->header_timeout_ms;
+    }
+    if (kind == DEADLINE_WRITE) {
+        return config->write_timeout_ms;
+    }
+    return config->idle_timeout_ms;
+}
+
+// Runs with the reaper's lock held, so the worker hasn't closed the fd yet
+static void expire(wheel_timer_t *timer, void *arg) {
+    deadline_reaper_t *reaper = (deadline_reaper_t *) arg;
+    deadline_t *deadline = (deadline_t *) timer->data;
+    shutdown(deadline->fd, SHUT_RDWR); // the worker's read or write returns, and it closes the connection
+    atomic_store(&deadline->expired, 1);
+    metrics_add_timeout(reaper->stats, timer->kind);
+}
+
+// THREAD FUNCTION: fires whatever is due every DEADLINE_CHECK_MS until stopped
+static void *run_reaper(void *arg) {
+    deadline_reaper_t *reaper = (deadline_reaper_t *) arg;
+    reaper->stats = metrics_register(reaper->metrics, "reaper");
+    struct timespec nap = { .tv_sec = 0, .tv_nsec = DEADLINE_CHECK_MS * 1000000L };
+    while (!atomic_load(&reaper->stop)) {
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&reaper->lock);
+        timer_wheel_advance(&reaper->wheel, deadline_now_ms(), expire, reaper);
+        pthread_mutex_unlock(&reaper->lock);
+    }
+    return NULL;
+}
+
+int deadline_reaper_start(deadline_reaper_t *reaper, metrics_t *metrics) {
+    if (pthread_mutex_init(&reaper->lock, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        return -1;
+    }
+    timer_wheel_init(&reaper->wheel, deadline_now_ms());
+    atomic_init(&reaper->stop, 0);
+    reaper->metrics = metrics;
+
+    sigset_t sigset;
+    sigset_t oldset;
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+    int err_code = pthread_create(&reaper->thread, NULL, run_reaper, reaper);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+        pthread_mutex_destroy(&reaper->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void deadline_init(deadline_t *deadline, int fd) {
+    timer_init(&deadline->timer, DEADLINE_HEADER, deadline);
+    deadline->fd = fd;
+    atomic_init(&deadline->expired, 0);
+}
+
+void deadline_arm(deadline_reaper_t *reaper, deadline_t *deadline, int kind, long long timeout_ms) {
+    long long now_ms = deadline_now_ms();
+    pthread_mutex_lock(&reaper->lock);
+    deadline->timer.kind = kind;
+    if (timeout_ms > 0) {
+        timer_wheel_schedule(&reaper->wheel, &deadline->timer, now_ms + timeout_ms);
+    }
+    else {
+        timer_wheel_cancel(&reaper->wheel, &deadline->timer);
+    }
+    pthread_mutex_unlock(&reaper->lock);
+}
+
+void deadline_cancel(deadline_reaper_t *reaper, deadline_t *deadline) {
+    pthread_mutex_lock(&reaper->lock);
+    timer_wheel_cancel(&reaper->wheel, &deadline->timer);
+    pthread_mutex_unlock(&reaper->lock);
+}
+
+int deadline_reaper_stop(deadline_reaper_t *reaper) {
+    atomic_store(&reaper->stop, 1);
+    int err_code = pthread_join(reaper->thread, NULL);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+        return -1;
+    }
+    pthread_mutex_destroy(&reaper->lock);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "server_config.h"
+#include "timer_wheel.h"
+
+#define DEADLINE_CHECK_MS 250 // longest a missed deadline can go unnoticed
+
+// A connection's current deadline, for a worker that blocks on its socket.
+// Only one kind is armed at a time; timer.kind says which.
+typedef struct {
+    wheel_timer_t timer;
+    int fd;
+    atomic_int expired; // set once the reaper has shut the socket down
+} deadline_t;
+
+// A timer wheel shared by blocking workers, and the thread that turns it. A
+// worker can't watch the clock while it's stuck in read or write, so when its
+// deadline passes the reaper shuts the socket down instead, which ends the
+// blocked call. The fd is never closed here, so it can't be reused under the
+// worker's feet.
+typedef struct {
+    pthread_mutex_t lock; // guards the wheel and every timer on it
+    timer_wheel_t wheel;
+    pthread_t thread;
+    atomic_int stop;
+    metrics_t *metrics;
+    thread_metrics_t *stats; // the reaper's own, it counts the timeouts
+} deadline_reaper_t;
+
+/*
+ * Returns a monotonic timestamp in milliseconds, the clock deadlines are kept in
+ */
+long long deadline_now_ms(void);
+
+/*
+ * How long a connection gets for one kind of deadline under these settings
+ * kind: DEADLINE_HEADER, DEADLINE_WRITE or DEADLINE_IDLE
+ * Returns the timeout in milliseconds, 0 if that kind is turned off
+ */
+long long deadline_timeout_ms(const server_config_t *config, int kind);
+
+/*
+ * Start a reaper thread. It blocks every signal.
+ * metrics: Where it registers to count timeouts
+ * Returns 0 on success or -1 on error
+ */
+int deadline_reaper_start(deadline_reaper_t *reaper, metrics_t *metrics);
+
+/*
+ * Set up a connection's deadline with nothing armed
+ */
+void deadline_init(deadline_t *deadline, int fd);
+
+/*
+ * Arm a connection's deadline, replacing whatever was armed. Thread safe.
+ * kind: DEADLINE_HEADER, DEADLINE_WRITE or DEADLINE_IDLE
+ * timeout_ms: How long from now, 0 to leave the connection without one
+ */
+void deadline_arm(deadline_reaper_t *reaper, deadline_t *deadline, int kind, long long timeout_ms);
+
+/*
+ * Disarm a connection's deadline. Must be called before its fd is closed.
+ */
+void deadline_cancel(deadline_reaper_t *reaper, deadline_t *deadline);
+
+/*
+ * Stop the reaper thread. Every deadline must have been cancelled.
+ * Returns 0 on success or -1 on error
+ */
+int deadline_reaper_stop(deadline_reaper_t *reaper);
+
+#endif // DEADLINE_H
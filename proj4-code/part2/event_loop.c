@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deadline.h"
+#include "event_loop.h"
+#include "http.h"
+
+#define BUFSIZE 512
+
+// Where a connection is in its request/response cycle
+#define CONN_READING 0
+#define CONN_WRITING 1
+
+// State kept for every open client connection
+typedef struct connection {
+    int fd;
+    int state;              // CONN_READING or CONN_WRITING
+    request_buffer_t rb;    // request bytes read but not answered yet, pipelined ones included
+    int keep_alive;         // whether to wait for another request after this response
+    int n_requests;         // requests answered so far
+    wheel_timer_t deadline; // whichever of the header, write or idle deadlines applies right now
+    long long started_ns;   // when the request being answered was complete, for its latency
+    http_response_t resp;   // only valid while CONN_WRITING
+    struct connection *prev; // every connection of a loop is on a list so shutdown can close them
+    struct connection *next;
+} connection_t;
+
+// One epoll instance and the connections it owns
+typedef struct {
+    int epoll_fd;
+    int sock_fd;
+    int wake_fd; // eventfd shared by all loops, readable once the server is shutting down
+    const server_config_t *config;
+    int *keep_going;
+    connection_t *connections;
+    timer_wheel_t deadlines; // every connection's deadline
+    thread_metrics_t *stats;
+    access_log_ring_t *log_ring; // NULL if requests aren't logged
+} event_loop_t;
+
+// epoll_event.data.ptr values that aren't connections
+static int listener_tag;
+static int wake_tag;
+
+// Arms one of a connection's deadlines in place of whichever it had, or
+// leaves it with none if that kind is turned off
+static void set_deadline(event_loop_t *loop, connection_t *conn, int kind) {
+    long long timeout_ms = deadline_timeout_ms(loop->config, kind);
+    conn->deadline.kind = kind;
+    if (timeout_ms > 0) {
+        timer_wheel_schedule(&loop->deadlines, &conn->deadline, deadline_now_ms() + timeout_ms);
+    }
+    else {
+        timer_wheel_cancel(&loop->deadlines, &conn->deadline);
+    }
+}
+
+// Unlinks a connection from its loop and releases everything it holds.
+// Closing the fd also takes it out of the epoll set.
+static void close_connection(event_loop_t *loop, connection_t *conn) {
+    timer_wheel_cancel(&loop->deadlines, &conn->deadline);
+    if (conn->state == CONN_WRITING) {
+        http_response_cleanup(&conn->resp);
+    }
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    close(conn->fd);
+    free(conn);
+}
+
+// Accepts every pending connection (edge-triggered, so we have to drain the
+// backlog) and registers each one with this loop's epoll instance.
+// Returns 0 on success or -1 on error
+static int accept_connections(event_loop_t *loop) {
+    while (1) {
+        int client_fd = accept4(loop->sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0; // backlog is empty
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) { // out of fds, try again when the next client shows up
+                perror("accept4");
+                return 0;
+            }
+            perror("accept4");
+            return -1;
+        }
+
+        // responses to pipelined requests shouldn't sit around waiting for the client's ACKs
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection_t *conn = malloc(sizeof(connection_t));
+        if (conn == NULL) {
+            perror("malloc");
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->state = CONN_READING;
+        request_buffer_init(&conn->rb);
+        conn->n_requests = 0;
+        timer_init(&conn->deadline, DEADLINE_HEADER, conn);
+        set_deadline(loop, conn, DEADLINE_HEADER);
+        conn->prev = NULL;
+        conn->next = loop->connections;
+        if (loop->connections != NULL) {
+            loop->connections->prev = conn;
+        }
+        loop->connections = conn;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET; // both directions, we only act on what the state needs
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            perror("epoll_ctl");
+            close_connection(loop, conn);
+        }
+    }
+}
+
+// Reads whatever the client has sent so far, unless a pipelined request is
+// already waiting in the buffer.
+// Returns 1 once a whole request is buffered, 0 if more is needed, or -1 if
+// the connection should be closed
+static int read_request(event_loop_t *loop, connection_t *conn) {
+    request_buffer_t *rb = &conn->rb;
+    while (1) {
+        int request_len = request_buffer_parse(rb);
+        if (request_len > 0) {
+            return 1;
+        }
+        if (request_len == -1) {
+            return -1; // error already printed
+        }
+        int nbytes = read(conn->fd, rb->data + rb->len, HTTP_REQUEST_MAX - rb->len);
+        if (nbytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0; // wait for the next EPOLLIN
+            }
+            perror("read");
+            return -1;
+        }
+        if (nbytes == 0) { // client hung up, quietly if it was between requests
+            if (rb->len != 0) {
+                fprintf(stderr, "connection closed in the middle of a request\n");
+            }
+            return -1;
+        }
+        if (conn->deadline.kind == DEADLINE_IDLE) { // the next request has started, it gets the header timeout
+            set_deadline(loop, conn, DEADLINE_HEADER);
+        }
+        rb->len += nbytes;
+    }
+}
+
+// Turns the request at the front of the buffer into a response ready to send
+// Returns 0 on success or -1 if the connection should be closed
+static int start_response(event_loop_t *loop, connection_t *conn) {
+    char resource[HTTP_RESOURCE_MAX];
+    if (parse_buffered_request(&conn->rb, resource, &conn->keep_alive) != 0) {
+        fprintf(stderr, "read_http_request failed\n");
+        return -1;
+    }
+    conn->n_requests++;
+    if (loop->config->idle_timeout_ms == 0 || conn->n_requests >= loop->config->max_requests) {
+        conn->keep_alive = 0; // tell the client this is the last one
+    }
+    char path[BUFSIZE * 2];
+    if (make_resource_path(path, sizeof(path), loop->config->server_dir, resource) != 0) {
+        return -1;
+    }
+    conn->started_ns = metrics_now_ns();
+    set_deadline(loop, conn, DEADLINE_WRITE);
+    int method = http_request_method(&conn->rb.req);
+    int result;
+    if (method == HTTP_METHOD_OTHER) {
+        result = http_response_init_not_implemented(&conn->resp);
+    }
+    else if (loop->config->metrics_in_band && strcmp(resource, METRICS_PATH) == 0) {
+        result = metrics_response(loop->config->metrics, &conn->resp, conn->keep_alive);
+    }
+    else if (loop->config->archive != NULL) {
+        result = http_response_init_archive(&conn->resp, loop->config->archive, resource, &conn->rb.req,
+                                            conn->keep_alive);
+    }
+    else {
+        result = http_response_init(&conn->resp, path, &conn->rb.req, conn->keep_alive, loop->config->cache,
+                                    loop->config->gzip_cache, loop->config->stat_cache);
+    }
+    if (result != 0) {
+        http_response_cleanup(&conn->resp);
+        fprintf(stderr, "http write failure\n");
+        return -1;
+    }
+    if (method == HTTP_METHOD_HEAD) {
+        http_response_drop_body(&conn->resp);
+    }
+    conn->state = CONN_WRITING;
+    return 0;
+}
+
+// Moves a connection's state machine as far forward as its socket allows.
+// With edge-triggered epoll we only hear about new data once, so keep going
+// until a read or a write would block.
+static void handle_connection(event_loop_t *loop, connection_t *conn, uint32_t events) {
+    if (events & EPOLLERR) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    while (1) {
+        if (conn->state == CONN_READING) {
+            int ret = read_request(loop, conn);
+            if (ret == -1) {
+                close_connection(loop, conn);
+                return;
+            }
+            if (ret == 0) {
+                if (events & EPOLLHUP) { // nothing more will ever arrive
+                    close_connection(loop, conn);
+                }
+                return;
+            }
+            if (start_response(loop, conn) != 0) {
+                close_connection(loop, conn);
+                return;
+            }
+            // fall through and try to send right away, the socket is probably writable
+        }
+
+        int ret = http_response_send(conn->fd, &conn->resp);
+        if (ret == HTTP_SEND_AGAIN) {
+            return; // EPOLLOUT will bring us back here
+        }
+        if (ret == HTTP_SEND_DONE) {
+            long long done_ns = metrics_now_ns();
+            metrics_record_response(loop->stats, conn->resp.status, conn->resp.bytes_sent, done_ns - conn->started_ns);
+            access_log_write(loop->log_ring, &conn->rb.req, conn->resp.status, conn->resp.bytes_sent,
+                             conn->started_ns, done_ns);
+        }
+        if (ret == HTTP_SEND_ERROR || !conn->keep_alive) {
+            if (ret == HTTP_SEND_ERROR) {
+                fprintf(stderr, "http write failure\n");
+            }
+            close_connection(loop, conn);
+            return;
+        }
+
+        // response is out, get ready for the next request on this connection
+        http_response_cleanup(&conn->resp);
+        request_buffer_consume(&conn->rb);
+        conn->state = CONN_READING;
+        set_deadline(loop, conn, conn->rb.len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE); // pipelined requests have started
+    }
+}
+
+// Closes a connection that missed its deadline
+static void expire(wheel_timer_t *timer, void *arg) {
+    event_loop_t *loop = (event_loop_t *) arg;
+    metrics_add_timeout(loop->stats, timer->kind);
+    close_connection(loop, (connection_t *) timer->data);
+}
+
+// Runs one event loop until the server shuts down
+static void *run_loop(void *arg) {
+    event_loop_t *loop = (event_loop_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    long ret_val = 0;
+
+    while (*loop->keep_going) {
+        int n_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, DEADLINE_CHECK_MS);
+        if (n_events == -1) {
+            if (errno == EINTR) {
+                continue; // SIGINT lands here on the main thread, loop condition checks it
+            }
+            perror("epoll_wait");
+            ret_val = -1;
+            break;
+        }
+        long long woke_ns = metrics_now_ns();
+        for (int i = 0; i < n_events; i++) {
+            if (events[i].data.ptr == &listener_tag) {
+                if (accept_connections(loop) == -1) {
+                    ret_val = -1;
+                    *loop->keep_going = 0;
+                }
+            }
+            else if (events[i].data.ptr == &wake_tag) {
+                *loop->keep_going = 0; // another loop is shutting down, follow it
+            }
+            else {
+                handle_connection(loop, (connection_t *) events[i].data.ptr, events[i].events);
+            }
+        }
+        timer_wheel_advance(&loop->deadlines, deadline_now_ms(), expire, loop);
+        metrics_add_busy(loop->stats, metrics_now_ns() - woke_ns);
+    }
+
+    // wake up the other loops in case we're the first to notice the shutdown
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        ret_val = -1;
+    }
+    while (loop->connections != NULL) {
+        close_connection(loop, loop->connections);
+    }
+    return (void *) ret_val;
+}
+
+// Creates the epoll instance for a loop and registers the shared fds with it
+// Returns 0 on success or -1 on error
+static int loop_init(event_loop_t *loop, int sock_fd, int wake_fd, const server_config_t *config, int *keep_going) {
+    loop->sock_fd = sock_fd;
+    loop->wake_fd = wake_fd;
+    loop->config = config;
+    loop->keep_going = keep_going;
+    loop->connections = NULL;
+    timer_wheel_init(&loop->deadlines, deadline_now_ms());
+    loop->stats = metrics_register(config->metrics, "loop");
+    loop->log_ring = access_log_register(config->access_log);
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    struct epoll_event event;
+    // EPOLLEXCLUSIVE wakes just one loop per new connection instead of all of them
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.ptr = &listener_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    event.events = EPOLLIN; // level-triggered and never read, so every loop sees it
+    event.data.ptr = &wake_tag;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+        perror("epoll_ctl");
+        close(loop->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_serve(int sock_fd, const server_config_t *config, int *keep_going) {
+    int n_loops = config->n_loops;
+    int flags = fcntl(sock_fd, F_GETFL);
+    if (flags == -1 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    event_loop_t *loops = malloc(n_loops * sizeof(event_loop_t));
+    pthread_t *threads = malloc(n_loops * sizeof(pthread_t));
+    if (loops == NULL || threads == NULL) {
+        perror("malloc");
+        free(loops);
+        free(threads);
+        close(wake_fd);
+        return -1;
+    }
+
+    int ret_val = 0;
+    int n_ready = 0; // loops that have an epoll instance
+    for (; n_ready < n_loops; n_ready++) {
+        if (loop_init(loops + n_ready, sock_fd, wake_fd, config, keep_going) != 0) {
+            ret_val = -1;
+            break;
+        }
+    }
+
+    // Loop 0 runs on this thread so it gets SIGINT, the others block every signal
+    int n_started = 1;
+    if (ret_val == 0) {
+        sigset_t sigset;
+        sigset_t oldset;
+        sigfillset(&sigset);
+        if (pthread_sigmask(SIG_BLOCK, &sigset, &oldset) != 0) {
+            perror("pthread_sigmask");
+            ret_val = -1;
+        }
+        for (; ret_val == 0 && n_started < n_loops; n_started++) {
+            int err_code = pthread_create(threads + n_started, NULL, run_loop, loops + n_started);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+                ret_val = -1;
+                break;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    }
+
+    if (ret_val == 0) {
+        ret_val = (long) run_loop(loops) == 0 ? 0 : -1;
+    }
+    else {
+        *keep_going = 0;
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+
+    for (int i = 1; i < n_started; i++) {
+        void *thread_ret;
+        int err_code = pthread_join(threads[i], &thread_ret);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+            ret_val = -1;
+        }
+        else if (thread_ret != NULL) {
+            ret_val = -1;
+        }
+    }
+    for (int i = 0; i < n_ready; i++) {
+        close(loops[i].epoll_fd);
+    }
+    close(wake_fd);
+    free(loops);
+    free(threads);
+    return ret_val;
+}
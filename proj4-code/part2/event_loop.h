@@ -0,0 +1,21 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "server_config.h"
+
+#define MAX_EVENTS 256 // most epoll events handled per epoll_wait call
+
+/*
+ * Serve HTTP connections from a listening socket using non-blocking sockets and
+ * edge-triggered epoll instead of one blocking thread per connection.
+ * Runs config->n_loops event loops (one on the calling thread, the rest on new
+ * threads) until SIGINT clears *keep_going. SIGINT must not be blocked in the
+ * calling thread.
+ * sock_fd: The listening socket, will be made non-blocking
+ * config: Served directory, loop count and keep-alive settings
+ * keep_going: Set to 0 by the SIGINT handler to stop the server
+ * Returns 0 on success or -1 on error
+ */
+int event_loop_serve(int sock_fd, const server_config_t *config, int *keep_going);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,544 @@
+// LD_PRELOAD shim that makes open, read, write, sendfile and accept slow and
+// unreliable on purpose, to see how the server's throughput and tail latency
+// hold up when the disk or the network misbehaves. Every call through the shim
+// is timed, and a latency histogram per call is printed to stderr at exit.
+// Usage: FAULT_READ=delay=200,dist=exp,short=0.1 LD_PRELOAD=./fault_inject.so ./http_server ...
+//
+// Each call is set up by its own variable, FAULT_OPEN, FAULT_READ, FAULT_WRITE,
+// FAULT_SENDFILE or FAULT_ACCEPT, holding comma-separated key=value pairs:
+//   delay=<us>     add this much latency before the real call (the mean for exp and pareto)
+//   dist=<name>    fixed (default), uniform (0 to 2 * delay), exp, or pareto (alpha 1.5, a heavy tail)
+//   error=<p>      fail this fraction of calls without making them
+//   errno=<name>   what a failed call sets errno to: EIO (the default), ENOENT, EMFILE, ENFILE,
+//                  ENOMEM, ENOSPC, EINTR, EPIPE, ECONNRESET, ECONNABORTED, or a number
+//   eagain=<p>     fail this fraction with EAGAIN, only on non-blocking descriptors. An
+//                  edge-triggered loop (-m epoll) isn't woken again for data a fake EAGAIN
+//                  hid, so there it shows up as connections stalling until the client gives up
+//   short=<p>      cut this fraction of reads and writes short, to a random part of the count
+//   all=1          also inject on read and write of descriptors that aren't sockets
+//   path=<prefix>  (open only) only inject on paths starting with prefix
+// FAULT_SEED=<n> makes the injected faults repeat from run to run.
+//
+// Nothing on the path of a call takes a lock: each thread times its calls into
+// histograms of its own, which are merged for the report, and whether a
+// descriptor is a socket is looked up once and remembered until it's closed.
+#define _GNU_SOURCE
+#undef _FILE_OFFSET_BITS // the Makefile sets it, but the plain and 64-bit names are interposed separately here
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+
+#define CALL_OPEN 0
+#define CALL_READ 1
+#define CALL_WRITE 2
+#define CALL_SENDFILE 3
+#define CALL_ACCEPT 4
+#define N_CALLS 5
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_EXP 2
+#define DIST_PARETO 3
+#define PARETO_ALPHA 1.5
+
+#define FD_CACHE_MAX 65536 // descriptors whose kind is remembered, higher ones are fstat'ed every time
+#define FD_UNKNOWN 0
+#define FD_SOCKET 1
+#define FD_OTHER 2
+
+#define SPEC_MAX 512
+#define PATH_PREFIX_MAX 256
+#define REPORT_LINE_MAX 256
+
+// What to do to one call, from its FAULT_* variable
+typedef struct {
+    long long delay_ns;
+    int dist;
+    double error_rate;
+    int error_errno;
+    double eagain_rate;
+    double short_rate;
+    int all_fds;                        // read/write: inject on pipes, files and eventfds too
+    char path_prefix[PATH_PREFIX_MAX];  // open: empty for every path
+    int enabled;                        // anything at all to inject
+} fault_spec_t;
+
+// Everything the shim knows about one call
+typedef struct {
+    int id;      // CALL_*, its histogram in every thread_hists_t
+    const char *name;
+    const char *env;
+    fault_spec_t spec;
+    unsigned long errors;  // atomic
+    unsigned long eagains;
+    unsigned long shorts;
+} call_t;
+
+static call_t calls[N_CALLS] = {
+    {.id = CALL_OPEN, .name = "open", .env = "FAULT_OPEN"},
+    {.id = CALL_READ, .name = "read", .env = "FAULT_READ"},
+    {.id = CALL_WRITE, .name = "write", .env = "FAULT_WRITE"},
+    {.id = CALL_SENDFILE, .name = "sendfile", .env = "FAULT_SENDFILE"},
+    {.id = CALL_ACCEPT, .name = "accept", .env = "FAULT_ACCEPT"},
+};
+
+// One thread's latencies, nanoseconds per call with any injected delay
+// included. Kept on the list after the thread exits so the report still has them.
+typedef struct thread_hists {
+    histogram_t hists[N_CALLS];
+    struct thread_hists *next;
+} thread_hists_t;
+
+static __thread thread_hists_t *my_hists;
+static thread_hists_t *all_hists;
+static pthread_mutex_t hists_lock = PTHREAD_MUTEX_INITIALIZER; // only taken once per thread, and by the report
+
+static unsigned char fd_kinds[FD_CACHE_MAX]; // FD_* per descriptor, read and written with relaxed atomics
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_sendfile)(int, int, off_t *, size_t);
+static ssize_t (*real_sendfile64)(int, int, off64_t *, size_t);
+static int (*real_accept)(int, struct sockaddr *, socklen_t *);
+static int (*real_accept4)(int, struct sockaddr *, socklen_t *, int);
+static int (*real_close)(int);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int resolved = 0; // the real_* pointers are set, fault_init's own error messages go straight through
+static unsigned long long seed;
+static __thread unsigned long long rng_state;
+static int reporting = 0; // set while the report is written, so its own writes aren't counted
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns a uniform random number in [0, 1) from this thread's xorshift64*
+// state, seeded from FAULT_SEED and the thread's stack address
+static double random_unit(void) {
+    if (rng_state == 0) {
+        rng_state = (seed ^ (unsigned long long) (uintptr_t) &rng_state) | 1;
+    }
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Returns a delay drawn from the spec's distribution
+static long long draw_delay(const fault_spec_t *spec) {
+    double mean = (double) spec->delay_ns;
+    switch (spec->dist) {
+    case DIST_UNIFORM:
+        return (long long) (random_unit() * 2 * mean);
+    case DIST_EXP:
+        return (long long) (-mean * log(1.0 - random_unit()));
+    case DIST_PARETO: // scaled so the mean comes out to delay
+        return (long long) (mean * (PARETO_ALPHA - 1) / PARETO_ALPHA / pow(1.0 - random_unit(), 1.0 / PARETO_ALPHA));
+    default:
+        return spec->delay_ns;
+    }
+}
+
+// Returns the errno named by 'name', or -1 if it isn't one we know
+static int parse_errno(const char *name) {
+    static const struct {
+        const char *name;
+        int value;
+    } names[] = {
+        {"EIO", EIO}, {"ENOENT", ENOENT}, {"EMFILE", EMFILE}, {"ENFILE", ENFILE}, {"ENOMEM", ENOMEM},
+        {"ENOSPC", ENOSPC}, {"EINTR", EINTR}, {"EPIPE", EPIPE}, {"ECONNRESET", ECONNRESET},
+        {"ECONNABORTED", ECONNABORTED}, {"EAGAIN", EAGAIN},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i].name, name) == 0) {
+            return names[i].value;
+        }
+    }
+    char *end;
+    long value = strtol(name, &end, 10);
+    return *name != '\0' && *end == '\0' && value > 0 ? (int) value : -1;
+}
+
+// Fills in call->spec from its variable, leaving it disabled if there isn't one
+// Returns 0 on success or -1 if the variable doesn't parse
+static int parse_spec(call_t *call) {
+    fault_spec_t *spec = &call->spec;
+    memset(spec, 0, sizeof(fault_spec_t));
+    spec->error_errno = EIO;
+    const char *value = getenv(call->env);
+    if (value == NULL || *value == '\0') {
+        return 0;
+    }
+    char copy[SPEC_MAX];
+    if (strlen(value) >= sizeof(copy)) {
+        fprintf(stderr, "fault_inject: %s is too long\n", call->env);
+        return -1;
+    }
+    strcpy(copy, value);
+    char *saveptr;
+    for (char *pair = strtok_r(copy, ",", &saveptr); pair != NULL; pair = strtok_r(NULL, ",", &saveptr)) {
+        char *arg = strchr(pair, '=');
+        if (arg == NULL) {
+            fprintf(stderr, "fault_inject: %s: expected key=value, got '%s'\n", call->env, pair);
+            return -1;
+        }
+        *arg++ = '\0';
+        char *end = arg;
+        if (strcmp(pair, "delay") == 0) {
+            spec->delay_ns = (long long) (strtod(arg, &end) * 1000);
+        }
+        else if (strcmp(pair, "dist") == 0) {
+            if (strcmp(arg, "fixed") == 0) {
+                spec->dist = DIST_FIXED;
+            }
+            else if (strcmp(arg, "uniform") == 0) {
+                spec->dist = DIST_UNIFORM;
+            }
+            else if (strcmp(arg, "exp") == 0) {
+                spec->dist = DIST_EXP;
+            }
+            else if (strcmp(arg, "pareto") == 0) {
+                spec->dist = DIST_PARETO;
+            }
+            else {
+                fprintf(stderr, "fault_inject: %s: unknown distribution '%s'\n", call->env, arg);
+                return -1;
+            }
+            end = arg + strlen(arg);
+        }
+        else if (strcmp(pair, "error") == 0) {
+            spec->error_rate = strtod(arg, &end);
+        }
+        else if (strcmp(pair, "errno") == 0) {
+            if ((spec->error_errno = parse_errno(arg)) == -1) {
+                fprintf(stderr, "fault_inject: %s: unknown errno '%s'\n", call->env, arg);
+                return -1;
+            }
+            end = arg + strlen(arg);
+        }
+        else if (strcmp(pair, "eagain") == 0) {
+            spec->eagain_rate = strtod(arg, &end);
+        }
+        else if (strcmp(pair, "short") == 0) {
+            spec->short_rate = strtod(arg, &end);
+        }
+        else if (strcmp(pair, "all") == 0) {
+            spec->all_fds = (int) strtol(arg, &end, 10);
+        }
+        else if (strcmp(pair, "path") == 0 && strlen(arg) < sizeof(spec->path_prefix)) {
+            strcpy(spec->path_prefix, arg);
+            end = arg + strlen(arg);
+        }
+        else {
+            fprintf(stderr, "fault_inject: %s: unknown key '%s'\n", call->env, pair);
+            return -1;
+        }
+        if (end == arg || *end != '\0') {
+            fprintf(stderr, "fault_inject: %s: bad value for %s: '%s'\n", call->env, pair, arg);
+            return -1;
+        }
+    }
+    spec->enabled = spec->delay_ns > 0 || spec->error_rate > 0 || spec->eagain_rate > 0 || spec->short_rate > 0;
+    return 0;
+}
+
+// Looks up the real function behind 'name', exiting if there isn't one
+static void *find_real(const char *name) {
+    void *real = dlsym(RTLD_NEXT, name);
+    if (real == NULL) {
+        fprintf(stderr, "fault_inject: dlsym %s: %s\n", name, dlerror());
+        exit(1);
+    }
+    return real;
+}
+
+// Finds the real calls and reads the FAULT_* variables, once
+static void fault_init(void) {
+    real_open = find_real("open");
+    real_open64 = find_real("open64");
+    real_read = find_real("read");
+    real_write = find_real("write");
+    real_sendfile = find_real("sendfile");
+    real_sendfile64 = find_real("sendfile64");
+    real_accept = find_real("accept");
+    real_accept4 = find_real("accept4");
+    real_close = find_real("close");
+    __atomic_store_n(&resolved, 1, __ATOMIC_RELEASE);
+
+    const char *seed_env = getenv("FAULT_SEED");
+    seed = seed_env != NULL ? strtoull(seed_env, NULL, 10) : (unsigned long long) now_ns() ^ getpid();
+    for (int i = 0; i < N_CALLS; i++) {
+        if (parse_spec(&calls[i]) != 0) {
+            exit(1);
+        }
+    }
+}
+
+// Makes sure fault_init has run before a call goes through the shim
+static void ensure_init(void) {
+    if (__atomic_load_n(&resolved, __ATOMIC_ACQUIRE) == 0) {
+        pthread_once(&init_once, fault_init);
+    }
+}
+
+// Runs before main, but another library's constructor could get to a call first
+__attribute__((constructor)) static void fault_load(void) {
+    ensure_init();
+}
+
+// Remembers what fd is until it's closed (or the shim sees it come back from accept or open)
+static void remember_fd(int fd, unsigned char kind) {
+    if (fd >= 0 && fd < FD_CACHE_MAX) {
+        __atomic_store_n(&fd_kinds[fd], kind, __ATOMIC_RELAXED);
+    }
+}
+
+// Returns 1 if fd is a socket, which is what read and write faults go to by
+// default: eventfd and pipe reads can't come back short without breaking the server
+static int is_socket(int fd) {
+    unsigned char kind = fd >= 0 && fd < FD_CACHE_MAX ? __atomic_load_n(&fd_kinds[fd], __ATOMIC_RELAXED) : FD_UNKNOWN;
+    if (kind == FD_UNKNOWN) {
+        struct stat stat_buf;
+        if (fstat(fd, &stat_buf) != 0) {
+            return 0; // the real call will fail the same way, nothing to remember
+        }
+        kind = S_ISSOCK(stat_buf.st_mode) ? FD_SOCKET : FD_OTHER;
+        remember_fd(fd, kind);
+    }
+    return kind == FD_SOCKET;
+}
+
+// Applies call's spec to one call before it's made: sleeps for the injected
+// delay, then maybe fails it or shortens *count
+// fd: The descriptor the call works on, for the EAGAIN check, or -1
+// count: The byte count to cut short, or NULL if the call has none
+// Returns 0 to go on with the real call, or -1 to fail it with errno set
+static int inject(call_t *call, int fd, size_t *count) {
+    const fault_spec_t *spec = &call->spec;
+    if (spec->delay_ns > 0) {
+        long long delay = draw_delay(spec);
+        struct timespec ts = {delay / 1000000000LL, delay % 1000000000LL};
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+        }
+    }
+    if (spec->error_rate > 0 && random_unit() < spec->error_rate) {
+        __atomic_fetch_add(&call->errors, 1, __ATOMIC_RELAXED);
+        errno = spec->error_errno;
+        return -1;
+    }
+    if (spec->eagain_rate > 0 && fd >= 0 && random_unit() < spec->eagain_rate) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1 && (flags & O_NONBLOCK)) { // a blocking call never says EAGAIN, callers don't expect it
+            __atomic_fetch_add(&call->eagains, 1, __ATOMIC_RELAXED);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    if (spec->short_rate > 0 && count != NULL && *count > 1 && random_unit() < spec->short_rate) {
+        __atomic_fetch_add(&call->shorts, 1, __ATOMIC_RELAXED);
+        *count = 1 + (size_t) (random_unit() * (*count - 1));
+    }
+    return 0;
+}
+
+// Returns 1 if the call on fd should go through inject. With all=1 there's
+// no need to know what fd is.
+static int targeted(const call_t *call, int fd) {
+    return call->spec.enabled && (call->spec.all_fds || is_socket(fd));
+}
+
+// Returns the calling thread's histograms, setting them up and adding them
+// to the list the first time, or NULL if there's no memory for them
+static thread_hists_t *thread_hists(void) {
+    if (my_hists == NULL) {
+        thread_hists_t *hists = malloc(sizeof(thread_hists_t));
+        if (hists == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < N_CALLS; i++) {
+            histogram_init(&hists->hists[i]);
+        }
+        pthread_mutex_lock(&hists_lock);
+        hists->next = all_hists;
+        all_hists = hists;
+        pthread_mutex_unlock(&hists_lock);
+        my_hists = hists;
+    }
+    return my_hists;
+}
+
+// Counts a call that started at start_ns, leaving errno as the call left it
+static void record(call_t *call, long long start_ns) {
+    if (reporting) {
+        return;
+    }
+    int saved_errno = errno;
+    long long elapsed = now_ns() - start_ns;
+    thread_hists_t *hists = thread_hists();
+    if (hists != NULL) {
+        histogram_record(&hists->hists[call->id], elapsed > 0 ? elapsed : 0);
+    }
+    errno = saved_errno;
+}
+
+// Shared by open and open64, which take a mode only when creating a file
+static int open_common(int is_open64, const char *pathname, int flags, mode_t mode) {
+    call_t *call = &calls[CALL_OPEN];
+    ensure_init();
+    long long start = now_ns();
+    int injected = 0;
+    if (call->spec.enabled &&
+        strncmp(pathname, call->spec.path_prefix, strlen(call->spec.path_prefix)) == 0) {
+        injected = inject(call, -1, NULL);
+    }
+    int (*real)(const char *, int, ...) = is_open64 ? real_open64 : real_open;
+    int fd = injected == 0 ? real(pathname, flags, mode) : -1;
+    remember_fd(fd, FD_OTHER);
+    record(call, start);
+    return fd;
+}
+
+int open(const char *pathname, int flags, ...) {
+    mode_t mode = 0;
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return open_common(0, pathname, flags, mode);
+}
+
+int open64(const char *pathname, int flags, ...) {
+    mode_t mode = 0;
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return open_common(1, pathname, flags, mode);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+    call_t *call = &calls[CALL_READ];
+    ensure_init();
+    long long start = now_ns();
+    int injected = targeted(call, fd) ? inject(call, fd, &count) : 0;
+    ssize_t result = injected == 0 ? real_read(fd, buf, count) : -1;
+    record(call, start);
+    return result;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    call_t *call = &calls[CALL_WRITE];
+    ensure_init();
+    long long start = now_ns();
+    int injected = !reporting && targeted(call, fd) ? inject(call, fd, &count) : 0;
+    ssize_t result = injected == 0 ? real_write(fd, buf, count) : -1;
+    record(call, start);
+    return result;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    call_t *call = &calls[CALL_SENDFILE];
+    ensure_init();
+    long long start = now_ns();
+    int injected = call->spec.enabled ? inject(call, out_fd, &count) : 0;
+    ssize_t result = injected == 0 ? real_sendfile(out_fd, in_fd, offset, count) : -1;
+    record(call, start);
+    return result;
+}
+
+ssize_t sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count) {
+    call_t *call = &calls[CALL_SENDFILE];
+    ensure_init();
+    long long start = now_ns();
+    int injected = call->spec.enabled ? inject(call, out_fd, &count) : 0;
+    ssize_t result = injected == 0 ? real_sendfile64(out_fd, in_fd, offset, count) : -1;
+    record(call, start);
+    return result;
+}
+
+// A blocking accept's time includes waiting for a client to connect
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
+    call_t *call = &calls[CALL_ACCEPT];
+    ensure_init();
+    long long start = now_ns();
+    int injected = call->spec.enabled ? inject(call, sockfd, NULL) : 0;
+    int fd = injected == 0 ? real_accept(sockfd, addr, addrlen) : -1;
+    remember_fd(fd, FD_SOCKET);
+    record(call, start);
+    return fd;
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+    call_t *call = &calls[CALL_ACCEPT];
+    ensure_init();
+    long long start = now_ns();
+    int injected = call->spec.enabled ? inject(call, sockfd, NULL) : 0;
+    int fd = injected == 0 ? real_accept4(sockfd, addr, addrlen, flags) : -1;
+    remember_fd(fd, FD_SOCKET);
+    record(call, start);
+    return fd;
+}
+
+// Not timed, just keeps a closed descriptor's number from being taken for
+// what it used to be once something else gets it
+int close(int fd) {
+    ensure_init();
+    remember_fd(fd, FD_UNKNOWN);
+    return real_close(fd);
+}
+
+// Prints every call's counts and latency percentiles, in microseconds. Runs
+// at exit in every process the shim was loaded into, forked workers included.
+__attribute__((destructor)) static void fault_report(void) {
+    reporting = 1;
+    char line[REPORT_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "fault_inject[%d]: %-8s %9s %7s %7s %7s %9s %9s %9s %9s %9s\n",
+                       (int) getpid(), "call", "calls", "errors", "eagain", "short", "mean", "p50", "p99",
+                       "p99.9", "max");
+    real_write(STDERR_FILENO, line, len);
+    static histogram_t merged; // too big for the stack of whatever thread calls exit
+    for (int i = 0; i < N_CALLS; i++) {
+        call_t *call = &calls[i];
+        histogram_t *hist = &merged;
+        histogram_init(hist);
+        // threads that are still running may be partway through counting a call, which can't matter here
+        pthread_mutex_lock(&hists_lock);
+        for (thread_hists_t *hists = all_hists; hists != NULL; hists = hists->next) {
+            histogram_merge(hist, &hists->hists[i]);
+        }
+        pthread_mutex_unlock(&hists_lock);
+        if (hist->total > 0) {
+            len = snprintf(line, sizeof(line),
+                           "fault_inject[%d]: %-8s %9lu %7lu %7lu %7lu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                           (int) getpid(), call->name, hist->total, call->errors, call->eagains, call->shorts,
+                           hist->sum / hist->total / 1e3, histogram_percentile(hist, 50) / 1e3,
+                           histogram_percentile(hist, 99) / 1e3, histogram_percentile(hist, 99.9) / 1e3,
+                           hist->max / 1e3);
+            real_write(STDERR_FILENO, line, len);
+        }
+    }
+}
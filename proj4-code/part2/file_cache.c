@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+// Returns a monotonic timestamp in milliseconds
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a, picks both the shard and the bucket within it
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static cache_shard_t *shard_for(file_cache_t *cache, uint32_t hash) {
+    return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static cache_entry_t **bucket_for(cache_shard_t *shard, uint32_t hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+// Bytes an entry counts against its shard's budget
+static size_t entry_cost(const cache_entry_t *entry) {
+    return entry->size + entry->header_len + strlen(entry->path) + sizeof(cache_entry_t);
+}
+
+static void entry_free(cache_entry_t *entry) {
+    free(entry->path);
+    free(entry->header);
+    free(entry->body);
+    free(entry);
+}
+
+// Drops one reference, freeing the entry if it was the last. Shard lock must be held.
+static void entry_unref(cache_entry_t *entry) {
+    entry->refs--;
+    if (entry->refs == 0) {
+        entry_free(entry);
+    }
+}
+
+static void lru_remove(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_shard_t *shard, cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    }
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL) {
+        shard->lru_tail = entry;
+    }
+}
+
+// Takes an entry out of its shard and drops the cache's reference to it.
+// Responses still sending it keep it alive until they release it. Shard lock must be held.
+static void unlink_entry(cache_shard_t *shard, cache_entry_t *entry, uint32_t hash) {
+    cache_entry_t **link = bucket_for(shard, hash);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    lru_remove(shard, entry);
+    shard->bytes_used -= entry_cost(entry);
+    entry_unref(entry);
+}
+
+// Finds the entry for path in a shard. Shard lock must be held.
+static cache_entry_t *find_entry(cache_shard_t *shard, const char *path, uint32_t hash) {
+    for (cache_entry_t *entry = *bucket_for(shard, hash); entry != NULL; entry = entry->hash_next) {
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int file_cache_init(file_cache_t *cache, size_t budget) {
+    cache->shard_budget = budget / CACHE_SHARDS;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        memset(shard->buckets, 0, sizeof(shard->buckets));
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->bytes_used = 0;
+        shard->hits = 0;
+        shard->misses = 0;
+        shard->evictions = 0;
+        shard->coalesced = 0;
+        shard->flights = NULL;
+        if (pthread_mutex_init(&shard->lock, NULL) != 0 || pthread_cond_init(&shard->landed, NULL) != 0) {
+            fprintf(stderr, "pthread init failed\n");
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&cache->shards[j].lock);
+                pthread_cond_destroy(&cache->shards[j].landed);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Finds a fresh entry for path and takes a reference to it, counting a hit or
+// a miss. Shard lock must be held.
+static cache_entry_t *lookup(cache_shard_t *shard, const char *path, uint32_t hash) {
+    cache_entry_t *entry = find_entry(shard, path, hash);
+    if (entry == NULL) {
+        shard->misses++;
+        return NULL;
+    }
+
+    // once a second, make sure the file hasn't been changed underneath us
+    long now = now_ms();
+    if (now - entry->checked_ms >= CACHE_REVALIDATE_MS) {
+        struct stat stat_buf;
+        if (stat(path, &stat_buf) == -1 || stat_buf.st_size != entry->source_size ||
+            stat_buf.st_mtim.tv_sec != entry->mtime.tv_sec || stat_buf.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+            unlink_entry(shard, entry, hash); // stale, next load will pick up the new version
+            shard->misses++;
+            return NULL;
+        }
+        entry->checked_ms = now;
+    }
+
+    lru_remove(shard, entry);
+    lru_push_front(shard, entry);
+    entry->refs++;
+    shard->hits++;
+    return entry;
+}
+
+cache_entry_t *file_cache_get(file_cache_t *cache, const char *path) {
+    uint32_t hash = hash_path(path);
+    cache_shard_t *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = lookup(shard, path, hash);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+// Lets go of a flight that has landed and has nobody left waiting on it. Shard lock must be held.
+static void flight_free(cache_flight_t *flight) {
+    if (flight->entry != NULL) {
+        entry_unref(flight->entry);
+    }
+    free(flight->path);
+    free(flight);
+}
+
+cache_entry_t *file_cache_acquire(file_cache_t *cache, const char *path, int *outcome) {
+    uint32_t hash = hash_path(path);
+    cache_shard_t *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = lookup(shard, path, hash);
+    if (entry != NULL) {
+        *outcome = CACHE_HIT;
+        pthread_mutex_unlock(&shard->lock);
+        return entry;
+    }
+
+    cache_flight_t *flight = shard->flights;
+    while (flight != NULL && strcmp(flight->path, path) != 0) {
+        flight = flight->next;
+    }
+    if (flight == NULL) { // we're first, the load is ours
+        *outcome = CACHE_LOAD;
+        flight = malloc(sizeof(cache_flight_t));
+        if (flight != NULL && (flight->path = strdup(path)) == NULL) {
+            free(flight);
+            flight = NULL;
+        }
+        if (flight == NULL) {
+            perror("malloc");
+            *outcome = CACHE_UNCACHED; // load it anyway, just without anyone waiting on us
+        }
+        else {
+            flight->outcome = CACHE_LOAD;
+            flight->entry = NULL;
+            flight->waiters = 0;
+            flight->next = shard->flights;
+            shard->flights = flight;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    flight->waiters++;
+    shard->coalesced++;
+    while (flight->outcome == CACHE_LOAD) {
+        pthread_cond_wait(&shard->landed, &shard->lock);
+    }
+    *outcome = flight->outcome;
+    if (flight->entry != NULL) {
+        entry = flight->entry;
+        entry->refs++;
+    }
+    flight->waiters--;
+    if (flight->waiters == 0) {
+        flight_free(flight);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void file_cache_land(file_cache_t *cache, const char *path, cache_entry_t *entry, int outcome) {
+    cache_shard_t *shard = shard_for(cache, hash_path(path));
+    pthread_mutex_lock(&shard->lock);
+    cache_flight_t **link = &shard->flights;
+    while (*link != NULL && strcmp((*link)->path, path) != 0) {
+        link = &(*link)->next;
+    }
+    cache_flight_t *flight = *link;
+    if (flight != NULL) { // NULL if acquire couldn't allocate one
+        *link = flight->next; // from now on a miss on the path starts a new load
+        flight->outcome = outcome;
+        if (entry != NULL && outcome == CACHE_HIT) {
+            flight->entry = entry;
+            entry->refs++; // the waiters' until the last of them has taken its own
+        }
+        if (flight->waiters == 0) {
+            flight_free(flight);
+        }
+        else {
+            pthread_cond_broadcast(&shard->landed);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+off_t file_cache_size(file_cache_t *cache, const char *path) {
+    uint32_t hash = hash_path(path);
+    cache_shard_t *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *entry = find_entry(shard, path, hash);
+    off_t size = entry != NULL ? entry->size : -1;
+    pthread_mutex_unlock(&shard->lock);
+    return size;
+}
+
+// Adds a freshly built entry (holding two references, the cache's and the caller's)
+// to its shard, evicting from the cold end to make room. If another thread cached
+// the same path first, the new entry is thrown away and theirs is returned.
+static cache_entry_t *insert_entry(file_cache_t *cache, cache_entry_t *entry) {
+    const char *path = entry->path;
+    uint32_t hash = hash_path(path);
+    cache_shard_t *shard = shard_for(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *existing = find_entry(shard, path, hash);
+    if (existing != NULL) { // someone else loaded it while we were busy, use theirs
+        existing->refs++;
+        pthread_mutex_unlock(&shard->lock);
+        entry_free(entry);
+        return existing;
+    }
+
+    // make room by evicting from the cold end of the LRU list
+    size_t cost = entry_cost(entry);
+    while (shard->bytes_used + cost > cache->shard_budget && shard->lru_tail != NULL) {
+        cache_entry_t *victim = shard->lru_tail;
+        unlink_entry(shard, victim, hash_path(victim->path));
+        shard->evictions++;
+    }
+
+    cache_entry_t **bucket = bucket_for(shard, hash);
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->bytes_used += cost;
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+cache_entry_t *file_cache_put(file_cache_t *cache, const char *path, int fd, const char *header,
+                              const char *etag, const char *last_modified) {
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("fstat");
+        return NULL;
+    }
+    if (stat_buf.st_size > CACHE_MAX_FILE_SIZE ||
+        stat_buf.st_size + strlen(header) + strlen(path) + sizeof(cache_entry_t) > cache->shard_budget) {
+        return NULL; // would push everything else out of its shard, just stream it instead
+    }
+
+    // read the file before taking the lock, other paths in the shard shouldn't wait on our disk I/O
+    cache_entry_t *entry = malloc(sizeof(cache_entry_t));
+    if (entry == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    entry->path = strdup(path);
+    entry->header = strdup(header);
+    entry->body = malloc(stat_buf.st_size > 0 ? stat_buf.st_size : 1);
+    if (entry->path == NULL || entry->header == NULL || entry->body == NULL) {
+        perror("malloc");
+        entry_free(entry);
+        return NULL;
+    }
+    entry->header_len = strlen(header);
+    entry->size = stat_buf.st_size;
+    entry->source_size = stat_buf.st_size;
+    entry->mtime = stat_buf.st_mtim;
+    snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+    snprintf(entry->last_modified, sizeof(entry->last_modified), "%s", last_modified);
+    entry->checked_ms = now_ms();
+    entry->refs = 2; // one for the cache, one for the caller
+
+    off_t nread = 0;
+    while (nread < entry->size) {
+        ssize_t nbytes = pread(fd, entry->body + nread, entry->size - nread, nread);
+        if (nbytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            entry_free(entry);
+            return NULL;
+        }
+        if (nbytes == 0) { // file got shorter since fstat
+            fprintf(stderr, "unexpected end of file\n");
+            entry_free(entry);
+            return NULL;
+        }
+        nread += nbytes;
+    }
+
+    return insert_entry(cache, entry);
+}
+
+cache_entry_t *file_cache_put_body(file_cache_t *cache, const char *path, char *body, size_t size,
+                                   const struct stat *source, const char *header,
+                                   const char *etag, const char *last_modified) {
+    if (size + strlen(header) + strlen(path) + sizeof(cache_entry_t) > cache->shard_budget) {
+        free(body);
+        return NULL;
+    }
+    cache_entry_t *entry = malloc(sizeof(cache_entry_t));
+    if (entry == NULL) {
+        perror("malloc");
+        free(body);
+        return NULL;
+    }
+    entry->path = strdup(path);
+    entry->header = strdup(header);
+    entry->body = body;
+    if (entry->path == NULL || entry->header == NULL) {
+        perror("malloc");
+        entry_free(entry);
+        return NULL;
+    }
+    entry->header_len = strlen(header);
+    entry->size = size;
+    entry->source_size = source->st_size;
+    entry->mtime = source->st_mtim;
+    snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+    snprintf(entry->last_modified, sizeof(entry->last_modified), "%s", last_modified);
+    entry->checked_ms = now_ms();
+    entry->refs = 2; // one for the cache, one for the caller
+    return insert_entry(cache, entry);
+}
+
+void file_cache_release(file_cache_t *cache, cache_entry_t *entry) {
+    cache_shard_t *shard = shard_for(cache, hash_path(entry->path));
+    pthread_mutex_lock(&shard->lock);
+    entry_unref(entry);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void file_cache_stats(file_cache_t *cache, file_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(file_cache_stats_t));
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->coalesced += shard->coalesced;
+        stats->bytes_used += shard->bytes_used;
+        for (cache_entry_t *entry = shard->lru_head; entry != NULL; entry = entry->lru_next) {
+            stats->entries++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int file_cache_free(file_cache_t *cache) {
+    int ret_val = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        while (shard->lru_head != NULL) {
+            cache_entry_t *entry = shard->lru_head;
+            unlink_entry(shard, entry, hash_path(entry->path));
+        }
+        if (pthread_mutex_destroy(&shard->lock) != 0) {
+            fprintf(stderr, "pthread_mutex_destroy failed\n");
+            ret_val = -1;
+        }
+        pthread_cond_destroy(&shard->landed);
+    }
+    return ret_val;
+}
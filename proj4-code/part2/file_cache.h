@@ -0,0 +1,170 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define CACHE_SHARDS 16            // independent locks, picked by hashing the resource path
+#define CACHE_BUCKETS 256          // hash buckets per shard
+#define CACHE_REVALIDATE_MS 1000   // how stale a hit can get before we stat the file again
+#define DEFAULT_CACHE_BUDGET_MB 64 // total bytes the cache may hold, split evenly between shards
+#define CACHE_MAX_FILE_SIZE (512 * 1024) // bigger files go out faster with sendfile than from a heap copy
+#define CACHE_VALIDATOR_MAX 64     // room for an ETag or Last-Modified value
+
+// What file_cache_acquire found, and what a load passed to file_cache_land came to
+#define CACHE_HIT 0      // an entry, with a reference held for the caller
+#define CACHE_LOAD 1     // not cached and nobody is loading it: the caller loads it, then calls file_cache_land
+#define CACHE_MISSING 2  // the load found no such file
+#define CACHE_FAILED 3   // the load hit an error
+#define CACHE_UNCACHED 4 // the load didn't end up in the cache (too big, or not a plain 200), so load it yourself
+
+// A cached file: its whole body plus the part of the response header that
+// doesn't change between requests. Entries are reference counted so an
+// eviction can't free a body that a connection is still sending.
+typedef struct cache_entry {
+    char *path;
+    char *header;          // "HTTP/1.1 200 OK\r\n...Content-Length: N\r\n", no Connection line or blank line
+    int header_len;
+    char *body;
+    off_t size;
+    off_t source_size;     // size of the file on disk, differs from size when the body is a compressed copy
+    struct timespec mtime; // file's mtime when it was loaded, a change means the entry is stale
+    char etag[CACHE_VALIDATOR_MAX];          // validators worked out when the file was loaded, so a
+    char last_modified[CACHE_VALIDATOR_MAX]; // conditional request can be answered without touching the disk
+    long checked_ms;       // last time mtime was compared against the file
+    int refs;              // the cache's own reference (until evicted) plus one per response using it
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev; // most recently used at the head of the shard's list
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+// A load of a path that isn't cached yet. Threads that miss on the same path
+// while it's under way wait for it and share what it found, instead of all
+// reading the same file at once.
+typedef struct cache_flight {
+    char *path;
+    int outcome;           // CACHE_LOAD until it lands
+    cache_entry_t *entry;  // CACHE_HIT: what it loaded, with a reference kept for the waiters
+    int waiters;           // threads still to pick up the outcome, the last one frees the flight
+    struct cache_flight *next;
+} cache_flight_t;
+
+// One lock's worth of the cache
+typedef struct {
+    pthread_mutex_t lock;
+    cache_entry_t *buckets[CACHE_BUCKETS];
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    size_t bytes_used;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long coalesced;  // misses that waited for another thread's load instead of loading
+    cache_flight_t *flights;  // loads under way
+    pthread_cond_t landed;    // broadcast whenever one of them lands
+} cache_shard_t;
+
+typedef struct {
+    cache_shard_t shards[CACHE_SHARDS];
+    size_t shard_budget; // bytes each shard may hold; bigger files aren't cached
+} file_cache_t;
+
+// Totals across all shards
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long coalesced;
+    unsigned long entries;
+    size_t bytes_used;
+} file_cache_stats_t;
+
+/*
+ * Initialize a file cache
+ * cache: Pointer to file_cache_t to be initialized
+ * budget: Most bytes of file bodies and headers to keep in memory
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_init(file_cache_t *cache, size_t budget);
+
+/*
+ * Look up a resource. Counts a hit or a miss. An entry whose file has changed
+ * on disk is dropped and reported as a miss.
+ * Returns the entry with a reference held for the caller, or NULL on a miss
+ */
+cache_entry_t *file_cache_get(file_cache_t *cache, const char *path);
+
+/*
+ * file_cache_get, except that on a miss only one thread loads the path: if
+ * another thread is loading it already, this waits for that load and shares
+ * what it came to.
+ * outcome: Set to CACHE_HIT, CACHE_LOAD (the caller must load the path and
+ * call file_cache_land, even if it fails), or what another thread's load came
+ * to: CACHE_MISSING, CACHE_FAILED or CACHE_UNCACHED
+ * Returns the entry with a reference held for the caller, or NULL if outcome
+ * isn't CACHE_HIT
+ */
+cache_entry_t *file_cache_acquire(file_cache_t *cache, const char *path, int *outcome);
+
+/*
+ * Finish a load file_cache_acquire handed to the caller, waking every thread
+ * waiting on it
+ * entry: What was loaded, when outcome is CACHE_HIT. The caller keeps its own reference.
+ * outcome: CACHE_HIT, CACHE_MISSING, CACHE_FAILED or CACHE_UNCACHED
+ */
+void file_cache_land(file_cache_t *cache, const char *path, cache_entry_t *entry, int outcome);
+
+/*
+ * Size of a resource's cached body, for guessing how big its response will
+ * be. Doesn't count a hit or a miss, move the entry up the LRU list or check
+ * whether the file has changed.
+ * Returns the size, or -1 if it isn't cached
+ */
+off_t file_cache_size(file_cache_t *cache, const char *path);
+
+/*
+ * Read an open file into the cache and return it with a reference held for
+ * the caller. If another thread cached the same path first, that entry is
+ * returned instead.
+ * fd: The open file, read with pread so its offset isn't touched
+ * header: Header lines to send with the file, see cache_entry_t
+ * etag, last_modified: The file's validators, kept with the entry
+ * Returns the entry, or NULL if the file is too big to cache (more than
+ * CACHE_MAX_FILE_SIZE or its shard's share of the budget) or on error
+ */
+cache_entry_t *file_cache_put(file_cache_t *cache, const char *path, int fd, const char *header,
+                              const char *etag, const char *last_modified);
+
+/*
+ * Cache a body that was built from a file rather than read straight out of
+ * it, e.g. a compressed copy. The entry is checked for staleness against the
+ * file at 'path' just like one added with file_cache_put.
+ * body: malloc'd bytes to keep, the cache takes them over either way
+ * source: stat of the file the body was built from
+ * Returns the entry with a reference held for the caller, or NULL if it's too
+ * big for its shard or on error
+ */
+cache_entry_t *file_cache_put_body(file_cache_t *cache, const char *path, char *body, size_t size,
+                                   const struct stat *source, const char *header,
+                                   const char *etag, const char *last_modified);
+
+/*
+ * Give back a reference from file_cache_get, file_cache_put or file_cache_put_body
+ */
+void file_cache_release(file_cache_t *cache, cache_entry_t *entry);
+
+/*
+ * Add up the counters of every shard
+ */
+void file_cache_stats(file_cache_t *cache, file_cache_stats_t *stats);
+
+/*
+ * Free every entry and the shard locks. No references may be outstanding and
+ * no loads may be under way.
+ * Returns 0 on success or -1 on error
+ */
+int file_cache_free(file_cache_t *cache);
+
+#endif // FILE_CACHE_H
@@ -0,0 +1,69 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gzip.h"
+
+#define GZIP_READ_CHUNK (64 * 1024)
+
+int gzip_file(int fd, off_t size, char **body, size_t *body_len) {
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    // 15 + 16 asks zlib for a gzip header and trailer instead of a raw zlib stream
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return -1;
+    }
+
+    // deflateBound is the worst case, so the output never has to grow
+    size_t capacity = deflateBound(&stream, size);
+    char *out = malloc(capacity);
+    if (out == NULL) {
+        perror("malloc");
+        deflateEnd(&stream);
+        return -1;
+    }
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = capacity;
+
+    char chunk[GZIP_READ_CHUNK];
+    off_t offset = 0;
+    int flush = Z_NO_FLUSH;
+    while (flush != Z_FINISH) {
+        size_t want = size - offset < GZIP_READ_CHUNK ? (size_t) (size - offset) : GZIP_READ_CHUNK;
+        ssize_t nbytes = want > 0 ? pread(fd, chunk, want, offset) : 0;
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            perror("pread");
+            break;
+        }
+        if (nbytes == 0 && offset < size) { // file got shorter since we stat'ed it
+            fprintf(stderr, "unexpected end of file\n");
+            break;
+        }
+        offset += nbytes;
+        flush = offset >= size ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = (Bytef *) chunk;
+        stream.avail_in = nbytes;
+        int result = deflate(&stream, flush);
+        if (result == Z_STREAM_ERROR || stream.avail_in != 0 || (flush == Z_FINISH && result != Z_STREAM_END)) {
+            fprintf(stderr, "deflate failed\n");
+            flush = Z_NO_FLUSH; // counts as breaking out early below
+            break;
+        }
+    }
+    if (flush != Z_FINISH) { // broke out early
+        deflateEnd(&stream);
+        free(out);
+        return -1;
+    }
+
+    *body = out;
+    *body_len = stream.total_out;
+    deflateEnd(&stream);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define GZIP_MAX_FILE_SIZE (8 * 1024 * 1024) // bigger files aren't compressed on the fly
+#define GZIP_LEVEL 6                          // zlib's default trade-off between size and speed
+
+/*
+ * Compress a whole file into a gzip stream in memory
+ * fd: The open file, read with pread so its offset isn't touched
+ * size: Number of bytes to read from the start of the file
+ * body: Set to a malloc'd buffer holding the compressed bytes on success
+ * body_len: Set to the number of compressed bytes on success
+ * Returns 0 on success or -1 on error
+ */
+int gzip_file(int fd, off_t size, char **body, size_t *body_len);
+
+#endif // GZIP_H
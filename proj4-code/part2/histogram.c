@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include "histogram.h"
+
+// Picks the bucket a value is counted in
+static int bucket_of(unsigned long long value) {
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return value;
+    }
+    // value's top bit is 'msb', so it's in the group of buckets that are 2^shift wide
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HISTOGRAM_SUB_BITS - 1);
+    return HISTOGRAM_SUB_COUNT + (shift - 1) * HISTOGRAM_HALF_COUNT + (int) (value >> shift) - HISTOGRAM_HALF_COUNT;
+}
+
+// Returns the biggest value that lands in a bucket
+static unsigned long long bucket_top(int bucket) {
+    if (bucket < HISTOGRAM_SUB_COUNT) {
+        return bucket;
+    }
+    int shift = (bucket - HISTOGRAM_SUB_COUNT) / HISTOGRAM_HALF_COUNT + 1;
+    unsigned long long sub = (bucket - HISTOGRAM_SUB_COUNT) % HISTOGRAM_HALF_COUNT + HISTOGRAM_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void histogram_init(histogram_t *hist) {
+    memset(hist, 0, sizeof(histogram_t));
+    hist->min = ~0ULL;
+}
+
+void histogram_record(histogram_t *hist, unsigned long long value) {
+    hist->counts[bucket_of(value)]++;
+    hist->total++;
+    hist->sum += value;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void histogram_merge(histogram_t *into, const histogram_t *from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+unsigned long long histogram_percentile(const histogram_t *hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    // rank of the value we want, counting from 1
+    unsigned long rank = (unsigned long) (percentile / 100.0 * hist->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            unsigned long long top = bucket_top(i);
+            return top < hist->max ? top : hist->max; // the last bucket's top can overshoot the real max
+        }
+    }
+    return hist->max;
+}
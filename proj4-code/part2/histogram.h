@@ -0,0 +1,45 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+// Values below 2^HISTOGRAM_SUB_BITS get a bucket each. Above that every power
+// of two is split into 2^(HISTOGRAM_SUB_BITS - 1) equal buckets, so a value is
+// always recorded to within 1/64th (about 1.6%) of itself, all the way up to
+// 2^64, in a fixed 30KB of counters (the HdrHistogram layout).
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_HALF_COUNT (HISTOGRAM_SUB_COUNT / 2)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT + (64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_HALF_COUNT)
+
+// Counts of recorded values (e.g. latencies in nanoseconds). Not thread safe:
+// give each thread its own and merge them at the end.
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    unsigned long long min;
+    unsigned long long max;
+    double sum; // for the mean
+} histogram_t;
+
+/*
+ * Empty a histogram
+ */
+void histogram_init(histogram_t *hist);
+
+/*
+ * Count one value
+ */
+void histogram_record(histogram_t *hist, unsigned long long value);
+
+/*
+ * Add every count in 'from' to 'into'
+ */
+void histogram_merge(histogram_t *into, const histogram_t *from);
+
+/*
+ * Returns the value that 'percentile' percent of the recorded values are at or
+ * below (the top of its bucket, so it never understates), or 0 if nothing
+ * was recorded
+ */
+unsigned long long histogram_percentile(const histogram_t *hist, double percentile);
+
+#endif // HISTOGRAM_H
@@ -1,14 +1,27 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "gzip.h"
 #include "http.h"
+#include "trace.h"
 
 #define BUFSIZE 512
+#define MAX_SEND_CHUNK 0x7ffff000 // most bytes linux will move in one sendfile/splice call
+#define GZIP_SUFFIX ".gz"         // a precompressed copy of a file sits next to it with this added
 
 const char* get_mime_type(const char* file_extension) {
     if (strcmp(".txt", file_extension) == 0) {
@@ -30,87 +43,170 @@ const char* get_mime_type(const char* file_extension) {
     return NULL;
 }
 
-int read_http_request(int fd, char* resource_name) {
-    char buf[BUFSIZE]; // here is our buffer
-    // Start by reading the entirety of the request (likely) into a char* (buf)
-    int nbytes = read(fd, buf, BUFSIZE);
-    if (nbytes < 0) {
-        perror("read");
+// Copies the path of a parsed request into resource_name
+// Returns 0 on success or 1 if it's too long
+static int copy_resource_name(const http_request_t* req, char* resource_name) {
+    if (req->path.len >= HTTP_RESOURCE_MAX) {
+        fprintf(stderr, "requested file name is too long\n");
+        return 1;
+    }
+    memcpy(resource_name, req->path.start, req->path.len);
+    resource_name[req->path.len] = '\0'; // terminate with null character
+    return 0;
+}
+
+int parse_http_request(const char* buf, int nbytes, char* resource_name) {
+    http_request_t req;
+    http_parser_init(&req);
+    // a lone request doesn't need its whole header, just the first line
+    if (http_parse(&req, buf, nbytes, nbytes + 1) == -1 || req.state == HTTP_PARSE_REQUEST_LINE) {
+        if (req.state == HTTP_PARSE_REQUEST_LINE) {
+            fprintf(stderr, "HTML request not formatted properly\n");
+        }
         return 1;
     }
-    else if (nbytes == 0) {
-        fprintf(stderr, "empty HTTP request\n");
+    return copy_resource_name(&req, resource_name);
+}
+
+int make_resource_path(char* path, int path_size, const char* server_dir, const char* resource_name) {
+    // serve_dir is directory to serve, the "/" should be part of what the request parsing returns
+    if (snprintf(path, path_size, "%s%s", server_dir, resource_name) >= path_size) {
+        fprintf(stderr, "resource path too long\n");
         return 1;
     }
+    return 0;
+}
 
-    // Make a copy of buf so we can iterate through it by modifying it without
-    // losing the original HTTP request
-    char* buf_copy = malloc(sizeof(buf)); // use pointer so we can iterate easily
-    char* pointer_to_free = buf_copy; // when buf_copy gets incremented we lose track of what to free
-    strncpy(buf_copy, buf, nbytes);
+void request_buffer_init(request_buffer_t* rb) {
+    rb->len = 0;
+    rb->request_len = 0;
+    http_parser_init(&rb->req);
+}
 
-    // find the start of the file name
-    while (strncmp(buf_copy, "/", 1) != 0)
-    {
-        if (strncmp(buf_copy, "\r", 1) == 0) {
-            fprintf(stderr, "no file name specified on first line of request\n");
-            free(pointer_to_free);
-            return 1;
+void request_buffer_consume(request_buffer_t* rb) {
+    // slide any pipelined requests that came in behind this one to the front
+    memmove(rb->data, rb->data + rb->request_len, rb->len - rb->request_len);
+    rb->len -= rb->request_len;
+    rb->request_len = 0;
+    http_parser_init(&rb->req); // slices pointed at the old request, start over on the next one
+}
+
+// Reads a Content-Length value
+// Returns the length, or -1 if it isn't a number or is longer than a request can be
+static long body_length(http_slice_t value) {
+    long len = 0;
+    for (int i = 0; i < value.len; i++) {
+        if (value.start[i] < '0' || value.start[i] > '9' || len > HTTP_REQUEST_MAX) {
+            return -1;
         }
-        // iterate to next character
-        buf_copy++;
+        len = len * 10 + value.start[i] - '0';
     }
+    return len;
+}
 
-    // copy the file name into resource_name
-    //buf_copy++; // skip past '/'
-    int i = 0; // used to keep track of the position of resource_name we're copying to
-    while (strncmp(buf_copy, " ", 1) != 0 && strncmp(buf_copy, "\r", 1) != 0)
-    {
-        strncpy(resource_name + i, buf_copy, 1);
-        i++;
-        buf_copy++; // iterate to next character to copy over
+int request_buffer_parse(request_buffer_t* rb) {
+    int header_len = http_parse(&rb->req, rb->data, rb->len, HTTP_REQUEST_MAX);
+    if (header_len <= 0 || !rb->req.has_body || rb->req.transfer_encoding.start != NULL) {
+        return header_len; // a chunked body can't be framed here, parse_buffered_request makes sure the connection closes
+    }
+    // nothing reads a body, but it's buffered and dropped along with its request so it's never taken for the next one
+    long body_len = body_length(rb->req.content_length);
+    if (body_len < 0 || header_len + body_len > HTTP_REQUEST_MAX) {
+        fprintf(stderr, "HTTP request body bad or too long\n");
+        return -1;
     }
-    if (strncmp(buf_copy, "\r", 1) == 0) { // we can take this out later but it might help debugging
-        fprintf(stderr, "HTML request not formatted properly\n"); //eh it seems like an error that a poorly coded client might run into, let's keep it.
-        free(pointer_to_free);
+    return rb->len >= header_len + body_len ? header_len + body_len : 0;
+}
+
+int parse_buffered_request(request_buffer_t* rb, char* resource_name, int* keep_alive) {
+    int request_len = request_buffer_parse(rb);
+    if (request_len <= 0) {
+        fprintf(stderr, "HTTP request incomplete or too long\n");
         return 1;
     }
-    *(resource_name + i) = '\0'; // terminate with null character
+    if (copy_resource_name(&rb->req, resource_name) != 0) {
+        return 1; // error already printed
+    }
+    // what follows a chunked body can't be found, so the connection can't be used again after one
+    *keep_alive = rb->req.keep_alive && rb->req.transfer_encoding.start == NULL &&
+                  http_request_method(&rb->req) != HTTP_METHOD_OTHER;
+    rb->request_len = request_len;
+    return 0;
+}
 
-    // read the rest of the request (if there is anything left) because that's
-    // what the project specification said to do
-    //(it also clears stuff to read in the next request from the client, I think, which is why it's in the spec)
-    if (nbytes != BUFSIZE) {
-        // printf("nothing left to read\n");
-        free(pointer_to_free);
-        return 0;
+int http_request_method(const http_request_t* req) {
+    // methods are case-sensitive, unlike header names
+    if (req->method.len == 3 && strncmp(req->method.start, "GET", 3) == 0) {
+        return HTTP_METHOD_GET;
+    }
+    if (req->method.len == 4 && strncmp(req->method.start, "HEAD", 4) == 0) {
+        return HTTP_METHOD_HEAD;
     }
-    while ((nbytes = read(fd, buf, BUFSIZE)) > 0)
-    {
-        // do nothing with it
-        //added an error check in here too just to be on the safe side, since one read might fail badly and then a later one might not.
-        //not sure how that'd work but better to be safe.
+    return HTTP_METHOD_OTHER;
+}
+
+int read_next_http_request(int fd, request_buffer_t* rb, char* resource_name, int* keep_alive, int timeout_ms) {
+    request_buffer_consume(rb); // done with whatever request came before this one
+    // the trace's read starts with the request's first byte, not with waiting for it
+    long long trace_ns = rb->len > 0 ? trace_start() : 0;
+    while (1) {
+        int request_len = request_buffer_parse(rb);
+        if (request_len > 0) { // might have been pipelined in with the last one, no need to read
+            int result = parse_buffered_request(rb, resource_name, keep_alive) == 0 ? HTTP_READ_OK : HTTP_READ_ERROR;
+            trace_end(TRACE_READ, trace_ns);
+            return result;
+        }
+        if (request_len == -1) {
+            return HTTP_READ_ERROR; // error already printed
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR) { continue; }
+            perror("poll");
+            return HTTP_READ_ERROR;
+        }
+        if (ready == 0) {
+            return HTTP_READ_TIMEOUT; // anything read so far stays in rb for the next call
+        }
+
+        int nbytes = read(fd, rb->data + rb->len, HTTP_REQUEST_MAX - rb->len);
         if (nbytes == -1) {
+            if (errno == EINTR || errno == EAGAIN) { continue; } // EAGAIN: non-blocking socket, poll again
             perror("read");
-            free(pointer_to_free);
-            return 1;
+            return HTTP_READ_ERROR;
         }
+        if (nbytes == 0) {
+            if (rb->len == 0) {
+                return HTTP_READ_CLOSED; // client hung up between requests, that's normal
+            }
+            fprintf(stderr, "connection closed in the middle of a request\n");
+            return HTTP_READ_ERROR;
+        }
+        if (trace_ns == 0) {
+            trace_ns = trace_start();
+        }
+        rb->len += nbytes;
     }
-    if (nbytes == -1) {
-        perror("read");
-        free(pointer_to_free);
-        return 1;
-    }
+}
 
-    free(pointer_to_free);
-    return 0;
+int read_http_request(int fd, char* resource_name) {
+    // read until the header is complete, not until EOF: the client may be waiting for our answer
+    request_buffer_t rb;
+    request_buffer_init(&rb);
+    int keep_alive;
+    return read_next_http_request(fd, &rb, resource_name, &keep_alive, -1) == HTTP_READ_OK ? 0 : 1;
 }
 
 
-// Returns size of resource_path on success, -1 if resource_path doesn't exist, or -2 on other error
-int get_file_size(const char* resource_path) {
-    struct stat stat_buf;
-    if (stat(resource_path, &stat_buf) == -1) {
+// Stats resource_path into stat_buf
+// Returns 0 on success, -1 if resource_path doesn't exist, or -2 on other error
+static int stat_resource(const char* resource_path, struct stat* stat_buf) {
+    long long trace_ns = trace_start();
+    int result = stat(resource_path, stat_buf);
+    trace_end(TRACE_STAT, trace_ns);
+    if (result == -1) {
         if (errno == ENOENT) {
             fprintf(stderr, "file doesn't exist\n"); // SHOULD SEND BACK 404, JUST PUT THIS HERE FOR NOW
             return -1;
@@ -120,7 +216,14 @@ int get_file_size(const char* resource_path) {
             return -2;
         }
     }
-    return stat_buf.st_size;
+    return 0;
+}
+
+// Returns size of resource_path on success, -1 if resource_path doesn't exist, or -2 on other error
+off_t get_file_size(const char* resource_path) {
+    struct stat stat_buf;
+    int result = stat_resource(resource_path, &stat_buf);
+    return result == 0 ? stat_buf.st_size : result;
 }
 
 // Returns the file type of resource_path (e.g. application/pdf, text/plain) on success and "\0" on error
@@ -147,31 +250,582 @@ const char* get_file_type(const char* resource_path) {
     return get_mime_type(file_extension);
 }
 
-int write_http_response(int fd, const char* resource_path) {
-    int file_exists = 1;
-    int file_size = get_file_size(resource_path);
-    if (file_size == -2) { // 
-        return 1; // error already printed
+// Finishes a response header with the Connection line and the blank line that ends it
+static void end_header(http_response_t* resp, int keep_alive) {
+    resp->base_header_len = strlen(resp->header);
+    // tell the client whether to send its next request on this connection
+    strcat(resp->header, keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    // add "\r\n" to header
+    strncat(resp->header, "\r\n", 3);
+    resp->header_len = strlen(resp->header);
+    resp->status = atoi(resp->header + 9); // just past "HTTP/1.1 "
+}
+
+// Points a response at a cache entry. Takes over the caller's reference to it.
+static void use_cache_entry(http_response_t* resp, cache_entry_t* entry, int keep_alive) {
+    memcpy(resp->header, entry->header, entry->header_len + 1);
+    end_header(resp, keep_alive);
+    resp->cached = entry;
+    resp->offset = 0;
+    resp->remaining = entry->size;
+}
+
+// Works out a file's validators: an ETag built from its inode, size and mtime
+// (so any change to the file changes it), and its mtime as an HTTP date
+static void make_validators(http_response_t* resp, const struct stat* stat_buf) {
+    unsigned long long mtime_ns = stat_buf->st_mtim.tv_sec * 1000000000ULL + stat_buf->st_mtim.tv_nsec;
+    snprintf(resp->etag, sizeof(resp->etag), "\"%llx-%llx-%llx\"", (unsigned long long) stat_buf->st_ino,
+             (unsigned long long) stat_buf->st_size, mtime_ns);
+    struct tm tm;
+    gmtime_r(&stat_buf->st_mtim.tv_sec, &tm);
+    strftime(resp->last_modified, sizeof(resp->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    resp->mtime = stat_buf->st_mtim.tv_sec;
+}
+
+// Returns 1 if 'etag' is in an If-None-Match list (or the list is "*"), 0 if not.
+// W/ prefixes are ignored, If-None-Match only needs a weak match.
+static int etag_listed(http_slice_t list, const char* etag) {
+    int etag_len = strlen(etag);
+    const char* pos = list.start;
+    const char* end = list.start + list.len;
+    while (pos < end) {
+        if (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos++;
+            continue;
+        }
+        const char* item = pos;
+        while (pos < end && *pos != ',') {
+            pos++;
+        }
+        int item_len = pos - item;
+        while (item_len > 0 && (item[item_len - 1] == ' ' || item[item_len - 1] == '\t')) {
+            item_len--;
+        }
+        if (item_len == 1 && *item == '*') {
+            return 1;
+        }
+        if (item_len > 2 && strncmp(item, "W/", 2) == 0) {
+            item += 2;
+            item_len -= 2;
+        }
+        if (item_len == etag_len && memcmp(item, etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if the request's validators say the client's copy of the file is
+// still good, 0 if the file has to be sent. resp's validators must be set.
+static int not_modified(const http_request_t* req, const http_response_t* resp) {
+    if (req == NULL) {
+        return 0;
+    }
+    if (req->if_none_match.len > 0) { // when both are sent, If-Modified-Since is ignored
+        return etag_listed(req->if_none_match, resp->etag);
+    }
+    if (req->if_modified_since.len > 0 && req->if_modified_since.len < CACHE_VALIDATOR_MAX) {
+        char date[CACHE_VALIDATOR_MAX];
+        memcpy(date, req->if_modified_since.start, req->if_modified_since.len);
+        date[req->if_modified_since.len] = '\0';
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end != NULL && *end == '\0') { // a date we can't read is ignored
+            return resp->mtime <= timegm(&tm);
+        }
+    }
+    return 0;
+}
+
+// Builds a 304 response: just the validators, no body
+// vary: 1 if the 200 it stands in for has Vary: Accept-Encoding, which a cache revalidating it needs to see again
+static void init_not_modified(http_response_t* resp, int keep_alive, int vary) {
+    snprintf(resp->header, HTTP_HEADER_MAX, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n%s",
+             resp->etag, resp->last_modified, vary ? "Vary: Accept-Encoding\r\n" : "");
+    resp->remaining = 0;
+    end_header(resp, keep_alive);
+}
+
+// Returns 1 if the request's Accept-Encoding lets us send gzip, 0 if not
+static int accepts_gzip(const http_request_t* req) {
+    if (req == NULL) {
+        return 0;
+    }
+    const char* pos = req->accept_encoding.start;
+    const char* end = req->accept_encoding.start + req->accept_encoding.len;
+    int star = 0; // "*" covers gzip only if gzip isn't named on its own
+    while (pos < end) {
+        if (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos++;
+            continue;
+        }
+        const char* item = pos;
+        while (pos < end && *pos != ',') {
+            pos++;
+        }
+        const char* params = memchr(item, ';', pos - item);
+        http_slice_t coding = { item, (params != NULL ? params : pos) - item };
+        while (coding.len > 0 && (coding.start[coding.len - 1] == ' ' || coding.start[coding.len - 1] == '\t')) {
+            coding.len--;
+        }
+        // "q=0" (or 0.0, 0.00...) means the client refuses this coding
+        int refused = 0;
+        const char* q = params != NULL ? memmem(params, pos - params, "q=", 2) : NULL;
+        if (q != NULL) {
+            q += 2;
+            while (q < pos && (*q == '0' || *q == '.')) {
+                q++;
+            }
+            refused = q == pos || *q == ' ' || *q == '\t' || *q == ';';
+        }
+        if (http_slice_equals(coding, "gzip") || http_slice_equals(coding, "x-gzip")) {
+            return !refused;
+        }
+        if (http_slice_equals(coding, "*")) {
+            star = !refused;
+        }
+    }
+    return star;
+}
+
+// Returns 1 if files of this MIME type shrink enough to be worth compressing.
+// jpeg, png and pdf are compressed already.
+static int compressible(const char* mime_type) {
+    return mime_type != NULL && strncmp(mime_type, "text/", 5) == 0;
+}
+
+// Reads a whole file into a malloc'd buffer
+// Returns 0 on success or -1 on error
+static int read_whole_file(int fd, off_t size, char** body) {
+    *body = malloc(size > 0 ? size : 1);
+    if (*body == NULL) {
+        perror("malloc");
+        return -1;
     }
-    else if (file_size == -1) {
-        file_exists = 0; // still send back 404
+    off_t nread = 0;
+    while (nread < size) {
+        ssize_t nbytes = pread(fd, *body + nread, size - nread, nread);
+        if (nbytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes <= 0) {
+            nbytes == 0 ? fprintf(stderr, "unexpected end of file\n") : perror("pread");
+            free(*body);
+            return -1;
+        }
+        nread += nbytes;
+    }
+    return 0;
+}
+
+// Writes the header of a gzip-encoded 200 response, without the Connection line
+static void render_gzip_header(http_response_t* resp, const char* file_type, off_t body_size) {
+    snprintf(resp->header, HTTP_HEADER_MAX, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\n"
+             "Vary: Accept-Encoding\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n",
+             file_type, (long long) body_size, resp->etag, resp->last_modified);
+}
+
+// Stats a path for load_gzip, through the stat cache if there is one, so a
+// warm lookup costs no system call, a missing .gz sibling included
+// Returns 0 if the path exists or -1 if it doesn't (or can't be stat'ed)
+static int gzip_stat(stat_cache_t* stat_cache, const char* path, struct stat* stat_buf) {
+    const char* mime_type;
+    int known = stat_cache != NULL ? stat_cache_get(stat_cache, path, stat_buf, &mime_type) : STAT_UNKNOWN;
+    if (known != STAT_UNKNOWN) {
+        return known;
+    }
+    if (stat(path, stat_buf) == -1) {
+        if (errno == ENOENT && stat_cache != NULL) {
+            stat_cache_put(stat_cache, path, STAT_MISSING, NULL, NULL);
+        }
+        return -1;
+    }
+    if (stat_cache != NULL) { // no MIME type, whoever serves the path itself works it out
+        stat_cache_put(stat_cache, path, STAT_FOUND, stat_buf, NULL);
+    }
+    return 0;
+}
+
+// The part of init_gzip after a gzip cache miss: builds the response from a
+// sibling .gz file at least as new as the file, else from compressing the
+// file and keeping the result in the gzip cache.
+// Returns 1 if the response was built here, 0 if the file should go out
+// unencoded, or -1 on error
+static int load_gzip(http_response_t* resp, const char* resource_path, const char* file_type,
+                     const http_request_t* req, int keep_alive, file_cache_t* gzip_cache, stat_cache_t* stat_cache) {
+    struct stat source;
+    if (gzip_stat(stat_cache, resource_path, &source) == -1) {
+        return 0; // the normal path reports the 404
+    }
+    char gz_path[BUFSIZE * 2 + sizeof(GZIP_SUFFIX)];
+    snprintf(gz_path, sizeof(gz_path), "%s" GZIP_SUFFIX, resource_path);
+    struct stat sibling;
+    int has_sibling = gzip_stat(stat_cache, gz_path, &sibling) == 0 && S_ISREG(sibling.st_mode) &&
+                      sibling.st_mtim.tv_sec >= source.st_mtim.tv_sec;
+    if (!has_sibling && (gzip_cache == NULL || source.st_size > GZIP_MAX_FILE_SIZE)) {
+        return 0;
+    }
+
+    // the encoded body is a different representation, so it gets its own ETag
+    make_validators(resp, &source);
+    int etag_len = strlen(resp->etag);
+    snprintf(resp->etag + etag_len - 1, sizeof(resp->etag) - etag_len + 1, "-gz\"");
+    if (not_modified(req, resp)) {
+        init_not_modified(resp, keep_alive, 1);
+        return 1;
     }
 
+    int fd = open(has_sibling ? gz_path : resource_path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (has_sibling && (gzip_cache == NULL || sibling.st_size > CACHE_MAX_FILE_SIZE)) {
+        // too big to keep in memory, stream the .gz file like any other
+        render_gzip_header(resp, file_type, sibling.st_size);
+        end_header(resp, keep_alive);
+        resp->file_fd = fd;
+        resp->remaining = sibling.st_size;
+        return 1;
+    }
+
+    char* body;
+    size_t body_len = has_sibling ? sibling.st_size : 0;
+    int result = has_sibling ? read_whole_file(fd, sibling.st_size, &body) : gzip_file(fd, source.st_size, &body, &body_len);
+    close(fd);
+    if (result != 0) {
+        return 0; // error already printed, the plain file can still go out
+    }
+    render_gzip_header(resp, file_type, body_len);
+    cache_entry_t* entry = file_cache_put_body(gzip_cache, resource_path, body, body_len, &source,
+                                               resp->header, resp->etag, resp->last_modified);
+    if (entry == NULL) {
+        return 0; // too big for the gzip cache
+    }
+    resp->cache = gzip_cache;
+    use_cache_entry(resp, entry, keep_alive);
+    return 1;
+}
+
+// Builds a gzip-encoded response (or a 304) for a compressible file. The body
+// comes from the gzip cache, else see load_gzip.
+// coalesce: 1 to have a miss wait for another thread that's already compressing
+// the same file, instead of compressing it again alongside it
+// Returns 1 if the response was built here, 0 if the file should go out
+// unencoded, or -1 on error
+static int init_gzip(http_response_t* resp, const char* resource_path, const char* file_type,
+                     const http_request_t* req, int keep_alive, file_cache_t* gzip_cache, stat_cache_t* stat_cache,
+                     int coalesce) {
+    if (gzip_cache == NULL) {
+        return load_gzip(resp, resource_path, file_type, req, keep_alive, gzip_cache, stat_cache);
+    }
+    int outcome = CACHE_UNCACHED;
+    cache_entry_t* entry = coalesce ? file_cache_acquire(gzip_cache, resource_path, &outcome)
+                                    : file_cache_get(gzip_cache, resource_path);
+    if (entry != NULL) {
+        memcpy(resp->etag, entry->etag, sizeof(resp->etag));
+        memcpy(resp->last_modified, entry->last_modified, sizeof(resp->last_modified));
+        resp->mtime = entry->mtime.tv_sec;
+        if (not_modified(req, resp)) {
+            file_cache_release(gzip_cache, entry);
+            init_not_modified(resp, keep_alive, 1);
+            return 1;
+        }
+        resp->cache = gzip_cache; // so cleanup gives the entry back to the right cache
+        use_cache_entry(resp, entry, keep_alive);
+        return 1;
+    }
+    int result = load_gzip(resp, resource_path, file_type, req, keep_alive, gzip_cache, stat_cache);
+    if (outcome == CACHE_LOAD) { // anything but a freshly cached body (a 304, a streamed .gz) and they go it alone
+        int cached = result == 1 && resp->cached != NULL && resp->cache == gzip_cache;
+        file_cache_land(gzip_cache, resource_path, cached ? resp->cached : NULL, cached ? CACHE_HIT : CACHE_UNCACHED);
+    }
+    return result;
+}
+
+// Reads a decimal byte offset at *pos, moving *pos past it
+// Returns 1 if one was read, 0 if there were no digits, or -1 if it doesn't fit in an off_t
+static int read_offset(const char** pos, const char* end, off_t* value) {
+    const char* start = *pos;
+    *value = 0;
+    while (*pos < end && **pos >= '0' && **pos <= '9') {
+        int digit = **pos - '0';
+        if (*value > (INT64_MAX - digit) / 10) {
+            return -1;
+        }
+        *value = *value * 10 + digit;
+        (*pos)++;
+    }
+    return *pos > start;
+}
+
+// Works out which bytes of a 'size' byte file a "bytes=..." Range header asks for.
+// Ranges past the end of the file are dropped and ends past it are cut short.
+// Returns the number of ranges put in 'ranges' (0 if none of them can be
+// satisfied), or -1 if the header is malformed or asks for more than
+// HTTP_MAX_RANGES ranges and should be ignored
+static int parse_ranges(http_slice_t header, off_t size, http_range_t* ranges) {
+    const char* pos = header.start;
+    const char* end = header.start + header.len;
+    if (header.len < 6 || strncasecmp(pos, "bytes=", 6) != 0) {
+        return -1;
+    }
+    pos += 6;
+
+    int n_ranges = 0;
+    int n_specs = 0;
+    while (pos < end) {
+        if (*pos == ' ' || *pos == '\t' || *pos == ',') {
+            pos++;
+            continue;
+        }
+        off_t first;
+        off_t last;
+        int has_first = read_offset(&pos, end, &first);
+        if (has_first == -1 || pos >= end || *pos != '-') {
+            return -1;
+        }
+        pos++; // skip '-'
+        int has_last = read_offset(&pos, end, &last);
+        if (has_last == -1 || (!has_first && !has_last) || (has_first && has_last && last < first)) {
+            return -1;
+        }
+        if (pos < end && *pos != ',' && *pos != ' ' && *pos != '\t') {
+            return -1;
+        }
+        if (++n_specs > HTTP_MAX_RANGES) {
+            return -1;
+        }
+
+        if (!has_first) { // "-N" is the last N bytes
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        }
+        else {
+            if (first >= size) {
+                continue;
+            }
+            if (!has_last || last >= size) {
+                last = size - 1;
+            }
+        }
+        ranges[n_ranges].first = first;
+        ranges[n_ranges].last = last;
+        n_ranges++;
+    }
+    return n_specs > 0 ? n_ranges : -1;
+}
+
+// Writes the boundary and headers that go in front of part 'index' of a
+// multipart/byteranges body, or the closing boundary if index == n_ranges.
+// Returns the length, which is all snprintf needs to count when dest is NULL
+static int render_part_header(const http_response_t* resp, const http_range_t* ranges, int n_ranges, int index,
+                              char* dest, size_t space) {
+    if (index == n_ranges) {
+        return snprintf(dest, space, "\r\n--" HTTP_BOUNDARY "--\r\n");
+    }
+    return snprintf(dest, space, "\r\n--" HTTP_BOUNDARY "\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    resp->content_type, (long long) ranges[index].first, (long long) ranges[index].last,
+                    (long long) resp->file_size);
+}
+
+// Starts the next part of a multipart response: its headers become what's left
+// to send of 'header' (added to the end if append is 1) and its bytes become the body.
+// Returns 1 if there was another part, or 0 once the closing boundary has been started
+static int start_next_part(http_response_t* resp, int append) {
+    if (resp->n_ranges == 0 || resp->next_range > resp->n_ranges) {
+        return 0;
+    }
+    int index = resp->next_range++;
+    int start = append ? resp->header_len : 0;
+    resp->header_len = start + render_part_header(resp, resp->ranges, resp->n_ranges, index,
+                                                  resp->header + start, HTTP_HEADER_MAX - start);
+    if (!append) {
+        resp->header_sent = 0;
+    }
+    if (index < resp->n_ranges) {
+        resp->offset = resp->ranges[index].first;
+        resp->remaining = resp->ranges[index].last - resp->ranges[index].first + 1;
+    }
+    else {
+        resp->remaining = 0;
+    }
+    return 1;
+}
+
+// Builds a 206 or 416 response if the request's Range header calls for one.
+// resp->file_size, resp->content_type and the body's source (cached or file_fd)
+// must already be set.
+// Returns 1 if the response was built here, or 0 if the Range header should be
+// ignored and the whole file sent
+static int init_ranges(http_response_t* resp, const http_request_t* req, int keep_alive) {
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int n_ranges = parse_ranges(req->range, resp->file_size, ranges);
+    if (n_ranges == -1) {
+        return 0;
+    }
+
+    char* header = resp->header;
+    long long size = resp->file_size;
+    if (n_ranges == 0) {
+        snprintf(header, HTTP_HEADER_MAX, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                 "Content-Range: bytes */%lld\r\nContent-Length: 0\r\n", size);
+        resp->remaining = 0;
+        end_header(resp, keep_alive);
+        return 1;
+    }
+    if (n_ranges == 1) {
+        long long first = ranges[0].first;
+        long long last = ranges[0].last;
+        snprintf(header, HTTP_HEADER_MAX, "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+                 "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\nETag: %s\r\nLast-Modified: %s\r\n",
+                 resp->content_type, first, last, size, last - first + 1, resp->etag, resp->last_modified);
+        resp->offset = first; // sendfile and friends start right here, the bytes before it are never read
+        resp->remaining = last - first + 1;
+        end_header(resp, keep_alive);
+        return 1;
+    }
+
+    // several ranges: every part gets its own little header, and all of them count toward the length
+    long long length = render_part_header(resp, ranges, n_ranges, n_ranges, NULL, 0);
+    for (int i = 0; i < n_ranges; i++) {
+        length += render_part_header(resp, ranges, n_ranges, i, NULL, 0);
+        length += ranges[i].last - ranges[i].first + 1;
+    }
+    snprintf(header, HTTP_HEADER_MAX, "HTTP/1.1 206 Partial Content\r\n"
+             "Content-Type: multipart/byteranges; boundary=" HTTP_BOUNDARY "\r\nContent-Length: %lld\r\n"
+             "ETag: %s\r\nLast-Modified: %s\r\n", length, resp->etag, resp->last_modified);
+    end_header(resp, keep_alive);
+    memcpy(resp->ranges, ranges, n_ranges * sizeof(http_range_t));
+    resp->n_ranges = n_ranges;
+    resp->next_range = 0;
+    start_next_part(resp, 1); // first part's header goes out right behind the response header
+    return 1;
+}
+
+// Puts a response in the empty state every way of building one starts from
+static void reset_response(http_response_t* resp, file_cache_t* cache) {
+    resp->header_len = 0;
+    resp->header_sent = 0;
+    resp->base_header_len = 0;
+    resp->file_fd = -1;
+    resp->offset = 0;
+    resp->remaining = 0;
+    resp->body_mode = BODY_SENDFILE;
+    resp->pipe_fds[0] = -1;
+    resp->pipe_fds[1] = -1;
+    resp->in_pipe = 0;
+    resp->cache = cache;
+    resp->cached = NULL;
+    resp->cacheable = 0;
+    resp->n_ranges = 0;
+    resp->next_range = 0;
+    resp->file_size = 0;
+    resp->content_type = NULL;
+    resp->status = 0;
+    resp->bytes_sent = 0;
+    resp->owns_cached = 0;
+}
+
+// http_response_start, optionally coalescing cache misses
+// outcome: With coalesce set, what file_cache_acquire said on a miss. Unless
+// it's CACHE_LOAD, the caller doesn't load the file for anyone else.
+static int start_response(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                          int keep_alive, file_cache_t* cache, file_cache_t* gzip_cache, stat_cache_t* stat_cache,
+                          int coalesce, int* outcome) {
+    reset_response(resp, cache);
+    int wants_range = req != NULL && req->range.len > 0;
+    *outcome = CACHE_UNCACHED;
+
+    // text goes out gzipped to clients that take it; ranges are always served from the plain file
+    if (!wants_range && accepts_gzip(req) && compressible(get_file_type(resource_path))) {
+        int result = init_gzip(resp, resource_path, get_file_type(resource_path), req, keep_alive, gzip_cache,
+                               stat_cache, coalesce);
+        if (result != 0) {
+            return result == -1 ? HTTP_START_ERROR : HTTP_START_DONE;
+        }
+    }
+
+    // hot files skip the stat, the open and the reads entirely
+    if (cache != NULL) {
+        cache_entry_t* entry = coalesce ? file_cache_acquire(cache, resource_path, outcome)
+                                        : file_cache_get(cache, resource_path);
+        if (entry != NULL) {
+            memcpy(resp->etag, entry->etag, sizeof(resp->etag));
+            memcpy(resp->last_modified, entry->last_modified, sizeof(resp->last_modified));
+            resp->mtime = entry->mtime.tv_sec;
+            if (not_modified(req, resp)) { // validators came from the cache, so no disk I/O at all
+                file_cache_release(cache, entry);
+                init_not_modified(resp, keep_alive, compressible(get_file_type(resource_path)));
+                return HTTP_START_DONE;
+            }
+            if (wants_range) { // serve the range out of the cached body
+                resp->cached = entry;
+                resp->file_size = entry->size;
+                resp->content_type = get_file_type(resource_path);
+                if (init_ranges(resp, req, keep_alive)) {
+                    return HTTP_START_DONE;
+                }
+            }
+            use_cache_entry(resp, entry, keep_alive);
+            return HTTP_START_DONE;
+        }
+    }
+    return HTTP_START_NEED_FILE;
+}
+
+int http_response_start(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                        int keep_alive, file_cache_t* cache, file_cache_t* gzip_cache, stat_cache_t* stat_cache) {
+    struct stat stat_buf;
     const char* file_type;
+    if (stat_cache != NULL && stat_cache_get(stat_cache, resource_path, &stat_buf, &file_type) == STAT_MISSING) {
+        reset_response(resp, cache);
+        return http_response_finish(resp, resource_path, req, keep_alive, NULL, -1) == 0 ? HTTP_START_DONE
+                                                                                        : HTTP_START_ERROR;
+    }
+    int outcome;
+    return start_response(resp, resource_path, req, keep_alive, cache, gzip_cache, stat_cache, 0, &outcome);
+}
+
+// The part of http_response_finish that only needs the file's stat: the
+// header of a 200 (without its Connection line), or a whole 404, 415 or 304
+// encodable: 1 if text at this path can also go out gzipped, so its header needs Vary
+// Returns 0 if the body still has to be set up, 1 if the response is
+// complete without one, or -1 on error
+static int begin_file(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                      int keep_alive, const struct stat* stat_buf, int encodable) {
+    int file_exists = stat_buf != NULL;
+    off_t file_size = file_exists ? stat_buf->st_size : 0;
+
+    const char* file_type = ""; // stays empty for a 404, checked below
     if (file_exists) { // only get file type if file exists
-        file_type = get_file_type(resource_path);
-        if (strcmp(file_type, "\0") == 0) { return 1; } // no "." found in resource_path, error already printed
+        file_type = resp->content_type != NULL ? resp->content_type : get_file_type(resource_path);
+        if (file_type == NULL) { file_type = "file type not supported"; } // extension we don't have a MIME type for
+        if (strcmp(file_type, "\0") == 0) { // no "." found in resource_path, error already printed
+            return -1;
+        }
+        resp->content_type = file_type;
     }
 
-    char header[BUFSIZE] = "HTTP/1.0 ";
-    // char next_line[BUFSIZE] = "";
+    char* header = resp->header;
+    strcpy(header, "HTTP/1.1 ");
     if (file_exists && (strcmp(file_type, "file type not supported") != 0)) {
         // add "200 OK\r\n" to header
         strncat(header, "200 OK\r\n", 9);
         // add "Content-Type: file_type\r\n" to header
         sprintf(header + strlen(header), "Content-Type: %s\r\n", file_type);
         // add "Content-Length: file_size\r\n" to header
-        sprintf(header + strlen(header), "Content-Length: %d\r\n", file_size);
+        sprintf(header + strlen(header), "Content-Length: %lld\r\n", (long long) file_size);
+        // validators, so the client can ask again with If-None-Match/If-Modified-Since
+        make_validators(resp, stat_buf);
+        sprintf(header + strlen(header), "ETag: %s\r\nLast-Modified: %s\r\n", resp->etag, resp->last_modified);
+        if (encodable && compressible(file_type)) { // caches must not hand this to a client that asked for gzip
+            strcat(header, "Vary: Accept-Encoding\r\n");
+        }
     }
     else if (strcmp(file_type, "file type not supported") == 0) { //handling files like .c, .h, a.out
         //file type not supported. project documentation didn't tell us to do this BUT we should anyways
@@ -185,55 +839,452 @@ int write_http_response(int fd, const char* resource_path) {
         // add "Content-Length: 0\r\n" to header
         strncat(header, "Content-Length: 0\r\n", 20);
     }
-    // add "\r\n" to header
-    strncat(header, "\r\n", 3);
-    //printf("%s", header); used for debugging
 
-    //write header.
-    if (write(fd, header, strlen(header)) == -1) { //write the header to the socket
-        perror("write");
+    if (!file_exists || (strcmp(file_type, "file type not supported") == 0)) { // 404 and 415 are header-only
+        end_header(resp, keep_alive);
+        return 1;
+    }
+    if (not_modified(req, resp)) { // client's copy is current, don't even open the file
+        init_not_modified(resp, keep_alive, encodable && compressible(file_type));
         return 1;
     }
+    resp->file_size = file_size;
+    return 0;
+}
 
-    if (!file_exists || (strcmp(file_type, "file type not supported") == 0)) { return 0; } // 404 not found is done here, should we return 0 or 1? (probably 0, it succeeded.)
-    //415 unsupported media type is ALSO done here, added it to the if.
+// The rest of a 200 or 206 begun by begin_file, once the body's source
+// (file_fd or cached) is set
+static void begin_body(http_response_t* resp, const http_request_t* req, int keep_alive) {
+    if (req != NULL && req->range.len > 0) {
+        if (init_ranges(resp, req, keep_alive)) {
+            return;
+        }
+        // malformed Range header, ignore it and send the whole file
+    }
 
-    // write the file to fd in a loop
+    end_header(resp, keep_alive);
+    resp->remaining = resp->file_size;
+    resp->cacheable = resp->cached == NULL;
+}
+
+int http_response_finish(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                         int keep_alive, const struct stat* stat_buf, int fd) {
+    int result = begin_file(resp, resource_path, req, keep_alive, stat_buf, 1);
+    if (result != 0) {
+        if (fd != -1) { close(fd); }
+        return result == -1 ? 1 : 0;
+    }
 
-    int target_file = open(resource_path, O_RDONLY);
-    if (target_file == -1) {
+    resp->file_fd = fd != -1 ? fd : open(resource_path, O_RDONLY);
+    if (resp->file_fd == -1) {
         perror("open");
         return 1;
     }
+    begin_body(resp, req, keep_alive);
+    return 0;
+}
+
+int http_response_init_archive(http_response_t* resp, const archive_t* archive, const char* resource_name,
+                               const http_request_t* req, int keep_alive) {
+    reset_response(resp, NULL); // no cache, so cleanup leaves the member alone
+    const archive_member_t* member = archive_find(archive, resource_name);
+    struct stat stat_buf;
+    if (member != NULL) {
+        memset(&stat_buf, 0, sizeof(stat_buf));
+        stat_buf.st_ino = member->offset; // stands in for the inode in the ETag, so a rebuilt archive changes it
+        stat_buf.st_size = member->data.size;
+        stat_buf.st_mtim.tv_sec = member->mtime;
+    }
+    // an archive member is only ever sent as it is, so its encoding never depends on the request
+    int result = begin_file(resp, resource_name, req, keep_alive, member != NULL ? &stat_buf : NULL, 0);
+    if (result != 0) {
+        return result == -1 ? 1 : 0;
+    }
+    resp->cached = (cache_entry_t*) &member->data; // sent straight out of the mapping
+    begin_body(resp, req, keep_alive);
+    return 0;
+}
+
+int http_response_cache_body(http_response_t* resp, const char* resource_path, char* body,
+                             const struct stat* stat_buf) {
+    if (resp->cache == NULL || !resp->cacheable) {
+        return 0;
+    }
+    char header[HTTP_HEADER_MAX]; // the cache keeps the header without our Connection line
+    memcpy(header, resp->header, resp->base_header_len);
+    header[resp->base_header_len] = '\0';
+    cache_entry_t* entry = file_cache_put_body(resp->cache, resource_path, body, resp->remaining, stat_buf,
+                                               header, resp->etag, resp->last_modified);
+    if (entry == NULL) {
+        return 0;
+    }
+    close(resp->file_fd);
+    resp->file_fd = -1;
+    resp->cached = entry;
+    resp->offset = 0;
+    resp->remaining = entry->size;
+    return 1;
+}
 
-    void* buf = malloc(sizeof(void*) * BUFSIZE); // buffer to read from target_file and write to fd
-    int nbytes; // to store how many bytes are read from target_file
-    while ((nbytes = read(target_file, buf, BUFSIZE)) > 0) {//know it'll be > 0 at first because know the target_file exists
+int http_response_init(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                       int keep_alive, file_cache_t* cache, file_cache_t* gzip_cache, stat_cache_t* stat_cache) {
+    // a path we just found missing gets its 404 without touching the file system or the caches
+    struct stat stat_buf;
+    const char* file_type = NULL;
+    int known = stat_cache != NULL ? stat_cache_get(stat_cache, resource_path, &stat_buf, &file_type) : STAT_UNKNOWN;
+    if (known == STAT_MISSING) {
+        reset_response(resp, cache);
+        return http_response_finish(resp, resource_path, req, keep_alive, NULL, -1);
+    }
 
-        if (write(fd, buf, nbytes) == -1) { // write the same amount of bytes that was read from target_file
+    // concurrent misses on one path wait for a single load instead of each doing their own
+    int outcome;
+    int result = start_response(resp, resource_path, req, keep_alive, cache, gzip_cache, stat_cache, 1, &outcome);
+    if (result != HTTP_START_NEED_FILE) {
+        return result;
+    }
+    if (outcome == CACHE_FAILED) {
+        return 1; // the thread that loaded it printed the error
+    }
+    if (outcome == CACHE_MISSING) {
+        return http_response_finish(resp, resource_path, req, keep_alive, NULL, -1); // a 404, no need to stat again
+    }
+
+    int landed = CACHE_FAILED; // what our load comes to, if it's ours
+    resp->content_type = file_type;
+    int stat_result = known == STAT_FOUND ? 0 : stat_resource(resource_path, &stat_buf);
+    // a file that doesn't exist still gets a 404
+    if (stat_result != -2 &&
+        http_response_finish(resp, resource_path, req, keep_alive, stat_result == 0 ? &stat_buf : NULL, -1) == 0) {
+        landed = stat_result == -1 ? CACHE_MISSING : CACHE_UNCACHED;
+        if (stat_cache != NULL && known == STAT_UNKNOWN) {
+            stat_cache_put(stat_cache, resource_path, stat_result, &stat_buf, resp->content_type);
+        }
+        // first request for this file, keep a copy for next time if it fits
+        if (cache != NULL && resp->cacheable) {
+            char header[HTTP_HEADER_MAX];
+            memcpy(header, resp->header, resp->base_header_len);
+            header[resp->base_header_len] = '\0';
+            cache_entry_t* entry = file_cache_put(cache, resource_path, resp->file_fd, header,
+                                                  resp->etag, resp->last_modified);
+            if (entry != NULL) {
+                close(resp->file_fd);
+                resp->file_fd = -1;
+                use_cache_entry(resp, entry, keep_alive);
+                landed = CACHE_HIT;
+            }
+        }
+    }
+    if (outcome == CACHE_LOAD) {
+        file_cache_land(cache, resource_path, landed == CACHE_HIT ? resp->cached : NULL, landed);
+    }
+    return landed == CACHE_FAILED ? 1 : 0; // errors already printed
+}
+
+int http_response_init_not_implemented(http_response_t* resp) {
+    reset_response(resp, NULL);
+    snprintf(resp->header, HTTP_HEADER_MAX, "HTTP/1.1 501 Not Implemented\r\nAllow: GET, HEAD\r\n"
+             "Content-Length: 0\r\n");
+    end_header(resp, 0);
+    return 0;
+}
+
+void http_response_drop_body(http_response_t* resp) {
+    // a multipart response has its first part's header queued behind the main one, cut it off too
+    char* end = strstr(resp->header, "\r\n\r\n");
+    if (end != NULL) {
+        resp->header_len = end + 4 - resp->header;
+        resp->header[resp->header_len] = '\0';
+    }
+    resp->remaining = 0;
+    resp->n_ranges = 0;
+    resp->cacheable = 0; // nothing of the file gets read, so there's nothing to cache
+}
+
+// Sends a cached response: whatever is left of the header and the body from
+// memory, both in a single writev.
+static int send_cached(int fd, http_response_t* resp) {
+    while (resp->header_sent < resp->header_len || resp->remaining > 0) {
+        struct iovec iov[2];
+        int iov_count = 0;
+        if (resp->header_sent < resp->header_len) {
+            iov[iov_count].iov_base = resp->header + resp->header_sent;
+            iov[iov_count].iov_len = resp->header_len - resp->header_sent;
+            iov_count++;
+        }
+        if (resp->remaining > 0) {
+            iov[iov_count].iov_base = resp->cached->body + resp->offset;
+            iov[iov_count].iov_len = resp->remaining;
+            iov_count++;
+        }
+        ssize_t nbytes = writev(fd, iov, iov_count);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return HTTP_SEND_AGAIN; }
+            perror("writev");
+            return HTTP_SEND_ERROR;
+        }
+        // a short write can end anywhere, the header gets credited first
+        int header_part = resp->header_len - resp->header_sent;
+        if (nbytes < header_part) {
+            header_part = nbytes;
+        }
+        resp->header_sent += header_part;
+        resp->offset += nbytes - header_part;
+        resp->remaining -= nbytes - header_part;
+        resp->bytes_sent += nbytes;
+    }
+    return HTTP_SEND_DONE;
+}
+
+// Sends body bytes with pread/write through a user space buffer. Last resort for
+// when sendfile and splice both refuse the file.
+static int send_body_copy(int fd, http_response_t* resp) {
+    char buf[BUFSIZE * 16];
+    while (resp->remaining > 0) {
+        size_t chunk = resp->remaining < (off_t) sizeof(buf) ? (size_t) resp->remaining : sizeof(buf);
+        ssize_t nbytes = pread(resp->file_fd, buf, chunk, resp->offset);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            perror("pread");
+            return HTTP_SEND_ERROR;
+        }
+        if (nbytes == 0) { // file got shorter since we stat'ed it
+            fprintf(stderr, "unexpected end of file\n");
+            return HTTP_SEND_ERROR;
+        }
+        ssize_t written = write(fd, buf, nbytes);
+        if (written == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return HTTP_SEND_AGAIN; }
             perror("write");
-            free(buf);
-            close(target_file);
-            return 1;
+            return HTTP_SEND_ERROR;
         }
+        // a short write is fine, whatever didn't fit just gets read again next time around
+        resp->offset += written;
+        resp->remaining -= written;
+        resp->bytes_sent += written;
     }
-    if (nbytes < 0) { // If loop breaks because read returned an error
-        perror("read");
-        free(buf);
-        close(target_file);
-        return 1;
+    return HTTP_SEND_DONE;
+}
+
+// Sends body bytes by splicing them through a pipe, so the data never gets
+// copied into user space. Bytes left in the pipe on EAGAIN go out on the next call.
+static int send_body_splice(int fd, http_response_t* resp) {
+    if (resp->pipe_fds[0] == -1 && pipe(resp->pipe_fds) == -1) {
+        perror("pipe");
+        return HTTP_SEND_ERROR;
+    }
+    while (resp->remaining > 0 || resp->in_pipe > 0) {
+        if (resp->in_pipe == 0) { // only refill the pipe once it's been drained
+            size_t chunk = resp->remaining < MAX_SEND_CHUNK ? (size_t) resp->remaining : MAX_SEND_CHUNK;
+            loff_t in_off = resp->offset; // splice always takes a 64 bit offset
+            ssize_t nbytes = splice(resp->file_fd, &in_off, resp->pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (nbytes == -1) {
+                if (errno == EINTR) { continue; }
+                if (errno == EINVAL || errno == ENOSYS) { // pipe is empty so nothing is lost by switching
+                    resp->body_mode = BODY_COPY;
+                    return send_body_copy(fd, resp);
+                }
+                perror("splice");
+                return HTTP_SEND_ERROR;
+            }
+            if (nbytes == 0) {
+                fprintf(stderr, "unexpected end of file\n");
+                return HTTP_SEND_ERROR;
+            }
+            resp->offset = in_off;
+            resp->remaining -= nbytes;
+            resp->in_pipe = nbytes;
+        }
+        ssize_t out = splice(resp->pipe_fds[0], NULL, fd, NULL, resp->in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (out == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return HTTP_SEND_AGAIN; }
+            perror("splice");
+            return HTTP_SEND_ERROR;
+        }
+        resp->in_pipe -= out;
+        resp->bytes_sent += out;
+    }
+    return HTTP_SEND_DONE;
+}
+
+// Sends body bytes straight from the page cache to the socket with sendfile.
+// Switches the response over to splice if the kernel won't sendfile this file.
+static int send_body_sendfile(int fd, http_response_t* resp) {
+    while (resp->remaining > 0) {
+        size_t chunk = resp->remaining < MAX_SEND_CHUNK ? (size_t) resp->remaining : MAX_SEND_CHUNK;
+        ssize_t nbytes = sendfile(fd, resp->file_fd, &resp->offset, chunk); // advances offset for us
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return HTTP_SEND_AGAIN; }
+            if (errno == EINVAL || errno == ENOSYS) { // e.g. a filesystem without sendfile support
+                resp->body_mode = BODY_SPLICE;
+                return send_body_splice(fd, resp);
+            }
+            perror("sendfile");
+            return HTTP_SEND_ERROR;
+        }
+        if (nbytes == 0) { // file got shorter since we stat'ed it
+            fprintf(stderr, "unexpected end of file\n");
+            return HTTP_SEND_ERROR;
+        }
+        resp->remaining -= nbytes; // short writes just go around the loop again
+        resp->bytes_sent += nbytes;
+    }
+    return HTTP_SEND_DONE;
+}
+
+// Sends the rest of the header and the body: the whole response, or one part
+// of a multipart one
+static int send_part(int fd, http_response_t* resp) {
+    if (resp->cached != NULL) {
+        return send_cached(fd, resp);
+    }
+
+    // MSG_MORE holds the header back so it goes out in the same packet as the start of the body
+    int flags = resp->remaining > 0 ? MSG_MORE : 0;
+    while (resp->header_sent < resp->header_len) {
+        ssize_t nbytes = send(fd, resp->header + resp->header_sent, resp->header_len - resp->header_sent, flags);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return HTTP_SEND_AGAIN; }
+            perror("send");
+            return HTTP_SEND_ERROR;
+        }
+        resp->header_sent += nbytes;
+        resp->bytes_sent += nbytes;
     }
 
-    free(buf); // done reading and writing, don't need this anymore
+    if (resp->remaining == 0 && resp->in_pipe == 0) {
+        return HTTP_SEND_DONE;
+    }
+    if (resp->body_mode == BODY_SENDFILE) {
+        return send_body_sendfile(fd, resp);
+    }
+    else if (resp->body_mode == BODY_SPLICE) {
+        return send_body_splice(fd, resp);
+    }
+    return send_body_copy(fd, resp);
+}
+
+int http_response_send(int fd, http_response_t* resp) {
+    int result;
+    do {
+        result = send_part(fd, resp);
+    } while (result == HTTP_SEND_DONE && start_next_part(resp, 0));
+    return result;
+}
+
+int http_response_send_some(int fd, http_response_t* resp, off_t max_body) {
+    // hide everything past the limit from send_part, then give it back
+    off_t held_back = resp->remaining > max_body ? resp->remaining - max_body : 0;
+    resp->remaining -= held_back;
+    int result = send_part(fd, resp);
+    resp->remaining += held_back;
+    if (result != HTTP_SEND_DONE) {
+        return result;
+    }
+    if (held_back > 0 || start_next_part(resp, 0)) {
+        return HTTP_SEND_MORE;
+    }
+    return HTTP_SEND_DONE;
+}
+
+int http_response_next_part(http_response_t* resp) {
+    return start_next_part(resp, 0);
+}
+
+int http_response_init_body(http_response_t* resp, const char* content_type, char* body, size_t len,
+                            int keep_alive) {
+    reset_response(resp, NULL);
+    if (body == NULL) { // the caller couldn't build it, error already printed
+        return 1;
+    }
+    // a private entry no cache knows about, so every server's cached-body path can send it as is
+    cache_entry_t* entry = calloc(1, sizeof(cache_entry_t));
+    if (entry == NULL) {
+        perror("calloc");
+        free(body);
+        return 1;
+    }
+    entry->body = body;
+    entry->size = len;
+    snprintf(resp->header, HTTP_HEADER_MAX, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+             "Cache-Control: no-store\r\n", content_type, len);
+    end_header(resp, keep_alive);
+    resp->cached = entry;
+    resp->owns_cached = 1;
+    resp->remaining = len;
+    return 0;
+}
 
-    if (close(target_file) == -1) {
+int http_response_cleanup(http_response_t* resp) {
+    int ret_val = 0;
+    if (resp->file_fd != -1 && close(resp->file_fd) == -1) {
         perror("close");
+        ret_val = 1;
+    }
+    if (resp->pipe_fds[0] != -1) {
+        close(resp->pipe_fds[0]);
+        close(resp->pipe_fds[1]);
+    }
+    if (resp->cached != NULL && resp->owns_cached) {
+        free(resp->cached->body);
+        free(resp->cached);
+    }
+    else if (resp->cached != NULL && resp->cache != NULL) { // archive members belong to the archive
+        file_cache_release(resp->cache, resp->cached);
+    }
+    resp->file_fd = -1;
+    resp->pipe_fds[0] = -1;
+    resp->pipe_fds[1] = -1;
+    resp->cached = NULL;
+    return ret_val;
+}
+
+int write_http_response(int fd, const char* resource_path) {
+    return send_http_response(fd, resource_path, NULL, 0, NULL, NULL);
+}
+
+int send_http_response(int fd, const char* resource_path, const http_request_t* req, int keep_alive,
+                       file_cache_t* cache, file_cache_t* gzip_cache) {
+    http_response_t resp;
+    if (http_response_init(&resp, resource_path, req, keep_alive, cache, gzip_cache, NULL) != 0) {
+        http_response_cleanup(&resp);
+        return 1; // error already printed
+    }
+    int result = http_response_send_all(fd, &resp);
+    if (http_response_cleanup(&resp) != 0 || result != 0) {
         return 1;
     }
+    return 0;
+}
 
+int send_http_unavailable(int fd, int retry_after_s) {
+    char header[HTTP_HEADER_MAX];
+    int len = snprintf(header, HTTP_HEADER_MAX, "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\n"
+                       "Content-Length: 0\r\nConnection: close\r\n\r\n", retry_after_s);
+    if (send(fd, header, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+        return 1; // client already gone, nothing worth printing
+    }
     return 0;
 }
 
+int http_response_send_all(int fd, http_response_t* resp) {
+    int result;
+    while ((result = http_response_send(fd, resp)) == HTTP_SEND_AGAIN) {
+        // non-blocking socket with a full send buffer, wait for the client to drain it
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+    }
+    return result == HTTP_SEND_DONE ? 0 : 1;
+}
+
 //int main(int argc, char **argv) {
     // READ_HTTP_REQUEST TEST
     // int fd = open("GET.txt", O_RDONLY | O_CREAT);
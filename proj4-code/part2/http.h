@@ -1,8 +1,324 @@
 #ifndef HTTP_H
 #define HTTP_H
 
-int read_http_request(int fd, char *resource_name);
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
-int write_http_response(int fd, const char *resource_path);
+#include "archive.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "stat_cache.h"
+
+#define HTTP_HEADER_MAX 512
+#define HTTP_REQUEST_MAX 8192 // longest request (header and any body) we'll buffer
+#define HTTP_RESOURCE_MAX 512 // longest resource name, including the null terminator
+#define HTTP_MAX_RANGES 16    // byte ranges honored in one request, a longer Range header is ignored
+#define HTTP_BOUNDARY "3d6b6a416f9b5e21" // separates the parts of a multipart/byteranges body
+
+// Return values of read_next_http_request
+#define HTTP_READ_OK 0      // resource_name holds the next request
+#define HTTP_READ_ERROR 1   // bad request or socket error, error already printed
+#define HTTP_READ_CLOSED 2  // client closed the connection between requests
+#define HTTP_READ_TIMEOUT 3 // nothing (or only part of a request) arrived in time
+
+// Return values of http_response_send
+#define HTTP_SEND_DONE 0  // whole response has been written
+#define HTTP_SEND_ERROR 1 // something went wrong, error already printed
+#define HTTP_SEND_AGAIN 2 // non-blocking socket is full, call again once it's writable
+#define HTTP_SEND_MORE 3  // http_response_send_some stopped at its limit, call again for the rest
+
+// Return values of http_response_start
+#define HTTP_START_DONE 0      // response is ready to send
+#define HTTP_START_ERROR 1     // something went wrong, error already printed
+#define HTTP_START_NEED_FILE 2 // nothing cached, finish it with http_response_finish
+
+// Return values of http_request_method
+#define HTTP_METHOD_GET 0
+#define HTTP_METHOD_HEAD 1   // answered like a GET, minus the body
+#define HTTP_METHOD_OTHER 2  // answered with http_response_init_not_implemented
+
+// How the body of a response gets from the file to the socket
+#define BODY_SENDFILE 0
+#define BODY_SPLICE 1
+#define BODY_COPY 2
+
+// Bytes read from a connection that haven't been answered yet. Pipelined
+// requests wait here, in order, until the ones ahead of them are done.
+typedef struct {
+    char data[HTTP_REQUEST_MAX];
+    int len;         // bytes in data
+    int request_len; // bytes at the front used by the request being answered
+    http_request_t req; // parse of the request at the front, picks up where it left off as bytes arrive
+} request_buffer_t;
+
+// First and last byte of a requested range, both included
+typedef struct {
+    off_t first;
+    off_t last;
+} http_range_t;
+
+// An HTTP response that may be sent over several calls, so that a
+// non-blocking socket can pick up where it left off.
+// A multipart/byteranges response goes out as one part at a time: each part's
+// boundary and headers are put in 'header' once the part before it is sent.
+typedef struct {
+    char header[HTTP_HEADER_MAX];
+    int header_len;
+    int header_sent;
+    int base_header_len; // length of the header before its Connection line
+    int file_fd;     // -1 if the response has no body
+    off_t offset;    // next byte of the file to send
+    off_t remaining; // bytes of the body still to send
+    int body_mode;   // BODY_SENDFILE, BODY_SPLICE or BODY_COPY
+    int pipe_fds[2]; // only used by BODY_SPLICE
+    size_t in_pipe;  // bytes spliced into the pipe but not out to the socket yet
+    file_cache_t* cache;   // where cached comes from, NULL if caching is off (or cached is an archive member)
+    cache_entry_t* cached; // body comes from this cache entry instead of file_fd
+    int cacheable;   // a plain 200 with the whole file as its body, worth keeping in the cache
+    http_range_t ranges[HTTP_MAX_RANGES]; // parts of a multipart/byteranges response
+    int n_ranges;    // 0 unless the response is multipart
+    int next_range;  // index of the next part to start, n_ranges for the closing boundary
+    off_t file_size;
+    const char* content_type;
+    char etag[CACHE_VALIDATOR_MAX];          // validators of the file, sent with 200, 206 and 304 responses
+    char last_modified[CACHE_VALIDATOR_MAX];
+    time_t mtime;                            // for comparing against If-Modified-Since
+    int owns_cached; // cached is a private entry from http_response_init_body, freed rather than released
+    int status;      // status code, once the header is built
+    off_t bytes_sent; // header and body bytes the socket has taken so far
+} http_response_t;
+
+/*
+ * Read an HTTP request from an active TCP connection socket
+ * fd: The socket's file descriptor
+ * resource_name: Set to the name of the requested resource on success
+ * Returns 0 on success or 1 on error
+ */
+int read_http_request(int fd, char* resource_name);
+
+/*
+ * Pull the requested resource name out of a buffered HTTP request
+ * buf: The bytes of the request read so far
+ * nbytes: Number of bytes in buf
+ * resource_name: Set to the name of the requested resource on success
+ * Returns 0 on success or 1 on error
+ */
+int parse_http_request(const char* buf, int nbytes, char* resource_name);
+
+/*
+ * Parse whatever has arrived of the request at the front of a request buffer.
+ * Only the bytes added since the last call are looked at.
+ * Returns the request's length including the blank line that ends its header
+ * and any Content-Length body after that, 0 if more bytes are needed, or -1
+ * if it's malformed or doesn't fit in HTTP_REQUEST_MAX bytes
+ */
+int request_buffer_parse(request_buffer_t* rb);
+
+/*
+ * Join the served directory and a requested resource name into a file path
+ * path: Set to the joined path on success
+ * path_size: Size of the path buffer
+ * Returns 0 on success or 1 if the path doesn't fit
+ */
+int make_resource_path(char* path, int path_size, const char* server_dir, const char* resource_name);
+
+/*
+ * Set up an empty request buffer for a new connection
+ */
+void request_buffer_init(request_buffer_t* rb);
+
+/*
+ * Drop the request that was just answered from the front of a request buffer
+ */
+void request_buffer_consume(request_buffer_t* rb);
+
+/*
+ * Parse the complete request at the front of a request buffer
+ * resource_name: Set to the name of the requested resource on success
+ * keep_alive: Set to 1 if the client wants the connection kept open after
+ * this request. Always 0 for a method other than GET or HEAD, and for a
+ * Transfer-Encoding body, which can't be told apart from the next request.
+ * Returns 0 on success or 1 on error
+ */
+int parse_buffered_request(request_buffer_t* rb, char* resource_name, int* keep_alive);
+
+/*
+ * Returns HTTP_METHOD_GET, HTTP_METHOD_HEAD or HTTP_METHOD_OTHER for a parsed request
+ */
+int http_request_method(const http_request_t* req);
+
+/*
+ * Read the next request on a persistent connection. Drops the previous
+ * request from the buffer first, so pipelined requests come out in order.
+ * fd: The socket's file descriptor
+ * rb: The connection's request buffer, set up with request_buffer_init
+ * resource_name: Set to the name of the requested resource on success
+ * keep_alive: Set to 1 if the client wants the connection kept open after this request
+ * timeout_ms: Longest to wait for more bytes, -1 to wait forever
+ * Returns HTTP_READ_OK, HTTP_READ_ERROR, HTTP_READ_CLOSED or HTTP_READ_TIMEOUT
+ */
+int read_next_http_request(int fd, request_buffer_t* rb, char* resource_name, int* keep_alive, int timeout_ms);
+
+/*
+ * Write an HTTP response to an active TCP connection socket
+ * fd: The socket's file descriptor
+ * resource_path: The path to the requested resource in the server's file system
+ * Returns 0 on success or 1 on error
+ */
+int write_http_response(int fd, const char* resource_path);
+
+/*
+ * Write an HTTP/1.1 response that says whether the connection stays open.
+ * Doesn't return until it's all sent, even on a non-blocking socket.
+ * fd: The socket's file descriptor
+ * resource_path: The path to the requested resource in the server's file system
+ * req: The parsed request, for its Range header. NULL sends the whole file.
+ * keep_alive: 1 to tell the client it can send another request, 0 to say we're closing
+ * cache: File cache to serve from and fill, or NULL to always read the file
+ * gzip_cache: Cache of compressed bodies, or NULL to never compress on the fly
+ * Returns 0 on success or 1 on error
+ */
+int send_http_response(int fd, const char* resource_path, const http_request_t* req, int keep_alive,
+                       file_cache_t* cache, file_cache_t* gzip_cache);
+
+/*
+ * Answer a connection the server is too busy to serve with a header-only
+ * 503 Service Unavailable that closes it. Never waits: a fresh socket always
+ * has room for it, and if it somehow doesn't, the client just doesn't get it.
+ * fd: The socket's file descriptor, may be blocking or non-blocking
+ * retry_after_s: Seconds the client is told to wait before trying again
+ * Returns 0 on success or 1 on error
+ */
+int send_http_unavailable(int fd, int retry_after_s);
+
+/*
+ * Build the response for a resource without sending anything yet. Opens the
+ * file if there is a body to send. A request whose If-None-Match or
+ * If-Modified-Since matches the file gets a 304, without the file ever being
+ * opened. A satisfiable Range header gets a 206 with
+ * just those bytes (multipart/byteranges for more than one range), an
+ * unsatisfiable one gets a 416, and a malformed one is ignored. Text goes out
+ * gzip-encoded if the client accepts it, taken from a sibling .gz file when
+ * there is one or else compressed once into gzip_cache.
+ * resp: The response to fill in, must be passed to http_response_cleanup
+ * resource_path: The path to the requested resource in the server's file system
+ * req: The parsed request, NULL to send the whole file unconditionally
+ * keep_alive: 1 to tell the client it can send another request, 0 to say we're closing
+ * cache: File cache to serve from and fill, or NULL to always read the file
+ * gzip_cache: Cache of compressed bodies, or NULL to never compress on the fly
+ * stat_cache: Recent stat results and 404s to answer from, or NULL to always stat the file
+ * Returns 0 on success or 1 on error
+ */
+int http_response_init(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                       int keep_alive, file_cache_t* cache, file_cache_t* gzip_cache, stat_cache_t* stat_cache);
+
+/*
+ * The first half of http_response_init, for servers that do their own file
+ * I/O: builds the response from the caches if it can, without touching the
+ * file system for a plain cache hit or a path stat_cache knows is missing.
+ * Returns HTTP_START_DONE, HTTP_START_ERROR, or HTTP_START_NEED_FILE if the
+ * file has to be looked at, in which case call http_response_finish
+ */
+int http_response_start(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                        int keep_alive, file_cache_t* cache, file_cache_t* gzip_cache, stat_cache_t* stat_cache);
+
+/*
+ * The second half of http_response_init: builds the response from the
+ * file's stat. Never reads the file or adds it to the cache; check
+ * resp->cacheable and use http_response_cache_body for that.
+ * stat_buf: The file's stat, NULL if it doesn't exist (sends a 404)
+ * resp->content_type may already hold the file's MIME type (say, from a
+ * stat_cache_t), else it's worked out here. Either way it's left there.
+ * fd: The file opened read-only, or -1 to have it opened here if there's a
+ * body to send. Closed if it isn't needed.
+ * Returns 0 on success or 1 on error
+ */
+int http_response_finish(http_response_t* resp, const char* resource_path, const http_request_t* req,
+                         int keep_alive, const struct stat* stat_buf, int fd);
+
+/*
+ * Turn a cacheable response into one served from the cache, given the whole
+ * file read some other way
+ * body: malloc'd copy of the whole file, the cache takes it over either way
+ * stat_buf: The stat the response was finished with
+ * Returns 1 if the body now comes from the cache, or 0 if it's still to be
+ * read from resp->file_fd (no cache, or no room in it)
+ */
+int http_response_cache_body(http_response_t* resp, const char* resource_path, char* body,
+                             const struct stat* stat_buf);
+
+/*
+ * Build the response to a request for a member of a mapped tar archive, the
+ * same one http_response_init would build for the file itself except that
+ * text isn't gzipped (and so has no Vary: Accept-Encoding). The body goes out
+ * straight from the mapping.
+ * resource_name: The requested resource, e.g. "/index.html" for the member "index.html"
+ * Returns 0 on success or 1 on error
+ */
+int http_response_init_archive(http_response_t* resp, const archive_t* archive, const char* resource_name,
+                               const http_request_t* req, int keep_alive);
+
+/*
+ * Build a header-only 501 Not Implemented response, for a method other than
+ * GET or HEAD. It always closes the connection.
+ * resp: The response to fill in, must be passed to http_response_cleanup
+ * Returns 0 on success or 1 on error
+ */
+int http_response_init_not_implemented(http_response_t* resp);
+
+/*
+ * Turn a built response into the answer to a HEAD request: the same header
+ * (Content-Length and all), but no body. Whatever the body would have come
+ * from is still released by http_response_cleanup.
+ */
+void http_response_drop_body(http_response_t* resp);
+
+/*
+ * Move a multipart/byteranges response on to its next part once the current
+ * one is sent, for servers that send the pieces themselves
+ * Returns 1 if there's another part (or the closing boundary) to send, 0 if
+ * the response is done
+ */
+int http_response_next_part(http_response_t* resp);
+
+/*
+ * Build a 200 response for a body made in memory rather than read from a
+ * file. Clients are told not to cache it.
+ * resp: The response to fill in, must be passed to http_response_cleanup
+ * content_type: Value of the Content-Type header
+ * body: malloc'd body, the response takes it over either way. NULL (the
+ * caller failed to build it) just fails, leaving resp safe to clean up.
+ * Returns 0 on success or 1 on error
+ */
+int http_response_init_body(http_response_t* resp, const char* content_type, char* body, size_t len,
+                            int keep_alive);
+
+/*
+ * Send as much of a response as the socket will accept
+ * fd: The socket's file descriptor, may be blocking or non-blocking
+ * Returns HTTP_SEND_DONE, HTTP_SEND_AGAIN or HTTP_SEND_ERROR
+ */
+int http_response_send(int fd, http_response_t* resp);
+
+/*
+ * http_response_send, but stopping once about max_body body bytes have gone
+ * out, so a big response can be sent a slice at a time with other work in
+ * between. A multipart response also stops at the end of every part.
+ * Returns HTTP_SEND_DONE, HTTP_SEND_MORE, HTTP_SEND_AGAIN or HTTP_SEND_ERROR
+ */
+int http_response_send_some(int fd, http_response_t* resp, off_t max_body);
+
+/*
+ * Send the rest of a response, waiting on a non-blocking socket whenever it's full
+ * Returns 0 on success or 1 on error
+ */
+int http_response_send_all(int fd, http_response_t* resp);
+
+/*
+ * Release the file, pipe and cache entry held by a response
+ * Returns 0 on success or 1 on error
+ */
+int http_response_cleanup(http_response_t* resp);
 
 #endif // HTTP_H
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_parser.h"
+
+// Drops spaces and tabs from both ends of a slice
+static http_slice_t trim(const char *start, int len) {
+    while (len > 0 && (*start == ' ' || *start == '\t')) {
+        start++;
+        len--;
+    }
+    while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t')) {
+        len--;
+    }
+    http_slice_t slice = { start, len };
+    return slice;
+}
+
+// Splits "METHOD /path HTTP/x.y" into its three parts
+// Returns 0 on success or -1 if the line is malformed
+static int parse_request_line(http_request_t *req, const char *line, int len) {
+    const char *end = line + len;
+    const char *space = memchr(line, ' ', len);
+    if (space == NULL || space == line) {
+        fprintf(stderr, "HTML request not formatted properly\n");
+        return -1;
+    }
+    req->method.start = line;
+    req->method.len = space - line;
+
+    const char *path = space + 1;
+    if (path >= end || *path != '/') {
+        fprintf(stderr, "no file name specified on first line of request\n");
+        return -1;
+    }
+    space = memchr(path, ' ', end - path);
+    if (space == NULL) {
+        fprintf(stderr, "HTML request not formatted properly\n");
+        return -1;
+    }
+    req->path.start = path;
+    req->path.len = space - path;
+
+    req->version = trim(space + 1, end - space - 1);
+    if (req->version.len < 5 || strncmp(req->version.start, "HTTP/", 5) != 0) {
+        fprintf(stderr, "HTML request not formatted properly\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 1 if a Content-Length value is a number of zero, 0 if it's anything else
+static int zero_length(http_slice_t value) {
+    if (value.len == 0) {
+        return 0;
+    }
+    for (int i = 0; i < value.len; i++) {
+        if (value.start[i] != '0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Saves the value of a header we care about, anything else is skipped
+// Returns 0 on success or -1 if the line isn't a header
+static int parse_header_line(http_request_t *req, const char *line, int len) {
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL) {
+        fprintf(stderr, "malformed HTTP header line\n");
+        return -1;
+    }
+    int name_len = colon - line;
+    http_slice_t *field = NULL;
+    // the length alone rules out almost every header, so only compare when it matches
+    switch (name_len) {
+        case 5:
+            if (strncasecmp(line, "Range", 5) == 0) { field = &req->range; }
+            break;
+        case 10:
+            if (strncasecmp(line, "Connection", 10) == 0) { field = &req->connection; }
+            break;
+        case 13:
+            if (strncasecmp(line, "If-None-Match", 13) == 0) { field = &req->if_none_match; }
+            break;
+        case 14:
+            if (strncasecmp(line, "Content-Length", 14) == 0) { field = &req->content_length; }
+            break;
+        case 15:
+            if (strncasecmp(line, "Accept-Encoding", 15) == 0) { field = &req->accept_encoding; }
+            break;
+        case 17:
+            if (strncasecmp(line, "If-Modified-Since", 17) == 0) { field = &req->if_modified_since; }
+            else if (strncasecmp(line, "Transfer-Encoding", 17) == 0) { field = &req->transfer_encoding; }
+            break;
+    }
+    if (field != NULL) {
+        *field = trim(colon + 1, line + len - colon - 1);
+    }
+    return 0;
+}
+
+void http_parser_init(http_request_t *req) {
+    memset(req, 0, sizeof(http_request_t));
+    req->state = HTTP_PARSE_REQUEST_LINE;
+}
+
+int http_parse(http_request_t *req, const char *buf, int len, int max_len) {
+    while (req->state != HTTP_PARSE_DONE) {
+        const char *newline = memchr(buf + req->scanned, '\n', len - req->scanned);
+        if (newline == NULL) {
+            req->scanned = len; // don't search these bytes again next time
+            if (len >= max_len) {
+                fprintf(stderr, "HTTP request header too long\n");
+                return -1;
+            }
+            return 0;
+        }
+
+        const char *line = buf + req->line_start;
+        int line_len = newline - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--; // lines should end in \r\n, but take a bare \n too
+        }
+        req->line_start = newline + 1 - buf;
+        req->scanned = req->line_start;
+
+        if (req->state == HTTP_PARSE_REQUEST_LINE) {
+            if (line_len == 0) {
+                continue; // stray blank lines before a request are allowed
+            }
+            if (parse_request_line(req, line, line_len) != 0) {
+                return -1;
+            }
+            req->state = HTTP_PARSE_HEADERS;
+        }
+        else if (line_len == 0) { // blank line ends the header
+            req->state = HTTP_PARSE_DONE;
+        }
+        else if (parse_header_line(req, line, line_len) != 0) {
+            return -1;
+        }
+    }
+
+    // HTTP/1.1 keeps connections open unless told otherwise, HTTP/1.0 is the opposite
+    req->keep_alive = http_slice_equals(req->version, "HTTP/1.1");
+    if (http_slice_has_token(req->connection, "close")) {
+        req->keep_alive = 0;
+    }
+    else if (http_slice_has_token(req->connection, "keep-alive")) {
+        req->keep_alive = 1;
+    }
+    // anything but a Content-Length of 0 means a body follows, which mustn't be taken for the next request
+    req->has_body = req->transfer_encoding.start != NULL ||
+                    (req->content_length.start != NULL && !zero_length(req->content_length));
+    return req->line_start;
+}
+
+int http_slice_has_token(http_slice_t slice, const char *token) {
+    const char *end = slice.start + slice.len;
+    for (const char *item = slice.start; item < end; ) {
+        const char *comma = memchr(item, ',', end - item);
+        const char *item_end = comma != NULL ? comma : end;
+        if (http_slice_equals(trim(item, item_end - item), token)) {
+            return 1;
+        }
+        item = item_end + 1;
+    }
+    return 0;
+}
+
+int http_slice_equals(http_slice_t slice, const char *str) {
+    int len = strlen(str);
+    return slice.len == len && (len == 0 || strncasecmp(slice.start, str, len) == 0);
+}
@@ -0,0 +1,67 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+// Where the parser is in the request
+#define HTTP_PARSE_REQUEST_LINE 0
+#define HTTP_PARSE_HEADERS 1
+#define HTTP_PARSE_DONE 2
+
+// Part of a request, pointing straight into the buffer it was read into.
+// Not null terminated. A header that wasn't sent has start == NULL and len == 0.
+typedef struct {
+    const char *start;
+    int len;
+} http_slice_t;
+
+// A request line plus the headers the server cares about, filled in as the
+// bytes arrive. Nothing is copied or allocated: the slices stay valid as long
+// as the buffer isn't moved or overwritten.
+typedef struct {
+    http_slice_t method;
+    http_slice_t path;
+    http_slice_t version;
+    http_slice_t connection;
+    http_slice_t range;
+    http_slice_t if_none_match;
+    http_slice_t if_modified_since;
+    http_slice_t accept_encoding;
+    http_slice_t content_length;
+    http_slice_t transfer_encoding;
+    int keep_alive; // set once the header is done: what the version and Connection header ask for
+    int has_body;   // set once the header is done: a body follows the header (Transfer-Encoding, or a Content-Length that isn't 0)
+
+    int state;      // HTTP_PARSE_REQUEST_LINE, HTTP_PARSE_HEADERS or HTTP_PARSE_DONE
+    int line_start; // offset of the first line that hasn't been parsed yet
+    int scanned;    // bytes already searched for the end of that line
+} http_request_t;
+
+/*
+ * Get a parser ready for a new request
+ */
+void http_parser_init(http_request_t *req);
+
+/*
+ * Parse as much of a request as has arrived. Call again with the same buffer
+ * after more bytes are appended to it; lines already parsed aren't looked at
+ * again.
+ * buf: The request read so far, always starting at the same address
+ * len: Number of bytes in buf
+ * max_len: Size of the buffer, a header that doesn't end before filling it is an error
+ * Returns the length of the request header (including the blank line that ends
+ * it) once it's complete, 0 if more bytes are needed, or -1 if the request is
+ * malformed or too long. Any body (see has_body) is not part of that length.
+ */
+int http_parse(http_request_t *req, const char *buf, int len, int max_len);
+
+/*
+ * Returns 1 if 'token' is one of the slice's comma-separated elements, ignoring
+ * case and the whitespace around each one, or 0 if not
+ */
+int http_slice_has_token(http_slice_t slice, const char *token);
+
+/*
+ * Returns 1 if the slice is exactly 'str', ignoring case, or 0 if not
+ */
+int http_slice_equals(http_slice_t slice, const char *str);
+
+#endif // HTTP_PARSER_H
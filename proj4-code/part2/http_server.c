@@ -1,27 +1,148 @@
+#define _GNU_SOURCE // accept4, CPU affinity
+
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include "http.h"
 #include "connection_queue.h"
+#include "deadline.h"
+#include "event_loop.h"
+#include "priority_queue.h"
+#include "server_config.h"
+#include "steal_deque.h"
+#include "uring_loop.h"
 
 #define BUFSIZE 512
-#define LISTEN_QUEUE_LEN 5
-#define N_THREADS 5
+#define POLL_SLICE_MS 250 // how often a worker waiting on a kept-alive connection checks for shutdown
+#define STEAL_IDLE_MS 10  // how long a stealing worker with nothing to do sleeps before looking at its peers again
+#define STEAL_DEQUE_SLOTS 1024 // ready connections one stealing worker can hold
+#define STEAL_BATCH 64    // parked connections picked up per epoll_wait
+#define SJF_CHUNK (64 * 1024) // body bytes a size-ordered worker sends before checking for smaller work
+#define SJF_HALF_DELAY_BYTES (64 * 1024) // response size that gets half of the longest delay
+#define SJF_BATCH 64      // connections the size-ordered acceptor picks up per epoll_wait
+
+// Serving modes, picked with -m on the command line
+#define MODE_THREADS 0 // blocking worker threads fed by connection_queue_t
+#define MODE_EPOLL 1   // non-blocking sockets driven by epoll event loops
+#define MODE_SHARDED 2 // one SO_REUSEPORT listener, acceptor and worker group per CPU
+#define MODE_URING 3   // io_uring rings doing all socket and file I/O asynchronously
 
 typedef struct {
     connection_queue_t *queue;
-    const char *server_dir;
+    const server_config_t *config;
+    int cpu; // CPU the thread pins itself to, -1 to let it float
+    deadline_reaper_t *reaper; // enforces the workers' read and write deadlines
 } args_t;
 
+// Sharded mode: everything that serves connections arriving on one CPU's listener
+typedef struct {
+    int sock_fd;               // this shard's SO_REUSEPORT listening socket
+    connection_queue_t *queue; // accepted connections waiting for one of this shard's workers
+    args_t args;               // shared by the shard's acceptor and workers
+    pthread_t acceptor;
+    pthread_t *workers;
+    int n_workers;             // workers actually started, so cleanup knows what to join
+    int acceptor_started;
+    int accept_failed;
+    deadline_reaper_t reaper;  // for this shard's workers
+    int reaper_started;
+} shard_t;
+
+// Work-stealing dispatch: a connection between requests. It belongs to
+// whichever worker took it off a deque or inbox until it's parked again.
+typedef struct steal_conn {
+    int fd;
+    int home;            // worker it parks with between requests, the one that first served it
+    int registered;      // added to home's epoll set yet
+    int waiting_kind;    // deadline armed while parked, -1 right after a response
+    int n_requests;      // requests answered so far
+    request_buffer_t rb; // request bytes read but not answered yet
+    deadline_t deadline;
+    struct steal_conn *prev; // every connection of a home is on its list so shutdown can close them
+    struct steal_conn *next;
+} steal_conn_t;
+
+struct steal_pool;
+
+// Work-stealing dispatch: one worker and what it owns
+typedef struct {
+    steal_deque_t deque;     // connections with a request ready, only this worker pushes
+    lockfree_queue_t *inbox; // new connections dealt to this worker by the acceptor
+    int epoll_fd;            // its parked connections, one-shot, plus wake_fd
+    int wake_fd;             // eventfd the acceptor bumps after adding to the inbox
+    pthread_mutex_t lock;    // guards conns
+    steal_conn_t *conns;     // connections parked here or being served after parking here
+    atomic_int busy;         // serving a connection, so its inbox and parked connections are fair game
+    pthread_t thread;
+    int index;
+    struct steal_pool *pool;
+} steal_worker_t;
+
+// Work-stealing dispatch: every worker and what they share
+typedef struct steal_pool {
+    steal_worker_t *workers;
+    int n_workers;
+    const server_config_t *config;
+    deadline_reaper_t reaper;
+} steal_pool_t;
+
+// Size-ordered dispatch: a connection, waiting for its next request, waiting
+// in line, or being answered
+typedef struct sjf_conn {
+    int fd;
+    int registered;      // added to the acceptor's epoll set yet
+    int waiting_kind;    // deadline armed while parked, -1 right after a response
+    int n_requests;      // requests answered so far
+    int responding;      // resp is partway out
+    int keep_alive;      // what resp told the client
+    long long ready_ns;  // when its current request went in line, the base of its key
+    long long started_ns; // when resp was started
+    request_buffer_t rb; // request bytes read but not answered yet
+    http_response_t resp;
+    deadline_t deadline;
+    struct sjf_conn *prev; // every connection is on the pool's list so shutdown can close them
+    struct sjf_conn *next;
+} sjf_conn_t;
+
+// Size-ordered dispatch: the line, the workers, and the acceptor's epoll set
+typedef struct {
+    priority_queue_t queue; // connections with a request ready, smallest expected response first
+    int epoll_fd;           // the listening socket plus every parked connection, one-shot
+    pthread_mutex_t lock;   // guards conns
+    sjf_conn_t *conns;
+    pthread_t *workers;
+    int n_workers;
+    const server_config_t *config;
+    deadline_reaper_t reaper;
+} sjf_pool_t;
+
+// The metrics port: its own listener and the thread answering scrapes on it
+typedef struct {
+    int sock_fd;
+    metrics_t* metrics;
+    pthread_t thread;
+} metrics_server_t;
+
 int keep_going = 1;
 int code = 0; //used to hold return valuefor main
 
@@ -29,14 +150,208 @@ void handle_sigint(int signo) { //rewrite for queues.
     keep_going = 0;
 }
 
+// Builds the response to the request read_next_http_request just took out of
+// rb and arms the write deadline for sending it
+// started_ns: Set to when the response was started, for end_answer
+// Returns 0 on success or -1 if the connection should be closed, with resp cleaned up
+int begin_answer(request_buffer_t* rb, const char* resource, int keep_alive, const server_config_t* config,
+                 deadline_reaper_t* reaper, deadline_t* deadline, http_response_t* resp, long long* started_ns) {
+    char path[BUFSIZE * 2];
+    if (make_resource_path(path, sizeof(path), config->server_dir, resource) != 0) {
+        return -1;
+    }
+    deadline_arm(reaper, deadline, DEADLINE_WRITE, deadline_timeout_ms(config, DEADLINE_WRITE));
+    *started_ns = metrics_now_ns();
+    long long trace_ns = trace_start();
+    int method = http_request_method(&rb->req);
+    int result;
+    if (method == HTTP_METHOD_OTHER) {
+        result = http_response_init_not_implemented(resp);
+    }
+    else if (config->metrics_in_band && strcmp(resource, METRICS_PATH) == 0) {
+        result = metrics_response(config->metrics, resp, keep_alive);
+    }
+    else if (config->archive != NULL) {
+        result = http_response_init_archive(resp, config->archive, resource, &rb->req, keep_alive);
+    }
+    else {
+        result = http_response_init(resp, path, &rb->req, keep_alive, config->cache, config->gzip_cache,
+                                    config->stat_cache);
+    }
+    trace_end(TRACE_PREPARE, trace_ns);
+    if (result != 0) {
+        http_response_cleanup(resp);
+        if (!atomic_load(&deadline->expired)) {
+            fprintf(stderr, "http write failure\n");
+        }
+        return -1;
+    }
+    if (method == HTTP_METHOD_HEAD) {
+        http_response_drop_body(resp);
+    }
+    return 0;
+}
+
+// Cleans up a response begin_answer started, and records it if it all went out
+// sent: 1 if the whole response was sent, 0 if sending failed
+// Returns 0 on success or -1 if the connection should be closed
+int end_answer(request_buffer_t* rb, http_response_t* resp, int sent, long long started_ns,
+               thread_metrics_t* stats, access_log_ring_t* log_ring, deadline_t* deadline) {
+    trace_request_end(&rb->req, resp->status);
+    if (http_response_cleanup(resp) != 0 || !sent) {
+        if (!atomic_load(&deadline->expired)) {
+            fprintf(stderr, "http write failure\n");
+        }
+        return -1;
+    }
+    long long done_ns = metrics_now_ns();
+    metrics_record_response(stats, resp->status, resp->bytes_sent, done_ns - started_ns);
+    metrics_add_busy(stats, done_ns - started_ns);
+    access_log_write(log_ring, &rb->req, resp->status, resp->bytes_sent, started_ns, done_ns);
+    return 0;
+}
+
+// Answers the request read_next_http_request just took out of rb. The write
+// deadline covers the send.
+// Returns 0 on success or -1 if the connection should be closed
+int answer_request(int client_fd, request_buffer_t* rb, const char* resource, int keep_alive,
+                   const server_config_t* config, thread_metrics_t* stats, access_log_ring_t* log_ring,
+                   deadline_reaper_t* reaper, deadline_t* deadline) {
+    http_response_t resp;
+    long long started_ns;
+    if (begin_answer(rb, resource, keep_alive, config, reaper, deadline, &resp, &started_ns) != 0) {
+        return -1;
+    }
+    long long trace_ns = trace_start();
+    int sent = http_response_send_all(client_fd, &resp) == 0;
+    trace_end(TRACE_SEND, trace_ns);
+    return end_answer(rb, &resp, sent, started_ns, stats, log_ring, deadline);
+}
+
+// Answers requests on one client connection until the client closes it, it
+// misses a deadline, or it reaches the per-connection request limit.
+// Pipelined requests are answered one at a time, in the order they arrived.
+void serve_connection(int client_fd, const server_config_t* config, thread_metrics_t* stats,
+                      access_log_ring_t* log_ring, deadline_reaper_t* reaper) {
+    request_buffer_t rb;
+    request_buffer_init(&rb);
+    char resource[HTTP_RESOURCE_MAX];
+    int n_requests = 0;
+    int keep_alive = 1;
+    deadline_t deadline; // if the client misses it, the reaper shuts the socket down and our read or write fails
+    deadline_init(&deadline, client_fd);
+
+    while (keep_alive && keep_going) {
+        // a new connection should send its request right away, a kept-alive one gets longer to start the next
+        int kind = n_requests == 0 ? DEADLINE_HEADER : DEADLINE_IDLE;
+        deadline_arm(reaper, &deadline, kind, deadline_timeout_ms(config, kind));
+        trace_request_begin(config->tracer);
+        // wait in short slices so shutting down doesn't have to sit out the idle timeout
+        int http_ret; //return value for read_next_http_request
+        while ((http_ret = read_next_http_request(client_fd, &rb, resource, &keep_alive, POLL_SLICE_MS)) == HTTP_READ_TIMEOUT) {
+            if (!keep_going) {
+                break;
+            }
+            if (kind == DEADLINE_IDLE && rb.len > 0) { // the next request has started, it gets the header timeout
+                kind = DEADLINE_HEADER;
+                deadline_arm(reaper, &deadline, kind, deadline_timeout_ms(config, kind));
+            }
+        }
+        if (http_ret != HTTP_READ_OK) {
+            if (http_ret == HTTP_READ_ERROR && !atomic_load(&deadline.expired)) {
+                fprintf(stderr, "read_http_request failed\n");
+            }
+            break;
+        }
+
+        n_requests++;
+        if (config->idle_timeout_ms == 0 || n_requests >= config->max_requests) {
+            keep_alive = 0; // tell the client this is the last one
+        }
+        if (answer_request(client_fd, &rb, resource, keep_alive, config, stats, log_ring, reaper, &deadline) != 0) {
+            break;
+        }
+    }
+    deadline_cancel(reaper, &deadline); // the caller is about to close client_fd
+}
+
+// Answers a connection that won't be queued with a 503 and closes it. Whatever
+// the client has sent already is read first: closing with unread data would
+// reset the connection, and the 503 could be lost with it.
+void shed_connection(int client_fd, int retry_after_s) {
+    char discard[BUFSIZE];
+    while (recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    send_http_unavailable(client_fd, retry_after_s);
+    shutdown(client_fd, SHUT_WR);
+    close(client_fd);
+}
+
+// Answers every queued connection that has waited past the admission wait
+// limit with a 503, so nobody sits in the queue for the whole time a worker is
+// tied up with some other client.
+// Returns the ms until the next one would expire, for poll, or -1 if there's
+// nothing waiting (or no limit)
+int shed_expired(connection_queue_t* queue, const admission_config_t* admission, thread_metrics_t* stats) {
+    long long wait_limit = admission_wait_limit(admission);
+    if (wait_limit == 0) {
+        return -1;
+    }
+    long long now_ns = metrics_now_ns();
+    int client_fd;
+    while ((client_fd = connection_dequeue_older(queue, now_ns - wait_limit)) != -1) {
+        shed_connection(client_fd, admission->retry_after_s);
+        metrics_add_shed(stats);
+    }
+    long long waited_ns = connection_queue_oldest_wait(queue, now_ns);
+    if (waited_ns == 0) {
+        return -1;
+    }
+    return (wait_limit - waited_ns) / 1000000 + 1;
+}
+
+// Pins the calling thread to one CPU. Failing isn't fatal, the thread just runs wherever.
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+    }
+}
+
+// Serves one connection a worker took off the queue, unless it waited there
+// so long it should be turned away instead
+void serve_queued(int client_fd, long long enqueued_ns, thread_metrics_t* stats, access_log_ring_t* log_ring,
+                  void* details) {
+    args_t *args = (args_t *)details;
+    long long wait_limit = admission_wait_limit(&args->config->admission);
+    if (wait_limit > 0 && metrics_now_ns() - enqueued_ns >= wait_limit) {
+        shed_connection(client_fd, args->config->admission.retry_after_s); // its client has likely given up anyway
+        metrics_add_shed(stats);
+        return;
+    }
+    trace_queued(args->config->tracer, enqueued_ns);
+    serve_connection(client_fd, args->config, stats, log_ring, args->reaper);
+    close(client_fd);
+    // printf("client closed\n"); // debugging
+}
+
 // THREAD FUNCTION
 void* respond(void* details) {
     // printf("respond entered\n"); // debugging
     int exit_code = 0;
+    if (((args_t *)details)->cpu >= 0) {
+        pin_to_cpu(((args_t *)details)->cpu);
+    }
+    thread_metrics_t* stats = metrics_register(((args_t *)details)->config->metrics, "worker");
+    access_log_ring_t* log_ring = access_log_register(((args_t *)details)->config->access_log);
     while (keep_going) { // Thread will repeatedly pick up connections from queue until server shutdown
         args_t *args = (args_t *)details;
         int client_fd;
-        if ((client_fd = connection_dequeue(args->queue)) == -1) {
+        long long enqueued_ns;
+        if ((client_fd = connection_dequeue_stamped(args->queue, &enqueued_ns)) == -1) {
             fprintf(stderr, "connection_dequeue failed\n");
             exit_code = 1;
             pthread_exit(&exit_code);
@@ -48,127 +363,19 @@ void* respond(void* details) {
             pthread_exit(&exit_code); // Succesfully shut down, exit code 0
         }
         // printf("client fd = %d\n", client_fd); // debugging
-
-        //do stuff with http requests while connected to client.
-        int http_ret; //return value for read_http_request
-        char resource[BUFSIZE]; //probably won't get a file path longer than bufsize long?
-        if ((http_ret = read_http_request(client_fd, resource)) == 0) { //1 is error value for http_read_request
-
-            //http req read in, convert what's stored in resource to a proper file path for use in write_http_response
-            char temp[BUFSIZE]; //temp to store rest of file path so "/server_files" can be appended to the start of resource.
-            strncpy(temp, resource, strlen(resource) + 1);
-            strncpy(resource, args->server_dir, strlen(args->server_dir) + 1);
-            strncat(resource, temp, strlen(temp) + 1); // serve_dir is directory to serve, the "/" should be part of what read_http_request returns
-
-            //printf("%s", resource); //debugging
-
-            //write result
-            if (write_http_response(client_fd, resource) == 1) {//write error
-                fprintf(stderr, "http write failure\n");
-                close(client_fd); //close since can't write to it
-                exit_code = 1;
-                pthread_exit(&exit_code); // returns void *
-            }
-
-            close(client_fd);
-            // printf("client closed\n"); // debugging
-        } //end read_http_request
-        else { // read_http_request failed
-            fprintf(stderr, "read_http_request failed\n");
-            close(client_fd);
-            exit_code = 1;
-            pthread_exit(&exit_code);
-        }
+        serve_queued(client_fd, enqueued_ns, stats, log_ring, details);
     } // end while (keep_going)
 
-    printf("thread exiting\n");
+    // printf("thread exiting\n"); // debugging, would show up in the concurrent test output
     pthread_exit(&exit_code);
 }
 
-int main(int argc, char** argv) {
-    // First command is directory to serve, second command is port
-    if (argc != 3) {
-        printf("Usage: %s <directory> <port>\n", argv[0]);
-        return 1;
-    }
-    // Uncomment the lines below to use these definitions:
-    const char* server_dir = argv[1]; //directory to serve
-    const char* port = argv[2]; //port to bind to
-
-    //install sigint handler before starting setup (similar to in-class example) for tcp server
-    struct sigaction sact;
-    sact.sa_handler = handle_sigint;
-    if (sigfillset(&sact.sa_mask) == -1) { //didn't error check in in-class example but we probably should since there's an error return val
-        perror("sigfillset"); //errno is set so perror.
-        return 1; //not in server loop yet so we can just terminate.
-    }
-    sact.sa_flags = 0; //don't want to restart system calls here- more detail on why in project writeup. thus, no SA_RESTART
-    if (sigaction(SIGINT, &sact, NULL) == -1) { //also want to error check this to make sure handler installed correctly
-        perror("sigaction");
-        return 1; //still terminate relatively normally because not in server loop yet. no cleanup (yet).
-    }
-
-    //malloc and init queue
-    connection_queue_t* q = malloc(sizeof(connection_queue_t));
-    if (q == NULL) {
-        perror("malloc");
-        return 1;
-    }
-    if (connection_queue_init(q) == -1) {
-        fprintf(stderr, "queue initialization failed");
-        free(q);
-        return 1;
-    }
-
-    // CREATE NEW THREADS FOR RESPONDING TO REQUESTS
-    // Block signals in all threads (signal masks get inherited)
-    sigset_t sigset;
-    sigset_t oldset;
-    if (sigfillset(&sigset) != 0) {
-        perror("sigfillset");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
-        return 1;
-    }
-    if (sigprocmask(SIG_BLOCK, &sigset, &oldset) != 0) {
-        perror("sigprocmask");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
-        return 1;
-    }
-
-    int err_code = 0;
-    pthread_t threads[N_THREADS]; 
-    args_t details; // Thread arguments, they're the same for every thread
-    // populate details with thread args
-    details.queue = q;
-    details.server_dir = server_dir;
-    for (int i = 0; i < N_THREADS; i++) {
-        if ((err_code = pthread_create(threads + i, NULL, respond, &details)) != 0) {
-            fprintf(stderr, "pthread_create: %s", strerror(err_code));
-            connection_queue_shutdown(q);
-            connection_queue_free(q);
-            return 1;
-        }
-    }
-
-    // Unblock all signals in the parent
-    if (sigprocmask(SIG_UNBLOCK, &sigset, NULL)) {
-        perror("sigprocmask");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
-        return 1;
-    }
-    // Block the signals that were previously blocked
-    if (sigprocmask(SIG_BLOCK, &oldset, NULL)) {
-        perror("sigprocmask");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
-        return 1;
-    }
-    // end creating thread
-
-
+// Creates a TCP socket listening on 'port' on all interfaces
+// backlog: connections the kernel queues for us before we accept them
+// reuse_port: 1 to set SO_REUSEPORT, so several sockets can share the port and the
+// kernel spreads incoming connections between them
+// Returns the socket's fd on success or -1 on error
+int open_listen_socket(const char* port, int backlog, int reuse_port) {
     //set up hints for getaddrinfo()- remember! server rather than client; use tcp
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints)); //set all fields to 0
@@ -181,44 +388,171 @@ int main(int argc, char** argv) {
     int ret_val = getaddrinfo(NULL, port, &hints, &server); //not sure why we need a double ptr to server, but *shrugs*
     if (ret_val != 0) { //error, setup failed.
         fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(ret_val)); //pretty much only need ret_val as a glorified errno, but we do need it.
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
-        return 1; //still not a ton of cleanup because we failed in setup.
+        return -1;
     }
 
     //set up socket
     int sock_fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
     if (sock_fd == -1) {//socket setup failed
         perror("socket");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
         freeaddrinfo(server); //freeaddrinfo MUST be done, similar to free with malloc
-        return 1;
+        return -1;
+    }
+
+    int one = 1;
+    if (reuse_port && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("setsockopt");
+        freeaddrinfo(server);
+        close(sock_fd);
+        return -1;
     }
 
     //bind socket to receive at specific port so clients know where to connect.
     if (bind(sock_fd, server->ai_addr, server->ai_addrlen) == -1) {//more error handling yay \o/
         perror("bind");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
         freeaddrinfo(server);
-        close(sock_fd); //don't need to have nested error branches for the sake of projects. a real server might have one but we don't need it.
-        return 1;
+        close(sock_fd);
+        return -1;
     }
     freeaddrinfo(server); //don't need server's addrinfo now that we're set up.
 
     //designate socket as server socket
-    if (listen(sock_fd, LISTEN_QUEUE_LEN) == -1) { //LISTEN_QUEUE_LEN is the num clients that can be kept waiting for a server connection I think
+    if (listen(sock_fd, backlog) == -1) { //backlog is the num clients that can be kept waiting for a server connection
         perror("listen");
-        connection_queue_shutdown(q);
-        connection_queue_free(q);
         close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+// Runs the server with epoll event loops instead of the thread pool
+// Returns 0 on success or 1 on error
+int serve_epoll(const server_config_t* config, const char* port) {
+    // every idle connection holds an fd, so let ourselves have as many as we're allowed
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            perror("setrlimit"); // not fatal, we just top out sooner
+        }
+    }
+
+    int sock_fd = open_listen_socket(port, config->listen_backlog, 0);
+    if (sock_fd == -1) {
+        return 1;
+    }
+    int ret_val = 0;
+    if (event_loop_serve(sock_fd, config, &keep_going) != 0) {
+        fprintf(stderr, "event_loop_serve failed\n");
+        ret_val = 1;
+    }
+    if (close(sock_fd) == -1) {
+        perror("close");
+        ret_val = 1;
+    }
+    return ret_val;
+}
+
+// Runs the server with io_uring, or with epoll event loops if this kernel can't
+// Returns 0 on success or 1 on error
+int serve_uring(const server_config_t* config, const char* port) {
+    int sock_fd = open_listen_socket(port, config->listen_backlog, 0);
+    if (sock_fd == -1) {
+        return 1;
+    }
+    int ret_val = 0;
+    int result = uring_loop_serve(sock_fd, config, &keep_going);
+    if (result == URING_UNAVAILABLE) { // old kernel, seccomp, or io_uring switched off
+        fprintf(stderr, "falling back to epoll\n");
+        result = event_loop_serve(sock_fd, config, &keep_going);
+    }
+    if (result != 0) {
+        fprintf(stderr, "uring_loop_serve failed\n");
+        ret_val = 1;
+    }
+    if (close(sock_fd) == -1) {
+        perror("close");
+        ret_val = 1;
+    }
+    return ret_val;
+}
+
+// Runs the server with a pool of blocking workers fed by a connection queue, sized to the queue wait
+// Returns 0 on success or 1 on error
+int serve_threads(const server_config_t* config, const char* port) {
+
+    //malloc and init queue
+    connection_queue_t* q = malloc(sizeof(connection_queue_t));
+    if (q == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int init_result;
+    if (config->queue_kind == QUEUE_LOCKFREE) {
+        init_result = connection_queue_init_lockfree(q, config->queue_capacity);
+    }
+    else {
+        init_result = connection_queue_init(q);
+    }
+    if (init_result == -1) {
+        fprintf(stderr, "queue initialization failed");
+        free(q);
+        return 1;
+    }
+    deadline_reaper_t reaper;
+    if (deadline_reaper_start(&reaper, config->metrics) != 0) {
+        connection_queue_free(q);
+        return 1;
+    }
+    metrics_watch_queue(config->metrics, q);
+    thread_metrics_t* stats = metrics_register(config->metrics, "acceptor");
+    admission_t admission;
+    admission_init(&admission, &config->admission);
+
+    // CREATE NEW THREADS FOR RESPONDING TO REQUESTS
+    // The pool blocks all signals in its threads, so SIGINT still lands here
+    args_t details; // Thread arguments, they're the same for every thread
+    // populate details with thread args
+    details.queue = q;
+    details.config = config;
+    details.cpu = -1;
+    details.reaper = &reaper;
+    worker_pool_t pool;
+    if (worker_pool_start(&pool, &config->pool, q, serve_queued, &details, config->metrics, config->access_log) != 0) {
+        deadline_reaper_stop(&reaper);
+        metrics_unwatch_queue(config->metrics, q);
+        connection_queue_free(q);
         return 1;
     }
+    // end creating thread
+
+
+    int sock_fd = open_listen_socket(port, config->listen_backlog, 0);
+    if (sock_fd == -1) {
+        worker_pool_stop(&pool);
+        deadline_reaper_stop(&reaper);
+        metrics_unwatch_queue(config->metrics, q);
+        connection_queue_free(q);
+        return 1; //still not a ton of cleanup because we failed in setup.
+    }
 
     while (keep_going) { //server loop for receiving and servicing requests
         //wait to receive a req from a client; don't bother saving client address info because this is tcp and we have an active connection
         // printf("Waiting for a client to connect\n"); //not strictly necessary, but might be nice for debugging later or for matching test output >_>
+        // while connections are queued, wake up in time to turn away any that wait too long
+        int timeout_ms = shed_expired(q, &config->admission, stats);
+        if (timeout_ms >= 0) {
+            struct pollfd pfd = { .fd = sock_fd, .events = POLLIN };
+            int ready = poll(&pfd, 1, timeout_ms);
+            if (ready == -1 && errno != EINTR) {
+                perror("poll");
+                code = 1;
+                break;
+            }
+            if (ready <= 0) {
+                continue; // SIGINT is noticed by the loop condition
+            }
+        }
         int client_fd = accept(sock_fd, NULL, NULL); //NULLs since we don't need to save address info
         if (client_fd == -1) {
             if (errno != EINTR) {
@@ -231,11 +565,21 @@ int main(int argc, char** argv) {
                 break; //SIGINT received, terminating loop to shut down server.
             }
         }
+        // responses to pipelined requests shouldn't sit around waiting for the client's ACKs
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        long long enqueue_ns = metrics_now_ns();
+        if (!admission_admit(&admission, q, enqueue_ns)) { // overloaded, a quick 503 beats a long wait
+            shed_connection(client_fd, config->admission.retry_after_s);
+            metrics_add_shed(stats);
+            continue;
+        }
         if (connection_enqueue(q, client_fd) == -1) {
             fprintf(stderr, "connection_enqueue failed\n");
             code = 1;
             break;
         }
+        metrics_add_enqueue(stats, metrics_now_ns() - enqueue_ns); // nonzero only while every worker is busy
 
     }//end accept loop
 
@@ -243,19 +587,15 @@ int main(int argc, char** argv) {
     // printf("cleanup\n"); // debugging
     //cleanup; reached even if sigint thanks to our handler.
     // even if one fails, we should clean up the rest
-    if (connection_queue_shutdown(q) != 0) {
-        fprintf(stderr, "connection_queue_shutdown failed\n");
+    // shuts the queue down and waits for all threads before destroying mutex variables and freeing memory
+    if (worker_pool_stop(&pool) != 0) {
         code = 1;
     }
-    // wait for all threads before destroying mutex variables and freeing memory
-    for (int i = 0; i < N_THREADS; i++) {
-        // printf("waiting on thread %d\n", i); // debugging
-        if ((err_code = pthread_join(threads[i], NULL)) != 0) {
-            fprintf(stderr, "pthread_join: %s", strerror(err_code));
-            code = 1; // error return val
-        }
-    }
     // printf("done waiting for threads\n"); // debugging
+    if (deadline_reaper_stop(&reaper) != 0) {
+        code = 1;
+    }
+    metrics_unwatch_queue(config->metrics, q);
     if (connection_queue_free(q) != 0) {
         fprintf(stderr, "connection_queue_free failed\n");
         code = 1;
@@ -267,4 +607,1416 @@ int main(int argc, char** argv) {
     }
 
     return code;
-}
\ No newline at end of file
+}
+
+// Work-stealing dispatch: gives a connection its first worker
+// Returns the connection, or NULL on error
+steal_conn_t* new_steal_conn(steal_worker_t* home, int client_fd) {
+    steal_conn_t* conn = malloc(sizeof(steal_conn_t));
+    if (conn == NULL) {
+        perror("malloc");
+        close(client_fd);
+        return NULL;
+    }
+    conn->fd = client_fd;
+    conn->home = home->index;
+    conn->registered = 0;
+    conn->waiting_kind = -1;
+    conn->n_requests = 0;
+    request_buffer_init(&conn->rb);
+    deadline_init(&conn->deadline, client_fd);
+    conn->prev = NULL;
+    pthread_mutex_lock(&home->lock);
+    conn->next = home->conns;
+    if (home->conns != NULL) {
+        home->conns->prev = conn;
+    }
+    home->conns = conn;
+    pthread_mutex_unlock(&home->lock);
+    return conn;
+}
+
+// Work-stealing dispatch: disarms, unlinks, closes and frees a connection
+void close_steal_conn(steal_pool_t* pool, steal_conn_t* conn) {
+    steal_worker_t* home = &pool->workers[conn->home];
+    deadline_cancel(&pool->reaper, &conn->deadline);
+    pthread_mutex_lock(&home->lock);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        home->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&home->lock);
+    close(conn->fd); // takes it out of home's epoll set too
+    free(conn);
+}
+
+// Work-stealing dispatch: waits in home's epoll set until the client sends
+// more. Home is where the connection was last served, so that's usually who
+// picks it up again, with its request buffer and file cache entries still
+// warm; anyone else only gets it by stealing.
+// Returns 0 on success or -1 if the connection should be closed
+int park_steal_conn(steal_pool_t* pool, steal_conn_t* conn) {
+    // a partial request keeps the header deadline it started with, or a slow client could stretch it forever
+    int kind = conn->n_requests == 0 || conn->rb.len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE;
+    if (kind != conn->waiting_kind) {
+        deadline_arm(&pool->reaper, &conn->deadline, kind, deadline_timeout_ms(pool->config, kind));
+        conn->waiting_kind = kind;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    int op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->registered = 1;
+    // once this returns another worker may already have it, so it's the last thing we touch
+    if (epoll_ctl(pool->workers[conn->home].epoll_fd, op, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Work-stealing dispatch: answers every request the connection has ready,
+// then parks it until it has another, or closes it
+void serve_steal_conn(steal_pool_t* pool, steal_conn_t* conn, thread_metrics_t* stats, access_log_ring_t* log_ring) {
+    const server_config_t* config = pool->config;
+    char resource[HTTP_RESOURCE_MAX];
+    int keep_alive = 1;
+    while (keep_going) {
+        trace_request_begin(config->tracer);
+        // never waits: a request that isn't all here yet is finished off by whoever gets the connection next
+        int http_ret = read_next_http_request(conn->fd, &conn->rb, resource, &keep_alive, 0);
+        if (http_ret == HTTP_READ_TIMEOUT) {
+            if (!atomic_load(&conn->deadline.expired) && park_steal_conn(pool, conn) == 0) {
+                return;
+            }
+            break;
+        }
+        if (http_ret != HTTP_READ_OK) {
+            if (http_ret == HTTP_READ_ERROR && !atomic_load(&conn->deadline.expired)) {
+                fprintf(stderr, "read_http_request failed\n");
+            }
+            break;
+        }
+        conn->n_requests++;
+        if (config->idle_timeout_ms == 0 || conn->n_requests >= config->max_requests) {
+            keep_alive = 0; // tell the client this is the last one
+        }
+        conn->waiting_kind = -1; // the write deadline replaces whatever was armed
+        if (answer_request(conn->fd, &conn->rb, resource, keep_alive, config, stats, log_ring,
+                           &pool->reaper, &conn->deadline) != 0 || !keep_alive) {
+            break;
+        }
+    }
+    close_steal_conn(pool, conn);
+}
+
+// Work-stealing dispatch: moves connections that have something to read from
+// a worker's epoll set onto the deque of the worker doing the looking
+// timeout_ms: How long to wait for one, 0 to only take what's ready
+void collect_parked(steal_worker_t* self, steal_worker_t* from, int timeout_ms) {
+    struct epoll_event events[STEAL_BATCH];
+    int n_events = epoll_wait(from->epoll_fd, events, STEAL_BATCH, timeout_ms);
+    for (int i = 0; i < n_events; i++) {
+        if (events[i].data.ptr == from) { // the acceptor's wakeup, the inbox gets checked next anyway
+            uint64_t count;
+            if (from == self && read(self->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("read");
+            }
+            continue;
+        }
+        steal_conn_t* conn = (steal_conn_t*) events[i].data.ptr;
+        if (steal_deque_push(&self->deque, conn) == -1) { // full, let it come up again next time
+            park_steal_conn(self->pool, conn);
+        }
+    }
+}
+
+// Work-stealing dispatch: finds the next connection to serve. A worker's own
+// deque comes first (newest first, for the cache), then its parked
+// connections and its inbox, and only then its peers, oldest first.
+// Returns the connection, or NULL if there's nothing anywhere
+steal_conn_t* find_steal_work(steal_worker_t* self, thread_metrics_t* stats) {
+    steal_pool_t* pool = self->pool;
+    steal_conn_t* conn = steal_deque_pop(&self->deque);
+    if (conn != NULL) {
+        return conn;
+    }
+    collect_parked(self, self, 0);
+    if ((conn = steal_deque_pop(&self->deque)) != NULL) {
+        return conn;
+    }
+    int client_fd = lockfree_dequeue_older(self->inbox, LLONG_MAX);
+    if (client_fd != -1) {
+        return new_steal_conn(self, client_fd);
+    }
+    for (int i = 1; i < pool->n_workers; i++) {
+        steal_worker_t* victim = &pool->workers[(self->index + i) % pool->n_workers];
+        void* item;
+        int result;
+        while ((result = steal_deque_steal(&victim->deque, &item)) == -1) {
+        }
+        if (result == 1) {
+            metrics_add_steal(stats);
+            return (steal_conn_t*) item;
+        }
+        if (!atomic_load_explicit(&victim->busy, memory_order_relaxed)) {
+            continue; // it's about to take its own inbox, it was woken for it
+        }
+        if ((client_fd = lockfree_dequeue_older(victim->inbox, LLONG_MAX)) != -1) {
+            metrics_add_steal(stats);
+            return new_steal_conn(self, client_fd); // it parks with us from now on
+        }
+    }
+    // a busy worker's parked connections shouldn't have to wait for it
+    for (int i = 1; i < pool->n_workers; i++) {
+        steal_worker_t* victim = &pool->workers[(self->index + i) % pool->n_workers];
+        if (!atomic_load_explicit(&victim->busy, memory_order_relaxed)) {
+            continue; // it's waiting on its epoll set, it'll get them itself
+        }
+        collect_parked(self, victim, 0);
+        if ((conn = steal_deque_pop(&self->deque)) != NULL) {
+            metrics_add_steal(stats);
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+// THREAD FUNCTION for work-stealing dispatch
+void* steal_respond(void* arg) {
+    steal_worker_t* self = (steal_worker_t*) arg;
+    thread_metrics_t* stats = metrics_register(self->pool->config->metrics, "worker");
+    access_log_ring_t* log_ring = access_log_register(self->pool->config->access_log);
+    while (keep_going) {
+        steal_conn_t* conn = find_steal_work(self, stats);
+        if (conn == NULL) {
+            // sleep until a parked connection or the acceptor needs us, or it's time to look at the peers again
+            collect_parked(self, self, STEAL_IDLE_MS);
+            continue;
+        }
+        atomic_store_explicit(&self->busy, 1, memory_order_relaxed);
+        serve_steal_conn(self->pool, conn, stats, log_ring);
+        atomic_store_explicit(&self->busy, 0, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+// Work-stealing dispatch: frees one worker's queues and closes every
+// connection still waiting in them. Its thread must be done.
+void free_steal_worker(steal_pool_t* pool, steal_worker_t* worker) {
+    if (worker->inbox != NULL) {
+        int client_fd;
+        while ((client_fd = lockfree_dequeue_older(worker->inbox, LLONG_MAX)) != -1) {
+            close(client_fd);
+        }
+        lockfree_queue_free(worker->inbox);
+        free(worker->inbox);
+    }
+    while (worker->conns != NULL) {
+        close_steal_conn(pool, worker->conns);
+    }
+    if (worker->epoll_fd != -1) {
+        close(worker->epoll_fd);
+    }
+    if (worker->wake_fd != -1) {
+        close(worker->wake_fd);
+    }
+    steal_deque_free(&worker->deque);
+    pthread_mutex_destroy(&worker->lock);
+}
+
+// Work-stealing dispatch: sets up one worker's deque, inbox and epoll set
+// Returns 0 on success or -1 on error, after cleaning up
+int init_steal_worker(steal_pool_t* pool, int index) {
+    steal_worker_t* worker = &pool->workers[index];
+    worker->index = index;
+    worker->pool = pool;
+    worker->conns = NULL;
+    atomic_init(&worker->busy, 0);
+    worker->epoll_fd = -1;
+    worker->wake_fd = -1;
+    worker->inbox = NULL;
+    if (steal_deque_init(&worker->deque, STEAL_DEQUE_SLOTS) != 0) {
+        return -1;
+    }
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->inbox = aligned_alloc(CACHE_LINE, sizeof(lockfree_queue_t));
+    if (worker->inbox == NULL || lockfree_queue_init(worker->inbox, pool->config->queue_capacity) != 0) {
+        perror("aligned_alloc");
+        free(worker->inbox);
+        worker->inbox = NULL;
+        free_steal_worker(pool, worker);
+        return -1;
+    }
+    worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = worker;
+    if (worker->epoll_fd == -1 || worker->wake_fd == -1 ||
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) == -1) {
+        perror("epoll");
+        free_steal_worker(pool, worker);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs the server with work-stealing dispatch: the acceptor deals connections
+// round-robin to per-worker inboxes, each worker serves from its own deque
+// and steals from its peers when it runs dry. A kept-alive connection waits
+// for its next request in the epoll set of the worker that last served it
+// instead of holding a worker, and goes back to that worker's deque when the
+// request arrives.
+// Returns 0 on success or 1 on error
+int serve_stealing(const server_config_t* config, const char* port) {
+    steal_pool_t pool;
+    pool.config = config;
+    pool.n_workers = config->pool.min_workers;
+    pool.workers = malloc(pool.n_workers * sizeof(steal_worker_t));
+    if (pool.workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (deadline_reaper_start(&pool.reaper, config->metrics) != 0) {
+        free(pool.workers);
+        return 1;
+    }
+    int n_ready = 0; // workers set up, and then started
+    while (n_ready < pool.n_workers && init_steal_worker(&pool, n_ready) == 0) {
+        n_ready++;
+    }
+    int ret_val = n_ready == pool.n_workers ? 0 : 1;
+    int n_started = 0;
+    if (ret_val == 0) {
+        sigset_t sigset;
+        sigset_t oldset;
+        sigfillset(&sigset);
+        pthread_sigmask(SIG_BLOCK, &sigset, &oldset); // SIGINT has to land on this thread
+        for (; n_started < pool.n_workers; n_started++) {
+            int err_code = pthread_create(&pool.workers[n_started].thread, NULL, steal_respond, &pool.workers[n_started]);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+                ret_val = 1;
+                break;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    }
+    int sock_fd = -1;
+    if (ret_val == 0 && (sock_fd = open_listen_socket(port, config->listen_backlog, 0)) == -1) {
+        ret_val = 1;
+    }
+
+    thread_metrics_t* stats = metrics_register(config->metrics, "acceptor");
+    int next = 0;
+    while (ret_val == 0 && keep_going) {
+        int client_fd = accept(sock_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+                ret_val = 1;
+            }
+            break; // SIGINT lands here
+        }
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        long long enqueue_ns = metrics_now_ns();
+        steal_worker_t* worker = &pool.workers[next];
+        next = (next + 1) % pool.n_workers;
+        lockfree_enqueue(worker->inbox, client_fd, enqueue_ns);
+        uint64_t wake = 1;
+        if (write(worker->wake_fd, &wake, sizeof(wake)) == -1) {
+            perror("write");
+        }
+        metrics_add_enqueue(stats, metrics_now_ns() - enqueue_ns);
+    }
+
+    keep_going = 0; // in case we stopped on an error
+    for (int i = 0; i < n_ready; i++) {
+        lockfree_queue_shutdown(pool.workers[i].inbox);
+    }
+    for (int i = 0; i < n_started; i++) {
+        int err_code = pthread_join(pool.workers[i].thread, NULL);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+            ret_val = 1;
+        }
+    }
+    for (int i = 0; i < n_ready; i++) {
+        free_steal_worker(&pool, &pool.workers[i]);
+    }
+    if (deadline_reaper_stop(&pool.reaper) != 0) {
+        ret_val = 1;
+    }
+    free(pool.workers);
+    if (sock_fd != -1 && close(sock_fd) == -1) {
+        perror("close");
+        ret_val = 1;
+    }
+    return ret_val;
+}
+
+// Size-ordered dispatch: where a response of some size goes in line. Its key
+// is when its request went in line plus a delay that grows with the size but
+// never reaches the longest delay, so a small response gets ahead of a big one
+// that came in a little earlier, but nothing that came in more than the
+// longest delay later ever gets ahead of it.
+long long sjf_key(const server_config_t* config, long long ready_ns, off_t bytes) {
+    return ready_ns + (long long) ((double) config->sjf_max_delay_ns * bytes / (bytes + SJF_HALF_DELAY_BYTES));
+}
+
+// Size-ordered dispatch: guesses how big the response to a connection's next
+// request will be, from what the client has sent of it so far, without
+// taking any of it off the socket. Files the cache doesn't hold are stat'ed.
+// Returns the expected body size, 0 if the request line isn't all here yet
+// (a worker finds out what's going on quickly), or -1 if nothing has arrived
+off_t sjf_estimate(sjf_pool_t* pool, sjf_conn_t* conn) {
+    char buf[HTTP_REQUEST_MAX];
+    int len = conn->rb.len - conn->rb.request_len; // pipelined bytes behind the last answered request
+    memcpy(buf, conn->rb.data + conn->rb.request_len, len);
+    ssize_t peeked = recv(conn->fd, buf + len, sizeof(buf) - len, MSG_PEEK | MSG_DONTWAIT);
+    if (peeked > 0) {
+        len += peeked;
+    }
+    if (len == 0) {
+        return -1;
+    }
+    http_request_t req;
+    http_parser_init(&req);
+    if (http_parse(&req, buf, len, sizeof(buf)) == -1 || req.state == HTTP_PARSE_REQUEST_LINE ||
+        req.path.len >= HTTP_RESOURCE_MAX) {
+        return 0;
+    }
+    char resource[HTTP_RESOURCE_MAX];
+    memcpy(resource, req.path.start, req.path.len);
+    resource[req.path.len] = '\0';
+    if (pool->config->archive != NULL) {
+        const archive_member_t* member = archive_find(pool->config->archive, resource);
+        return member != NULL ? member->data.size : 0;
+    }
+    char path[BUFSIZE * 2];
+    if (make_resource_path(path, sizeof(path), pool->config->server_dir, resource) != 0) {
+        return 0;
+    }
+    off_t size = pool->config->cache != NULL ? file_cache_size(pool->config->cache, path) : -1;
+    struct stat stat_buf;
+    const char* file_type;
+    int known = pool->config->stat_cache != NULL ? stat_cache_get(pool->config->stat_cache, path, &stat_buf, &file_type)
+                                                 : STAT_UNKNOWN;
+    if (size == -1 && known != STAT_UNKNOWN) {
+        size = known == STAT_FOUND ? stat_buf.st_size : 0;
+    }
+    if (size == -1) {
+        size = stat(path, &stat_buf) == 0 ? stat_buf.st_size : 0; // a 404 is tiny
+    }
+    return size;
+}
+
+// Size-ordered dispatch: starts tracking a new connection
+// Returns the connection, or NULL on error
+sjf_conn_t* new_sjf_conn(sjf_pool_t* pool, int client_fd) {
+    sjf_conn_t* conn = malloc(sizeof(sjf_conn_t));
+    if (conn == NULL) {
+        perror("malloc");
+        close(client_fd);
+        return NULL;
+    }
+    conn->fd = client_fd;
+    conn->registered = 0;
+    conn->waiting_kind = -1;
+    conn->n_requests = 0;
+    conn->responding = 0;
+    request_buffer_init(&conn->rb);
+    deadline_init(&conn->deadline, client_fd);
+    conn->prev = NULL;
+    pthread_mutex_lock(&pool->lock);
+    conn->next = pool->conns;
+    if (pool->conns != NULL) {
+        pool->conns->prev = conn;
+    }
+    pool->conns = conn;
+    pthread_mutex_unlock(&pool->lock);
+    return conn;
+}
+
+// Size-ordered dispatch: drops a response partway out, disarms, unlinks,
+// closes and frees a connection
+void close_sjf_conn(sjf_pool_t* pool, sjf_conn_t* conn) {
+    if (conn->responding) {
+        http_response_cleanup(&conn->resp);
+    }
+    deadline_cancel(&pool->reaper, &conn->deadline);
+    pthread_mutex_lock(&pool->lock);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        pool->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    close(conn->fd); // takes it out of the epoll set too
+    free(conn);
+}
+
+// Size-ordered dispatch: waits in the acceptor's epoll set until the client
+// sends more
+// Returns 0 on success or -1 if the connection should be closed
+int park_sjf_conn(sjf_pool_t* pool, sjf_conn_t* conn) {
+    // a partial request keeps the header deadline it started with, or a slow client could stretch it forever
+    int kind = conn->n_requests == 0 || conn->rb.len > conn->rb.request_len ? DEADLINE_HEADER : DEADLINE_IDLE;
+    if (kind != conn->waiting_kind) {
+        deadline_arm(&pool->reaper, &conn->deadline, kind, deadline_timeout_ms(pool->config, kind));
+        conn->waiting_kind = kind;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    int op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->registered = 1;
+    // once this returns the acceptor may already have it, so it's the last thing we touch
+    if (epoll_ctl(pool->epoll_fd, op, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Size-ordered dispatch: puts a connection with a request (or at least the
+// start of one) in line for a worker, by how big its response looks
+// Returns 0 on success or -1 if the connection should be closed
+int queue_sjf_conn(sjf_pool_t* pool, sjf_conn_t* conn) {
+    if (conn->waiting_kind != DEADLINE_HEADER) { // its request has started, waiting in line counts against it
+        deadline_arm(&pool->reaper, &conn->deadline, DEADLINE_HEADER, deadline_timeout_ms(pool->config, DEADLINE_HEADER));
+        conn->waiting_kind = DEADLINE_HEADER;
+    }
+    off_t bytes = sjf_estimate(pool, conn);
+    conn->ready_ns = metrics_now_ns();
+    return priority_queue_push(&pool->queue, conn, sjf_key(pool->config, conn->ready_ns, bytes < 0 ? 0 : bytes));
+}
+
+// Size-ordered dispatch: reads the request at the front of a connection and
+// starts its response
+// Returns 1 if there's a response to send, or 0 if the connection was parked
+// or closed instead
+int start_sjf_response(sjf_pool_t* pool, sjf_conn_t* conn) {
+    const server_config_t* config = pool->config;
+    char resource[HTTP_RESOURCE_MAX];
+    // never waits: a request that isn't all here yet goes back to the acceptor until it is
+    int http_ret = read_next_http_request(conn->fd, &conn->rb, resource, &conn->keep_alive, 0);
+    if (http_ret == HTTP_READ_TIMEOUT) {
+        if (!atomic_load(&conn->deadline.expired) && park_sjf_conn(pool, conn) == 0) {
+            return 0;
+        }
+    }
+    else if (http_ret != HTTP_READ_OK) {
+        if (http_ret == HTTP_READ_ERROR && !atomic_load(&conn->deadline.expired)) {
+            fprintf(stderr, "read_http_request failed\n");
+        }
+    }
+    else {
+        conn->n_requests++;
+        if (config->idle_timeout_ms == 0 || conn->n_requests >= config->max_requests) {
+            conn->keep_alive = 0; // tell the client this is the last one
+        }
+        conn->waiting_kind = -1; // the write deadline replaces whatever was armed
+        if (begin_answer(&conn->rb, resource, conn->keep_alive, config, &pool->reaper, &conn->deadline,
+                         &conn->resp, &conn->started_ns) == 0) {
+            conn->responding = 1;
+            return 1;
+        }
+    }
+    close_sjf_conn(pool, conn);
+    return 0;
+}
+
+// Size-ordered dispatch: after a response, queues the connection's next
+// request if it was pipelined in already, parks it to wait for one, or closes it
+void finish_sjf_response(sjf_pool_t* pool, sjf_conn_t* conn, int sent, thread_metrics_t* stats,
+                         access_log_ring_t* log_ring) {
+    conn->responding = 0;
+    if (end_answer(&conn->rb, &conn->resp, sent, conn->started_ns, stats, log_ring, &conn->deadline) != 0 ||
+        !conn->keep_alive || !keep_going) {
+        close_sjf_conn(pool, conn);
+        return;
+    }
+    // a request that's already in rb won't make the socket readable again
+    int result = conn->rb.len > conn->rb.request_len ? queue_sjf_conn(pool, conn) : park_sjf_conn(pool, conn);
+    if (result != 0) {
+        close_sjf_conn(pool, conn);
+    }
+}
+
+// THREAD FUNCTION for size-ordered dispatch: takes whichever connection is
+// at the front of the line and sends its response a slice at a time. After
+// every slice of a big one it checks the line again, and if something with a
+// smaller key has come in, puts the rest back in line (keyed by what's left to
+// send) and takes that instead.
+void* sjf_respond(void* arg) {
+    sjf_pool_t* pool = (sjf_pool_t*) arg;
+    thread_metrics_t* stats = metrics_register(pool->config->metrics, "worker");
+    access_log_ring_t* log_ring = access_log_register(pool->config->access_log);
+    sjf_conn_t* conn = NULL;
+    while (conn != NULL || (conn = priority_queue_pop(&pool->queue)) != NULL) {
+        if (!conn->responding && !start_sjf_response(pool, conn)) {
+            conn = NULL;
+            continue;
+        }
+        int result = http_response_send_some(conn->fd, &conn->resp, SJF_CHUNK);
+        if (result == HTTP_SEND_MORE) {
+            off_t left = conn->resp.remaining + conn->resp.in_pipe;
+            sjf_conn_t* next = priority_queue_exchange(&pool->queue, conn, sjf_key(pool->config, conn->ready_ns, left));
+            if (next != conn) {
+                metrics_add_yield(stats);
+            }
+            conn = next;
+            continue;
+        }
+        finish_sjf_response(pool, conn, result == HTTP_SEND_DONE, stats, log_ring);
+        conn = NULL;
+    }
+    return NULL;
+}
+
+// Size-ordered dispatch: accepts every connection waiting on the listening
+// socket, putting the ones that have sent a request already straight in line
+// Returns 0 on success or -1 on error
+int accept_sjf_conns(sjf_pool_t* pool, int sock_fd, thread_metrics_t* stats) {
+    while (1) {
+        int client_fd = accept(sock_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                return 0;
+            }
+            perror("accept");
+            return -1;
+        }
+        // the listening socket is non-blocking, but workers block on the connections
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        long long enqueue_ns = metrics_now_ns();
+        sjf_conn_t* conn = new_sjf_conn(pool, client_fd);
+        if (conn == NULL) {
+            continue;
+        }
+        int result;
+        if (sjf_estimate(pool, conn) == -1) { // nothing to go on yet, wait for the request
+            result = park_sjf_conn(pool, conn);
+        }
+        else {
+            result = queue_sjf_conn(pool, conn);
+            metrics_add_enqueue(stats, metrics_now_ns() - enqueue_ns);
+        }
+        if (result != 0) {
+            close_sjf_conn(pool, conn);
+        }
+    }
+}
+
+// Runs the server with size-ordered dispatch: the acceptor reads the request
+// line of every request as it arrives (without taking it off the socket),
+// looks up how big the file is, and puts the connection in a priority queue
+// keyed by that, with aging so big responses aren't starved. Workers send big
+// bodies a slice at a time, giving way to smaller responses in between. A
+// kept-alive connection waits for its next request in the acceptor's epoll
+// set instead of holding a worker.
+// Returns 0 on success or 1 on error
+int serve_sjf(const server_config_t* config, const char* port) {
+    sjf_pool_t pool;
+    pool.config = config;
+    pool.conns = NULL;
+    pool.n_workers = config->pool.min_workers;
+    pool.workers = malloc(pool.n_workers * sizeof(pthread_t));
+    if (pool.workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (priority_queue_init(&pool.queue, config->queue_capacity) != 0) {
+        free(pool.workers);
+        return 1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    int ret_val = 0;
+    int reaper_started = 0;
+    int sock_fd = -1;
+    pool.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool.epoll_fd == -1) {
+        perror("epoll_create1");
+        ret_val = 1;
+    }
+    else if (deadline_reaper_start(&pool.reaper, config->metrics) != 0) {
+        ret_val = 1;
+    }
+    else {
+        reaper_started = 1;
+    }
+    if (ret_val == 0 && (sock_fd = open_listen_socket(port, config->listen_backlog, 0)) == -1) {
+        ret_val = 1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // marks the listening socket
+    if (ret_val == 0 && (fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+                         epoll_ctl(pool.epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) == -1)) {
+        perror("epoll_ctl");
+        ret_val = 1;
+    }
+    int n_started = 0;
+    if (ret_val == 0) {
+        sigset_t sigset;
+        sigset_t oldset;
+        sigfillset(&sigset);
+        pthread_sigmask(SIG_BLOCK, &sigset, &oldset); // SIGINT has to land on this thread
+        for (; n_started < pool.n_workers; n_started++) {
+            int err_code = pthread_create(&pool.workers[n_started], NULL, sjf_respond, &pool);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+                ret_val = 1;
+                break;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    }
+
+    thread_metrics_t* stats = metrics_register(config->metrics, "acceptor");
+    struct epoll_event events[SJF_BATCH];
+    while (ret_val == 0 && keep_going) {
+        int n_events = epoll_wait(pool.epoll_fd, events, SJF_BATCH, -1);
+        if (n_events == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                ret_val = 1;
+            }
+            continue; // SIGINT is noticed by the loop condition
+        }
+        for (int i = 0; i < n_events; i++) {
+            sjf_conn_t* conn = (sjf_conn_t*) events[i].data.ptr;
+            if (conn == NULL) {
+                if (accept_sjf_conns(&pool, sock_fd, stats) != 0) {
+                    ret_val = 1;
+                }
+                continue;
+            }
+            long long enqueue_ns = metrics_now_ns();
+            if (queue_sjf_conn(&pool, conn) != 0) {
+                close_sjf_conn(&pool, conn);
+                continue;
+            }
+            metrics_add_enqueue(stats, metrics_now_ns() - enqueue_ns);
+        }
+    }
+
+    keep_going = 0; // in case we stopped on an error
+    priority_queue_shutdown(&pool.queue); // workers finish the response they're on, then leave
+    for (int i = 0; i < n_started; i++) {
+        int err_code = pthread_join(pool.workers[i], NULL);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+            ret_val = 1;
+        }
+    }
+    while (pool.conns != NULL) { // parked, in line, or set aside partway through a response
+        close_sjf_conn(&pool, pool.conns);
+    }
+    if (reaper_started && deadline_reaper_stop(&pool.reaper) != 0) {
+        ret_val = 1;
+    }
+    if (sock_fd != -1 && close(sock_fd) == -1) {
+        perror("close");
+        ret_val = 1;
+    }
+    if (pool.epoll_fd != -1) {
+        close(pool.epoll_fd);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    priority_queue_free(&pool.queue);
+    free(pool.workers);
+    return ret_val;
+}
+
+// Sharded mode: accepts connections on one shard's listener and hands them to the
+// shard's own workers. Polls in short slices so it notices shutdown without a signal.
+// Returns 0 on success or 1 on error
+int accept_connections(shard_t* shard) {
+    struct pollfd pfd = { .fd = shard->sock_fd, .events = POLLIN };
+    thread_metrics_t* stats = metrics_register(shard->args.config->metrics, "acceptor");
+    admission_t admission;
+    admission_init(&admission, &shard->args.config->admission);
+    while (keep_going) {
+        int timeout_ms = shed_expired(shard->queue, &shard->args.config->admission, stats);
+        if (timeout_ms < 0 || timeout_ms > POLL_SLICE_MS) {
+            timeout_ms = POLL_SLICE_MS;
+        }
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == -1) {
+            if (errno == EINTR) { continue; }
+            perror("poll");
+            return 1;
+        }
+        // the listener is non-blocking, so take everything that's waiting
+        while (ready > 0 && keep_going) {
+            int client_fd = accept4(shard->sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                if (errno == ECONNABORTED || errno == EPROTO) { // client gave up before we got to it
+                    continue;
+                }
+                perror("accept4");
+                return 1;
+            }
+            int one = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            long long enqueue_ns = metrics_now_ns();
+            if (!admission_admit(&admission, shard->queue, enqueue_ns)) {
+                shed_connection(client_fd, shard->args.config->admission.retry_after_s);
+                metrics_add_shed(stats);
+                continue;
+            }
+            if (connection_enqueue(shard->queue, client_fd) == -1) {
+                fprintf(stderr, "connection_enqueue failed\n");
+                close(client_fd);
+                return 1;
+            }
+            metrics_add_enqueue(stats, metrics_now_ns() - enqueue_ns);
+        }
+    }
+    return 0;
+}
+
+// THREAD FUNCTION for the acceptors of shards 1 and up, shard 0's runs on the main thread
+void* accept_thread(void* arg) {
+    shard_t* shard = (shard_t*) arg;
+    pin_to_cpu(shard->args.cpu);
+    if (accept_connections(shard) != 0) {
+        shard->accept_failed = 1;
+        keep_going = 0; // can't take connections on this CPU any more, bring the server down
+    }
+    return NULL;
+}
+
+// Sets up one shard: its listener, its queue and its pinned workers.
+// Returns 0 on success or 1 on error, leaving whatever was started for stop_shards
+int start_shard(shard_t* shard, const server_config_t* config, const char* port, int cpu) {
+    shard->args.config = config;
+    shard->args.cpu = cpu;
+    shard->sock_fd = open_listen_socket(port, config->listen_backlog, 1);
+    if (shard->sock_fd == -1) {
+        return 1;
+    }
+    if (fcntl(shard->sock_fd, F_SETFL, fcntl(shard->sock_fd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return 1;
+    }
+
+    shard->queue = malloc(sizeof(connection_queue_t));
+    if (shard->queue == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int init_result;
+    if (config->queue_kind == QUEUE_LOCKFREE) {
+        init_result = connection_queue_init_lockfree(shard->queue, config->queue_capacity);
+    }
+    else {
+        init_result = connection_queue_init(shard->queue);
+    }
+    if (init_result == -1) {
+        fprintf(stderr, "queue initialization failed\n");
+        free(shard->queue);
+        shard->queue = NULL;
+        return 1;
+    }
+    shard->args.queue = shard->queue;
+    metrics_watch_queue(config->metrics, shard->queue);
+    if (deadline_reaper_start(&shard->reaper, config->metrics) != 0) {
+        return 1;
+    }
+    shard->reaper_started = 1;
+    shard->args.reaper = &shard->reaper;
+
+    shard->workers = malloc(config->shard_workers * sizeof(pthread_t));
+    if (shard->workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < config->shard_workers; i++) {
+        int err_code = pthread_create(&shard->workers[i], NULL, respond, &shard->args);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+            return 1;
+        }
+        shard->n_workers++;
+    }
+    return 0;
+}
+
+// Stops and frees every shard, in whatever state start_shard left it.
+// Returns 0 on success or 1 on error
+int stop_shards(shard_t* shards, int n_shards) {
+    int ret_val = 0;
+    keep_going = 0;
+    for (int i = 0; i < n_shards; i++) {
+        if (shards[i].acceptor_started) {
+            pthread_join(shards[i].acceptor, NULL);
+        }
+        if (shards[i].accept_failed) {
+            ret_val = 1;
+        }
+        if (shards[i].queue != NULL) {
+            connection_queue_shutdown(shards[i].queue);
+        }
+    }
+    for (int i = 0; i < n_shards; i++) {
+        for (int j = 0; j < shards[i].n_workers; j++) {
+            int err_code = pthread_join(shards[i].workers[j], NULL);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+                ret_val = 1;
+            }
+        }
+        free(shards[i].workers);
+        if (shards[i].reaper_started && deadline_reaper_stop(&shards[i].reaper) != 0) {
+            ret_val = 1;
+        }
+        if (shards[i].queue != NULL) {
+            metrics_unwatch_queue(shards[i].args.config->metrics, shards[i].queue);
+        }
+        if (shards[i].queue != NULL && connection_queue_free(shards[i].queue) != 0) {
+            fprintf(stderr, "connection_queue_free failed\n");
+            ret_val = 1;
+        }
+        if (shards[i].sock_fd != -1 && close(shards[i].sock_fd) == -1) {
+            perror("close");
+            ret_val = 1;
+        }
+    }
+    free(shards);
+    return ret_val;
+}
+
+// Runs the server as one shard per CPU: each has its own SO_REUSEPORT listener,
+// acceptor and workers, all pinned to that CPU, so a connection is accepted and
+// served on the core the kernel steered it to and no queue is shared between cores.
+// Returns 0 on success or 1 on error
+int serve_sharded(const server_config_t* config, const char* port) {
+    // hand out the CPUs we're allowed to run on, round robin if there are more shards than CPUs
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    int cpus[CPU_SETSIZE];
+    int n_cpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[n_cpus++] = cpu;
+        }
+    }
+
+    int n_shards = config->n_loops;
+    shard_t* shards = calloc(n_shards, sizeof(shard_t));
+    if (shards == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < n_shards; i++) {
+        shards[i].sock_fd = -1;
+    }
+
+    // only the main thread should see SIGINT, the other threads inherit a full mask
+    sigset_t sigset;
+    sigset_t oldset;
+    sigfillset(&sigset);
+    if (sigprocmask(SIG_BLOCK, &sigset, &oldset) != 0) {
+        perror("sigprocmask");
+        free(shards);
+        return 1;
+    }
+    int ret_val = 0;
+    for (int i = 0; i < n_shards && ret_val == 0; i++) {
+        ret_val = start_shard(&shards[i], config, port, cpus[i % n_cpus]);
+        if (ret_val == 0 && i > 0) {
+            int err_code = pthread_create(&shards[i].acceptor, NULL, accept_thread, &shards[i]);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+                ret_val = 1;
+            }
+            shards[i].acceptor_started = (err_code == 0);
+        }
+    }
+    if (sigprocmask(SIG_SETMASK, &oldset, NULL) != 0) {
+        perror("sigprocmask");
+        ret_val = 1;
+    }
+
+    if (ret_val == 0) {
+        pin_to_cpu(shards[0].args.cpu);
+        ret_val = accept_connections(&shards[0]);
+    }
+
+    if (stop_shards(shards, n_shards) != 0) {
+        ret_val = 1;
+    }
+    return ret_val;
+}
+
+// THREAD FUNCTION for the metrics port: answers every request with the metrics,
+// whatever path it asks for, one request per connection. Polls in short slices
+// so it notices shutdown without a signal.
+void* serve_metrics(void* arg) {
+    metrics_server_t* server = (metrics_server_t*) arg;
+    struct pollfd pfd = { .fd = server->sock_fd, .events = POLLIN };
+    while (keep_going) {
+        int ready = poll(&pfd, 1, POLL_SLICE_MS);
+        if (ready <= 0) {
+            continue; // timeout, or EINTR during shutdown
+        }
+        int client_fd = accept(server->sock_fd, NULL, NULL); // listener is non-blocking, client isn't
+        if (client_fd == -1) {
+            continue;
+        }
+        request_buffer_t rb;
+        request_buffer_init(&rb);
+        char resource[HTTP_RESOURCE_MAX];
+        int keep_alive;
+        if (read_next_http_request(client_fd, &rb, resource, &keep_alive, POLL_SLICE_MS * 4) == HTTP_READ_OK) {
+            http_response_t resp;
+            if (metrics_response(server->metrics, &resp, 0) == 0) {
+                http_response_send_all(client_fd, &resp);
+            }
+            http_response_cleanup(&resp);
+        }
+        close(client_fd);
+    }
+    return NULL;
+}
+
+// Prints a cache's stats if asked to, then frees it. Does nothing for NULL.
+// Returns 0 on success or 1 on error
+static int free_cache(file_cache_t* cache, const char* name, int verbose) {
+    if (cache == NULL) {
+        return 0;
+    }
+    if (verbose) {
+        file_cache_stats_t stats;
+        file_cache_stats(cache, &stats);
+        printf("%s cache: %lu hits, %lu misses (%lu coalesced), %lu evictions, %lu entries, %zu bytes\n",
+               name, stats.hits, stats.misses, stats.coalesced, stats.evictions, stats.entries, stats.bytes_used);
+    }
+    if (file_cache_free(cache) != 0) {
+        fprintf(stderr, "file_cache_free failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Prints the stat cache's stats if asked to, then frees it. Does nothing for NULL.
+static void free_stat_cache(stat_cache_t* cache, int verbose) {
+    if (cache == NULL) {
+        return;
+    }
+    if (verbose) {
+        stat_cache_stats_t stats;
+        stat_cache_stats(cache, &stats);
+        printf("stat cache: %lu hits, %lu misses, %lu evictions, %lu entries\n",
+               stats.hits, stats.misses, stats.evictions, stats.entries);
+    }
+    stat_cache_free(cache);
+}
+
+int main(int argc, char** argv) {
+    // First command is directory to serve, second command is port, options can go anywhere
+    int mode = MODE_THREADS;
+    server_config_t config;
+    config.n_loops = sysconf(_SC_NPROCESSORS_ONLN); // epoll, uring and sharded modes: one loop, ring or shard per core by default
+    config.listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    config.shard_workers = DEFAULT_SHARD_WORKERS;
+    config.idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    config.header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS;
+    config.write_timeout_ms = DEFAULT_WRITE_TIMEOUT_MS;
+    config.max_requests = DEFAULT_MAX_REQUESTS;
+    config.queue_kind = QUEUE_MUTEX;
+    config.queue_capacity = DEFAULT_QUEUE_CAPACITY;
+    config.sjf_max_delay_ns = DEFAULT_SJF_MAX_DELAY_MS * 1000000LL;
+    long cache_budget_mb = DEFAULT_CACHE_BUDGET_MB;
+    long gzip_budget_mb = DEFAULT_GZIP_BUDGET_MB;
+    int stat_ttl_ms = DEFAULT_STAT_TTL_MS;
+    const char* archive_path = NULL; // serve the members of this tar archive instead of a directory
+    const char* metrics_port = NULL; // NULL answers METRICS_PATH on the serving port instead
+    const char* log_path = NULL;
+    const char* trace_prefix = NULL; // dump sampled requests' spans to <prefix>.<n>.json
+    int trace_sample = DEFAULT_TRACE_SAMPLE;
+    int log_policy = ACCESS_LOG_DROP;
+    memset(&config.admission, 0, sizeof(config.admission));
+    config.admission.policy = ADMIT_ALL;
+    config.admission.interval_ns = DEFAULT_CODEL_INTERVAL_MS * 1000000LL;
+    config.admission.retry_after_s = DEFAULT_RETRY_AFTER_S;
+    config.pool.min_workers = DEFAULT_MIN_WORKERS;
+    config.pool.max_workers = DEFAULT_MAX_WORKERS;
+    config.pool.grow_wait_ns = DEFAULT_GROW_WAIT_MS * 1000000LL;
+    config.pool.shrink_idle_ms = DEFAULT_SHRINK_IDLE_MS;
+    int verbose = 0;
+    int opt;
+    const struct option long_options[] = { { "archive", required_argument, NULL, 'A' },
+                                           { "trace", required_argument, NULL, 'x' },
+                                           { "trace-sample", required_argument, NULL, 'X' }, { NULL, 0, NULL, 0 } };
+    while ((opt = getopt_long(argc, argv, "m:e:b:w:p:P:g:i:k:t:T:r:c:z:S:A:q:Q:j:M:l:L:s:W:C:R:x:X:v", long_options,
+                              NULL)) != -1) {
+        if (opt == 'm' && strcmp(optarg, "threads") == 0) {
+            mode = MODE_THREADS;
+        }
+        else if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+            mode = MODE_EPOLL;
+        }
+        else if (opt == 'm' && strcmp(optarg, "sharded") == 0) {
+            mode = MODE_SHARDED;
+        }
+        else if (opt == 'm' && strcmp(optarg, "uring") == 0) {
+            mode = MODE_URING;
+        }
+        else if (opt == 'e' && atoi(optarg) > 0) {
+            config.n_loops = atoi(optarg);
+        }
+        else if (opt == 'b' && atoi(optarg) > 0) {
+            config.listen_backlog = atoi(optarg);
+        }
+        else if (opt == 'w' && atoi(optarg) > 0) {
+            config.shard_workers = atoi(optarg);
+        }
+        else if (opt == 'p' && atoi(optarg) > 0) {
+            config.pool.min_workers = atoi(optarg);
+        }
+        else if (opt == 'P' && atoi(optarg) > 0) {
+            config.pool.max_workers = atoi(optarg);
+        }
+        else if (opt == 'g' && atol(optarg) > 0) {
+            config.pool.grow_wait_ns = atol(optarg) * 1000000LL;
+        }
+        else if (opt == 'i' && atoi(optarg) >= 0) {
+            config.pool.shrink_idle_ms = atoi(optarg) * 1000;
+        }
+        else if (opt == 'k' && atoi(optarg) >= 0) {
+            config.idle_timeout_ms = atoi(optarg) * 1000;
+        }
+        else if (opt == 't' && atoi(optarg) >= 0) {
+            config.header_timeout_ms = atoi(optarg) * 1000;
+        }
+        else if (opt == 'T' && atoi(optarg) >= 0) {
+            config.write_timeout_ms = atoi(optarg) * 1000;
+        }
+        else if (opt == 'r' && atoi(optarg) > 0) {
+            config.max_requests = atoi(optarg);
+        }
+        else if (opt == 'c' && atol(optarg) >= 0) {
+            cache_budget_mb = atol(optarg);
+        }
+        else if (opt == 'z' && atol(optarg) >= 0) {
+            gzip_budget_mb = atol(optarg);
+        }
+        else if (opt == 'S' && atoi(optarg) >= 0) {
+            stat_ttl_ms = atoi(optarg);
+        }
+        else if (opt == 'A') {
+            archive_path = optarg;
+        }
+        else if (opt == 'q' && strcmp(optarg, "mutex") == 0) {
+            config.queue_kind = QUEUE_MUTEX;
+        }
+        else if (opt == 'q' && strcmp(optarg, "lockfree") == 0) {
+            config.queue_kind = QUEUE_LOCKFREE;
+        }
+        else if (opt == 'q' && strcmp(optarg, "steal") == 0) {
+            config.queue_kind = QUEUE_STEAL;
+        }
+        else if (opt == 'q' && strcmp(optarg, "sjf") == 0) {
+            config.queue_kind = QUEUE_SJF;
+        }
+        else if (opt == 'j' && atol(optarg) >= 0) {
+            config.sjf_max_delay_ns = atol(optarg) * 1000000LL;
+        }
+        else if (opt == 'Q' && atol(optarg) > 0) {
+            config.queue_capacity = atol(optarg);
+        }
+        else if (opt == 'M') {
+            metrics_port = optarg;
+        }
+        else if (opt == 'l') {
+            log_path = optarg;
+        }
+        else if (opt == 'L' && strcmp(optarg, "drop") == 0) {
+            log_policy = ACCESS_LOG_DROP;
+        }
+        else if (opt == 'L' && strcmp(optarg, "block") == 0) {
+            log_policy = ACCESS_LOG_BLOCK;
+        }
+        else if (opt == 's' && atol(optarg) > 0) {
+            config.admission.max_depth = atol(optarg);
+        }
+        else if (opt == 'W' && atol(optarg) > 0) {
+            config.admission.max_wait_ns = atol(optarg) * 1000000LL;
+        }
+        else if (opt == 'C' && atol(optarg) > 0) {
+            config.admission.target_ns = atol(optarg) * 1000000LL;
+        }
+        else if (opt == 'R' && atoi(optarg) >= 0) {
+            config.admission.retry_after_s = atoi(optarg);
+        }
+        else if (opt == 'x') {
+            trace_prefix = optarg;
+        }
+        else if (opt == 'X' && atoi(optarg) > 0) {
+            trace_sample = atoi(optarg);
+        }
+        else if (opt == 'v') {
+            verbose = 1;
+        }
+        else {
+            argc = 0; // fall into the usage message below
+            break;
+        }
+    }
+    if (argc - optind != (archive_path != NULL ? 1 : 2)) {
+        printf("Usage: %s <directory> <port> [-m threads|epoll|sharded|uring] [-e <event loops, rings or shards>]\n"
+               "   or: %s --archive <tar file to serve instead of a directory> <port> [the same options]\n"
+               "       [-b <listen backlog>] [-w <workers per shard>]\n"
+               "       [-p <min workers>] [-P <max workers>] [-g <queue wait ms to add workers at>]\n"
+               "       [-i <idle seconds before extra workers leave, 0 = never>]\n"
+               "       [-k <keep-alive idle seconds, 0 = off>] [-t <request header seconds, 0 = no limit>]\n"
+               "       [-T <response send seconds, 0 = no limit>] [-r <max requests per connection>]\n"
+               "       [-c <file cache MB, 0 = off>] [-z <gzip cache MB, 0 = only precompressed .gz files>]\n"
+               "       [-S <ms to remember a stat or 404 for, 0 = off>]\n"
+               "       [-q mutex|lockfree|steal|sjf] [-Q <lock-free queue slots>]\n"
+               "       [-j <ms smaller responses can hold up a big one by, with -q sjf>] [-M <metrics port>]\n"
+               "       [-l <access log file, - for stdout>] [-L drop|block when the log falls behind]\n"
+               "       [-s <queue depth to shed at>] [-W <queue wait ms to shed at>] [-C <CoDel target queue wait ms>]\n"
+               "       [-R <Retry-After seconds>] [--trace <file prefix to dump traces to on SIGUSR1 and exit>]\n"
+               "       [--trace-sample <trace 1 request in this many>] [-v]\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (config.n_loops < 1) {
+        config.n_loops = 1;
+    }
+    if (config.pool.max_workers < config.pool.min_workers) {
+        config.pool.max_workers = config.pool.min_workers;
+    }
+    if (config.admission.target_ns > 0) {
+        config.admission.policy = ADMIT_CODEL;
+    }
+    else if (config.admission.max_depth > 0 || config.admission.max_wait_ns > 0) {
+        config.admission.policy = ADMIT_LIMIT;
+    }
+    // Uncomment the lines below to use these definitions:
+    const char* server_dir = archive_path != NULL ? "" : argv[optind]; //directory to serve
+    const char* port = argv[argc - 1]; //port to bind to
+    config.server_dir = server_dir;
+    if (archive_path != NULL) { // every body is already in memory, the caches would only hold copies
+        cache_budget_mb = 0;
+        gzip_budget_mb = 0;
+        stat_ttl_ms = 0;
+    }
+
+    //install sigint handler before starting setup (similar to in-class example) for tcp server
+    struct sigaction sact;
+    sact.sa_handler = handle_sigint;
+    if (sigfillset(&sact.sa_mask) == -1) { //didn't error check in in-class example but we probably should since there's an error return val
+        perror("sigfillset"); //errno is set so perror.
+        return 1; //not in server loop yet so we can just terminate.
+    }
+    sact.sa_flags = 0; //don't want to restart system calls here- more detail on why in project writeup. thus, no SA_RESTART
+    if (sigaction(SIGINT, &sact, NULL) == -1) { //also want to error check this to make sure handler installed correctly
+        perror("sigaction");
+        return 1; //still terminate relatively normally because not in server loop yet. no cleanup (yet).
+    }
+    // a client hanging up mid-response should be a write error, not kill the server
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &ignore, NULL) == -1) {
+        perror("sigaction");
+        return 1;
+    }
+
+    // files small enough to fit are kept in memory after their first request
+    file_cache_t cache;
+    config.cache = NULL;
+    if (cache_budget_mb > 0) {
+        if (file_cache_init(&cache, cache_budget_mb * 1024 * 1024) != 0) {
+            fprintf(stderr, "file_cache_init failed\n");
+            return 1;
+        }
+        config.cache = &cache;
+    }
+    // text files are compressed once for clients that accept gzip, then kept here
+    file_cache_t gzip_cache;
+    config.gzip_cache = NULL;
+    if (gzip_budget_mb > 0) {
+        if (file_cache_init(&gzip_cache, gzip_budget_mb * 1024 * 1024) != 0) {
+            fprintf(stderr, "file_cache_init failed\n");
+            free_cache(config.cache, "file", 0);
+            return 1;
+        }
+        config.gzip_cache = &gzip_cache;
+    }
+    // repeated lookups of the same path, 404s included, skip the stat for a little while
+    stat_cache_t stat_cache;
+    config.stat_cache = NULL;
+    if (stat_ttl_ms > 0) {
+        if (stat_cache_init(&stat_cache, stat_ttl_ms) != 0) {
+            free_cache(config.cache, "file", 0);
+            free_cache(config.gzip_cache, "gzip", 0);
+            return 1;
+        }
+        config.stat_cache = &stat_cache;
+    }
+
+    // every serving thread records into this, scrapes add it all up
+    metrics_t metrics;
+    if (metrics_init(&metrics) != 0) {
+        free_cache(config.cache, "file", 0);
+        free_cache(config.gzip_cache, "gzip", 0);
+        free_stat_cache(config.stat_cache, 0);
+        return 1;
+    }
+    config.metrics = &metrics;
+    metrics.cache = config.cache;
+    metrics.gzip_cache = config.gzip_cache;
+    metrics.stat_cache = config.stat_cache;
+    config.metrics_in_band = metrics_port == NULL;
+    // workers hand entries to the log's flusher thread, which does the formatting and writing
+    access_log_t access_log;
+    config.access_log = NULL;
+    if (log_path != NULL) {
+        if (access_log_open(&access_log, log_path, log_policy) != 0) {
+            metrics_free(&metrics);
+            free_cache(config.cache, "file", 0);
+            free_cache(config.gzip_cache, "gzip", 0);
+            free_stat_cache(config.stat_cache, 0);
+            return 1;
+        }
+        config.access_log = &access_log;
+        metrics.access_log = &access_log;
+    }
+    // the metrics port, tracer and archive each print their own error and set
+    // code if they can't be set up, and then the server doesn't start
+    metrics_server_t metrics_server;
+    metrics_server.sock_fd = -1;
+    metrics_server.metrics = &metrics;
+    if (metrics_port != NULL) {
+        metrics_server.sock_fd = open_listen_socket(metrics_port, config.listen_backlog, 0);
+        if (metrics_server.sock_fd != -1 &&
+            fcntl(metrics_server.sock_fd, F_SETFL, fcntl(metrics_server.sock_fd, F_GETFL) | O_NONBLOCK) == -1) {
+            perror("fcntl");
+            close(metrics_server.sock_fd);
+            metrics_server.sock_fd = -1;
+        }
+        if (metrics_server.sock_fd == -1) {
+            code = 1;
+        }
+        else { // only the main thread should see SIGINT
+            sigset_t sigset;
+            sigset_t oldset;
+            sigfillset(&sigset);
+            pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+            int err_code = pthread_create(&metrics_server.thread, NULL, serve_metrics, &metrics_server);
+            pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+                close(metrics_server.sock_fd);
+                metrics_server.sock_fd = -1;
+                code = 1;
+            }
+        }
+    }
+
+    // sampled requests' spans wait in per-thread rings until SIGUSR1 or shutdown writes them out
+    tracer_t tracer;
+    config.tracer = NULL;
+    if (code == 0 && trace_prefix != NULL) {
+        if (mode == MODE_EPOLL || mode == MODE_URING || (mode == MODE_THREADS && config.queue_kind == QUEUE_SJF)) {
+            fprintf(stderr, "tracing only covers threads, steal and sharded modes, this one won't record anything\n");
+        }
+        if (tracer_open(&tracer, trace_prefix, trace_sample) != 0) {
+            code = 1;
+        }
+        else {
+            config.tracer = &tracer;
+        }
+    }
+
+    // the archive's headers are read once here, every response afterwards comes out of the mapping
+    archive_t archive;
+    config.archive = NULL;
+    if (code == 0 && archive_path != NULL) {
+        if (archive_open(&archive, archive_path) != 0) {
+            code = 1;
+        }
+        else {
+            config.archive = &archive;
+            if (verbose) {
+                printf("archive %s: %zu files\n", archive_path, archive.n_members);
+            }
+        }
+    }
+
+    if (code == 0) {
+        if (mode == MODE_EPOLL) {
+            code = serve_epoll(&config, port);
+        }
+        else if (mode == MODE_SHARDED) {
+            code = serve_sharded(&config, port);
+        }
+        else if (mode == MODE_URING) {
+            code = serve_uring(&config, port);
+        }
+        else if (config.queue_kind == QUEUE_STEAL) {
+            code = serve_stealing(&config, port);
+        }
+        else if (config.queue_kind == QUEUE_SJF) {
+            code = serve_sjf(&config, port);
+        }
+        else {
+            code = serve_threads(&config, port);
+        }
+    }
+
+    if (metrics_server.sock_fd != -1) {
+        keep_going = 0; // in case the server stopped on an error rather than SIGINT
+        pthread_join(metrics_server.thread, NULL);
+        close(metrics_server.sock_fd);
+    }
+    if (config.tracer != NULL && tracer_close(config.tracer) != 0) {
+        code = 1;
+    }
+    if (config.access_log != NULL) {
+        if (verbose) {
+            printf("access log: %llu entries dropped\n", access_log_dropped(config.access_log));
+        }
+        if (access_log_close(config.access_log) != 0) {
+            code = 1;
+        }
+    }
+    metrics_free(&metrics);
+
+    if (free_cache(config.cache, "file", verbose) != 0) {
+        code = 1;
+    }
+    if (free_cache(config.gzip_cache, "gzip", verbose) != 0) {
+        code = 1;
+    }
+    free_stat_cache(config.stat_cache, verbose);
+    if (config.archive != NULL && archive_close(config.archive) != 0) {
+        code = 1;
+    }
+    return code;
+}
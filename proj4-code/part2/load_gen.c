@@ -0,0 +1,659 @@
+// HTTP load generator for comparing the servers in part1 and part2.
+// Each thread drives its share of the connections with epoll. In closed-loop
+// mode (the default) a connection sends its next request as soon as the last
+// response is in. In open-loop mode (-r) every connection sends on a fixed
+// schedule instead, and latency is measured from when a request was due, not
+// from when it actually went out, so a stalled server can't hide the requests
+// it held up (coordinated omission).
+// Usage: ./load_gen [options] <port> [resource[:weight] ...]
+// With no resources listed, every file in the -D directory is requested equally often.
+// With more than one resource, latency is also broken down by resource.
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+
+#define MAX_RESOURCES 256
+#define REQUEST_MAX 512
+#define RESPONSE_HEADER_MAX 4096
+#define READ_CHUNK (256 * 1024)
+#define MAX_EVENTS 256
+
+// Where a connection is in its request/response cycle
+#define CONN_IDLE 0       // connected (or not yet) and waiting for its next request to come due
+#define CONN_CONNECTING 1 // non-blocking connect in progress
+#define CONN_SENDING 2
+#define CONN_READING 3
+
+typedef struct {
+    char name[256];
+    int weight;
+} resource_t;
+
+// Settings from the command line, shared read-only by every thread
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    const char *host;
+    int connections;
+    int threads;
+    double duration_s;
+    double rate;    // requests per second across all connections, 0 for closed loop
+    int keep_alive;
+    resource_t resources[MAX_RESOURCES];
+    int n_resources;
+    int total_weight;
+} options_t;
+
+typedef struct {
+    int fd;                  // -1 when there's no socket
+    int state;
+    char request[REQUEST_MAX];
+    int request_len;
+    int sent;
+    int resource;            // index of the resource being requested
+    char header[RESPONSE_HEADER_MAX]; // response header collected so far
+    int header_len;
+    int header_done;
+    long long body_left;     // -1 means the body runs until the server closes
+    int server_closes;       // response said Connection: close
+    int reused;              // socket has already carried a response
+    long long due_ns;        // when the current (or, while idle, the next) request should start
+} conn_t;
+
+// One thread's connections and counters
+typedef struct {
+    const options_t *opts;
+    conn_t *conns;
+    int n_conns;
+    int epoll_fd;
+    unsigned int seed;       // rand_r state for picking resources, same every run
+    long long interval_ns;   // open loop: time between one connection's requests
+    long long end_ns;
+    histogram_t latency;
+    histogram_t *by_resource; // completed requests only, NULL with a single resource
+    unsigned long completed;
+    unsigned long unfinished;    // requests still outstanding when time ran out
+    unsigned long connect_errors;
+    unsigned long socket_errors;
+    unsigned long reconnects;    // requests resent because a kept-alive connection turned out closed
+    unsigned long status_errors; // responses that weren't 2xx or 304
+    unsigned long long bytes;
+} worker_t;
+
+static void lost_connection(worker_t *worker, conn_t *conn);
+
+// Returns a monotonic timestamp in nanoseconds
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Picks the next resource by weight and writes the request for it
+static void build_request(worker_t *worker, conn_t *conn) {
+    const options_t *opts = worker->opts;
+    int pick = rand_r(&worker->seed) % opts->total_weight;
+    const resource_t *res = opts->resources;
+    while (pick >= res->weight) {
+        pick -= res->weight;
+        res++;
+    }
+    conn->resource = res - opts->resources;
+    conn->request_len = snprintf(conn->request, REQUEST_MAX, "GET /%s HTTP/1.1\r\nHost: %s\r\n%s\r\n", res->name,
+                                 opts->host, opts->keep_alive ? "" : "Connection: close\r\n");
+    conn->sent = 0;
+    conn->header_len = 0;
+    conn->header_done = 0;
+    conn->server_closes = !opts->keep_alive;
+}
+
+// Drops a connection's socket. The next request opens a new one.
+static void drop_socket(worker_t *worker, conn_t *conn) {
+    if (conn->fd != -1) {
+        close(conn->fd); // takes it out of the epoll set too
+        conn->fd = -1;
+        conn->reused = 0;
+    }
+}
+
+// Registers a socket with the thread's epoll instance
+// Returns 0 on success or -1 on error
+static int watch(worker_t *worker, conn_t *conn, uint32_t events, int op) {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    if (epoll_ctl(worker->epoll_fd, op, conn->fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Counts a failed request and leaves the connection idle without a socket
+static void fail_request(worker_t *worker, conn_t *conn, unsigned long *counter) {
+    (*counter)++;
+    drop_socket(worker, conn);
+    conn->state = CONN_IDLE;
+    // closed loop tries again right away, open loop gives up this request's slot in the schedule
+    conn->due_ns = worker->interval_ns > 0 ? conn->due_ns + worker->interval_ns : now_ns();
+}
+
+// Writes as much of the request as the socket takes
+// Returns 0 on success or -1 on error
+static int send_request(worker_t *worker, conn_t *conn) {
+    while (conn->sent < conn->request_len) {
+        ssize_t nbytes = send(conn->fd, conn->request + conn->sent, conn->request_len - conn->sent, MSG_NOSIGNAL);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return watch(worker, conn, EPOLLOUT, EPOLL_CTL_MOD);
+            }
+            return -1;
+        }
+        conn->sent += nbytes;
+    }
+    conn->state = CONN_READING;
+    return watch(worker, conn, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+// Starts the request that's due on a connection, connecting first if needed
+static void start_request(worker_t *worker, conn_t *conn) {
+    build_request(worker, conn);
+    if (conn->fd != -1) {
+        conn->state = CONN_SENDING;
+        if (send_request(worker, conn) != 0) {
+            lost_connection(worker, conn);
+        }
+        return;
+    }
+    const options_t *opts = worker->opts;
+    conn->fd = socket(opts->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd == -1) {
+        perror("socket");
+        fail_request(worker, conn, &worker->connect_errors);
+        return;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, (const struct sockaddr *) &opts->addr, opts->addr_len) == -1 && errno != EINPROGRESS) {
+        fail_request(worker, conn, &worker->connect_errors);
+        return;
+    }
+    conn->state = CONN_CONNECTING;
+    if (watch(worker, conn, EPOLLOUT, EPOLL_CTL_ADD) != 0) {
+        fail_request(worker, conn, &worker->connect_errors);
+    }
+}
+
+// Handles the socket failing under a request. If it was a kept-alive socket and
+// no response came back at all, the server closed it without saying so, so the
+// request is sent again on a new connection like a browser would (part1's server
+// does this after every response). Otherwise the request failed.
+static void lost_connection(worker_t *worker, conn_t *conn) {
+    if (conn->reused && conn->header_len == 0) {
+        drop_socket(worker, conn);
+        worker->reconnects++;
+        start_request(worker, conn);
+    }
+    else {
+        fail_request(worker, conn, &worker->socket_errors);
+    }
+}
+
+// Parses the status and the headers we need once the whole header is in
+// Returns 0 on success or -1 if it's garbled
+static int parse_header(worker_t *worker, conn_t *conn) {
+    int status;
+    if (sscanf(conn->header, "HTTP/%*d.%*d %d", &status) != 1) {
+        return -1;
+    }
+    if (!((status >= 200 && status < 300) || status == 304)) {
+        worker->status_errors++;
+    }
+    conn->body_left = -1;
+    char *line = strstr(conn->header, "\r\n");
+    while (line != NULL && line[2] != '\0') {
+        line += 2;
+        char *line_end = strstr(line, "\r\n");
+        *line_end = '\0'; // header ends in \r\n, so there's always one
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            conn->body_left = atoll(line + 15);
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line, "close") != NULL) {
+            conn->server_closes = 1;
+        }
+        *line_end = '\r';
+        line = line_end;
+    }
+    return 0;
+}
+
+// Records a finished response and gets the connection ready for the next one
+static void finish_request(worker_t *worker, conn_t *conn) {
+    long long now = now_ns();
+    histogram_record(&worker->latency, now - conn->due_ns);
+    if (worker->by_resource != NULL) {
+        histogram_record(&worker->by_resource[conn->resource], now - conn->due_ns);
+    }
+    worker->completed++;
+    if (conn->server_closes) {
+        drop_socket(worker, conn);
+    }
+    else {
+        conn->reused = 1;
+    }
+    conn->state = CONN_IDLE;
+    // open loop keeps to the schedule no matter how late this one finished
+    conn->due_ns = worker->interval_ns > 0 ? conn->due_ns + worker->interval_ns : now;
+}
+
+// Reads whatever the server has sent, finishing the response if it's all there
+static void read_response(worker_t *worker, conn_t *conn, char *buf) {
+    while (1) {
+        ssize_t nbytes = read(conn->fd, buf, READ_CHUNK);
+        if (nbytes == -1) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { return; }
+            lost_connection(worker, conn);
+            return;
+        }
+        if (nbytes == 0) {
+            if (conn->header_done && conn->body_left == -1) { // body ended with the connection
+                conn->server_closes = 1;
+                finish_request(worker, conn);
+            }
+            else {
+                lost_connection(worker, conn);
+            }
+            return;
+        }
+        worker->bytes += nbytes;
+
+        ssize_t body_bytes = nbytes;
+        if (!conn->header_done) {
+            // copy into the header buffer until the blank line turns up, the rest is body
+            int room = RESPONSE_HEADER_MAX - 1 - conn->header_len;
+            int take = nbytes < room ? nbytes : room;
+            memcpy(conn->header + conn->header_len, buf, take);
+            int old_len = conn->header_len;
+            conn->header_len += take;
+            conn->header[conn->header_len] = '\0';
+            char *end = strstr(conn->header, "\r\n\r\n");
+            if (end == NULL) {
+                if (conn->header_len == RESPONSE_HEADER_MAX - 1) {
+                    fail_request(worker, conn, &worker->socket_errors);
+                    return;
+                }
+                continue;
+            }
+            int header_size = end + 4 - conn->header;
+            end[2] = '\0'; // keep the last header line's \r\n for parse_header
+            conn->header_done = 1;
+            if (parse_header(worker, conn) != 0) {
+                fail_request(worker, conn, &worker->socket_errors);
+                return;
+            }
+            body_bytes = nbytes - (header_size - old_len);
+        }
+        if (conn->body_left >= 0) {
+            conn->body_left -= body_bytes;
+            if (conn->body_left <= 0) {
+                finish_request(worker, conn);
+                return;
+            }
+        }
+    }
+}
+
+// Handles readiness on a connection's socket
+static void handle_event(worker_t *worker, conn_t *conn, uint32_t events, char *buf) {
+    if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            fail_request(worker, conn, &worker->connect_errors);
+            return;
+        }
+        conn->state = CONN_SENDING;
+    }
+    if (conn->state == CONN_SENDING) {
+        if (send_request(worker, conn) != 0) {
+            lost_connection(worker, conn);
+        }
+        return;
+    }
+    if (conn->state == CONN_READING) {
+        read_response(worker, conn, buf);
+    }
+    else { // nothing should arrive on an idle socket but the server hanging up
+        drop_socket(worker, conn);
+    }
+}
+
+// Runs one thread's connections until the test is over
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    char *buf = malloc(READ_CHUNK);
+    struct epoll_event *events = malloc(MAX_EVENTS * sizeof(struct epoll_event));
+    if (buf == NULL || events == NULL) {
+        perror("malloc");
+        free(buf);
+        free(events);
+        return (void *) -1;
+    }
+
+    while (1) {
+        long long now = now_ns();
+        if (now >= worker->end_ns) {
+            break;
+        }
+        // start everything that's due and find out how long until the next one is
+        long long next_due = worker->end_ns;
+        for (int i = 0; i < worker->n_conns; i++) {
+            conn_t *conn = worker->conns + i;
+            if (conn->state != CONN_IDLE) {
+                continue;
+            }
+            if (conn->due_ns <= now) {
+                start_request(worker, conn);
+            }
+            if (conn->state == CONN_IDLE && conn->due_ns < next_due) {
+                next_due = conn->due_ns;
+            }
+        }
+        long long wait_ns = next_due - now_ns();
+        int timeout_ms = wait_ns <= 0 ? 0 : (int) ((wait_ns + 999999) / 1000000);
+        int n_events = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (n_events == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n_events; i++) {
+            handle_event(worker, (conn_t *) events[i].data.ptr, events[i].events, buf);
+        }
+    }
+
+    // In open loop, a request still outstanding at the end, and every one it held
+    // up behind it, has waited at least until now, so it counts at that latency.
+    // Leaving them out would hide exactly the stalls this mode is meant to show.
+    long long end = now_ns();
+    for (int i = 0; i < worker->n_conns; i++) {
+        conn_t *conn = worker->conns + i;
+        if (conn->state != CONN_IDLE) {
+            worker->unfinished++;
+            if (worker->interval_ns > 0) {
+                for (long long due = conn->due_ns; due < worker->end_ns; due += worker->interval_ns) {
+                    histogram_record(&worker->latency, end - due);
+                }
+            }
+        }
+        drop_socket(worker, conn);
+    }
+    free(buf);
+    free(events);
+    return NULL;
+}
+
+// Adds every regular file in 'dir' to the mix with weight 1
+// Returns 0 on success or -1 on error
+static int scan_directory(options_t *opts, const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && opts->n_resources < MAX_RESOURCES) {
+        char path[1024];
+        struct stat stat_buf;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_name[0] == '.' || stat(path, &stat_buf) == -1 || !S_ISREG(stat_buf.st_mode)) {
+            continue;
+        }
+        resource_t *res = opts->resources + opts->n_resources++;
+        snprintf(res->name, sizeof(res->name), "%s", entry->d_name);
+        res->weight = 1;
+    }
+    closedir(d);
+    return 0;
+}
+
+// Adds "name" or "name:weight" to the mix
+// Returns 0 on success or -1 if it's malformed
+static int add_resource(options_t *opts, const char *arg) {
+    if (opts->n_resources == MAX_RESOURCES) {
+        fprintf(stderr, "too many resources\n");
+        return -1;
+    }
+    resource_t *res = opts->resources + opts->n_resources;
+    snprintf(res->name, sizeof(res->name), "%s", arg[0] == '/' ? arg + 1 : arg);
+    res->weight = 1;
+    char *colon = strrchr(res->name, ':');
+    if (colon != NULL) {
+        res->weight = atoi(colon + 1);
+        *colon = '\0';
+        if (res->weight < 1) {
+            fprintf(stderr, "bad weight in '%s'\n", arg);
+            return -1;
+        }
+    }
+    opts->n_resources++;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    options_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.host = "localhost";
+    opts.connections = 16;
+    opts.threads = 2;
+    opts.duration_s = 10;
+    opts.keep_alive = 1;
+    const char *dir = "server_files";
+    int opt;
+    while ((opt = getopt(argc, argv, "h:c:t:d:r:k:D:")) != -1) {
+        if (opt == 'h') {
+            opts.host = optarg;
+        }
+        else if (opt == 'c' && atoi(optarg) > 0) {
+            opts.connections = atoi(optarg);
+        }
+        else if (opt == 't' && atoi(optarg) > 0) {
+            opts.threads = atoi(optarg);
+        }
+        else if (opt == 'd' && atof(optarg) > 0) {
+            opts.duration_s = atof(optarg);
+        }
+        else if (opt == 'r' && atof(optarg) >= 0) {
+            opts.rate = atof(optarg);
+        }
+        else if (opt == 'k' && (strcmp(optarg, "0") == 0 || strcmp(optarg, "1") == 0)) {
+            opts.keep_alive = atoi(optarg);
+        }
+        else if (opt == 'D') {
+            dir = optarg;
+        }
+        else {
+            argc = 0; // fall into the usage message below
+            break;
+        }
+    }
+    if (argc - optind < 1) {
+        printf("Usage: %s [-h host] [-c connections] [-t threads] [-d seconds]\n"
+               "       [-r requests/s, 0 = closed loop] [-k 0|1 keep-alive] [-D dir to take resources from]\n"
+               "       <port> [resource[:weight] ...]\n", argv[0]);
+        return 1;
+    }
+    const char *port = argv[optind];
+    for (int i = optind + 1; i < argc; i++) {
+        if (add_resource(&opts, argv[i]) != 0) {
+            return 1;
+        }
+    }
+    if (opts.n_resources == 0 && scan_directory(&opts, dir) != 0) {
+        return 1;
+    }
+    if (opts.n_resources == 0) {
+        fprintf(stderr, "no resources to request\n");
+        return 1;
+    }
+    for (int i = 0; i < opts.n_resources; i++) {
+        opts.total_weight += opts.resources[i].weight;
+    }
+    if (opts.threads > opts.connections) {
+        opts.threads = opts.connections;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *server;
+    int err_code = getaddrinfo(opts.host, port, &hints, &server);
+    if (err_code != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err_code));
+        return 1;
+    }
+    memcpy(&opts.addr, server->ai_addr, server->ai_addrlen);
+    opts.addr_len = server->ai_addrlen;
+    freeaddrinfo(server);
+
+    worker_t *workers = calloc(opts.threads, sizeof(worker_t));
+    pthread_t *threads = malloc(opts.threads * sizeof(pthread_t));
+    conn_t *conns = malloc(opts.connections * sizeof(conn_t));
+    if (workers == NULL || threads == NULL || conns == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    // each connection gets rate / connections of the load, their first requests spread over one interval
+    long long interval_ns = opts.rate > 0 ? (long long) (1e9 * opts.connections / opts.rate) : 0;
+    long long start = now_ns();
+    int next_conn = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        worker_t *worker = workers + i;
+        worker->opts = &opts;
+        worker->seed = i + 1;
+        worker->interval_ns = interval_ns;
+        worker->end_ns = start + (long long) (opts.duration_s * 1e9);
+        worker->conns = conns + next_conn;
+        worker->n_conns = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        next_conn += worker->n_conns;
+        histogram_init(&worker->latency);
+        worker->by_resource = NULL;
+        if (opts.n_resources > 1) {
+            worker->by_resource = malloc(opts.n_resources * sizeof(histogram_t));
+            if (worker->by_resource == NULL) {
+                perror("malloc");
+                return 1;
+            }
+            for (int j = 0; j < opts.n_resources; j++) {
+                histogram_init(&worker->by_resource[j]);
+            }
+        }
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epoll_fd == -1) {
+            perror("epoll_create1");
+            return 1;
+        }
+        for (int j = 0; j < worker->n_conns; j++) {
+            conn_t *conn = worker->conns + j;
+            int k = conn - conns;
+            conn->fd = -1;
+            conn->state = CONN_IDLE;
+            conn->due_ns = start + (interval_ns * k) / opts.connections;
+        }
+    }
+    for (int i = 0; i < opts.threads; i++) {
+        err_code = pthread_create(threads + i, NULL, run_worker, workers + i);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+            return 1;
+        }
+    }
+
+    histogram_t latency;
+    histogram_init(&latency);
+    worker_t total;
+    memset(&total, 0, sizeof(total));
+    int ret_val = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        void *thread_ret;
+        pthread_join(threads[i], &thread_ret);
+        if (thread_ret != NULL) {
+            ret_val = 1;
+        }
+        worker_t *worker = workers + i;
+        histogram_merge(&latency, &worker->latency);
+        if (worker->by_resource != NULL && i > 0) {
+            for (int j = 0; j < opts.n_resources; j++) {
+                histogram_merge(&workers[0].by_resource[j], &worker->by_resource[j]);
+            }
+            free(worker->by_resource);
+        }
+        total.completed += worker->completed;
+        total.unfinished += worker->unfinished;
+        total.connect_errors += worker->connect_errors;
+        total.socket_errors += worker->socket_errors;
+        total.reconnects += worker->reconnects;
+        total.status_errors += worker->status_errors;
+        total.bytes += worker->bytes;
+        close(worker->epoll_fd);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    if (opts.rate > 0) {
+        printf("open loop at %.0f req/s, latency measured from when each request was due\n", opts.rate);
+    }
+    else {
+        printf("closed loop\n");
+    }
+    printf("%d connections on %d threads, keep-alive %s, %.1f s, %d resources\n", opts.connections, opts.threads,
+           opts.keep_alive ? "on" : "off", elapsed, opts.n_resources);
+    printf("requests    %lu completed, %lu errors (%lu connect, %lu socket, %lu status), %lu unfinished\n",
+           total.completed, total.connect_errors + total.socket_errors + total.status_errors,
+           total.connect_errors, total.socket_errors, total.status_errors, total.unfinished);
+    if (total.reconnects > 0) {
+        printf("            %lu requests resent after the server closed a kept-alive connection\n", total.reconnects);
+    }
+    printf("throughput  %.1f req/s, %.2f MB/s\n", total.completed / elapsed, total.bytes / elapsed / (1024 * 1024));
+    if (latency.total > 0) {
+        printf("latency ms  %lu samples  min %.3f  mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+               latency.total, latency.min / 1e6, latency.sum / latency.total / 1e6, histogram_percentile(&latency, 50) / 1e6,
+               histogram_percentile(&latency, 90) / 1e6, histogram_percentile(&latency, 99) / 1e6,
+               histogram_percentile(&latency, 99.9) / 1e6, latency.max / 1e6);
+    }
+    if (workers[0].by_resource != NULL) { // every thread's were merged into the first's
+        for (int j = 0; j < opts.n_resources; j++) {
+            const histogram_t *hist = &workers[0].by_resource[j];
+            if (hist->total == 0) {
+                continue;
+            }
+            printf("  %-16s %8lu samples  p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n", opts.resources[j].name,
+                   hist->total, histogram_percentile(hist, 50) / 1e6, histogram_percentile(hist, 99) / 1e6,
+                   histogram_percentile(hist, 99.9) / 1e6, hist->max / 1e6);
+        }
+        free(workers[0].by_resource);
+    }
+    free(workers);
+    free(threads);
+    free(conns);
+    return ret_val;
+}
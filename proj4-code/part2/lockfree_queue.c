@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lockfree_queue.h"
+
+// timeout: how long to sleep at most, NULL for as long as it takes
+static void futex_wait(atomic_uint *word, unsigned int expected, const struct timespec *timeout) {
+    // returns straight away if *word already moved on, so a wakeup between our check and this call isn't lost
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void futex_wake(atomic_uint *word, int n_threads) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n_threads, NULL, NULL, 0);
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// One attempt at claiming a free slot. Returns 1 if fd was added, 0 if the queue is full
+static int try_enqueue(lockfree_queue_t *queue, int fd, long long enqueued_ns) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        lockfree_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) { // slot is free, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->fd = fd;
+                __atomic_store_n(&cell->enqueued_ns, enqueued_ns, __ATOMIC_RELAXED); // lockfree_queue_oldest may be reading it
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release); // hand it to the consumer
+                return 1;
+            }
+            // lost the race, pos now holds the new enqueue_pos
+        }
+        else if (diff < 0) { // slot still holds an item from a lap ago
+            return 0;
+        }
+        else { // someone else already claimed pos
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// One attempt at taking an item. Returns 1 and sets *fd if one was taken, 0 if the queue is empty
+static int try_dequeue(lockfree_queue_t *queue, int *fd, long long *enqueued_ns) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        lockfree_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) { // slot holds our item, try to claim it
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *fd = cell->fd;
+                if (enqueued_ns != NULL) {
+                    *enqueued_ns = cell->enqueued_ns;
+                }
+                // free the slot for the producer one lap ahead
+                atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+                return 1;
+            }
+        }
+        else if (diff < 0) { // producer hasn't filled it yet
+            return 0;
+        }
+        else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Lets sleepers on the other side know something changed
+static void notify(atomic_uint *seq, atomic_int *waiters) {
+    atomic_fetch_add(seq, 1);
+    if (atomic_load(waiters) > 0) {
+        futex_wake(seq, 1);
+    }
+}
+
+int lockfree_queue_init(lockfree_queue_t *queue, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    if (size < 2) {
+        size = 2; // the sequence numbers need at least two slots to tell "free" from "full"
+    }
+    queue->cells = malloc(size * sizeof(lockfree_cell_t));
+    if (queue->cells == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].seq, i);
+        queue->cells[i].fd = -1;
+        queue->cells[i].enqueued_ns = 0;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->items_seq, 0);
+    atomic_init(&queue->items_waiters, 0);
+    atomic_init(&queue->space_seq, 0);
+    atomic_init(&queue->space_waiters, 0);
+    atomic_init(&queue->shutdown, 0);
+    return 0;
+}
+
+int lockfree_enqueue(lockfree_queue_t *queue, int fd, long long enqueued_ns) {
+    for (int spins = 0; ; spins++) {
+        if (atomic_load(&queue->shutdown)) {
+            return 0; // nothing added, same as the mutex queue
+        }
+        if (try_enqueue(queue, fd, enqueued_ns)) {
+            notify(&queue->items_seq, &queue->items_waiters);
+            return 0;
+        }
+        if (spins < LOCKFREE_SPINS) {
+            cpu_relax();
+            continue;
+        }
+        // full for a while, sleep until a consumer frees a slot
+        atomic_fetch_add(&queue->space_waiters, 1);
+        unsigned int seq = atomic_load(&queue->space_seq);
+        if (!atomic_load(&queue->shutdown) && try_enqueue(queue, fd, enqueued_ns)) {
+            atomic_fetch_sub(&queue->space_waiters, 1);
+            notify(&queue->items_seq, &queue->items_waiters);
+            return 0;
+        }
+        if (!atomic_load(&queue->shutdown)) {
+            futex_wait(&queue->space_seq, seq, NULL);
+        }
+        atomic_fetch_sub(&queue->space_waiters, 1);
+        spins = 0;
+    }
+}
+
+int lockfree_dequeue(lockfree_queue_t *queue, long long *enqueued_ns) {
+    return lockfree_dequeue_timed(queue, enqueued_ns, -1);
+}
+
+int lockfree_dequeue_timed(lockfree_queue_t *queue, long long *enqueued_ns, int timeout_ms) {
+    long long deadline_ms = timeout_ms >= 0 ? monotonic_ms() + timeout_ms : 0;
+    int fd;
+    for (int spins = 0; ; spins++) {
+        if (atomic_load(&queue->shutdown)) {
+            return 0; // same as the mutex queue
+        }
+        if (try_dequeue(queue, &fd, enqueued_ns)) {
+            notify(&queue->space_seq, &queue->space_waiters);
+            return fd;
+        }
+        if (spins < LOCKFREE_SPINS) {
+            cpu_relax();
+            continue;
+        }
+        // empty for a while, sleep until a producer adds something
+        atomic_fetch_add(&queue->items_waiters, 1);
+        unsigned int seq = atomic_load(&queue->items_seq);
+        if (!atomic_load(&queue->shutdown) && try_dequeue(queue, &fd, enqueued_ns)) {
+            atomic_fetch_sub(&queue->items_waiters, 1);
+            notify(&queue->space_seq, &queue->space_waiters);
+            return fd;
+        }
+        long long left_ms = timeout_ms >= 0 ? deadline_ms - monotonic_ms() : 0;
+        if (timeout_ms >= 0 && left_ms <= 0) {
+            atomic_fetch_sub(&queue->items_waiters, 1);
+            return LOCKFREE_TIMEOUT;
+        }
+        if (!atomic_load(&queue->shutdown)) {
+            struct timespec left = { .tv_sec = left_ms / 1000, .tv_nsec = (left_ms % 1000) * 1000000L };
+            futex_wait(&queue->items_seq, seq, timeout_ms >= 0 ? &left : NULL);
+        }
+        atomic_fetch_sub(&queue->items_waiters, 1);
+        spins = 0;
+    }
+}
+
+int lockfree_dequeue_older(lockfree_queue_t *queue, long long before_ns) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    lockfree_cell_t *cell = &queue->cells[pos & queue->mask];
+    if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1 ||
+        __atomic_load_n(&cell->enqueued_ns, __ATOMIC_RELAXED) >= before_ns) {
+        return -1;
+    }
+    // only claim that exact slot: if a consumer got there first, the item we looked at is gone
+    if (!atomic_compare_exchange_strong_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                 memory_order_relaxed, memory_order_relaxed)) {
+        return -1;
+    }
+    int fd = cell->fd;
+    atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+    notify(&queue->space_seq, &queue->space_waiters);
+    return fd;
+}
+
+void lockfree_queue_shutdown(lockfree_queue_t *queue) {
+    atomic_store(&queue->shutdown, 1);
+    atomic_fetch_add(&queue->items_seq, 1);
+    atomic_fetch_add(&queue->space_seq, 1);
+    futex_wake(&queue->items_seq, INT_MAX);
+    futex_wake(&queue->space_seq, INT_MAX);
+}
+
+size_t lockfree_queue_length(lockfree_queue_t *queue) {
+    size_t enqueued = atomic_load(&queue->enqueue_pos);
+    size_t dequeued = atomic_load(&queue->dequeue_pos);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+long long lockfree_queue_oldest(lockfree_queue_t *queue) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    lockfree_cell_t *cell = &queue->cells[pos & queue->mask];
+    if (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1) {
+        return 0; // empty, or the producer hasn't finished filling it
+    }
+    // a consumer may take it and a producer refill it as we read, so this is only a good guess
+    return __atomic_load_n(&cell->enqueued_ns, __ATOMIC_RELAXED);
+}
+
+void lockfree_queue_free(lockfree_queue_t *queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
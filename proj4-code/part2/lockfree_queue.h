@@ -0,0 +1,94 @@
+#ifndef LOCKFREE_QUEUE_H
+#define LOCKFREE_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define CACHE_LINE 64
+#define LOCKFREE_SPINS 128 // tries before a blocked thread parks on its futex
+#define LOCKFREE_TIMEOUT -2 // lockfree_dequeue_timed found nothing in time
+
+// One slot of the ring. 'seq' tells producers and consumers whose turn it is:
+// seq == pos means free for the producer at pos, seq == pos + 1 means it holds
+// the item for the consumer at pos.
+typedef struct {
+    atomic_size_t seq;
+    int fd;
+    long long enqueued_ns; // when fd went in, for how long the oldest item has waited
+} lockfree_cell_t;
+
+// Bounded multi-producer multi-consumer ring of file descriptors (Vyukov's
+// design). Enqueue and dequeue each claim a slot with one compare-and-swap
+// and never take a lock. Threads that have to wait for space or items sleep
+// on a futex that the other side bumps and wakes.
+typedef struct {
+    lockfree_cell_t *cells;
+    size_t mask; // capacity - 1, capacity is a power of two
+    // each hot counter gets its own cache line so producers and consumers don't fight over one
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE) atomic_uint items_seq; // futex word, bumped after every enqueue
+    atomic_int items_waiters;                   // consumers asleep (or about to be) on items_seq
+    _Alignas(CACHE_LINE) atomic_uint space_seq; // futex word, bumped after every dequeue
+    atomic_int space_waiters;                   // producers asleep (or about to be) on space_seq
+    _Alignas(CACHE_LINE) atomic_int shutdown;
+} lockfree_queue_t;
+
+/*
+ * Initialize a lock-free queue
+ * capacity: Number of slots, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int lockfree_queue_init(lockfree_queue_t *queue, size_t capacity);
+
+/*
+ * Add a file descriptor, sleeping while the queue is full
+ * enqueued_ns: Timestamp stored with it, see lockfree_queue_oldest
+ * Returns 0 on success or if the queue was shut down (nothing is added then)
+ */
+int lockfree_enqueue(lockfree_queue_t *queue, int fd, long long enqueued_ns);
+
+/*
+ * Remove the oldest file descriptor, sleeping while the queue is empty
+ * enqueued_ns: Set to the timestamp it was enqueued with, unless NULL
+ * Returns the file descriptor, or 0 if the queue was shut down
+ */
+int lockfree_dequeue(lockfree_queue_t *queue, long long *enqueued_ns);
+
+/*
+ * lockfree_dequeue, giving up if the queue stays empty for too long
+ * timeout_ms: Longest to wait, -1 to wait as long as it takes
+ * Returns the file descriptor, 0 if the queue was shut down, or LOCKFREE_TIMEOUT
+ */
+int lockfree_dequeue_timed(lockfree_queue_t *queue, long long *enqueued_ns, int timeout_ms);
+
+/*
+ * Remove the oldest file descriptor if it was enqueued before a given time.
+ * Never waits.
+ * before_ns: Only take it if its timestamp is older than this
+ * Returns the file descriptor, or -1 if the queue is empty or its oldest item is newer
+ */
+int lockfree_dequeue_older(lockfree_queue_t *queue, long long before_ns);
+
+/*
+ * Wake every sleeping thread and make all further calls return right away
+ */
+void lockfree_queue_shutdown(lockfree_queue_t *queue);
+
+/*
+ * Number of items in the queue right now (approximate while threads are using it)
+ */
+size_t lockfree_queue_length(lockfree_queue_t *queue);
+
+/*
+ * Timestamp the oldest item was enqueued with, or 0 if the queue is empty
+ * (approximate while threads are using it)
+ */
+long long lockfree_queue_oldest(lockfree_queue_t *queue);
+
+/*
+ * Free the ring. No threads may still be using the queue.
+ */
+void lockfree_queue_free(lockfree_queue_t *queue);
+
+#endif // LOCKFREE_QUEUE_H
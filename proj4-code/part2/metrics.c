@@ -0,0 +1,307 @@
+#define _GNU_SOURCE // open_memstream
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+static const int status_codes[] = METRICS_STATUS_CODES;
+static const char *deadline_names[N_DEADLINES] = { "header", "write", "idle" };
+
+// A counter only its own thread writes: a plain read of it is safe there, and
+// the relaxed store just keeps a scrape from ever seeing half a write
+#define BUMP(counter, amount) __atomic_store_n(&(counter), (counter) + (amount), __ATOMIC_RELAXED)
+#define READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+long long metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int metrics_init(metrics_t *metrics) {
+    // aligned so each thread's set really does start its own cache line
+    metrics->threads = aligned_alloc(CACHE_LINE, (METRICS_MAX_THREADS + 1) * sizeof(thread_metrics_t));
+    if (metrics->threads == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    memset(metrics->threads, 0, (METRICS_MAX_THREADS + 1) * sizeof(thread_metrics_t));
+    strcpy(metrics->threads[METRICS_MAX_THREADS].name, "overflow");
+    metrics->n_threads = 0;
+    memset(metrics->queues, 0, sizeof(metrics->queues));
+    if (pthread_mutex_init(&metrics->lock, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        free(metrics->threads);
+        return -1;
+    }
+    metrics->start_ns = metrics_now_ns();
+    metrics->access_log = NULL;
+    metrics->cache = NULL;
+    metrics->gzip_cache = NULL;
+    metrics->stat_cache = NULL;
+    return 0;
+}
+
+thread_metrics_t *metrics_register(metrics_t *metrics, const char *role) {
+    int index = __atomic_fetch_add(&metrics->n_threads, 1, __ATOMIC_RELAXED);
+    if (index >= METRICS_MAX_THREADS) {
+        return &metrics->threads[METRICS_MAX_THREADS];
+    }
+    thread_metrics_t *stats = &metrics->threads[index];
+    char name[sizeof(stats->name)];
+    snprintf(name, sizeof(name), "%s-%d", role, index);
+    pthread_mutex_lock(&metrics->lock); // a scrape going on right now mustn't read a half-written name
+    memcpy(stats->name, name, sizeof(name));
+    pthread_mutex_unlock(&metrics->lock);
+    return stats;
+}
+
+int metrics_watch_queue(metrics_t *metrics, connection_queue_t *queue) {
+    pthread_mutex_lock(&metrics->lock);
+    for (int i = 0; i < METRICS_MAX_QUEUES; i++) {
+        if (metrics->queues[i] == NULL) {
+            metrics->queues[i] = queue;
+            pthread_mutex_unlock(&metrics->lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&metrics->lock);
+    return -1;
+}
+
+void metrics_unwatch_queue(metrics_t *metrics, connection_queue_t *queue) {
+    pthread_mutex_lock(&metrics->lock);
+    for (int i = 0; i < METRICS_MAX_QUEUES; i++) {
+        if (metrics->queues[i] == queue) {
+            metrics->queues[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&metrics->lock);
+}
+
+void metrics_record_response(thread_metrics_t *stats, int status, off_t bytes, long long latency_ns) {
+    int code = 0;
+    while (code < METRICS_N_STATUSES - 1 && status_codes[code] != status) {
+        code++;
+    }
+    BUMP(stats->requests[code], 1);
+    BUMP(stats->bytes_sent, bytes);
+
+    // smallest i with latency <= 16us * 2^i
+    unsigned long long units = latency_ns <= 0 ? 0 : (latency_ns + 15999) / 16000;
+    int bucket = units <= 1 ? 0 : 64 - __builtin_clzll(units - 1);
+    if (bucket > METRICS_LATENCY_BUCKETS) {
+        bucket = METRICS_LATENCY_BUCKETS;
+    }
+    BUMP(stats->latency[bucket], 1);
+    BUMP(stats->latency_sum_ns, latency_ns > 0 ? latency_ns : 0);
+}
+
+void metrics_add_busy(thread_metrics_t *stats, long long busy_ns) {
+    BUMP(stats->busy_ns, busy_ns);
+}
+
+void metrics_add_enqueue(thread_metrics_t *stats, long long blocked_ns) {
+    BUMP(stats->enqueues, 1);
+    BUMP(stats->enqueue_block_ns, blocked_ns);
+}
+
+void metrics_add_shed(thread_metrics_t *stats) {
+    BUMP(stats->shed, 1);
+}
+
+void metrics_record_pool(thread_metrics_t *stats, int n_workers, int grown, int shrunk) {
+    __atomic_store_n(&stats->pool_workers, n_workers, __ATOMIC_RELAXED);
+    BUMP(stats->pool_grown, grown);
+    BUMP(stats->pool_shrunk, shrunk);
+}
+
+void metrics_add_steal(thread_metrics_t *stats) {
+    BUMP(stats->steals, 1);
+}
+
+void metrics_add_yield(thread_metrics_t *stats) {
+    BUMP(stats->yields, 1);
+}
+
+void metrics_add_timeout(thread_metrics_t *stats, int kind) {
+    BUMP(stats->timeouts[kind], 1);
+}
+
+// Writes every metric in the Prometheus text format. Server-wide series are
+// the sums of every thread's counters; busy time stays per thread.
+static void render(metrics_t *metrics, FILE *out) {
+    int n_threads = READ(metrics->n_threads);
+    if (n_threads > METRICS_MAX_THREADS) {
+        n_threads = METRICS_MAX_THREADS + 1; // the shared overflow set is in use too
+    }
+    thread_metrics_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < n_threads; i++) {
+        thread_metrics_t *stats = &metrics->threads[i];
+        for (int j = 0; j < METRICS_N_STATUSES; j++) {
+            total.requests[j] += READ(stats->requests[j]);
+        }
+        for (int j = 0; j <= METRICS_LATENCY_BUCKETS; j++) {
+            total.latency[j] += READ(stats->latency[j]);
+        }
+        total.bytes_sent += READ(stats->bytes_sent);
+        total.latency_sum_ns += READ(stats->latency_sum_ns);
+        total.enqueues += READ(stats->enqueues);
+        total.enqueue_block_ns += READ(stats->enqueue_block_ns);
+        total.shed += READ(stats->shed);
+        total.steals += READ(stats->steals);
+        total.yields += READ(stats->yields);
+        for (int j = 0; j < N_DEADLINES; j++) {
+            total.timeouts[j] += READ(stats->timeouts[j]);
+        }
+        total.pool_workers += READ(stats->pool_workers);
+        total.pool_grown += READ(stats->pool_grown);
+        total.pool_shrunk += READ(stats->pool_shrunk);
+    }
+
+    fprintf(out, "# HELP http_requests_total Responses sent, by status code.\n"
+                 "# TYPE http_requests_total counter\n");
+    for (int i = 0; i < METRICS_N_STATUSES - 1; i++) {
+        fprintf(out, "http_requests_total{code=\"%d\"} %llu\n", status_codes[i], total.requests[i]);
+    }
+    fprintf(out, "http_requests_total{code=\"other\"} %llu\n", total.requests[METRICS_N_STATUSES - 1]);
+
+    fprintf(out, "# HELP http_response_bytes_total Header and body bytes sent.\n"
+                 "# TYPE http_response_bytes_total counter\n"
+                 "http_response_bytes_total %llu\n", total.bytes_sent);
+
+    fprintf(out, "# HELP http_request_duration_seconds Time from a whole request arriving to its response being sent.\n"
+                 "# TYPE http_request_duration_seconds histogram\n");
+    unsigned long long count = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        count += total.latency[i];
+        fprintf(out, "http_request_duration_seconds_bucket{le=\"%g\"} %llu\n", 16e-6 * (1 << i), count);
+    }
+    count += total.latency[METRICS_LATENCY_BUCKETS];
+    fprintf(out, "http_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+                 "http_request_duration_seconds_sum %.9f\n"
+                 "http_request_duration_seconds_count %llu\n", count, total.latency_sum_ns / 1e9, count);
+
+    fprintf(out, "# HELP http_thread_busy_seconds_total Time each thread spent serving rather than waiting for work.\n"
+                 "# TYPE http_thread_busy_seconds_total counter\n");
+    pthread_mutex_lock(&metrics->lock);
+    for (int i = 0; i < n_threads; i++) {
+        fprintf(out, "http_thread_busy_seconds_total{thread=\"%s\"} %.9f\n", metrics->threads[i].name,
+                READ(metrics->threads[i].busy_ns) / 1e9);
+    }
+
+    fprintf(out, "# HELP http_queue_length Connections waiting in each connection queue.\n"
+                 "# TYPE http_queue_length gauge\n");
+    for (int i = 0; i < METRICS_MAX_QUEUES; i++) {
+        if (metrics->queues[i] != NULL) {
+            fprintf(out, "http_queue_length{queue=\"%d\"} %zu\n", i, connection_queue_length(metrics->queues[i]));
+        }
+    }
+    pthread_mutex_unlock(&metrics->lock);
+
+    fprintf(out, "# HELP http_queue_enqueues_total Connections handed from an acceptor to a queue.\n"
+                 "# TYPE http_queue_enqueues_total counter\n"
+                 "http_queue_enqueues_total %llu\n", total.enqueues);
+    fprintf(out, "# HELP http_queue_enqueue_block_seconds_total Time acceptors spent waiting for room in a queue.\n"
+                 "# TYPE http_queue_enqueue_block_seconds_total counter\n"
+                 "http_queue_enqueue_block_seconds_total %.9f\n", total.enqueue_block_ns / 1e9);
+    fprintf(out, "# HELP http_shed_total Connections answered with a 503 instead of queued.\n"
+                 "# TYPE http_shed_total counter\n"
+                 "http_shed_total %llu\n", total.shed);
+    fprintf(out, "# HELP http_timeouts_total Connections closed for missing a deadline.\n"
+                 "# TYPE http_timeouts_total counter\n");
+    for (int i = 0; i < N_DEADLINES; i++) {
+        fprintf(out, "http_timeouts_total{deadline=\"%s\"} %llu\n", deadline_names[i], total.timeouts[i]);
+    }
+    fprintf(out, "# HELP http_steals_total Connections a work-stealing worker took from one of its peers.\n"
+                 "# TYPE http_steals_total counter\n"
+                 "http_steals_total %llu\n", total.steals);
+    fprintf(out, "# HELP http_response_yields_total Big responses put back in line partway through so a smaller one could go first.\n"
+                 "# TYPE http_response_yields_total counter\n"
+                 "http_response_yields_total %llu\n", total.yields);
+    fprintf(out, "# HELP http_workers Worker threads running in resizable pools.\n"
+                 "# TYPE http_workers gauge\n"
+                 "http_workers %llu\n", total.pool_workers);
+    fprintf(out, "# HELP http_worker_pool_resizes_total Workers added because connections waited too long, or retired after sitting idle.\n"
+                 "# TYPE http_worker_pool_resizes_total counter\n"
+                 "http_worker_pool_resizes_total{direction=\"grow\"} %llu\n"
+                 "http_worker_pool_resizes_total{direction=\"shrink\"} %llu\n", total.pool_grown, total.pool_shrunk);
+
+    file_cache_t *caches[] = { metrics->cache, metrics->gzip_cache };
+    const char *cache_names[] = { "file", "gzip" };
+    file_cache_stats_t cache_stats[2];
+    for (int i = 0; i < 2; i++) {
+        if (caches[i] != NULL) {
+            file_cache_stats(caches[i], &cache_stats[i]);
+        }
+    }
+    fprintf(out, "# HELP http_cache_lookups_total Cache lookups, by whether the entry was there.\n"
+                 "# TYPE http_cache_lookups_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        if (caches[i] != NULL) {
+            fprintf(out, "http_cache_lookups_total{cache=\"%s\",result=\"hit\"} %lu\n"
+                         "http_cache_lookups_total{cache=\"%s\",result=\"miss\"} %lu\n",
+                    cache_names[i], cache_stats[i].hits, cache_names[i], cache_stats[i].misses);
+        }
+    }
+    fprintf(out, "# HELP http_cache_coalesced_loads_total Misses that waited for another request's load of the same file instead of loading it again.\n"
+                 "# TYPE http_cache_coalesced_loads_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        if (caches[i] != NULL) {
+            fprintf(out, "http_cache_coalesced_loads_total{cache=\"%s\"} %lu\n", cache_names[i], cache_stats[i].coalesced);
+        }
+    }
+
+    if (metrics->stat_cache != NULL) {
+        stat_cache_stats_t stat_stats;
+        stat_cache_stats(metrics->stat_cache, &stat_stats);
+        fprintf(out, "# HELP http_stat_cache_lookups_total Stat cache lookups, by whether the path's stat (or 404) was remembered.\n"
+                     "# TYPE http_stat_cache_lookups_total counter\n"
+                     "http_stat_cache_lookups_total{result=\"hit\"} %lu\n"
+                     "http_stat_cache_lookups_total{result=\"miss\"} %lu\n", stat_stats.hits, stat_stats.misses);
+        fprintf(out, "# HELP http_stat_cache_evictions_total Remembered paths pushed out by newer ones before they expired.\n"
+                     "# TYPE http_stat_cache_evictions_total counter\n"
+                     "http_stat_cache_evictions_total %lu\n", stat_stats.evictions);
+        fprintf(out, "# HELP http_stat_cache_entries Paths remembered right now.\n"
+                     "# TYPE http_stat_cache_entries gauge\n"
+                     "http_stat_cache_entries %lu\n", stat_stats.entries);
+    }
+
+    if (metrics->access_log != NULL) {
+        fprintf(out, "# HELP http_access_log_dropped_total Access log entries dropped because a ring was full.\n"
+                     "# TYPE http_access_log_dropped_total counter\n"
+                     "http_access_log_dropped_total %llu\n", access_log_dropped(metrics->access_log));
+    }
+
+    fprintf(out, "# HELP http_uptime_seconds Time since the server started.\n"
+                 "# TYPE http_uptime_seconds gauge\n"
+                 "http_uptime_seconds %.3f\n", (metrics_now_ns() - metrics->start_ns) / 1e9);
+}
+
+int metrics_response(metrics_t *metrics, http_response_t *resp, int keep_alive) {
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (out == NULL) {
+        perror("open_memstream");
+    }
+    else {
+        render(metrics, out);
+        if (fclose(out) != 0) {
+            perror("fclose");
+            free(body);
+            body = NULL;
+        }
+    }
+    // resp gets set up even on failure, so the caller can always clean it up
+    return http_response_init_body(resp, "text/plain; version=0.0.4", body, len, keep_alive);
+}
+
+void metrics_free(metrics_t *metrics) {
+    pthread_mutex_destroy(&metrics->lock);
+    free(metrics->threads);
+}
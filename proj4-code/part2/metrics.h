@@ -0,0 +1,155 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "access_log.h"
+#include "connection_queue.h"
+#include "file_cache.h"
+#include "http.h"
+#include "stat_cache.h"
+
+#define METRICS_PATH "/__metrics"  // resource that answers with the metrics instead of a file
+#define METRICS_MAX_THREADS 256    // threads with their own counters, any more share one extra set
+#define METRICS_MAX_QUEUES 64      // connection queues whose length is reported
+#define METRICS_LATENCY_BUCKETS 20 // bucket i counts responses taken at most 16us * 2^i, up to about 8s
+
+// Status codes counted separately, everything else is counted as "other"
+#define METRICS_STATUS_CODES { 200, 206, 304, 404, 415, 416 }
+#define METRICS_N_STATUSES 7
+
+// Deadlines a connection can miss, each counted separately (see deadline.h)
+#define DEADLINE_HEADER 0 // a request has to arrive in full within header_timeout_ms of its start
+#define DEADLINE_WRITE 1  // a response has to be taken in full within write_timeout_ms
+#define DEADLINE_IDLE 2   // a kept-alive connection's next request has to start within idle_timeout_ms
+#define N_DEADLINES 3
+
+// Counters belonging to one thread. Only that thread writes them, so there are
+// no locked instructions on the hot path, and each set starts on its own cache
+// line so two threads' counters never share one. A scrape reads every set and
+// adds them up.
+typedef struct {
+    _Alignas(CACHE_LINE) char name[24]; // e.g. "worker-3", the thread label on per-thread series
+    unsigned long long requests[METRICS_N_STATUSES];
+    unsigned long long bytes_sent;
+    unsigned long long latency[METRICS_LATENCY_BUCKETS + 1]; // the last bucket is everything slower
+    unsigned long long latency_sum_ns;
+    unsigned long long busy_ns;          // time spent serving rather than waiting for work
+    unsigned long long enqueues;         // acceptors: connections handed to a queue
+    unsigned long long enqueue_block_ns; // acceptors: time spent waiting for room in the queue
+    unsigned long long shed;             // acceptors: connections turned away with a 503
+    unsigned long long timeouts[N_DEADLINES]; // connections closed for missing each kind of deadline
+    unsigned long long steals;           // work-stealing workers: connections taken from another worker
+    unsigned long long yields;           // size-ordered workers: big responses set aside mid-body for smaller ones
+    // worker pools keep these in the pool's own set and write them under the pool's lock
+    unsigned long long pool_workers; // workers running right now
+    unsigned long long pool_grown;   // workers added because connections waited too long
+    unsigned long long pool_shrunk;  // workers that left after sitting idle
+} thread_metrics_t;
+
+typedef struct {
+    thread_metrics_t *threads; // METRICS_MAX_THREADS + 1 sets
+    int n_threads;             // sets handed out so far
+    pthread_mutex_t lock;      // guards queues
+    connection_queue_t *queues[METRICS_MAX_QUEUES]; // NULL for an empty slot
+    long long start_ns;
+    access_log_t *access_log; // for its dropped count, NULL if there's no access log
+    file_cache_t *cache;      // for hit, miss and coalesced load counts, NULL if caching is off
+    file_cache_t *gzip_cache; // the same for compressed bodies
+    stat_cache_t *stat_cache; // for its hit, miss and eviction counts, NULL if it's off
+} metrics_t;
+
+/*
+ * Initialize an empty set of metrics
+ * Returns 0 on success or -1 on error
+ */
+int metrics_init(metrics_t *metrics);
+
+/*
+ * Hand out a set of counters for the calling thread to record into. Thread
+ * safe. Past METRICS_MAX_THREADS every thread gets the same shared set, whose
+ * counts are only approximate.
+ * role: What the thread does, e.g. "worker" or "loop"
+ * Returns the thread's counters
+ */
+thread_metrics_t *metrics_register(metrics_t *metrics, const char *role);
+
+/*
+ * Report a connection queue's length from now on
+ * Returns 0 on success or -1 if there's no room left to watch it
+ */
+int metrics_watch_queue(metrics_t *metrics, connection_queue_t *queue);
+
+/*
+ * Stop reporting a queue, before it's freed
+ */
+void metrics_unwatch_queue(metrics_t *metrics, connection_queue_t *queue);
+
+/*
+ * Returns a monotonic timestamp in nanoseconds, for timing what gets recorded
+ */
+long long metrics_now_ns(void);
+
+/*
+ * Count a response that has been completely sent
+ * status: Its status code
+ * bytes: Header and body bytes sent
+ * latency_ns: Time from having the whole request to having sent the whole response
+ */
+void metrics_record_response(thread_metrics_t *stats, int status, off_t bytes, long long latency_ns);
+
+/*
+ * Add to the time a thread spent working
+ */
+void metrics_add_busy(thread_metrics_t *stats, long long busy_ns);
+
+/*
+ * Count a connection handed to a queue, and how long the enqueue waited for room
+ */
+void metrics_add_enqueue(thread_metrics_t *stats, long long blocked_ns);
+
+/*
+ * Count a connection turned away with a 503 instead of queued
+ */
+void metrics_add_shed(thread_metrics_t *stats);
+
+/*
+ * Count a connection a work-stealing worker took from one of its peers
+ */
+void metrics_add_steal(thread_metrics_t *stats);
+
+/*
+ * Count a big response a size-ordered worker put back in the queue partway
+ * through, because a smaller one was waiting
+ */
+void metrics_add_yield(thread_metrics_t *stats);
+
+/*
+ * Count a connection closed for missing a deadline
+ * kind: DEADLINE_HEADER, DEADLINE_WRITE or DEADLINE_IDLE
+ */
+void metrics_add_timeout(thread_metrics_t *stats, int kind);
+
+/*
+ * Record a worker pool's size after it changed
+ * n_workers: Workers running now
+ * grown: Workers just added because connections waited too long
+ * shrunk: Workers that just left after sitting idle
+ */
+void metrics_record_pool(thread_metrics_t *stats, int n_workers, int grown, int shrunk);
+
+/*
+ * Build a 200 response carrying every metric in the Prometheus text format
+ * resp: The response to fill in, must be passed to http_response_cleanup
+ * even on error
+ * Returns 0 on success or 1 on error
+ */
+int metrics_response(metrics_t *metrics, http_response_t *resp, int keep_alive);
+
+/*
+ * Free what metrics_init set up. No thread may record anything afterwards.
+ */
+void metrics_free(metrics_t *metrics);
+
+#endif // METRICS_H
@@ -0,0 +1,152 @@
+// Throughput benchmark for the request parser, in bytes per CPU cycle.
+// Parses a browser-sized request over and over, once with the whole header
+// available and then fed in small pieces the way a slow client would send it.
+// Also checks that a request's body is left to the caller rather than parsed as
+// the next request, and that Connection tokens are matched whole.
+// Usage: ./parser_bench [iterations, default 1000000]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "http_parser.h"
+
+static const char REQUEST[] =
+    "GET /gatsby.txt HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "If-None-Match: \"5f2b-1a3c\"\r\n"
+    "Range: bytes=0-1023\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "\r\n";
+
+// A body that looks like a request of its own
+static const char BODY_REQUEST[] =
+    "POST /quote.txt HTTP/1.1\r\n"
+    "Host: localhost:8000\r\n"
+    "Content-Length: 26\r\n"
+    "\r\n"
+    "GET /nope.txt HTTP/1.1\r\n\r\n";
+
+// Timestamp in CPU cycles where we can read the counter, nanoseconds otherwise
+static unsigned long long ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Parses REQUEST 'iterations' times, making 'chunk' more bytes visible per call
+// Returns bytes per tick, or -1 if a parse went wrong
+static double run(long iterations, int chunk) {
+    int len = strlen(REQUEST);
+    long checksum = 0; // keeps the compiler from skipping the work
+    unsigned long long start = ticks();
+    for (long i = 0; i < iterations; i++) {
+        http_request_t req;
+        http_parser_init(&req);
+        int result = 0;
+        for (int seen = chunk < len ? chunk : len; result == 0; seen = seen + chunk < len ? seen + chunk : len) {
+            result = http_parse(&req, REQUEST, seen, len + 1);
+        }
+        if (result != len || req.range.len == 0 || req.if_none_match.len == 0) {
+            fprintf(stderr, "parse failed: %d\n", result);
+            return -1;
+        }
+        checksum += req.path.len + req.accept_encoding.len + req.keep_alive;
+    }
+    unsigned long long elapsed = ticks() - start;
+    if (checksum == 0) {
+        return -1;
+    }
+    return (double) iterations * len / elapsed;
+}
+
+// Makes sure the parser stops at the end of BODY_REQUEST's header and says a
+// body follows, so a keep-alive loop won't answer the body as a request
+// Returns 0 if it does or -1 if it doesn't
+static int check_body(void) {
+    int len = strlen(BODY_REQUEST);
+    int header_len = strstr(BODY_REQUEST, "\r\n\r\n") + 4 - BODY_REQUEST;
+    http_request_t req;
+    http_parser_init(&req);
+    int result = http_parse(&req, BODY_REQUEST, len, len + 1);
+    if (result != header_len || !req.has_body || req.content_length.len != 2 ||
+        strncmp(req.content_length.start, "26", 2) != 0) {
+        fprintf(stderr, "request body not framed: parsed %d of %d header bytes, has_body %d\n",
+                result, header_len, req.has_body);
+        return -1;
+    }
+    return 0;
+}
+
+// Makes sure a Connection value only counts when the token is a whole element
+// of it, not just somewhere inside
+// Returns 0 if every case comes out right or -1 if one doesn't
+static int check_tokens(void) {
+    static const struct {
+        const char *request;
+        int keep_alive;
+    } cases[] = {
+        {"GET / HTTP/1.1\r\nConnection: xclosey\r\n\r\n", 1},
+        {"GET / HTTP/1.0\r\nConnection: not-keep-alive-really\r\n\r\n", 0},
+        {"GET / HTTP/1.1\r\nConnection: Upgrade ,  Close\r\n\r\n", 0},
+        {"GET / HTTP/1.0\r\nConnection: keep-alive,upgrade\r\n\r\n", 1},
+    };
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        int len = strlen(cases[i].request);
+        http_request_t req;
+        http_parser_init(&req);
+        if (http_parse(&req, cases[i].request, len, len + 1) != len || req.keep_alive != cases[i].keep_alive) {
+            fprintf(stderr, "Connection token matched wrong: keep_alive %d for %.*s\n", req.keep_alive,
+                    req.connection.len, req.connection.start);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (iterations < 1) {
+        printf("Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    const char *unit = "bytes/cycle";
+#else
+    const char *unit = "bytes/ns";
+#endif
+    if (check_body() != 0 || check_tokens() != 0) {
+        return 1;
+    }
+    printf("request is %zu bytes, %ld iterations\n", strlen(REQUEST), iterations);
+    int chunks[] = { 100000, 64, 16, 1 };
+    for (int i = 0; i < (int) (sizeof(chunks) / sizeof(chunks[0])); i++) {
+        long n = chunks[i] == 1 ? iterations / 10 : iterations; // byte at a time is slow, keep the run short
+        double rate = run(n, chunks[i]);
+        if (rate < 0) {
+            return 1;
+        }
+        if (chunks[i] >= (int) strlen(REQUEST)) {
+            printf("%-22s %6.2f %s\n", "whole request", rate, unit);
+        }
+        else {
+            printf("%3d-byte reads %7s %6.2f %s\n", chunks[i], "", rate, unit);
+        }
+    }
+    return 0;
+}
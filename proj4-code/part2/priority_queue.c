@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "priority_queue.h"
+
+// Returns 1 if a has to come out before b
+static int before(const priority_entry_t *a, const priority_entry_t *b) {
+    return a->key < b->key || (a->key == b->key && a->seq < b->seq);
+}
+
+static void swap_entries(priority_entry_t *a, priority_entry_t *b) {
+    priority_entry_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Moves the entry at i up until its parent comes before it. Lock must be held.
+static void sift_up(priority_queue_t *queue, size_t i) {
+    while (i > 0 && before(&queue->heap[i], &queue->heap[(i - 1) / 2])) {
+        swap_entries(&queue->heap[i], &queue->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+}
+
+// Moves the entry at i down until both children come after it. Lock must be held.
+static void sift_down(priority_queue_t *queue, size_t i) {
+    while (1) {
+        size_t first = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if (left < queue->length && before(&queue->heap[left], &queue->heap[first])) {
+            first = left;
+        }
+        if (right < queue->length && before(&queue->heap[right], &queue->heap[first])) {
+            first = right;
+        }
+        if (first == i) {
+            return;
+        }
+        swap_entries(&queue->heap[i], &queue->heap[first]);
+        i = first;
+    }
+}
+
+// Takes the front entry off the heap. It must not be empty. Lock must be held.
+static void *remove_front(priority_queue_t *queue) {
+    void *item = queue->heap[0].item;
+    queue->length--;
+    if (queue->length > 0) {
+        queue->heap[0] = queue->heap[queue->length];
+        sift_down(queue, 0);
+    }
+    return item;
+}
+
+int priority_queue_init(priority_queue_t *queue, size_t capacity) {
+    queue->capacity = capacity > 0 ? capacity : 1;
+    queue->heap = malloc(queue->capacity * sizeof(priority_entry_t));
+    if (queue->heap == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    queue->length = 0;
+    queue->next_seq = 0;
+    queue->shutdown = 0;
+    if (pthread_mutex_init(&queue->lock, NULL) != 0 || pthread_cond_init(&queue->nonempty, NULL) != 0) {
+        fprintf(stderr, "pthread init failed\n");
+        free(queue->heap);
+        return -1;
+    }
+    return 0;
+}
+
+int priority_queue_push(priority_queue_t *queue, void *item, long long key) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->shutdown) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+    if (queue->length == queue->capacity) {
+        priority_entry_t *bigger = realloc(queue->heap, 2 * queue->capacity * sizeof(priority_entry_t));
+        if (bigger == NULL) {
+            perror("realloc");
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        queue->heap = bigger;
+        queue->capacity *= 2;
+    }
+    priority_entry_t *entry = &queue->heap[queue->length];
+    entry->key = key;
+    entry->seq = queue->next_seq++;
+    entry->item = item;
+    queue->length++;
+    sift_up(queue, queue->length - 1);
+    pthread_cond_signal(&queue->nonempty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+void *priority_queue_pop(priority_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->length == 0 && !queue->shutdown) {
+        pthread_cond_wait(&queue->nonempty, &queue->lock);
+    }
+    void *item = queue->shutdown ? NULL : remove_front(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return item;
+}
+
+void *priority_queue_exchange(priority_queue_t *queue, void *item, long long key) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->shutdown || queue->length == 0 || queue->heap[0].key >= key) {
+        pthread_mutex_unlock(&queue->lock);
+        return item;
+    }
+    // put item where the front was and let it sink, one pass instead of a pop and a push
+    void *front = queue->heap[0].item;
+    queue->heap[0].key = key;
+    queue->heap[0].seq = queue->next_seq++;
+    queue->heap[0].item = item;
+    sift_down(queue, 0);
+    pthread_mutex_unlock(&queue->lock);
+    return front;
+}
+
+size_t priority_queue_length(priority_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    size_t length = queue->length;
+    pthread_mutex_unlock(&queue->lock);
+    return length;
+}
+
+void priority_queue_shutdown(priority_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->shutdown = 1;
+    pthread_cond_broadcast(&queue->nonempty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void priority_queue_free(priority_queue_t *queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->nonempty);
+    free(queue->heap);
+    queue->heap = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef PRIORITY_QUEUE_H
+#define PRIORITY_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// One waiting item and what it's ordered by
+typedef struct {
+    long long key;         // smallest comes out first
+    unsigned long long seq; // ties go to whoever was pushed first
+    void *item;
+} priority_entry_t;
+
+// Unbounded min-heap of pointers guarded by a mutex, for handing work to
+// threads in order of a key instead of in order of arrival. Grows as needed,
+// so a push never has to wait for room.
+typedef struct {
+    priority_entry_t *heap;
+    size_t length;
+    size_t capacity;
+    unsigned long long next_seq;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+} priority_queue_t;
+
+/*
+ * Initialize an empty priority queue
+ * capacity: Slots to start with, it grows past this when it has to
+ * Returns 0 on success or -1 on error
+ */
+int priority_queue_init(priority_queue_t *queue, size_t capacity);
+
+/*
+ * Add an item. Wakes one thread waiting in priority_queue_pop.
+ * key: Where it goes in line, smaller keys come out first
+ * Returns 0 on success, or -1 on error or if the queue is shut down
+ */
+int priority_queue_push(priority_queue_t *queue, void *item, long long key);
+
+/*
+ * Remove the item with the smallest key, waiting for one if the queue is empty
+ * Returns the item, or NULL once the queue is shut down
+ */
+void *priority_queue_pop(priority_queue_t *queue);
+
+/*
+ * Trade an item the caller is holding for the one at the front of the queue,
+ * if that one's key is smaller. Never waits.
+ * key: Where item goes in line if it's put back
+ * Returns whichever item the caller should carry on with: item itself if
+ * nothing waiting comes before it (or the queue is shut down)
+ */
+void *priority_queue_exchange(priority_queue_t *queue, void *item, long long key);
+
+/*
+ * Number of items waiting right now
+ */
+size_t priority_queue_length(priority_queue_t *queue);
+
+/*
+ * Wake every thread waiting in priority_queue_pop and make it return NULL.
+ * Items still in the queue stay there, the caller keeps track of them.
+ */
+void priority_queue_shutdown(priority_queue_t *queue);
+
+/*
+ * Free the heap. No threads may still be using the queue.
+ */
+void priority_queue_free(priority_queue_t *queue);
+
+#endif // PRIORITY_QUEUE_H
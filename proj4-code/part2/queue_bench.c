@@ -0,0 +1,222 @@
+// Microbenchmark for the connection queue: N producers hand items to N consumers
+// through the mutex queue and through the lock-free queue, for N = 1, 2, 4, ... max.
+// The last column is work-stealing dispatch instead: N workers with a deque
+// each, where half of them are handed every item and the other half only get
+// work by stealing it.
+// Usage: ./queue_bench [max threads per side, default 64] [items per run, default 1000000]
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "connection_queue.h"
+#include "steal_deque.h"
+
+#define STOP_ITEM -2 // one per consumer after the producers finish, never a real item
+
+typedef struct {
+    connection_queue_t *queue;
+    long n_items;      // producers: how many to enqueue
+    long first_item;   // producers: items are first_item, first_item + 1, ...
+    long long sum;     // consumers: total of everything dequeued, checked at the end
+    long n_taken;      // consumers: how many items they got
+} bench_args_t;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *produce(void *arg) {
+    bench_args_t *args = (bench_args_t *) arg;
+    for (long i = 0; i < args->n_items; i++) {
+        if (connection_enqueue(args->queue, (int) (args->first_item + i)) == -1) {
+            fprintf(stderr, "connection_enqueue failed\n");
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *consume(void *arg) {
+    bench_args_t *args = (bench_args_t *) arg;
+    while (1) {
+        int item = connection_dequeue(args->queue);
+        if (item == STOP_ITEM || item <= 0) { // items start at 1, 0 would mean shut down
+            break;
+        }
+        args->sum += item;
+        args->n_taken++;
+    }
+    return NULL;
+}
+
+// Runs one producer/consumer round. Returns items per second, or -1 on error
+static double run(int kind, size_t capacity, int n_threads, long n_items) {
+    connection_queue_t *queue = malloc(sizeof(connection_queue_t));
+    if (queue == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    int init_result = kind == QUEUE_LOCKFREE ? connection_queue_init_lockfree(queue, capacity)
+                                             : connection_queue_init(queue);
+    if (init_result == -1) {
+        free(queue);
+        return -1;
+    }
+
+    pthread_t producers[n_threads];
+    pthread_t consumers[n_threads];
+    bench_args_t producer_args[n_threads];
+    bench_args_t consumer_args[n_threads];
+    long per_thread = n_items / n_threads;
+
+    double start = now_sec();
+    for (int i = 0; i < n_threads; i++) {
+        memset(&consumer_args[i], 0, sizeof(bench_args_t));
+        consumer_args[i].queue = queue;
+        pthread_create(&consumers[i], NULL, consume, &consumer_args[i]);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        memset(&producer_args[i], 0, sizeof(bench_args_t));
+        producer_args[i].queue = queue;
+        producer_args[i].n_items = per_thread;
+        producer_args[i].first_item = 1 + i * per_thread;
+        pthread_create(&producers[i], NULL, produce, &producer_args[i]);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        connection_enqueue(queue, STOP_ITEM);
+    }
+    long long sum = 0;
+    long n_taken = 0;
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(consumers[i], NULL);
+        sum += consumer_args[i].sum;
+        n_taken += consumer_args[i].n_taken;
+    }
+    double elapsed = now_sec() - start;
+
+    connection_queue_shutdown(queue);
+    connection_queue_free(queue);
+
+    long total = per_thread * n_threads;
+    if (n_taken != total || sum != (long long) total * (total + 1) / 2) {
+        fprintf(stderr, "lost or duplicated items: took %ld of %ld\n", n_taken, total);
+        return -1;
+    }
+    return total / elapsed;
+}
+
+typedef struct {
+    steal_deque_t *deques; // one per worker
+    int n_workers;
+    atomic_long *n_left;   // items nobody has taken yet
+    int index;
+    long n_items;          // items this worker pushes onto its own deque
+    long first_item;
+    long long sum;
+    long n_taken;
+} steal_args_t;
+
+// Pushes its own items (if it has any) and pops them back, then steals from
+// the others until every item has been taken
+static void *steal_work(void *arg) {
+    steal_args_t *args = (steal_args_t *) arg;
+    steal_deque_t *own = &args->deques[args->index];
+    long next = 0;
+    while (atomic_load_explicit(args->n_left, memory_order_relaxed) > 0) {
+        // keep a few items queued so thieves have something to take
+        while (next < args->n_items && steal_deque_length(own) < 16 &&
+               steal_deque_push(own, (void *) (args->first_item + next)) == 0) {
+            next++;
+        }
+        void *item = steal_deque_pop(own);
+        for (int i = 1; item == NULL && i < args->n_workers; i++) {
+            if (steal_deque_steal(&args->deques[(args->index + i) % args->n_workers], &item) != 1) {
+                item = NULL;
+            }
+        }
+        if (item != NULL) {
+            args->sum += (long) item;
+            args->n_taken++;
+            atomic_fetch_sub_explicit(args->n_left, 1, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+// Runs one work-stealing round. Returns items per second, or -1 on error
+static double run_steal(int n_threads, long n_items) {
+    steal_deque_t deques[n_threads];
+    pthread_t workers[n_threads];
+    steal_args_t args[n_threads];
+    int n_loaded = n_threads > 1 ? n_threads / 2 : 1; // workers that are handed items
+    long per_thread = n_items / n_loaded;
+    long total = per_thread * n_loaded;
+    atomic_long n_left;
+    atomic_init(&n_left, total);
+    for (int i = 0; i < n_threads; i++) {
+        if (steal_deque_init(&deques[i], 1024) == -1) {
+            return -1;
+        }
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < n_threads; i++) {
+        memset(&args[i], 0, sizeof(steal_args_t));
+        args[i].deques = deques;
+        args[i].n_workers = n_threads;
+        args[i].n_left = &n_left;
+        args[i].index = i;
+        if (i < n_loaded) {
+            args[i].n_items = per_thread;
+            args[i].first_item = 1 + i * per_thread;
+        }
+        pthread_create(&workers[i], NULL, steal_work, &args[i]);
+    }
+    long long sum = 0;
+    long n_taken = 0;
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(workers[i], NULL);
+        sum += args[i].sum;
+        n_taken += args[i].n_taken;
+    }
+    double elapsed = now_sec() - start;
+    for (int i = 0; i < n_threads; i++) {
+        steal_deque_free(&deques[i]);
+    }
+
+    if (n_taken != total || sum != (long long) total * (total + 1) / 2) {
+        fprintf(stderr, "lost or duplicated items: took %ld of %ld\n", n_taken, total);
+        return -1;
+    }
+    return total / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    long n_items = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_threads < 1 || n_items < max_threads) {
+        printf("Usage: %s [max threads per side] [items per run]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %16s %16s %16s %16s\n", "threads", "mutex (5)", "lockfree (8)", "lockfree (1024)", "steal (1024)");
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        double mutex = run(QUEUE_MUTEX, CAPACITY, n_threads, n_items);
+        double small = run(QUEUE_LOCKFREE, 8, n_threads, n_items);
+        double large = run(QUEUE_LOCKFREE, 1024, n_threads, n_items);
+        double steal = run_steal(n_threads, n_items);
+        if (mutex < 0 || small < 0 || large < 0 || steal < 0) {
+            return 1;
+        }
+        printf("%8d %14.0f/s %14.0f/s %14.0f/s %14.0f/s\n", n_threads, mutex, small, large, steal);
+    }
+    return 0;
+}
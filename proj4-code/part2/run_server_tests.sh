@@ -1,7 +1,7 @@
 #! /bin/bash
 
 mkdir -p downloaded_files
-./http_server server_files $PORT &
+./http_server server_files $PORT $SERVER_ARGS &
 http_server_pid=$!
 
 ./testy test_http_server.org $testnum
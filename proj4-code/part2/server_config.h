@@ -0,0 +1,50 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#define DEFAULT_IDLE_TIMEOUT_MS 5000 // how long a kept-alive connection waits for its next request
+#define DEFAULT_HEADER_TIMEOUT_MS 10000 // how long a request may take to arrive once it has started
+#define DEFAULT_WRITE_TIMEOUT_MS 30000  // how long the client may take to receive a whole response
+#define DEFAULT_MAX_REQUESTS 100     // requests answered on one connection before closing it
+#define DEFAULT_QUEUE_CAPACITY 1024  // threads mode: slots in the lock-free connection queue
+#define DEFAULT_GZIP_BUDGET_MB 16    // memory for compressed copies of text files
+#define DEFAULT_LISTEN_BACKLOG 128   // connections the kernel holds for each listening socket until accepted
+#define DEFAULT_SHARD_WORKERS 2      // sharded mode: worker threads per CPU
+#define DEFAULT_SJF_MAX_DELAY_MS 100 // size-ordered dispatch: longest smaller requests can keep a big one waiting
+
+#include <stddef.h>
+
+#include "access_log.h"
+#include "admission.h"
+#include "archive.h"
+#include "file_cache.h"
+#include "metrics.h"
+#include "stat_cache.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+// Settings picked on the command line that the serving code needs to see
+typedef struct {
+    const char *server_dir; // directory that requested resources are served from
+    archive_t *archive;     // tar archive to serve from instead of server_dir, NULL to serve the directory
+    int n_loops;            // epoll and uring modes: number of loop threads, sharded mode: number of shards
+    int listen_backlog;     // backlog passed to listen()
+    int shard_workers;      // sharded mode: worker threads in each shard
+    int idle_timeout_ms;    // 0 turns keep-alive off
+    int header_timeout_ms;  // 0 for no limit
+    int write_timeout_ms;   // 0 for no limit
+    int max_requests;       // at least 1
+    file_cache_t *cache;    // NULL if caching is turned off
+    file_cache_t *gzip_cache; // compressed copies of text files, NULL to only send precompressed .gz files
+    stat_cache_t *stat_cache; // recent stat results and 404s, NULL to stat every file that isn't cached
+    int queue_kind;         // threads and sharded modes: QUEUE_MUTEX or QUEUE_LOCKFREE, threads mode also QUEUE_STEAL or QUEUE_SJF
+    size_t queue_capacity;  // lock-free queue slots, rounded up to a power of two
+    metrics_t *metrics;     // every serving thread registers here and records what it does
+    int metrics_in_band;    // answer METRICS_PATH on the serving port, 0 when it has its own port
+    access_log_t *access_log; // NULL if requests aren't logged
+    tracer_t *tracer;       // threads, steal and sharded modes: samples requests to trace, NULL if they aren't traced
+    admission_config_t admission; // threads and sharded modes: when acceptors turn connections away
+    worker_pool_config_t pool; // threads mode: how many workers and when to add or retire them
+    long long sjf_max_delay_ns; // size-ordered dispatch: how far back in line a response's size can put it
+} server_config_t;
+
+#endif // SERVER_CONFIG_H
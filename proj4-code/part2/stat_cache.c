@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stat_cache.h"
+
+// Returns a monotonic timestamp in nanoseconds. The coarse clock is read from
+// the vDSO, so a lookup stays free of system calls.
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// FNV-1a, picks both the shard and the set within it
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static stat_shard_t *shard_for(stat_cache_t *cache, uint32_t hash) {
+    return &cache->shards[hash % STAT_CACHE_SHARDS];
+}
+
+static stat_entry_t *set_for(stat_shard_t *shard, uint32_t hash) {
+    return &shard->slots[(hash / STAT_CACHE_SHARDS) % STAT_CACHE_SETS * STAT_CACHE_WAYS];
+}
+
+int stat_cache_init(stat_cache_t *cache, int ttl_ms) {
+    cache->ttl_ns = ttl_ms * 1000000LL;
+    for (int i = 0; i < STAT_CACHE_SHARDS; i++) {
+        stat_shard_t *shard = &cache->shards[i];
+        shard->hits = 0;
+        shard->misses = 0;
+        shard->evictions = 0;
+        shard->slots = calloc(STAT_CACHE_SETS * STAT_CACHE_WAYS, sizeof(stat_entry_t));
+        if (shard->slots == NULL || pthread_mutex_init(&shard->lock, NULL) != 0) {
+            fprintf(stderr, "stat cache init failed\n");
+            free(shard->slots);
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&cache->shards[j].lock);
+                free(cache->shards[j].slots);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int stat_cache_get(stat_cache_t *cache, const char *path, struct stat *stat_buf, const char **mime_type) {
+    if (strlen(path) >= STAT_CACHE_PATH_MAX) {
+        return STAT_UNKNOWN;
+    }
+    uint32_t hash = hash_path(path);
+    stat_shard_t *shard = shard_for(cache, hash);
+    long long now = now_ns();
+    int result = STAT_UNKNOWN;
+    pthread_mutex_lock(&shard->lock);
+    stat_entry_t *set = set_for(shard, hash);
+    for (int i = 0; i < STAT_CACHE_WAYS; i++) {
+        if (set[i].expires_ns > now && strcmp(set[i].path, path) == 0) {
+            result = set[i].result;
+            if (result == STAT_FOUND) {
+                *stat_buf = set[i].stat_buf;
+                *mime_type = set[i].mime_type;
+            }
+            break;
+        }
+    }
+    if (result == STAT_UNKNOWN) {
+        shard->misses++;
+    }
+    else {
+        shard->hits++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+void stat_cache_put(stat_cache_t *cache, const char *path, int result, const struct stat *stat_buf,
+                    const char *mime_type) {
+    if (strlen(path) >= STAT_CACHE_PATH_MAX) {
+        return;
+    }
+    uint32_t hash = hash_path(path);
+    stat_shard_t *shard = shard_for(cache, hash);
+    long long now = now_ns();
+    pthread_mutex_lock(&shard->lock);
+    stat_entry_t *set = set_for(shard, hash);
+    // the path's own slot if it's still there, else a dead one, else whichever is closest to expiring
+    stat_entry_t *slot = &set[0];
+    for (int i = 0; i < STAT_CACHE_WAYS; i++) {
+        if (strcmp(set[i].path, path) == 0) {
+            slot = &set[i];
+            break;
+        }
+        if (set[i].expires_ns < slot->expires_ns) {
+            slot = &set[i];
+        }
+    }
+    if (slot->expires_ns > now && strcmp(slot->path, path) != 0) {
+        shard->evictions++;
+    }
+    strcpy(slot->path, path);
+    slot->result = result;
+    if (result == STAT_FOUND) {
+        slot->stat_buf = *stat_buf;
+        slot->mime_type = mime_type;
+    }
+    slot->expires_ns = now + cache->ttl_ns;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void stat_cache_stats(stat_cache_t *cache, stat_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(stat_cache_stats_t));
+    long long now = now_ns();
+    for (int i = 0; i < STAT_CACHE_SHARDS; i++) {
+        stat_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        for (int j = 0; j < STAT_CACHE_SETS * STAT_CACHE_WAYS; j++) {
+            if (shard->slots[j].expires_ns > now) {
+                stats->entries++;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void stat_cache_free(stat_cache_t *cache) {
+    for (int i = 0; i < STAT_CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].slots);
+        cache->shards[i].slots = NULL;
+    }
+}
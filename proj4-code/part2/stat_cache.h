@@ -0,0 +1,84 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define STAT_CACHE_SHARDS 16     // independent locks, picked by hashing the path
+#define STAT_CACHE_SETS 64       // sets of slots per shard, a path can only go in the set it hashes to
+#define STAT_CACHE_WAYS 4        // slots per set, so at most 16 * 64 * 4 = 4096 paths are remembered
+#define STAT_CACHE_PATH_MAX 256  // longer paths are never remembered
+#define DEFAULT_STAT_TTL_MS 1000 // how long a lookup is trusted, the same as the file cache's revalidation
+
+// What stat_cache_get knows about a path, the first two match stat_resource's return values
+#define STAT_FOUND 0    // the file exists, stat_buf and mime_type are filled in
+#define STAT_MISSING -1 // the file didn't exist, answer with a 404
+#define STAT_UNKNOWN 1  // not remembered (or expired), stat it
+
+// One remembered lookup
+typedef struct {
+    char path[STAT_CACHE_PATH_MAX]; // empty for a slot that was never used
+    int result;                     // STAT_FOUND or STAT_MISSING
+    struct stat stat_buf;           // only for STAT_FOUND
+    const char *mime_type;          // what get_file_type said, only for STAT_FOUND
+    long long expires_ns;
+} stat_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    stat_entry_t *slots; // STAT_CACHE_SETS * STAT_CACHE_WAYS, set i starts at slots[i * STAT_CACHE_WAYS]
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions; // live entries pushed out by a new path, a flood of random paths shows up here
+} stat_shard_t;
+
+// Remembers recent stat results, 404s included, so a path that's asked for
+// again within the TTL costs no system calls. Fixed size: a flood of paths
+// that don't exist replaces older entries instead of growing the cache.
+typedef struct {
+    stat_shard_t shards[STAT_CACHE_SHARDS];
+    long long ttl_ns;
+} stat_cache_t;
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries; // slots holding a lookup that hasn't expired
+} stat_cache_stats_t;
+
+/*
+ * Initialize an empty stat cache
+ * ttl_ms: How long a lookup is trusted before the file is stat'd again
+ * Returns 0 on success or -1 on error
+ */
+int stat_cache_init(stat_cache_t *cache, int ttl_ms);
+
+/*
+ * Look up what's known about path. Thread safe, never makes a system call.
+ * stat_buf: Filled in with the file's stat for STAT_FOUND
+ * mime_type: Set to the file's MIME type for STAT_FOUND
+ * Returns STAT_FOUND, STAT_MISSING or STAT_UNKNOWN
+ */
+int stat_cache_get(stat_cache_t *cache, const char *path, struct stat *stat_buf, const char **mime_type);
+
+/*
+ * Remember a lookup, replacing the oldest entry in its set if there's no room
+ * result: STAT_FOUND or STAT_MISSING
+ * stat_buf: The file's stat, only read for STAT_FOUND
+ * mime_type: The file's MIME type, must live as long as the cache
+ */
+void stat_cache_put(stat_cache_t *cache, const char *path, int result, const struct stat *stat_buf,
+                    const char *mime_type);
+
+/*
+ * Get a snapshot of the cache's counters
+ */
+void stat_cache_stats(stat_cache_t *cache, stat_cache_stats_t *stats);
+
+/*
+ * Free the slots. No threads may still be using the cache.
+ */
+void stat_cache_free(stat_cache_t *cache);
+
+#endif // STAT_CACHE_H
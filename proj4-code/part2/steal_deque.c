@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "steal_deque.h"
+
+int steal_deque_init(steal_deque_t *deque, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    deque->items = malloc(size * sizeof(*deque->items));
+    if (deque->items == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&deque->items[i], NULL);
+    }
+    deque->mask = size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+int steal_deque_push(steal_deque_t *deque, void *item) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top > deque->mask) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->items[bottom & deque->mask], item, memory_order_relaxed);
+    // the item has to be visible before a thief can see the new bottom
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+void *steal_deque_pop(steal_deque_t *deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    // claim the slot before looking at top, or a thief and we could both take it
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) { // empty, put bottom back
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void *item = atomic_load_explicit(&deque->items[bottom & deque->mask], memory_order_relaxed);
+    if (top == bottom) { // the last item, thieves may be after it too
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            item = NULL; // a thief got it
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+int steal_deque_steal(steal_deque_t *deque, void **item) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return 0;
+    }
+    void *taken = atomic_load_explicit(&deque->items[top & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return -1;
+    }
+    *item = taken;
+    return 1;
+}
+
+size_t steal_deque_length(steal_deque_t *deque) {
+    long top = atomic_load(&deque->top);
+    long bottom = atomic_load(&deque->bottom);
+    return bottom > top ? bottom - top : 0;
+}
+
+void steal_deque_free(steal_deque_t *deque) {
+    free(deque->items);
+    deque->items = NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef STEAL_DEQUE_H
+#define STEAL_DEQUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "lockfree_queue.h"
+
+// Bounded work-stealing deque of pointers (Chase and Lev, with the memory
+// orderings from Le et al., "Correct and Efficient Work-Stealing for Weak
+// Memory Models"). One thread owns it and pushes and pops at the bottom,
+// newest first, so what it just touched is what it picks up next. Any other
+// thread can steal from the top, oldest first. Only a steal that races the
+// owner for the last item, or another thief, costs a compare-and-swap.
+typedef struct {
+    _Atomic(void *) *items;
+    long mask; // capacity - 1, capacity is a power of two
+    _Alignas(CACHE_LINE) atomic_long top;    // next to steal, thieves move it up
+    _Alignas(CACHE_LINE) atomic_long bottom; // next free slot, only the owner moves it
+} steal_deque_t;
+
+/*
+ * Initialize an empty deque
+ * capacity: Number of slots, rounded up to a power of two
+ * Returns 0 on success or -1 on error
+ */
+int steal_deque_init(steal_deque_t *deque, size_t capacity);
+
+/*
+ * Add an item at the bottom. Owner only.
+ * Returns 0 on success or -1 if the deque is full
+ */
+int steal_deque_push(steal_deque_t *deque, void *item);
+
+/*
+ * Take the newest item from the bottom. Owner only.
+ * Returns the item, or NULL if the deque is empty
+ */
+void *steal_deque_pop(steal_deque_t *deque);
+
+/*
+ * Take the oldest item from the top. Any thread.
+ * item: Set to what was taken
+ * Returns 1 if an item was taken, 0 if the deque is empty, or -1 if another
+ * thread took it first (worth trying again)
+ */
+int steal_deque_steal(steal_deque_t *deque, void **item);
+
+/*
+ * Number of items in the deque right now (approximate while threads are using it)
+ */
+size_t steal_deque_length(steal_deque_t *deque);
+
+/*
+ * Free the slots. No threads may still be using the deque.
+ */
+void steal_deque_free(steal_deque_t *deque);
+
+#endif // STEAL_DEQUE_H
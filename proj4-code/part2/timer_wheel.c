@@ -0,0 +1,140 @@
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELAY ((1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1) // in ticks
+
+static void list_init(timer_link_t *head) {
+    head->prev = head;
+    head->next = head;
+}
+
+static void list_add(timer_link_t *head, timer_link_t *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void list_del(timer_link_t *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link;
+    link->next = link;
+}
+
+// Moves every link on 'from' onto 'to', leaving 'from' empty
+static void list_move_all(timer_link_t *from, timer_link_t *to) {
+    list_init(to);
+    if (from->next == from) {
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+// Links a timer into the slot for its expiry: the lowest level whose lap
+// still reaches that far from now
+static void place(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    long long delay = timer->expires - wheel->now;
+    if (delay < 0) {
+        timer->expires = wheel->now;
+        delay = 0;
+    }
+    else if (delay > MAX_DELAY) {
+        timer->expires = wheel->now + MAX_DELAY;
+        delay = MAX_DELAY;
+    }
+    int level = 0;
+    while (delay >= (1LL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    list_add(&wheel->slots[level][slot], &timer->link);
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, long long now_ms) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = now_ms / TIMER_WHEEL_TICK_MS;
+    wheel->n_pending = 0;
+}
+
+void timer_init(wheel_timer_t *timer, int kind, void *data) {
+    list_init(&timer->link);
+    timer->expires = 0;
+    timer->pending = 0;
+    timer->kind = kind;
+    timer->data = data;
+}
+
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, long long deadline_ms) {
+    timer_wheel_cancel(wheel, timer);
+    timer->expires = (deadline_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS; // round up, never fire early
+    timer->pending = 1;
+    wheel->n_pending++;
+    place(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer->pending) {
+        list_del(&timer->link);
+        timer->pending = 0;
+        wheel->n_pending--;
+    }
+}
+
+// Level 0 just wrapped: bring the timers in the next slot of each level above
+// down to where they belong now. A level only moves on when the one below it
+// has wrapped too.
+static void cascade(timer_wheel_t *wheel) {
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        int slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+        timer_link_t moving;
+        list_move_all(&wheel->slots[level][slot], &moving);
+        while (moving.next != &moving) {
+            timer_link_t *link = moving.next;
+            list_del(link);
+            place(wheel, (wheel_timer_t *) link);
+        }
+        if (slot != 0) {
+            break;
+        }
+    }
+}
+
+int timer_wheel_advance(timer_wheel_t *wheel, long long now_ms, timer_expired_fn expired, void *arg) {
+    long long target = now_ms / TIMER_WHEEL_TICK_MS;
+    int n_fired = 0;
+    while (wheel->now <= target) {
+        if (wheel->n_pending == 0) {
+            wheel->now = target + 1; // nothing to fire or cascade, skip straight there
+            break;
+        }
+        int slot = wheel->now & SLOT_MASK;
+        if (slot == 0) {
+            cascade(wheel);
+        }
+        // take the whole slot first, so anything a callback schedules for this
+        // tick lands on the next one instead of being lost in the list we're walking
+        timer_link_t due;
+        list_move_all(&wheel->slots[0][slot], &due);
+        wheel->now++;
+        while (due.next != &due) {
+            wheel_timer_t *timer = (wheel_timer_t *) due.next;
+            list_del(&timer->link);
+            timer->pending = 0;
+            wheel->n_pending--;
+            n_fired++;
+            expired(timer, arg);
+        }
+    }
+    return n_fired;
+}
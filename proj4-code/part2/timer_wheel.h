@@ -0,0 +1,69 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define TIMER_WHEEL_TICK_MS 10 // timers fire on a multiple of this, never early
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS) // slots in each level
+#define TIMER_WHEEL_LEVELS 4 // 64^4 ticks of 10ms, about 46 hours; later timers are pulled in to that
+
+// Links a timer into its slot's circular list. A slot's own link is the list head.
+typedef struct timer_link {
+    struct timer_link *prev;
+    struct timer_link *next;
+} timer_link_t;
+
+// One timer, kept inside whatever it times (a connection, say). It is either
+// on exactly one slot's list or on none.
+typedef struct {
+    timer_link_t link;      // must stay first, the wheel turns links back into timers
+    long long expires;      // tick it fires on
+    int pending;            // 1 while it's on the wheel
+    int kind;               // for the owner: which deadline this is
+    void *data;             // for the owner: what to act on when it fires
+} wheel_timer_t;
+
+// Hierarchical timing wheel (Varghese and Lauck): level 0 has one slot per
+// tick, each slot of level n covers a whole lap of level n - 1. A timer goes
+// straight into the slot for its expiry, so adding or cancelling one is O(1);
+// timers on the upper levels drop down a level each time the one below wraps.
+// Not thread safe.
+typedef struct {
+    timer_link_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    long long now;  // next tick to run, everything before it has fired
+    long n_pending; // timers on the wheel
+} timer_wheel_t;
+
+// Called for each timer that fires. The timer is already off the wheel, so the
+// callback can schedule it again, cancel others, or free it.
+typedef void (*timer_expired_fn)(wheel_timer_t *timer, void *arg);
+
+/*
+ * Initialize an empty wheel
+ * now_ms: The current time in milliseconds, from the clock later calls will use
+ */
+void timer_wheel_init(timer_wheel_t *wheel, long long now_ms);
+
+/*
+ * Initialize a timer that isn't on any wheel
+ */
+void timer_init(wheel_timer_t *timer, int kind, void *data);
+
+/*
+ * Put a timer on the wheel to fire at deadline_ms, taking it off wherever it
+ * was first. A deadline that has already passed fires on the next advance.
+ */
+void timer_wheel_schedule(timer_wheel_t *wheel, wheel_timer_t *timer, long long deadline_ms);
+
+/*
+ * Take a timer off the wheel. Does nothing if it isn't on one.
+ */
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+/*
+ * Fire every timer due by now_ms, in order of expiry tick
+ * expired: Called once for each, with arg
+ * Returns the number of timers that fired
+ */
+int timer_wheel_advance(timer_wheel_t *wheel, long long now_ms, timer_expired_fn expired, void *arg);
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define RING_MASK (TRACE_RING_SIZE - 1)
+#define DUMP_PATH_MAX 4096
+
+static const char *phase_names[] = { "request", "queue", "read", "stat", "prepare", "send" };
+
+// What the calling thread is tracing. Every thread serves one request at a
+// time, so this lives with the thread rather than being passed down to the
+// code that times each phase.
+typedef struct {
+    trace_ring_t *ring;       // NULL until the thread first traces
+    int no_ring;              // every ring was taken when it tried, don't keep asking
+    unsigned long n_requests; // requests begun, for sampling
+    int sampled;              // the current request is being traced
+    unsigned long long request;
+    long long first_ns;       // start of its earliest span so far, 0 for none yet
+    long long queued_ns;      // when the connection about to be served was queued, 0 if it wasn't
+    long long dequeued_ns;
+} trace_thread_t;
+
+static __thread trace_thread_t current;
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); // the same clock metrics_now_ns reads, for enqueued_ns
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Gives the calling thread a ring
+// Returns the ring, or NULL if every ring is taken
+static trace_ring_t *register_ring(tracer_t *tracer) {
+    pthread_mutex_lock(&tracer->lock);
+    int n_rings = atomic_load_explicit(&tracer->n_rings, memory_order_relaxed);
+    if (n_rings == TRACE_MAX_RINGS) {
+        pthread_mutex_unlock(&tracer->lock);
+        return NULL;
+    }
+    trace_ring_t *ring = aligned_alloc(CACHE_LINE, sizeof(trace_ring_t));
+    if (ring == NULL) {
+        perror("aligned_alloc");
+        pthread_mutex_unlock(&tracer->lock);
+        return NULL;
+    }
+    memset(ring->spans, 0, sizeof(ring->spans)); // fault the pages in now rather than on the request path
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->cached_tail = 0;
+    ring->tid = (int) syscall(SYS_gettid);
+    tracer->rings[n_rings] = ring;
+    atomic_store_explicit(&tracer->n_rings, n_rings + 1, memory_order_release); // the dumper can see it now
+    pthread_mutex_unlock(&tracer->lock);
+    return ring;
+}
+
+// Hands a span of the current request to the dumper, or counts it as dropped
+// if the thread's ring is full
+static void push_span(int phase, long long start_ns, long long end_ns, const http_request_t *req, int status) {
+    trace_ring_t *ring = current.ring;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->cached_tail == TRACE_RING_SIZE) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->cached_tail == TRACE_RING_SIZE) {
+            // only this thread writes the counter, so no atomic add is needed
+            unsigned long long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+            atomic_store_explicit(&ring->dropped, dropped + 1, memory_order_relaxed);
+            return;
+        }
+    }
+    trace_span_t *span = &ring->spans[head & RING_MASK];
+    span->start_ns = start_ns;
+    span->end_ns = end_ns;
+    span->request = current.request;
+    span->tid = ring->tid;
+    span->phase = phase;
+    span->status = status;
+    span->path[0] = '\0';
+    if (req != NULL) {
+        int path_len = req->path.len < TRACE_PATH_MAX ? req->path.len : TRACE_PATH_MAX - 1;
+        memcpy(span->path, req->path.start, path_len);
+        span->path[path_len] = '\0';
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release); // hand it to the dumper
+}
+
+void trace_queued(tracer_t *tracer, long long enqueued_ns) {
+    if (tracer == NULL) {
+        return;
+    }
+    current.queued_ns = enqueued_ns;
+    current.dequeued_ns = now_ns();
+}
+
+void trace_request_begin(tracer_t *tracer) {
+    current.sampled = 0;
+    if (tracer == NULL) {
+        return;
+    }
+    long long queued_ns = current.queued_ns;
+    current.queued_ns = 0; // only the connection's first request waited in the queue
+    if (current.ring == NULL) {
+        if (current.no_ring || (current.ring = register_ring(tracer)) == NULL) {
+            current.no_ring = 1;
+            return;
+        }
+    }
+    if (current.n_requests++ % tracer->sample_every != 0) {
+        return;
+    }
+    current.sampled = 1;
+    current.request = atomic_fetch_add_explicit(&tracer->next_request, 1, memory_order_relaxed) + 1;
+    current.first_ns = 0;
+    if (queued_ns != 0) {
+        push_span(TRACE_QUEUE, queued_ns, current.dequeued_ns, NULL, 0);
+    }
+}
+
+long long trace_start(void) {
+    return current.sampled ? now_ns() : 0;
+}
+
+void trace_end(int phase, long long start_ns) {
+    if (start_ns == 0 || !current.sampled) {
+        return;
+    }
+    if (current.first_ns == 0 || start_ns < current.first_ns) {
+        current.first_ns = start_ns;
+    }
+    push_span(phase, start_ns, now_ns(), NULL, 0);
+}
+
+void trace_request_end(const http_request_t *req, int status) {
+    if (!current.sampled) {
+        return;
+    }
+    current.sampled = 0;
+    if (current.first_ns != 0) {
+        push_span(TRACE_REQUEST, current.first_ns, now_ns(), req, status);
+    }
+}
+
+// Moves everything in the rings into the kept spans, overwriting the oldest
+// kept ones once there are TRACE_KEEP_SPANS
+static void drain_rings(tracer_t *tracer) {
+    int n_rings = atomic_load_explicit(&tracer->n_rings, memory_order_acquire);
+    for (int i = 0; i < n_rings; i++) {
+        trace_ring_t *ring = tracer->rings[i];
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            tracer->kept[tracer->n_kept % TRACE_KEEP_SPANS] = ring->spans[tail & RING_MASK];
+            tracer->n_kept++;
+            tail++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+}
+
+// Writes s as the inside of a JSON string
+static void write_json_string(FILE *file, const char *s) {
+    for (const unsigned char *c = (const unsigned char *) s; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        }
+        else if (*c < 0x20 || *c >= 0x7f) { // request paths aren't necessarily UTF-8
+            fprintf(file, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, file);
+        }
+    }
+}
+
+// Writes one span as trace events: a complete event, or for a queue wait a
+// pair of async events, since waits overlap whatever the thread was doing
+static void write_span(FILE *file, const trace_span_t *span, int pid) {
+    const char *name = phase_names[span->phase];
+    if (span->phase == TRACE_QUEUE) {
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"b\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                name, span->request, span->start_ns / 1e3, pid, span->tid);
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"e\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                name, span->request, span->end_ns / 1e3, pid, span->tid);
+        return;
+    }
+    fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"request\":%llu", name, span->start_ns / 1e3, (span->end_ns - span->start_ns) / 1e3, pid,
+            span->tid, span->request);
+    if (span->phase == TRACE_REQUEST) {
+        fprintf(file, ",\"status\":%d,\"path\":\"", span->status);
+        write_json_string(file, span->path);
+        fputc('"', file);
+    }
+    fputs("}}", file);
+}
+
+// Writes every span taken since the last dump (the newest TRACE_KEEP_SPANS of
+// them) to the next dump file
+// Returns 0 on success or -1 on error
+static int dump(tracer_t *tracer) {
+    drain_rings(tracer);
+    char path[DUMP_PATH_MAX];
+    snprintf(path, sizeof(path), "%s.%d.json", tracer->prefix, ++tracer->n_dumps);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    int pid = (int) getpid();
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"http_server\"}}", pid);
+    int n_rings = atomic_load_explicit(&tracer->n_rings, memory_order_acquire);
+    unsigned long long dropped = 0;
+    for (int i = 0; i < n_rings; i++) {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker\"}}",
+                pid, tracer->rings[i]->tid);
+        dropped += atomic_load_explicit(&tracer->rings[i]->dropped, memory_order_relaxed);
+    }
+    size_t first = tracer->n_kept > TRACE_KEEP_SPANS ? tracer->n_kept - TRACE_KEEP_SPANS : 0;
+    for (size_t i = first; i < tracer->n_kept; i++) {
+        write_span(file, &tracer->kept[i % TRACE_KEEP_SPANS], pid);
+    }
+    fputs("\n]}\n", file);
+    int ret_val = 0;
+    if (fclose(file) != 0) {
+        perror(path);
+        ret_val = -1;
+    }
+    fprintf(stderr, "trace: %zu spans written to %s, %zu older ones overwritten, %llu dropped so far\n",
+            tracer->n_kept - first, path, first, dropped);
+    tracer->n_kept = 0;
+    return ret_val;
+}
+
+// THREAD FUNCTION: drains the rings and dumps on SIGUSR1 until tracer_close, then dumps once more
+static void *run_dumper(void *arg) {
+    tracer_t *tracer = (tracer_t *) arg;
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    int ret_val = 0;
+    while (!atomic_load_explicit(&tracer->stop, memory_order_acquire)) {
+        struct timespec wait = { .tv_sec = 0, .tv_nsec = TRACE_DRAIN_MS * 1000000L };
+        if (sigtimedwait(&usr1, NULL, &wait) == SIGUSR1) {
+            dump(tracer); // a failed dump leaves the next one to try again
+        }
+        else {
+            drain_rings(tracer);
+        }
+    }
+    if (dump(tracer) != 0) {
+        ret_val = -1;
+    }
+    return (void *) (long) ret_val;
+}
+
+int tracer_open(tracer_t *tracer, const char *prefix, int sample_every) {
+    tracer->prefix = prefix;
+    tracer->sample_every = sample_every > 0 ? sample_every : 1;
+    tracer->n_kept = 0;
+    tracer->n_dumps = 0;
+    atomic_init(&tracer->n_rings, 0);
+    atomic_init(&tracer->next_request, 0);
+    atomic_init(&tracer->stop, 0);
+    tracer->kept = malloc(TRACE_KEEP_SPANS * sizeof(trace_span_t));
+    if (tracer->kept == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (pthread_mutex_init(&tracer->lock, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        free(tracer->kept);
+        return -1;
+    }
+
+    // SIGUSR1 stays pending until the dumper takes it, every thread started from here on inherits the block
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    sigset_t sigset;
+    sigset_t oldset;
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+    int err_code = pthread_create(&tracer->dumper, NULL, run_dumper, tracer);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+        pthread_mutex_destroy(&tracer->lock);
+        free(tracer->kept);
+        return -1;
+    }
+    return 0;
+}
+
+int tracer_close(tracer_t *tracer) {
+    int ret_val = 0;
+    atomic_store_explicit(&tracer->stop, 1, memory_order_release);
+    void *thread_ret;
+    int err_code = pthread_join(tracer->dumper, &thread_ret);
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+        ret_val = -1;
+    }
+    else if (thread_ret != NULL) {
+        ret_val = -1;
+    }
+    int n_rings = atomic_load_explicit(&tracer->n_rings, memory_order_relaxed);
+    for (int i = 0; i < n_rings; i++) {
+        free(tracer->rings[i]);
+    }
+    pthread_mutex_destroy(&tracer->lock);
+    free(tracer->kept);
+    return ret_val;
+}
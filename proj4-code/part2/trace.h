@@ -0,0 +1,114 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "http_parser.h"
+#include "lockfree_queue.h"
+
+#define TRACE_RING_SIZE 1024     // spans each thread can have waiting for the dumper, a power of two
+#define TRACE_MAX_RINGS 256      // threads that can trace, any more just don't
+#define TRACE_KEEP_SPANS 65536   // most recent spans the dumper holds on to for the next dump
+#define TRACE_PATH_MAX 40        // longer request paths are cut short in the trace
+#define TRACE_DRAIN_MS 20        // how often the dumper empties the rings and checks for SIGUSR1
+#define DEFAULT_TRACE_SAMPLE 1   // trace one request in this many
+
+// Phases of a request a span can cover
+#define TRACE_REQUEST 0 // the whole request, from its first span to its response being sent
+#define TRACE_QUEUE 1   // its connection waiting in the connection queue for a worker
+#define TRACE_READ 2    // reading and parsing it, from the first byte that arrived
+#define TRACE_STAT 3    // statting the file it asked for
+#define TRACE_PREPARE 4 // building the response: caches, opening the file, the header
+#define TRACE_SEND 5    // sending the response
+
+// One timed phase of one sampled request
+typedef struct {
+    long long start_ns;      // monotonic
+    long long end_ns;
+    unsigned long long request; // ties a request's spans together
+    int tid;                 // thread the span happened on
+    short phase;
+    short status;            // TRACE_REQUEST only
+    char path[TRACE_PATH_MAX]; // TRACE_REQUEST only, null-terminated
+} trace_span_t;
+
+// Single-producer single-consumer ring like access_log_ring_t: one thread
+// writes spans in, the dumper takes them out
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_size_t head; // next slot the thread fills
+    size_t cached_tail; // the thread's last look at tail
+    int tid;
+    _Alignas(CACHE_LINE) atomic_size_t tail; // next slot the dumper empties
+    _Alignas(CACHE_LINE) atomic_ullong dropped;
+    trace_span_t spans[TRACE_RING_SIZE];
+} trace_ring_t;
+
+// Samples requests and records how long each phase of them took. Threads
+// register a ring the first time they trace. The dumper thread moves spans
+// from the rings into a buffer of the most recent ones, and writes that out as
+// Chrome trace-event JSON (for chrome://tracing or ui.perfetto.dev) on SIGUSR1
+// and when the tracer is closed.
+typedef struct {
+    const char *prefix;     // dump n goes to <prefix>.<n>.json
+    int sample_every;
+    trace_ring_t *rings[TRACE_MAX_RINGS];
+    atomic_int n_rings;     // rings handed out, each pointer is set before this counts it
+    pthread_mutex_t lock;   // serializes registering
+    atomic_ullong next_request;
+    atomic_int stop;
+    pthread_t dumper;
+    trace_span_t *kept;     // dumper only: TRACE_KEEP_SPANS, the oldest overwritten first
+    size_t n_kept;          // dumper only: spans taken since the last dump, may be more than are still kept
+    int n_dumps;            // dumper only
+} tracer_t;
+
+/*
+ * Start the dumper thread. Blocks SIGUSR1 in the calling thread so the dumper
+ * can wait for it, so call this before starting any other threads.
+ * prefix: Dumps are written to <prefix>.1.json, <prefix>.2.json, ...
+ * sample_every: Trace one request in this many
+ * Returns 0 on success or -1 on error
+ */
+int tracer_open(tracer_t *tracer, const char *prefix, int sample_every);
+
+/*
+ * Note that the connection the calling thread is about to serve was queued at
+ * enqueued_ns, so its first request's trace shows the wait. Does nothing if
+ * tracer is NULL.
+ */
+void trace_queued(tracer_t *tracer, long long enqueued_ns);
+
+/*
+ * Decide whether the calling thread's next request is traced, registering a
+ * ring for the thread the first time. Traces nothing if tracer is NULL.
+ */
+void trace_request_begin(tracer_t *tracer);
+
+/*
+ * Returns the monotonic time in ns if the calling thread's request is being
+ * traced, or 0 if it isn't, for trace_end
+ */
+long long trace_start(void);
+
+/*
+ * Record a span of the current request from start_ns (what trace_start
+ * returned) to now. Does nothing if start_ns is 0.
+ */
+void trace_end(int phase, long long start_ns);
+
+/*
+ * Record the current request as a whole, with its path and status, and stop
+ * tracing it. Does nothing if it isn't being traced.
+ */
+void trace_request_end(const http_request_t *req, int status);
+
+/*
+ * Stop the dumper, which writes one last dump first. Every thread that traces
+ * must have stopped.
+ * Returns 0 on success or -1 on error
+ */
+int tracer_close(tracer_t *tracer);
+
+#endif // TRACE_H
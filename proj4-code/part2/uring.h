@@ -0,0 +1,74 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// An io_uring instance set up with the raw syscalls, no liburing needed.
+// Only one thread may use a ring at a time.
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head;  // advanced by the kernel as it takes submissions
+    unsigned *sq_tail;  // advanced by us as we add them
+    unsigned *sq_mask;
+    unsigned *sq_array; // indexes into sqes, in submission order
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;  // submissions filled in but not handed to the kernel yet
+    unsigned *cq_head;  // advanced by us as we take completions
+    unsigned *cq_tail;  // advanced by the kernel as it adds them
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;      // mappings to undo in uring_free
+    size_t sq_ring_size;
+    void *cq_ring;      // same as sq_ring when the kernel maps both at once
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/*
+ * Set up a ring and check that the kernel supports every operation in 'ops'
+ * entries: Submission queue slots, rounded up to a power of two
+ * ops: IORING_OP_* values the caller needs
+ * n_ops: Number of values in ops
+ * Returns 0 on success, or -1 if io_uring (or one of the operations) isn't
+ * available, with errno set
+ */
+int uring_init(uring_t *ring, unsigned entries, const int *ops, int n_ops);
+
+/*
+ * Get a blank submission to fill in. Hands the ones already filled in to the
+ * kernel first if the queue is full.
+ * Returns the submission, or NULL on error
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/*
+ * Returns how many submissions can be filled in before the queue is full.
+ * Linked submissions have to go to the kernel together, so check there's
+ * room for the whole chain first.
+ */
+unsigned uring_sq_space(uring_t *ring);
+
+/*
+ * Hand every submission filled in so far to the kernel, then wait until at
+ * least 'wait_nr' completions are ready
+ * Returns 0 on success or -1 on error with errno set (EINTR if a signal came in)
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr);
+
+/*
+ * Returns the oldest completion the caller hasn't seen, or NULL if there are none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/*
+ * Mark the completion from uring_peek_cqe as handled, so its slot can be reused
+ */
+void uring_cqe_seen(uring_t *ring);
+
+/*
+ * Tear the ring down. The kernel cancels anything still in flight.
+ */
+void uring_free(uring_t *ring);
+
+#endif // URING_H
@@ -0,0 +1,911 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "deadline.h"
+#include "http.h"
+#include "uring.h"
+#include "uring_loop.h"
+
+#define BUFSIZE 512
+
+// What a connection is waiting on
+#define CONN_RECV 0 // more of the next request
+#define CONN_FILE 1 // openat and statx of the requested file
+#define CONN_READ 2 // file bytes coming into memory
+#define CONN_SEND 3 // response bytes going out
+
+// Kinds of submission. Connections are malloc'd, so the low bits of their
+// address are free to say which of a connection's submissions completed.
+#define OP_ACCEPT 0
+#define OP_WAKE 1
+#define OP_RECV 2
+#define OP_TICK 3 // the loop's own timeout, so it checks deadlines even when nothing else happens
+#define OP_OPEN 4
+#define OP_STATX 5
+#define OP_READ 6
+#define OP_SEND 7
+#define OP_SPLICE_IN 8  // file into the connection's pipe
+#define OP_SPLICE_OUT 9 // pipe out to the socket
+#define OP_MASK 15
+
+// State kept for every open client connection
+typedef struct uring_conn {
+    int fd;
+    int state;           // CONN_RECV, CONN_FILE, CONN_READ or CONN_SEND
+    int pending;         // submissions in flight, the kernel may still write into this struct until it's 0
+    int closed;          // fd is closed, free as soon as pending drops to 0
+    request_buffer_t rb; // request bytes read but not answered yet, pipelined ones included
+    int keep_alive;      // whether to wait for another request after this response
+    int n_requests;      // requests answered so far
+    wheel_timer_t deadline; // whichever of the header, write or idle deadlines applies right now
+    long long started_ns; // when the request being answered was complete, for its latency
+    char path[BUFSIZE * 2];
+    int has_resp;        // resp needs cleaning up
+    http_response_t resp;
+    int file_ops_left;   // openat and statx both have to finish before the response can be built
+    int open_result;     // fd from openat, or -errno
+    int statx_result;    // 0 or -errno
+    struct statx stx;
+    struct stat stat_buf;
+    char *body;          // the whole file on its way into the cache, NULL otherwise
+    off_t body_read;
+    int pipe_fds[2];     // file bytes are spliced through here to the socket, -1 until first needed
+    size_t pipe_size;
+    size_t in_pipe;      // bytes spliced in but not out to the socket yet
+    int splice_ops_left; // the two halves of a splice both have to come back
+    int splice_failed;
+    int copy_body;       // splice isn't supported for this file, read it into 'chunk' and send that instead
+    char *chunk;         // URING_CHUNK bytes of the file on their way out when copying
+    size_t chunk_len;
+    size_t chunk_sent;
+    struct iovec iov[2]; // header and cached body, sent together
+    struct msghdr msg;
+    struct uring_conn *prev; // every connection of a loop is on a list so shutdown can close them
+    struct uring_conn *next;
+} uring_conn_t;
+
+// One ring and the connections it owns
+typedef struct {
+    uring_t ring;
+    int sock_fd;
+    int wake_fd; // eventfd shared by all loops, readable once the server is shutting down
+    const server_config_t *config;
+    int *keep_going;
+    uring_conn_t *connections;
+    timer_wheel_t deadlines; // every connection's deadline
+    struct __kernel_timespec tick;
+    thread_metrics_t *stats;
+    access_log_ring_t *log_ring; // NULL if requests aren't logged
+} uring_loop_t;
+
+static void next_request(uring_loop_t *loop, uring_conn_t *conn);
+static void send_more(uring_loop_t *loop, uring_conn_t *conn);
+
+// Gets a submission for a connection and tags it so its completion finds its way back
+// Returns the submission, or NULL on error
+static struct io_uring_sqe *conn_sqe(uring_loop_t *loop, uring_conn_t *conn, int op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return NULL;
+    }
+    sqe->user_data = (uint64_t) (uintptr_t) conn | op;
+    conn->pending++;
+    return sqe;
+}
+
+// Unlinks a connection from its loop and frees it, once the kernel is done with it
+static void free_connection(uring_loop_t *loop, uring_conn_t *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        loop->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    free(conn->body);
+    free(conn->chunk);
+    free(conn);
+}
+
+// Arms one of a connection's deadlines in place of whichever it had, or
+// leaves it with none if that kind is turned off
+static void set_deadline(uring_loop_t *loop, uring_conn_t *conn, int kind) {
+    long long timeout_ms = deadline_timeout_ms(loop->config, kind);
+    conn->deadline.kind = kind;
+    if (timeout_ms > 0) {
+        timer_wheel_schedule(&loop->deadlines, &conn->deadline, deadline_now_ms() + timeout_ms);
+    }
+    else {
+        timer_wheel_cancel(&loop->deadlines, &conn->deadline);
+    }
+}
+
+// Releases everything a connection holds. Submissions still in flight keep
+// the struct itself alive until they complete.
+static void close_connection(uring_loop_t *loop, uring_conn_t *conn) {
+    timer_wheel_cancel(&loop->deadlines, &conn->deadline);
+    if (conn->has_resp) {
+        http_response_cleanup(&conn->resp);
+        conn->has_resp = 0;
+    }
+    if (conn->pipe_fds[0] != -1) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+        conn->pipe_fds[0] = -1;
+    }
+    if (!conn->closed) {
+        close(conn->fd);
+        conn->closed = 1;
+    }
+    if (conn->pending == 0) {
+        free_connection(loop, conn);
+    }
+}
+
+// Waits for more of a request
+static void arm_recv(uring_loop_t *loop, uring_conn_t *conn) {
+    conn->state = CONN_RECV;
+    struct io_uring_sqe *sqe = conn_sqe(loop, conn, OP_RECV);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (conn->rb.data + conn->rb.len);
+    sqe->len = HTTP_REQUEST_MAX - conn->rb.len;
+}
+
+// Opens and stats the requested file at the same time
+static void arm_file_ops(uring_loop_t *loop, uring_conn_t *conn) {
+    conn->state = CONN_FILE;
+    conn->file_ops_left = 2;
+    struct io_uring_sqe *open_sqe = conn_sqe(loop, conn, OP_OPEN);
+    if (open_sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    open_sqe->opcode = IORING_OP_OPENAT;
+    open_sqe->fd = AT_FDCWD;
+    open_sqe->addr = (uint64_t) (uintptr_t) conn->path;
+    open_sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+    struct io_uring_sqe *statx_sqe = conn_sqe(loop, conn, OP_STATX);
+    if (statx_sqe == NULL) {
+        close_connection(loop, conn); // the open's fd gets closed when it comes back
+        return;
+    }
+    statx_sqe->opcode = IORING_OP_STATX;
+    statx_sqe->fd = AT_FDCWD;
+    statx_sqe->addr = (uint64_t) (uintptr_t) conn->path;
+    statx_sqe->len = STATX_BASIC_STATS;
+    statx_sqe->off = (uint64_t) (uintptr_t) &conn->stx;
+}
+
+// Reads 'len' bytes of the response's file at 'offset' into 'dest'
+static void arm_read(uring_loop_t *loop, uring_conn_t *conn, char *dest, size_t len, off_t offset) {
+    conn->state = CONN_READ;
+    struct io_uring_sqe *sqe = conn_sqe(loop, conn, OP_READ);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = conn->resp.file_fd;
+    sqe->addr = (uint64_t) (uintptr_t) dest;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+// Sends 'len' bytes from 'src', or the iovecs in conn->msg if src is NULL
+static void arm_send(uring_loop_t *loop, uring_conn_t *conn, const char *src, size_t len, int more) {
+    conn->state = CONN_SEND;
+    struct io_uring_sqe *sqe = conn_sqe(loop, conn, OP_SEND);
+    if (sqe == NULL) {
+        close_connection(loop, conn);
+        return;
+    }
+    // MSG_MORE holds the header back so it goes out in the same packet as the start of the body
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->fd = conn->fd;
+    if (src != NULL) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t) (uintptr_t) src;
+        sqe->len = len;
+    }
+    else {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t) (uintptr_t) &conn->msg;
+        sqe->len = 1;
+    }
+}
+
+// Moves the next chunk of the file to the socket through the connection's
+// pipe, so the bytes never come up to user space. The two splices are linked
+// so a single io_uring_enter covers both; if the first comes up short the
+// second is cancelled and whatever is in the pipe goes out next time.
+static void arm_splice(uring_loop_t *loop, uring_conn_t *conn) {
+    conn->state = CONN_SEND;
+    if (conn->pipe_fds[0] == -1) {
+        if (pipe2(conn->pipe_fds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            close_connection(loop, conn);
+            return;
+        }
+        int size = fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, URING_CHUNK); // bigger pipe, fewer round trips
+        conn->pipe_size = size > 0 ? (size_t) size : 65536;
+    }
+    if (uring_sq_space(&loop->ring) < 2 && uring_submit_and_wait(&loop->ring, 0) == -1) {
+        perror("io_uring_enter");
+        close_connection(loop, conn);
+        return;
+    }
+    http_response_t *resp = &conn->resp;
+    size_t len = conn->in_pipe;
+    conn->splice_ops_left = 0;
+    conn->splice_failed = 0;
+    struct io_uring_sqe *sqe;
+    if (conn->in_pipe == 0) {
+        len = resp->remaining < (off_t) conn->pipe_size ? (size_t) resp->remaining : conn->pipe_size;
+        sqe = conn_sqe(loop, conn, OP_SPLICE_IN);
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->splice_fd_in = resp->file_fd;
+        sqe->splice_off_in = resp->offset;
+        sqe->fd = conn->pipe_fds[1];
+        sqe->off = -1; // pipes have no offset
+        sqe->len = len;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        conn->splice_ops_left++;
+    }
+    sqe = conn_sqe(loop, conn, OP_SPLICE_OUT);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->pipe_fds[0];
+    sqe->splice_off_in = -1;
+    sqe->fd = conn->fd;
+    sqe->off = -1;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE | (resp->remaining > (off_t) len ? SPLICE_F_MORE : 0);
+    conn->splice_ops_left++;
+}
+
+// Turns the request at the front of the buffer into a response, asking the
+// ring to open and stat the file if the caches can't answer it
+static void start_response(uring_loop_t *loop, uring_conn_t *conn) {
+    char resource[HTTP_RESOURCE_MAX];
+    if (parse_buffered_request(&conn->rb, resource, &conn->keep_alive) != 0) {
+        fprintf(stderr, "read_http_request failed\n");
+        close_connection(loop, conn);
+        return;
+    }
+    conn->n_requests++;
+    if (loop->config->idle_timeout_ms == 0 || conn->n_requests >= loop->config->max_requests) {
+        conn->keep_alive = 0; // tell the client this is the last one
+    }
+    if (make_resource_path(conn->path, sizeof(conn->path), loop->config->server_dir, resource) != 0) {
+        close_connection(loop, conn);
+        return;
+    }
+    conn->started_ns = metrics_now_ns();
+    set_deadline(loop, conn, DEADLINE_WRITE);
+    int result;
+    if (http_request_method(&conn->rb.req) == HTTP_METHOD_OTHER) {
+        result = http_response_init_not_implemented(&conn->resp) == 0 ? HTTP_START_DONE : HTTP_START_ERROR;
+    }
+    else if (loop->config->metrics_in_band && strcmp(resource, METRICS_PATH) == 0) {
+        result = metrics_response(loop->config->metrics, &conn->resp, conn->keep_alive) == 0 ? HTTP_START_DONE
+                                                                                            : HTTP_START_ERROR;
+    }
+    else if (loop->config->archive != NULL) { // nothing to open, the body is already in memory
+        result = http_response_init_archive(&conn->resp, loop->config->archive, resource, &conn->rb.req,
+                                            conn->keep_alive) == 0 ? HTTP_START_DONE : HTTP_START_ERROR;
+    }
+    else {
+        result = http_response_start(&conn->resp, conn->path, &conn->rb.req, conn->keep_alive,
+                                     loop->config->cache, loop->config->gzip_cache, loop->config->stat_cache);
+    }
+    conn->has_resp = 1;
+    if (result == HTTP_START_ERROR) {
+        fprintf(stderr, "http write failure\n");
+        close_connection(loop, conn);
+    }
+    else if (result == HTTP_START_NEED_FILE) {
+        arm_file_ops(loop, conn);
+    }
+    else {
+        if (http_request_method(&conn->rb.req) == HTTP_METHOD_HEAD) {
+            http_response_drop_body(&conn->resp);
+        }
+        send_more(loop, conn);
+    }
+}
+
+// Builds the response once openat and statx are both back. A small file that
+// should be cached is read whole first; anything else goes out a chunk at a time.
+static void file_ready(uring_loop_t *loop, uring_conn_t *conn) {
+    const struct stat *found = NULL;
+    if (conn->statx_result == 0) {
+        memset(&conn->stat_buf, 0, sizeof(struct stat));
+        conn->stat_buf.st_dev = makedev(conn->stx.stx_dev_major, conn->stx.stx_dev_minor);
+        conn->stat_buf.st_ino = conn->stx.stx_ino;
+        conn->stat_buf.st_mode = conn->stx.stx_mode;
+        conn->stat_buf.st_size = conn->stx.stx_size;
+        conn->stat_buf.st_mtim.tv_sec = conn->stx.stx_mtime.tv_sec;
+        conn->stat_buf.st_mtim.tv_nsec = conn->stx.stx_mtime.tv_nsec;
+        found = &conn->stat_buf;
+    }
+    else if (conn->statx_result == -ENOENT) {
+        fprintf(stderr, "file doesn't exist\n"); // still send back 404
+        // only 404s are remembered here, a file that exists still needs opening so its statx costs nothing extra
+        if (loop->config->stat_cache != NULL) {
+            stat_cache_put(loop->config->stat_cache, conn->path, STAT_MISSING, NULL, NULL);
+        }
+    }
+    else {
+        fprintf(stderr, "statx: %s\n", strerror(-conn->statx_result));
+        if (conn->open_result >= 0) {
+            close(conn->open_result);
+        }
+        close_connection(loop, conn);
+        return;
+    }
+
+    int fd = conn->open_result >= 0 ? conn->open_result : -1;
+    if (http_response_finish(&conn->resp, conn->path, &conn->rb.req, conn->keep_alive, found, fd) != 0) {
+        fprintf(stderr, "http write failure\n");
+        close_connection(loop, conn);
+        return;
+    }
+    http_response_t *resp = &conn->resp;
+    if (http_request_method(&conn->rb.req) == HTTP_METHOD_HEAD) {
+        http_response_drop_body(resp); // and skip reading the file for the cache
+    }
+    if (resp->cacheable && resp->cache != NULL && resp->remaining <= CACHE_MAX_FILE_SIZE) {
+        conn->body = malloc(resp->remaining > 0 ? resp->remaining : 1);
+        conn->body_read = 0;
+        if (conn->body != NULL && resp->remaining > 0) {
+            arm_read(loop, conn, conn->body, resp->remaining, 0);
+            return;
+        }
+        if (conn->body != NULL) { // empty file, nothing to wait for
+            http_response_cache_body(resp, conn->path, conn->body, &conn->stat_buf);
+            conn->body = NULL;
+        }
+    }
+    send_more(loop, conn);
+}
+
+// Queues the next piece of the response: the rest of the header, body bytes
+// from memory, or the next chunk of the file. Once it's all out, moves on to
+// the next request, which may already be in the buffer.
+static void send_more(uring_loop_t *loop, uring_conn_t *conn) {
+    http_response_t *resp = &conn->resp;
+    while (1) {
+        if (conn->chunk_sent < conn->chunk_len) {
+            arm_send(loop, conn, conn->chunk + conn->chunk_sent, conn->chunk_len - conn->chunk_sent, resp->remaining > 0);
+            return;
+        }
+        conn->chunk_len = 0;
+        conn->chunk_sent = 0;
+
+        if (resp->cached != NULL && (resp->header_sent < resp->header_len || resp->remaining > 0)) {
+            // header and body straight from the cache entry in one sendmsg
+            int n_iov = 0;
+            if (resp->header_sent < resp->header_len) {
+                conn->iov[n_iov].iov_base = resp->header + resp->header_sent;
+                conn->iov[n_iov].iov_len = resp->header_len - resp->header_sent;
+                n_iov++;
+            }
+            if (resp->remaining > 0) {
+                conn->iov[n_iov].iov_base = resp->cached->body + resp->offset;
+                conn->iov[n_iov].iov_len = resp->remaining;
+                n_iov++;
+            }
+            memset(&conn->msg, 0, sizeof(struct msghdr));
+            conn->msg.msg_iov = conn->iov;
+            conn->msg.msg_iovlen = n_iov;
+            arm_send(loop, conn, NULL, 0, 0);
+            return;
+        }
+        if (resp->header_sent < resp->header_len) {
+            arm_send(loop, conn, resp->header + resp->header_sent, resp->header_len - resp->header_sent,
+                     resp->remaining > 0);
+            return;
+        }
+        if (conn->in_pipe > 0 || (resp->remaining > 0 && !conn->copy_body)) {
+            arm_splice(loop, conn);
+            return;
+        }
+        if (resp->remaining > 0) {
+            if (conn->chunk == NULL && (conn->chunk = malloc(URING_CHUNK)) == NULL) {
+                perror("malloc");
+                close_connection(loop, conn);
+                return;
+            }
+            size_t len = resp->remaining < URING_CHUNK ? (size_t) resp->remaining : URING_CHUNK;
+            arm_read(loop, conn, conn->chunk, len, resp->offset);
+            return;
+        }
+        if (!http_response_next_part(resp)) {
+            break;
+        }
+    }
+
+    // response is out, get ready for the next request on this connection
+    long long done_ns = metrics_now_ns();
+    metrics_record_response(loop->stats, resp->status, resp->bytes_sent, done_ns - conn->started_ns);
+    access_log_write(loop->log_ring, &conn->rb.req, resp->status, resp->bytes_sent, conn->started_ns, done_ns);
+    if (!conn->keep_alive) {
+        close_connection(loop, conn);
+        return;
+    }
+    http_response_cleanup(resp);
+    conn->has_resp = 0;
+    request_buffer_consume(&conn->rb);
+    set_deadline(loop, conn, conn->rb.len > 0 ? DEADLINE_HEADER : DEADLINE_IDLE); // pipelined requests have started
+    next_request(loop, conn);
+}
+
+// Answers the next request if the whole thing is buffered, otherwise reads more of it
+static void next_request(uring_loop_t *loop, uring_conn_t *conn) {
+    int request_len = request_buffer_parse(&conn->rb);
+    if (request_len == -1) {
+        close_connection(loop, conn); // error already printed
+    }
+    else if (request_len == 0) {
+        arm_recv(loop, conn);
+    }
+    else {
+        start_response(loop, conn);
+    }
+}
+
+// Credits bytes the socket took to whatever was being sent
+static void sent(uring_conn_t *conn, size_t nbytes) {
+    http_response_t *resp = &conn->resp;
+    resp->bytes_sent += nbytes;
+    if (conn->chunk_sent < conn->chunk_len) {
+        conn->chunk_sent += nbytes;
+        return;
+    }
+    // a short write can end anywhere, the header gets credited first
+    size_t header_part = resp->header_len - resp->header_sent;
+    if (nbytes < header_part) {
+        header_part = nbytes;
+    }
+    resp->header_sent += header_part;
+    if (resp->cached != NULL) {
+        resp->offset += nbytes - header_part;
+        resp->remaining -= nbytes - header_part;
+    }
+}
+
+// Sets up a connection the ring just accepted and starts reading its first request
+static void new_connection(uring_loop_t *loop, int client_fd) {
+    // responses to pipelined requests shouldn't sit around waiting for the client's ACKs
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uring_conn_t *conn = malloc(sizeof(uring_conn_t));
+    if (conn == NULL) {
+        perror("malloc");
+        close(client_fd);
+        return;
+    }
+    conn->fd = client_fd;
+    conn->pending = 0;
+    conn->closed = 0;
+    request_buffer_init(&conn->rb);
+    conn->n_requests = 0;
+    timer_init(&conn->deadline, DEADLINE_HEADER, conn);
+    set_deadline(loop, conn, DEADLINE_HEADER);
+    conn->has_resp = 0;
+    conn->body = NULL;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    conn->in_pipe = 0;
+    conn->copy_body = 0;
+    conn->chunk = NULL;
+    conn->chunk_len = 0;
+    conn->chunk_sent = 0;
+    conn->prev = NULL;
+    conn->next = loop->connections;
+    if (loop->connections != NULL) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    arm_recv(loop, conn);
+}
+
+// Keeps one accept in flight on the shared listening socket
+// Returns 0 on success or -1 on error
+static int arm_accept(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->sock_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    return 0;
+}
+
+// Keeps the loop's tick in flight, it completes every DEADLINE_CHECK_MS
+// Returns 0 on success or -1 on error
+static int arm_tick(uring_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) &loop->tick;
+    sqe->len = 1;
+    sqe->user_data = OP_TICK;
+    return 0;
+}
+
+// Gives up on a connection that missed its deadline. Shutting the socket down
+// ends whatever recv or send the kernel still has going on it; the connection
+// is freed once that comes back.
+static void expire(wheel_timer_t *timer, void *arg) {
+    uring_loop_t *loop = (uring_loop_t *) arg;
+    uring_conn_t *conn = (uring_conn_t *) timer->data;
+    metrics_add_timeout(loop->stats, timer->kind);
+    shutdown(conn->fd, SHUT_RDWR);
+    close_connection(loop, conn);
+}
+
+// Handles one completion
+// Returns 0 on success or -1 if the loop can't go on
+static int handle_completion(uring_loop_t *loop, uint64_t user_data, int res) {
+    int op = user_data & OP_MASK;
+    if (op == OP_ACCEPT) {
+        if (res >= 0) {
+            if (*loop->keep_going) {
+                new_connection(loop, res);
+            }
+            else {
+                close(res); // shutting down
+                return 0;
+            }
+        }
+        else if (res == -EMFILE || res == -ENFILE) {
+            fprintf(stderr, "accept: %s\n", strerror(-res)); // out of fds, keep trying
+        }
+        else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+            fprintf(stderr, "accept: %s\n", strerror(-res));
+            return -1;
+        }
+        return *loop->keep_going ? arm_accept(loop) : 0;
+    }
+    if (op == OP_WAKE) {
+        *loop->keep_going = 0; // another loop is shutting down, follow it
+        return 0;
+    }
+    if (op == OP_TICK) {
+        return *loop->keep_going ? arm_tick(loop) : 0; // the wheel is turned after every batch
+    }
+
+    uring_conn_t *conn = (uring_conn_t *) (uintptr_t) (user_data & ~(uint64_t) OP_MASK);
+    conn->pending--;
+    if (conn->closed) { // just waiting for the kernel to let go
+        if (op == OP_OPEN && res >= 0) {
+            close(res);
+        }
+        if (conn->pending == 0) {
+            free_connection(loop, conn);
+        }
+        return 0;
+    }
+
+    switch (op) {
+        case OP_RECV:
+            if (res > 0) {
+                if (conn->deadline.kind == DEADLINE_IDLE) { // the next request has started, it gets the header timeout
+                    set_deadline(loop, conn, DEADLINE_HEADER);
+                }
+                conn->rb.len += res;
+                next_request(loop, conn);
+            }
+            else { // hung up or broken
+                if (res == 0 && conn->rb.len != 0) {
+                    fprintf(stderr, "connection closed in the middle of a request\n");
+                }
+                else if (res < 0 && res != -ECANCELED && res != -ECONNRESET) {
+                    fprintf(stderr, "recv: %s\n", strerror(-res));
+                }
+                close_connection(loop, conn);
+            }
+            break;
+        case OP_OPEN:
+        case OP_STATX:
+            if (op == OP_OPEN) {
+                conn->open_result = res;
+            }
+            else {
+                conn->statx_result = res;
+            }
+            if (--conn->file_ops_left == 0) {
+                file_ready(loop, conn);
+            }
+            break;
+        case OP_READ:
+            if (res <= 0) {
+                if (res == 0) { // file got shorter since we stat'ed it
+                    fprintf(stderr, "unexpected end of file\n");
+                }
+                else {
+                    fprintf(stderr, "read: %s\n", strerror(-res));
+                }
+                close_connection(loop, conn);
+            }
+            else if (conn->body != NULL) { // reading the whole file for the cache
+                conn->body_read += res;
+                if (conn->body_read < conn->resp.remaining) {
+                    arm_read(loop, conn, conn->body + conn->body_read, conn->resp.remaining - conn->body_read,
+                             conn->body_read);
+                    break;
+                }
+                // if it doesn't fit after all, the file goes out in chunks like any other
+                http_response_cache_body(&conn->resp, conn->path, conn->body, &conn->stat_buf);
+                conn->body = NULL;
+                send_more(loop, conn);
+            }
+            else {
+                conn->chunk_len = res;
+                conn->chunk_sent = 0;
+                conn->resp.offset += res;
+                conn->resp.remaining -= res;
+                send_more(loop, conn);
+            }
+            break;
+        case OP_SPLICE_IN:
+        case OP_SPLICE_OUT:
+            if (res > 0 && op == OP_SPLICE_IN) {
+                conn->in_pipe += res;
+                conn->resp.offset += res;
+                conn->resp.remaining -= res;
+            }
+            else if (res > 0) {
+                conn->in_pipe -= res;
+                conn->resp.bytes_sent += res;
+            }
+            else if (res == -EINVAL && op == OP_SPLICE_IN) { // the pipe is empty so nothing is lost by switching
+                conn->copy_body = 1;
+            }
+            else if (res != -ECANCELED) { // cancelled just means the splice in came up short
+                if (res != -EPIPE && res != -ECONNRESET) {
+                    fprintf(stderr, "splice: %s\n", res == 0 ? "unexpected end of file" : strerror(-res));
+                }
+                conn->splice_failed = 1;
+            }
+            if (--conn->splice_ops_left == 0) {
+                if (conn->splice_failed) {
+                    close_connection(loop, conn);
+                }
+                else {
+                    send_more(loop, conn);
+                }
+            }
+            break;
+        case OP_SEND:
+            if (res <= 0) {
+                if (res != -EPIPE && res != -ECONNRESET) {
+                    fprintf(stderr, "send: %s\n", res == 0 ? "no progress" : strerror(-res));
+                }
+                close_connection(loop, conn);
+            }
+            else {
+                sent(conn, res);
+                send_more(loop, conn);
+            }
+            break;
+    }
+    return 0;
+}
+
+// Runs one ring until the server shuts down
+static void *run_loop(void *arg) {
+    uring_loop_t *loop = (uring_loop_t *) arg;
+    long ret_val = 0;
+
+    // the wake eventfd is never read, so it completes this poll on every loop
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL || arm_accept(loop) == -1 || arm_tick(loop) == -1) {
+        ret_val = -1;
+        *loop->keep_going = 0;
+    }
+    else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = loop->wake_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = OP_WAKE;
+    }
+
+    while (*loop->keep_going) {
+        if (uring_submit_and_wait(&loop->ring, 1) == -1) {
+            if (errno == EINTR) {
+                continue; // SIGINT lands here on the main thread, loop condition checks it
+            }
+            perror("io_uring_enter");
+            ret_val = -1;
+            break;
+        }
+        long long woke_ns = metrics_now_ns();
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&loop->ring);
+            if (handle_completion(loop, user_data, res) == -1) {
+                ret_val = -1;
+                *loop->keep_going = 0;
+            }
+        }
+        timer_wheel_advance(&loop->deadlines, deadline_now_ms(), expire, loop);
+        metrics_add_busy(loop->stats, metrics_now_ns() - woke_ns);
+    }
+
+    // wake up the other loops in case we're the first to notice the shutdown
+    *loop->keep_going = 0;
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) == -1) {
+        perror("write");
+        ret_val = -1;
+    }
+    // shutting the sockets down ends any recv or send still waiting on them,
+    // then wait for the kernel to hand back every buffer before freeing it
+    for (uring_conn_t *conn = loop->connections; conn != NULL; conn = conn->next) {
+        if (!conn->closed) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    uring_conn_t *conn = loop->connections;
+    while (conn != NULL) {
+        uring_conn_t *next = conn->next; // conn might get freed
+        close_connection(loop, conn);
+        conn = next;
+    }
+    while (loop->connections != NULL) {
+        if (uring_submit_and_wait(&loop->ring, 1) == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+            ret_val = -1;
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&loop->ring);
+            handle_completion(loop, user_data, res);
+        }
+    }
+    return (void *) ret_val;
+}
+
+int uring_loop_serve(int sock_fd, const server_config_t *config, int *keep_going) {
+    // everything the loops submit, checked up front so a kernel missing one falls back cleanly
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+                               IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_SPLICE,
+                               IORING_OP_TIMEOUT, IORING_OP_POLL_ADD };
+    int n_loops = config->n_loops;
+    uring_loop_t *loops = malloc(n_loops * sizeof(uring_loop_t));
+    pthread_t *threads = malloc(n_loops * sizeof(pthread_t));
+    if (loops == NULL || threads == NULL) {
+        perror("malloc");
+        free(loops);
+        free(threads);
+        return -1;
+    }
+
+    int ret_val = 0;
+    int n_ready = 0; // loops that have a ring
+    for (; n_ready < n_loops; n_ready++) {
+        uring_loop_t *loop = loops + n_ready;
+        if (uring_init(&loop->ring, URING_ENTRIES, ops, sizeof(ops) / sizeof(ops[0])) != 0) {
+            if (n_ready == 0) {
+                fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+                ret_val = URING_UNAVAILABLE;
+            }
+            else {
+                perror("io_uring_setup");
+                ret_val = -1;
+            }
+            break;
+        }
+        loop->sock_fd = sock_fd;
+        loop->config = config;
+        loop->keep_going = keep_going;
+        loop->connections = NULL;
+        loop->stats = metrics_register(config->metrics, "ring");
+        loop->log_ring = access_log_register(config->access_log);
+        timer_wheel_init(&loop->deadlines, deadline_now_ms());
+        loop->tick.tv_sec = DEADLINE_CHECK_MS / 1000;
+        loop->tick.tv_nsec = (DEADLINE_CHECK_MS % 1000) * 1000000LL;
+    }
+    int wake_fd = -1;
+    if (ret_val == 0) {
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd == -1) {
+            perror("eventfd");
+            ret_val = -1;
+        }
+    }
+    for (int i = 0; i < n_ready; i++) {
+        loops[i].wake_fd = wake_fd;
+    }
+
+    // Loop 0 runs on this thread so it gets SIGINT, the others block every signal
+    int n_started = 1;
+    if (ret_val == 0) {
+        sigset_t sigset;
+        sigset_t oldset;
+        sigfillset(&sigset);
+        if (pthread_sigmask(SIG_BLOCK, &sigset, &oldset) != 0) {
+            perror("pthread_sigmask");
+            ret_val = -1;
+        }
+        for (; ret_val == 0 && n_started < n_loops; n_started++) {
+            int err_code = pthread_create(threads + n_started, NULL, run_loop, loops + n_started);
+            if (err_code != 0) {
+                fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+                ret_val = -1;
+                break;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    }
+
+    if (ret_val == 0) {
+        ret_val = (long) run_loop(loops) == 0 ? 0 : -1;
+    }
+    else if (wake_fd != -1) {
+        *keep_going = 0;
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+
+    for (int i = 1; i < n_started; i++) {
+        void *thread_ret;
+        int err_code = pthread_join(threads[i], &thread_ret);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+            ret_val = -1;
+        }
+        else if (thread_ret != NULL) {
+            ret_val = -1;
+        }
+    }
+    for (int i = 0; i < n_ready; i++) {
+        uring_free(&loops[i].ring);
+    }
+    if (wake_fd != -1) {
+        close(wake_fd);
+    }
+    free(loops);
+    free(threads);
+    return ret_val;
+}
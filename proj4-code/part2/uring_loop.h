@@ -0,0 +1,26 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include "server_config.h"
+
+#define URING_ENTRIES 256        // submission queue slots per ring
+#define URING_CHUNK (256 * 1024) // most file bytes moved per splice (the pipe is grown to match) or read
+#define URING_UNAVAILABLE 1      // uring_loop_serve return value: io_uring can't be used, nothing was started
+
+/*
+ * Serve HTTP connections with io_uring: every accept, recv, open, statx,
+ * splice (or read) and send is a submission on a ring, so a cold file never
+ * blocks the thread and one io_uring_enter call carries the work of many
+ * connections.
+ * Runs config->n_loops threads with a ring each (one on the calling thread,
+ * the rest on new threads) until SIGINT clears *keep_going. SIGINT must not
+ * be blocked in the calling thread.
+ * sock_fd: The listening socket
+ * config: Served directory, loop count and keep-alive settings
+ * keep_going: Set to 0 by the SIGINT handler to stop the server
+ * Returns 0 on success, URING_UNAVAILABLE if this kernel can't do io_uring
+ * (so the caller can serve some other way), or -1 on error
+ */
+int uring_loop_serve(int sock_fd, const server_config_t *config, int *keep_going);
+
+#endif // URING_LOOP_H
@@ -0,0 +1,214 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "worker_pool.h"
+
+#define SLOT_FREE 0    // no thread, ready for a new worker
+#define SLOT_RUNNING 1
+#define SLOT_EXITED 2  // the worker has left but hasn't been joined yet
+
+// THREAD FUNCTION: serves connections from the queue until the pool stops, or
+// until it has sat idle for long enough while the pool is above its minimum
+static void *run_worker(void *arg) {
+    worker_slot_t *slot = (worker_slot_t *) arg;
+    worker_pool_t *pool = slot->pool;
+    if (slot->stats == NULL) { // first worker in this slot
+        slot->stats = metrics_register(pool->metrics, "worker");
+        slot->log_ring = access_log_register(pool->access_log);
+    }
+    int idle_ms = pool->config->shrink_idle_ms > 0 ? pool->config->shrink_idle_ms : -1;
+    int retired = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!atomic_load(&pool->stop)) {
+        pool->n_idle++;
+        pthread_mutex_unlock(&pool->lock);
+        long long enqueued_ns;
+        int client_fd = connection_dequeue_timed(pool->queue, &enqueued_ns, idle_ms);
+        pthread_mutex_lock(&pool->lock);
+        pool->n_idle--;
+        if (atomic_load(&pool->stop)) {
+            if (client_fd > 0) { // taken just before the queue was shut down
+                close(client_fd);
+            }
+            break;
+        }
+        if (client_fd == CONNECTION_QUEUE_TIMEOUT) {
+            if (pool->n_workers > pool->config->min_workers) {
+                retired = 1;
+                break;
+            }
+            continue;
+        }
+        if (client_fd == -1) {
+            fprintf(stderr, "connection_dequeue failed\n");
+            break; // the monitor starts a replacement if that leaves too few
+        }
+        pthread_mutex_unlock(&pool->lock);
+        pool->serve(client_fd, enqueued_ns, slot->stats, slot->log_ring, pool->arg);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pool->n_workers--;
+    metrics_record_pool(pool->stats, pool->n_workers, 0, retired);
+    slot->state = SLOT_EXITED;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Starts a worker in a free slot. The caller holds the lock, or is the only thread.
+// Returns 0 on success or -1 on error
+static int start_worker(worker_pool_t *pool) {
+    for (int i = 0; i < pool->config->max_workers; i++) {
+        worker_slot_t *slot = &pool->slots[i];
+        if (slot->state != SLOT_FREE) {
+            continue;
+        }
+        int err_code = pthread_create(&slot->thread, NULL, run_worker, slot);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+            return -1;
+        }
+        slot->state = SLOT_RUNNING;
+        pool->n_workers++;
+        return 0;
+    }
+    return -1; // can't happen, n_workers < max_workers whenever this is called
+}
+
+// Joins workers that have left, freeing their slots. The caller holds the lock.
+static void reap_workers(worker_pool_t *pool) {
+    for (int i = 0; i < pool->config->max_workers; i++) {
+        if (pool->slots[i].state == SLOT_EXITED) {
+            // it has already let go of the lock, so this only waits for it to return
+            pthread_join(pool->slots[i].thread, NULL);
+            pool->slots[i].state = SLOT_FREE;
+        }
+    }
+}
+
+// THREAD FUNCTION: every POOL_CHECK_MS, adds workers if connections are
+// waiting too long with nobody free to take them
+static void *run_monitor(void *arg) {
+    worker_pool_t *pool = (worker_pool_t *) arg;
+    struct timespec nap = { .tv_sec = 0, .tv_nsec = POOL_CHECK_MS * 1000000L };
+    while (!atomic_load(&pool->stop)) {
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&pool->lock);
+        reap_workers(pool);
+        if (atomic_load(&pool->stop)) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        int wanted = 0;
+        long long waited_ns = connection_queue_oldest_wait(pool->queue, metrics_now_ns());
+        if (pool->n_idle == 0 && waited_ns >= pool->config->grow_wait_ns) {
+            wanted = connection_queue_length(pool->queue); // one more for each connection waiting
+        }
+        if (pool->n_workers + wanted < pool->config->min_workers) {
+            wanted = pool->config->min_workers - pool->n_workers; // replaces workers that failed
+        }
+        if (wanted > pool->config->max_workers - pool->n_workers) {
+            wanted = pool->config->max_workers - pool->n_workers;
+        }
+        int started = 0;
+        while (started < wanted && start_worker(pool) == 0) {
+            started++;
+        }
+        if (started > 0) {
+            metrics_record_pool(pool->stats, pool->n_workers, started, 0);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int worker_pool_start(worker_pool_t *pool, const worker_pool_config_t *config, connection_queue_t *queue,
+                      worker_pool_fn serve, void *arg, metrics_t *metrics, access_log_t *access_log) {
+    pool->config = config;
+    pool->queue = queue;
+    pool->serve = serve;
+    pool->arg = arg;
+    pool->metrics = metrics;
+    pool->access_log = access_log;
+    pool->n_workers = 0;
+    pool->n_idle = 0;
+    atomic_init(&pool->stop, 0);
+    pool->slots = calloc(config->max_workers, sizeof(worker_slot_t));
+    if (pool->slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < config->max_workers; i++) {
+        pool->slots[i].state = SLOT_FREE;
+        pool->slots[i].pool = pool;
+    }
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        free(pool->slots);
+        return -1;
+    }
+    pool->stats = metrics_register(metrics, "pool");
+
+    // threads inherit the mask, so the monitor passes it on to every worker it starts
+    sigset_t sigset;
+    sigset_t oldset;
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &oldset);
+    int ret_val = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < config->min_workers && ret_val == 0; i++) {
+        ret_val = start_worker(pool);
+    }
+    metrics_record_pool(pool->stats, pool->n_workers, 0, 0);
+    pthread_mutex_unlock(&pool->lock);
+    if (ret_val == 0) {
+        int err_code = pthread_create(&pool->monitor, NULL, run_monitor, pool);
+        if (err_code != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err_code));
+            ret_val = -1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (ret_val != 0) { // stop whatever did start
+        atomic_store(&pool->stop, 1);
+        connection_queue_shutdown(queue);
+        for (int i = 0; i < config->max_workers; i++) {
+            if (pool->slots[i].state != SLOT_FREE) {
+                pthread_join(pool->slots[i].thread, NULL);
+            }
+        }
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->slots);
+    }
+    return ret_val;
+}
+
+int worker_pool_stop(worker_pool_t *pool) {
+    int ret_val = 0;
+    atomic_store(&pool->stop, 1);
+    int err_code = pthread_join(pool->monitor, NULL); // after this, no new workers
+    if (err_code != 0) {
+        fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+        ret_val = -1;
+    }
+    if (connection_queue_shutdown(pool->queue) != 0) {
+        fprintf(stderr, "connection_queue_shutdown failed\n");
+        ret_val = -1;
+    }
+    for (int i = 0; i < pool->config->max_workers; i++) {
+        if (pool->slots[i].state == SLOT_FREE) {
+            continue;
+        }
+        if ((err_code = pthread_join(pool->slots[i].thread, NULL)) != 0) {
+            fprintf(stderr, "pthread_join: %s\n", strerror(err_code));
+            ret_val = -1;
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slots);
+    return ret_val;
+}
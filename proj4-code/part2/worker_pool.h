@@ -0,0 +1,79 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "access_log.h"
+#include "connection_queue.h"
+#include "metrics.h"
+
+#define DEFAULT_MIN_WORKERS 5        // the size the pool used to be fixed at
+#define DEFAULT_MAX_WORKERS 64
+#define DEFAULT_GROW_WAIT_MS 10      // queue wait that means there aren't enough workers
+#define DEFAULT_SHRINK_IDLE_MS 30000 // how long a worker past the minimum waits for work before leaving
+#define POOL_CHECK_MS 50             // how often the pool looks at its queue
+
+// Settings picked on the command line
+typedef struct {
+    int min_workers;
+    int max_workers;       // at least min_workers
+    long long grow_wait_ns; // add workers once the oldest queued connection has waited this long
+    int shrink_idle_ms;     // 0 to never shrink
+} worker_pool_config_t;
+
+// Called by a worker for each connection it takes off the queue. The worker's
+// counters and log ring stay with its slot, so a pool that keeps resizing
+// never uses up more of them than max_workers.
+typedef void (*worker_pool_fn)(int client_fd, long long enqueued_ns, thread_metrics_t *stats,
+                               access_log_ring_t *log_ring, void *arg);
+
+struct worker_pool;
+
+// Where one worker thread runs. A slot is reused by later workers once the
+// one before it has left and been joined.
+typedef struct {
+    pthread_t thread;
+    int state; // SLOT_FREE, SLOT_RUNNING or SLOT_EXITED
+    thread_metrics_t *stats;     // registered by the slot's first worker
+    access_log_ring_t *log_ring;
+    struct worker_pool *pool;
+} worker_slot_t;
+
+// Blocking workers fed by a connection queue, between min_workers and
+// max_workers of them. A monitor thread adds workers while connections wait
+// in the queue longer than grow_wait_ns and no worker is free to take them;
+// a worker past the minimum that waits shrink_idle_ms for a connection leaves.
+typedef struct worker_pool {
+    const worker_pool_config_t *config;
+    connection_queue_t *queue;
+    worker_pool_fn serve;
+    void *arg;
+    metrics_t *metrics;
+    access_log_t *access_log;
+    pthread_mutex_t lock; // guards everything below
+    worker_slot_t *slots; // max_workers of them
+    int n_workers;        // running
+    int n_idle;           // running and waiting on the queue
+    thread_metrics_t *stats; // the pool's own, counts resizes
+    pthread_t monitor;
+    atomic_int stop;
+} worker_pool_t;
+
+/*
+ * Start min_workers workers and the monitor. Every thread the pool starts,
+ * then or later, blocks every signal.
+ * serve: Called with each connection and arg
+ * Returns 0 on success or -1 on error
+ */
+int worker_pool_start(worker_pool_t *pool, const worker_pool_config_t *config, connection_queue_t *queue,
+                      worker_pool_fn serve, void *arg, metrics_t *metrics, access_log_t *access_log);
+
+/*
+ * Shut the queue down and wait for every worker to finish the connection it's
+ * serving. Connections still in the queue are dropped.
+ * Returns 0 on success or -1 on error
+ */
+int worker_pool_stop(worker_pool_t *pool);
+
+#endif // WORKER_POOL_H